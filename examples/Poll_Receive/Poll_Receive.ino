@@ -0,0 +1,34 @@
+#include <XModem.h>
+XModem xmodem;
+//The arduino toolchain will add these declarations automatically but doing
+//manually so things also just work if someone uses a different/custom toolchain
+bool process_block(void *blk_id, size_t idSize, byte *data, size_t dataSize);
+
+/*
+ * Same as Basic_Receive but the transfer runs alongside the rest of loop()
+ * You can test this over your USB port using lrzsz: `stty -F /dev/ttyUSB0 4800 && sx -vaX /path/to/send/file > /dev/ttyUSB0 < /dev/ttyUSB0`
+ */
+void setup() {
+  Serial.begin(4800, SERIAL_8N1);
+  xmodem.begin(Serial, XModem::ProtocolType::XMODEM);
+  xmodem.setRecieveBlockHandler(process_block);
+  pinMode(LED_BUILTIN, OUTPUT);
+}
+
+void loop() {
+  //poll() only handles the bytes that have already arrived so it returns
+  //straight away, start another transfer once the last one has finished
+  if(xmodem.poll() != XModem::IN_PROGRESS) xmodem.beginReceive();
+
+  //do other stuff, eg. blink the LED
+  digitalWrite(LED_BUILTIN, (millis() / 500) % 2);
+}
+
+bool process_block(void *blk_id, size_t idSize, byte *data, size_t dataSize) {
+  for(int i = 0; i < dataSize; ++i) {
+    //do stuff with the recieved data
+  }
+
+  //return false to stop the transfer early
+  return true;
+}
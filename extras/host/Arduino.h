@@ -0,0 +1,99 @@
+/*
+ * Arduino.h - Just enough of the Arduino core to build the library on a host
+ *
+ * Only covers what src/XModem.cpp and src/XModemLoopback.cpp use. Print and
+ * Stream follow the Arduino core so Streams written against them also build on
+ * a board.
+ */
+#ifndef Arduino_h
+#define Arduino_h
+#include <stdint.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef uint8_t byte;
+
+inline unsigned long millis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long) ts.tv_sec * 1000UL + ts.tv_nsec / 1000000L;
+}
+
+inline unsigned long micros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long) ts.tv_sec * 1000000UL + ts.tv_nsec / 1000L;
+}
+
+inline void delay(unsigned long ms) {
+  struct timespec ts = {(time_t) (ms / 1000), (long) (ms % 1000) * 1000000L};
+  nanosleep(&ts, NULL);
+}
+
+inline void yield() {}
+
+class Print {
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t b) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size) {
+      size_t n = 0;
+      while(n < size && write(buffer[n])) ++n;
+      return n;
+    }
+    size_t write(const char *str) {
+      return str == NULL ? 0 : write((const uint8_t *) str, strlen(str));
+    }
+    virtual int availableForWrite() { return 0; }
+    virtual void flush() {}
+};
+
+class Stream : public Print {
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+
+    void setTimeout(unsigned long timeout) { _timeout = timeout; }
+    unsigned long getTimeout() { return _timeout; }
+
+    bool find(uint8_t target) {
+      int c;
+      while((c = timedRead()) >= 0) {
+        if(c == target) return true;
+      }
+      return false;
+    }
+
+    size_t readBytes(char *buffer, size_t length) {
+      size_t count = 0;
+      while(count < length) {
+        int c = timedRead();
+        if(c < 0) break;
+        *buffer++ = (char) c;
+        ++count;
+      }
+      return count;
+    }
+
+    size_t readBytes(uint8_t *buffer, size_t length) {
+      return readBytes((char *) buffer, length);
+    }
+
+  protected:
+    unsigned long _timeout = 1000;
+
+    int timedRead() {
+      unsigned long start = millis();
+      do {
+        int c = read();
+        if(c >= 0) return c;
+      } while(millis() - start < _timeout);
+      return -1;
+    }
+};
+
+#endif
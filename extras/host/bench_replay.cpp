@@ -0,0 +1,172 @@
+/*
+ * Times the CPU cost per block of XModem and XModemT without a peer. The
+ * receivers read a recording of a clean transfer from memory and the senders
+ * read a recording of the receiver's answers, everything written is thrown
+ * away, so only the library's own work is measured.
+ *
+ *   g++ -O2 -I. -I../../src bench_replay.cpp ../../src/XModem.cpp -o bench_replay
+ *   ./bench_replay [blocks] [rounds]
+ */
+#include "Arduino.h"
+#include "XModem.h"
+#include "XModemT.h"
+#include <stdio.h>
+
+//plays back a recording split into chunks, a chunk only becomes readable once
+//the library has written as many bytes as it would have before the real
+//device sent it, so flushes before a NAK don't throw the recording away
+class ReplayStream : public Stream {
+  public:
+    void load(const byte *data, const size_t *ends, const size_t *gates, size_t chunks) {
+      _data = data;
+      _ends = ends;
+      _gates = gates;
+      _chunks = chunks;
+      _chunk = 0;
+      _pos = 0;
+      _written = 0;
+    }
+    int available() { return (int) (readable() - _pos); }
+    int read() { return _pos < readable() ? _data[_pos++] : -1; }
+    int peek() { return _pos < readable() ? _data[_pos] : -1; }
+    size_t write(uint8_t b) { return write(&b, 1); }
+    size_t write(const uint8_t *buffer, size_t size) {
+      _written += size;
+      return size;
+    }
+    int availableForWrite() { return 4096; }
+    using Print::write;
+
+  private:
+    const byte *_data;
+    const size_t *_ends;
+    const size_t *_gates;
+    size_t _chunks;
+    size_t _chunk; //chunks before this one are readable
+    size_t _pos;
+    size_t _written;
+
+    size_t readable() {
+      while(_chunk < _chunks && _gates[_chunk] <= _written) ++_chunk;
+      return _chunk == 0 ? 0 : _ends[_chunk - 1];
+    }
+};
+
+static ReplayStream stream;
+
+bool discard_block(void *blk_id, size_t idSize, byte *data, size_t dataSize) {
+  return true;
+}
+
+struct recording {
+  byte *data;
+  size_t *ends;
+  size_t *gates;
+  size_t chunks;
+};
+
+static void add_chunk(struct recording *r, size_t end, size_t gate) {
+  r->ends[r->chunks] = end;
+  r->gates[r->chunks] = gate;
+  ++r->chunks;
+}
+
+//a receiver's view of a clean CRC_XMODEM transfer: each packet arrives after
+//the init byte or the ACK of the one before, then the two EOTs that end it
+static void record_packets(struct recording *r, const byte *data, size_t blocks) {
+  size_t pos = 0;
+  r->chunks = 0;
+  for(size_t b = 0; b < blocks; ++b) {
+    byte id = (byte) (b + 1);
+    r->data[pos++] = SOH;
+    r->data[pos++] = id;
+    r->data[pos++] = ~id;
+    memcpy(r->data + pos, data + b*128, 128);
+    unsigned short crc = xmodem_crc_16_update(0, data + b*128, 128);
+    memcpy(r->data + pos + 128, &crc, 2);
+    pos += 130;
+    add_chunk(r, pos, b + 1);
+  }
+  r->data[pos++] = EOT;
+  add_chunk(r, pos, blocks + 1);
+  r->data[pos++] = EOT;
+  add_chunk(r, pos, blocks + 2);
+}
+
+//a sender's view: the init byte, an ACK after each packet and the NAK/ACK of
+//the EOTs
+static void record_answers(struct recording *r, size_t blocks) {
+  size_t pos = 0;
+  r->chunks = 0;
+  r->data[pos++] = 'C';
+  add_chunk(r, pos, 0);
+  for(size_t b = 0; b < blocks; ++b) {
+    r->data[pos++] = ACK;
+    add_chunk(r, pos, (b + 1)*133);
+  }
+  r->data[pos++] = NAK;
+  add_chunk(r, pos, blocks*133 + 1);
+  r->data[pos++] = ACK;
+  add_chunk(r, pos, blocks*133 + 2);
+}
+
+static void replay(struct recording *r) {
+  stream.load(r->data, r->ends, r->gates, r->chunks);
+}
+
+template <class F>
+static double best_ns_per_block(F run, size_t blocks, int rounds) {
+  double best = 0;
+  for(int r = 0; r < rounds; ++r) {
+    unsigned long start = micros();
+    if(!run()) {
+      printf("transfer failed\n");
+      exit(1);
+    }
+    double ns = (micros() - start) * 1000.0 / blocks;
+    if(r == 0 || ns < best) best = ns;
+  }
+  return best;
+}
+
+int main(int argc, char **argv) {
+  size_t blocks = argc > 1 ? strtoul(argv[1], NULL, 10) : 4096;
+  int rounds = argc > 2 ? atoi(argv[2]) : 20;
+
+  byte *data = (byte *) malloc(blocks*128);
+  for(size_t i = 0; i < blocks*128; ++i) data[i] = (byte) (i * 7 + 3) == SUB ? 0x1B : (byte) (i * 7 + 3);
+  struct recording packets, answers;
+  packets.data = (byte *) malloc(blocks*133 + 2);
+  packets.ends = (size_t *) malloc((blocks + 2)*sizeof(size_t));
+  packets.gates = (size_t *) malloc((blocks + 2)*sizeof(size_t));
+  record_packets(&packets, data, blocks);
+  answers.data = (byte *) malloc(blocks + 3);
+  answers.ends = (size_t *) malloc((blocks + 3)*sizeof(size_t));
+  answers.gates = (size_t *) malloc((blocks + 3)*sizeof(size_t));
+  record_answers(&answers, blocks);
+
+  static XModem x;
+  static XModemT<1, 128, XModemCRC16> t;
+  x.begin(stream, XModem::ProtocolType::CRC_XMODEM);
+  x.setRecieveBlockHandler(discard_block);
+  t.begin(stream);
+  t.setRecieveBlockHandler(discard_block);
+
+  double x_rx = best_ns_per_block([&] { replay(&packets); return x.receive(); }, blocks, rounds);
+  double t_rx = best_ns_per_block([&] { replay(&packets); return t.receive(); }, blocks, rounds);
+  double x_tx = best_ns_per_block([&] { replay(&answers); return x.send(data, blocks*128); }, blocks, rounds);
+  double t_tx = best_ns_per_block([&] { replay(&answers); return t.send(data, blocks*128); }, blocks, rounds);
+
+  printf("CRC_XMODEM, %zu blocks, best of %d\n", blocks, rounds);
+  printf("                XModem      XModemT\n");
+  printf("  receive     %7.1f ns   %7.1f ns\n", x_rx, t_rx);
+  printf("  send        %7.1f ns   %7.1f ns\n", x_tx, t_tx);
+  free(data);
+  struct recording *recordings[] = {&packets, &answers};
+  for(struct recording *r : recordings) {
+    free(r->data);
+    free(r->ends);
+    free(r->gates);
+  }
+  return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * Runs an XModem sender and receiver against each other over an
+ * XModemLoopback in a single thread and reports how long the transfer took.
+ *
+ *   g++ -O2 -I. -I../../src loopback.cpp ../../src/XModem.cpp ../../src/XModemLoopback.cpp -o loopback
+ *   ./loopback [protocol type] [bytes] [poll|rx|tx|trx|ttx]
+ *
+ * poll drives both ends with poll(), rx runs a blocking receive() and tx a
+ * blocking send() with the other end polled from the loopback idle handler.
+ * trx and ttx do the same with an XModemT receiver or sender (XMODEM and
+ * CRC_XMODEM only).
+ */
+#include "Arduino.h"
+#include "XModem.h"
+#include "XModemLoopback.h"
+#include "XModemT.h"
+#include <stdio.h>
+
+static byte tx_ring[2048];
+static byte rx_ring[2048];
+static XModemLoopback tx_end(tx_ring, sizeof(tx_ring));
+static XModemLoopback rx_end(rx_ring, sizeof(rx_ring));
+static XModem sender;
+static XModem receiver;
+static XModemT<1, 128, XModemSumChecksum> t_basic;
+static XModemT<1, 128, XModemCRC16> t_crc;
+
+static byte *received;
+static size_t received_len;
+
+bool store_block(void *blk_id, size_t idSize, byte *data, size_t dataSize) {
+  memcpy(received + received_len, data, dataSize);
+  received_len += dataSize;
+  return true;
+}
+
+void poll_sender() {
+  sender.poll();
+}
+
+void poll_receiver() {
+  receiver.poll();
+}
+
+int main(int argc, char **argv) {
+  int type = argc > 1 ? atoi(argv[1]) : XModem::ProtocolType::CRC_XMODEM;
+  size_t len = argc > 2 ? strtoul(argv[2], NULL, 10) : 1048576;
+  const char *mode = argc > 3 ? argv[3] : "poll";
+  bool templated = strcmp(mode, "trx") == 0 || strcmp(mode, "ttx") == 0;
+  if(templated && type != XModem::ProtocolType::XMODEM && type != XModem::ProtocolType::CRC_XMODEM) {
+    printf("%s only supports types 0 (XMODEM) and 1 (CRC_XMODEM)\n", mode);
+    return 1;
+  }
+
+  //padding is stripped from the end of the last block so keep it out of the data
+  byte *data = (byte *) malloc(len);
+  received = (byte *) malloc(len + 1024);
+  for(size_t i = 0; i < len; ++i) data[i] = (byte) (i * 7 + 3) == 0x1A ? 0x1B : (byte) (i * 7 + 3);
+
+  tx_end.connect(rx_end);
+  sender.begin(tx_end, (XModem::ProtocolType) type);
+  receiver.begin(rx_end, (XModem::ProtocolType) type);
+  receiver.setRecieveBlockHandler(store_block);
+
+  unsigned long start = micros();
+  bool result;
+  if(templated) {
+    bool crc = type == XModem::ProtocolType::CRC_XMODEM;
+    if(crc) t_crc.begin(strcmp(mode, "trx") == 0 ? rx_end : tx_end);
+    else t_basic.begin(strcmp(mode, "trx") == 0 ? rx_end : tx_end);
+    if(strcmp(mode, "trx") == 0) {
+      t_crc.setRecieveBlockHandler(store_block);
+      t_basic.setRecieveBlockHandler(store_block);
+      rx_end.setIdleHandler(poll_sender);
+      sender.beginSend(data, len);
+      result = (crc ? t_crc.receive() : t_basic.receive()) && sender.poll() == XModem::COMPLETE;
+    } else {
+      tx_end.setIdleHandler(poll_receiver);
+      receiver.beginReceive();
+      result = (crc ? t_crc.send(data, len) : t_basic.send(data, len)) && receiver.poll() == XModem::COMPLETE;
+    }
+  } else if(strcmp(mode, "rx") == 0) {
+    rx_end.setIdleHandler(poll_sender);
+    sender.beginSend(data, len);
+    result = receiver.receive() && sender.poll() == XModem::COMPLETE;
+  } else if(strcmp(mode, "tx") == 0) {
+    tx_end.setIdleHandler(poll_receiver);
+    receiver.beginReceive();
+    result = sender.send(data, len) && receiver.poll() == XModem::COMPLETE;
+  } else {
+    receiver.beginReceive();
+    sender.beginSend(data, len);
+    XModem::TransferStatus rx_status, tx_status;
+    do {
+      tx_status = sender.poll();
+      rx_status = receiver.poll();
+    } while(tx_status == XModem::IN_PROGRESS || rx_status == XModem::IN_PROGRESS);
+    result = tx_status == XModem::COMPLETE && rx_status == XModem::COMPLETE;
+  }
+  unsigned long elapsed = micros() - start;
+
+  bool match = received_len == len && memcmp(received, data, len) == 0;
+  printf("type=%d bytes=%zu mode=%s result=%d match=%d time=%.1f ms (%.1f MB/s)\n",
+    type, len, mode, result, match, elapsed / 1000.0, elapsed ? len / (double) elapsed : 0.0);
+  free(data);
+  free(received);
+  return result && match ? 0 : 1;
+}
@@ -0,0 +1,497 @@
+/*
+ * Checks the XModem features that need both ends of a transfer by running a
+ * sender and a receiver against each other over an XModemLoopback in a single
+ * thread. Transfers that only have a blocking form on both ends run the sender
+ * on a second thread over a socketpair instead. Each check prints one line and
+ * the exit code is 0 when all of the ones that were run passed.
+ *
+ *   g++ -O2 -I. -I../../src test_loopback.cpp ../../src/XModem.cpp ../../src/XModemLoopback.cpp -o test_loopback -pthread
+ *   ./test_loopback [check|all]
+ *
+ * stream      - beginSend() over a Stream without availableForWrite()
+ * dead_stream - beginSend() over a Stream that never takes a byte has to fail
+ * null_chksum - incremental checksum handlers with a NULL init or update are ignored
+ * batch       - send_batch() of several files, one an exact block multiple and
+ *               one empty, to receive_batch() up to the empty block 0
+ * resume      - a receive() stopped partway is finished by resume_receive()
+ * resume_bad  - send() starts from the beginning when the complement of a byte
+ *               of the 'R' signal is wrong
+ * work_buffer - transfers fit in a buffer of workBufferSize() bytes that isn't
+ *               aligned, for every type, blocking and poll(), with and
+ *               without pipelineSends() and setReceiveQueue()
+ */
+#include "Arduino.h"
+#include "XModem.h"
+#include "XModemLoopback.h"
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static byte tx_ring[2048];
+static byte rx_ring[2048];
+
+//forwards to an XModemLoopback but keeps the Print default availableForWrite()
+//of 0 like SoftwareSerial and most other Streams. A dead one takes no bytes
+class PlainStream : public Stream {
+  public:
+    PlainStream(XModemLoopback &end, bool dead) : _end(end), _dead(dead) {}
+    int available() { return _end.available(); }
+    int read() { return _end.read(); }
+    int peek() { return _end.peek(); }
+    size_t write(uint8_t b) { return _dead ? 0 : _end.write(b); }
+    size_t write(const uint8_t *buffer, size_t size) { return _dead ? 0 : _end.write(buffer, size); }
+    using Print::write;
+
+  private:
+    XModemLoopback &_end;
+    bool _dead;
+};
+
+//one end of a socketpair, unlike an XModemLoopback both ends can be used from
+//different threads. Both ends spin while they wait so an empty read gives the
+//other thread the CPU
+class FdStream : public Stream {
+  public:
+    FdStream(int fd) : _fd(fd) {}
+    int available() {
+      int n = 0;
+      return ioctl(_fd, FIONREAD, &n) == 0 ? n : 0;
+    }
+    int read() { return recv_byte(0); }
+    int peek() { return recv_byte(MSG_PEEK); }
+    size_t write(uint8_t b) { return write(&b, 1); }
+    size_t write(const uint8_t *buffer, size_t size) {
+      size_t n = 0;
+      while(n < size) {
+        ssize_t sent = send(_fd, buffer + n, size - n, 0);
+        if(sent <= 0) break;
+        n += sent;
+      }
+      return n;
+    }
+    using Print::write;
+
+  private:
+    int _fd;
+
+    int recv_byte(int flags) {
+      byte b;
+      if(recv(_fd, &b, 1, flags | MSG_DONTWAIT) == 1) return b;
+      sched_yield();
+      return -1;
+    }
+};
+
+static byte *received;
+static size_t received_len;
+
+static bool store_block(void *blk_id, size_t idSize, byte *data, size_t dataSize) {
+  memcpy(received + received_len, data, dataSize);
+  received_len += dataSize;
+  return true;
+}
+
+//padding is stripped from the end of the last block so keep it out of the data
+static void fill_data(byte *data, size_t len, unsigned seed) {
+  for(size_t i = 0; i < len; ++i) {
+    data[i] = (byte) (i * 7 + seed);
+    if(data[i] == 0x1A) data[i] = 0x1B;
+  }
+}
+
+//polls a beginSend() and a beginReceive() until both are done or 20s passed
+static void poll_both(XModem &sender, XModem &receiver, XModem::TransferStatus &tx_status, XModem::TransferStatus &rx_status) {
+  unsigned long start = millis();
+  do {
+    tx_status = sender.poll();
+    rx_status = receiver.poll();
+  } while((tx_status == XModem::IN_PROGRESS || rx_status == XModem::IN_PROGRESS) && millis() - start < 20000);
+}
+
+static bool check_stream(bool dead) {
+  const size_t len = 5000;
+  byte data[len];
+  fill_data(data, len, 3);
+  byte buffer[len + 1024];
+  received = buffer;
+  received_len = 0;
+
+  XModemLoopback tx_end(tx_ring, sizeof(tx_ring));
+  XModemLoopback rx_end(rx_ring, sizeof(rx_ring));
+  tx_end.connect(rx_end);
+  PlainStream plain(tx_end, dead);
+  XModem sender;
+  XModem receiver;
+  sender.begin(plain, XModem::ProtocolType::CRC_XMODEM);
+  receiver.begin(rx_end, XModem::ProtocolType::CRC_XMODEM);
+  sender.setTimeoutBounds(10, 200);
+  receiver.setTimeoutBounds(10, 200);
+  receiver.setRecieveBlockHandler(store_block);
+
+  receiver.beginReceive();
+  sender.beginSend(data, len);
+  XModem::TransferStatus rx_status, tx_status;
+  poll_both(sender, receiver, tx_status, rx_status);
+
+  if(dead) return tx_status == XModem::FAILED;
+  return tx_status == XModem::COMPLETE && rx_status == XModem::COMPLETE && received_len == len && memcmp(received, data, len) == 0;
+}
+
+static bool check_plain_stream() { return check_stream(false); }
+static bool check_dead_stream() { return check_stream(true); }
+
+static bool check_null_chksum() {
+  const size_t len = 1000;
+  byte data[len];
+  fill_data(data, len, 5);
+  byte buffer[len + 128];
+  received = buffer;
+  received_len = 0;
+
+  XModemLoopback tx_end(tx_ring, sizeof(tx_ring));
+  XModemLoopback rx_end(rx_ring, sizeof(rx_ring));
+  tx_end.connect(rx_end);
+  XModem sender;
+  XModem receiver;
+  sender.begin(tx_end, XModem::ProtocolType::CRC_XMODEM);
+  receiver.begin(rx_end, XModem::ProtocolType::CRC_XMODEM);
+  sender.setTimeoutBounds(10, 200);
+  receiver.setTimeoutBounds(10, 200);
+  receiver.setRecieveBlockHandler(store_block);
+  //both have to keep the built in crc
+  sender.setChksumHandler(NULL, NULL, NULL);
+  receiver.setChksumHandler(NULL, NULL, NULL);
+
+  receiver.beginReceive();
+  sender.beginSend(data, len);
+  XModem::TransferStatus rx_status, tx_status;
+  poll_both(sender, receiver, tx_status, rx_status);
+  return tx_status == XModem::COMPLETE && rx_status == XModem::COMPLETE && received_len == len && memcmp(received, data, len) == 0;
+}
+
+struct batch_rx_file {
+  char name[32];
+  unsigned long size;
+  unsigned long mtime;
+  byte data[4096];
+  size_t len;
+  int closed; //number of times file_close was called
+  bool complete;
+};
+
+static struct batch_rx_file batch_rx[4];
+static size_t batch_rx_count;
+
+static bool batch_open(const char *name, unsigned long size, unsigned long mtime) {
+  if(batch_rx_count == sizeof(batch_rx) / sizeof(batch_rx[0])) return false;
+  struct batch_rx_file *f = &batch_rx[batch_rx_count++];
+  snprintf(f->name, sizeof(f->name), "%s", name);
+  f->size = size;
+  f->mtime = mtime;
+  return true;
+}
+
+static void batch_close(bool complete) {
+  struct batch_rx_file *f = &batch_rx[batch_rx_count - 1];
+  ++f->closed;
+  f->complete = complete;
+}
+
+static bool batch_block(void *blk_id, size_t idSize, byte *data, size_t dataSize) {
+  struct batch_rx_file *f = &batch_rx[batch_rx_count - 1];
+  if(f->len + dataSize > sizeof(f->data)) return false;
+  memcpy(f->data + f->len, data, dataSize);
+  f->len += dataSize;
+  return true;
+}
+
+struct batch_tx {
+  XModem *sender;
+  struct XModem::batch_file *files;
+  size_t count;
+  bool result;
+};
+
+static void *batch_send(void *arg) {
+  struct batch_tx *tx = (struct batch_tx *) arg;
+  tx->result = tx->sender->send_batch(tx->files, tx->count);
+  return NULL;
+}
+
+static bool check_batch() {
+  //a short file, one that fills its last block and ends in what looks like
+  //padding, and an empty one
+  static byte a[3000];
+  static byte b[2048];
+  fill_data(a, sizeof(a), 11);
+  fill_data(b, sizeof(b), 13);
+  memset(b + sizeof(b) - 4, 0x1A, 4);
+  struct XModem::batch_file files[] = {
+    { "a.txt", a, sizeof(a), 01234567 },
+    { "b.bin", b, sizeof(b), 0 },
+    { "empty", a, 0, 42 },
+  };
+  const size_t count = sizeof(files) / sizeof(files[0]);
+  memset(batch_rx, 0, sizeof(batch_rx));
+  batch_rx_count = 0;
+
+  int fds[2];
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return false;
+  FdStream tx_end(fds[0]);
+  FdStream rx_end(fds[1]);
+  XModem sender;
+  XModem receiver;
+  sender.begin(tx_end, XModem::ProtocolType::XMODEM_1K);
+  receiver.begin(rx_end, XModem::ProtocolType::XMODEM_1K);
+  //a thread that isn't scheduled for a while mustn't look like a lost packet,
+  //a NAK that crosses a late one leaves a spare ACK for the next packet
+  sender.setTimeoutBounds(100, 1000);
+  receiver.setTimeoutBounds(100, 1000);
+  receiver.setRecieveBlockHandler(batch_block);
+  receiver.setFileHandlers(batch_open, batch_close);
+
+  struct batch_tx tx = { &sender, files, count, false };
+  pthread_t thread;
+  pthread_create(&thread, NULL, batch_send, &tx);
+  //only returns true once the empty block 0 that ends the batch arrived
+  bool rx_result = receiver.receive_batch();
+  pthread_join(thread, NULL);
+  close(fds[0]);
+  close(fds[1]);
+
+  bool ok = tx.result && rx_result && batch_rx_count == count;
+  for(size_t i = 0; ok && i < count; ++i) {
+    struct batch_rx_file *f = &batch_rx[i];
+    ok = strcmp(f->name, files[i].name) == 0 && f->size == files[i].len && f->mtime == files[i].mtime &&
+      f->closed == 1 && f->complete && f->len == files[i].len && memcmp(f->data, files[i].data, f->len) == 0;
+  }
+  return ok;
+}
+
+struct blocking_tx {
+  XModem *sender;
+  byte *data;
+  size_t len;
+  bool result;
+};
+
+static void *blocking_send(void *arg) {
+  struct blocking_tx *tx = (struct blocking_tx *) arg;
+  tx->result = tx->sender->send(tx->data, tx->len);
+  return NULL;
+}
+
+static unsigned long resume_id;
+static unsigned long resume_offset;
+static size_t refuse_at; //received_len at which store_some refuses a block
+static unsigned long first_id; //id of the first block of a transfer, 0 before it
+
+static void store_checkpoint(void *blk_id, size_t idSize, unsigned long offset) {
+  resume_id = *(byte *) blk_id;
+  resume_offset = offset;
+  //the sender started over so what was kept has to go
+  if(offset == 0) received_len = 0;
+}
+
+static bool store_some(void *blk_id, size_t idSize, byte *data, size_t dataSize) {
+  if(received_len >= refuse_at) return false;
+  if(first_id == 0) first_id = *(byte *) blk_id;
+  return store_block(blk_id, idSize, data, dataSize);
+}
+
+//runs send() on a second thread against receive() or resume_receive() when
+//resume is set. bad_signal is written to the sender before either starts
+static bool run_blocking(byte *data, size_t len, bool resume, const byte *bad_signal, size_t bad_len, bool *tx_result) {
+  int fds[2];
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return false;
+  FdStream tx_end(fds[0]);
+  FdStream rx_end(fds[1]);
+  XModem sender;
+  XModem receiver;
+  sender.begin(tx_end, XModem::ProtocolType::CRC_XMODEM);
+  receiver.begin(rx_end, XModem::ProtocolType::CRC_XMODEM);
+  //see check_batch()
+  sender.setTimeoutBounds(100, 1000);
+  receiver.setTimeoutBounds(100, 1000);
+  receiver.setRecieveBlockHandler(store_some);
+  receiver.setCheckpointHandler(store_checkpoint);
+  if(bad_len > 0) rx_end.write(bad_signal, bad_len);
+
+  struct blocking_tx tx = { &sender, data, len, false };
+  pthread_t thread;
+  pthread_create(&thread, NULL, blocking_send, &tx);
+  bool rx_result = resume ? receiver.resume_receive(resume_id, resume_offset) : receiver.receive();
+  pthread_join(thread, NULL);
+  close(fds[0]);
+  close(fds[1]);
+  *tx_result = tx.result;
+  return rx_result;
+}
+
+static bool check_resume() {
+  const size_t len = 2000;
+  byte data[len];
+  fill_data(data, len, 17);
+  byte buffer[len + 128];
+  received = buffer;
+  received_len = 0;
+  resume_id = 0;
+  resume_offset = 0;
+
+  //the first transfer fails once 5 blocks have been kept
+  refuse_at = 5*128;
+  first_id = 0;
+  bool tx_result;
+  bool stopped = !run_blocking(data, len, false, NULL, 0, &tx_result) && !tx_result;
+  if(!stopped || resume_id != 5 || resume_offset != refuse_at || received_len != refuse_at) return false;
+
+  //the second one carries on with block 6 at offset 640
+  refuse_at = len + 128;
+  first_id = 0;
+  bool rx_result = run_blocking(data, len, true, NULL, 0, &tx_result);
+  return rx_result && tx_result && first_id == 6 && received_len == len && memcmp(received, data, len) == 0;
+}
+
+static bool check_resume_bad() {
+  const size_t len = 2000;
+  byte data[len];
+  fill_data(data, len, 19);
+  byte buffer[len + 128];
+  received = buffer;
+  received_len = 0;
+  refuse_at = len + 128;
+  first_id = 0;
+
+  //'R' for block 5 at offset 640 with the complement of the last offset byte
+  //off by one bit, a sender that took it would start with block 6
+  byte bad[] = { 'R', 0x05, 0xFA, 0x00, 0xFF, 0x00, 0xFF, 0x02, 0xFD, 0x80, 0x7E };
+  bool tx_result;
+  bool rx_result = run_blocking(data, len, false, bad, sizeof(bad), &tx_result);
+  return rx_result && tx_result && first_id == 1 && received_len == len && memcmp(received, data, len) == 0;
+}
+
+static XModem *idle_sender;
+static XModem *idle_receiver;
+
+static void poll_idle_sender() { idle_sender->poll(); }
+static void poll_idle_receiver() { idle_receiver->poll(); }
+
+//each end gets exactly workBufferSize() bytes starting offset bytes past an
+//aligned address, followed by guard bytes that must not be touched
+static bool run_work_buffer(XModem::ProtocolType type, const char *mode, bool pipeline, byte queue, size_t offset) {
+  const size_t len = 3000;
+  byte data[len];
+  fill_data(data, len, 23);
+  byte buffer[len + 1024];
+  received = buffer;
+  received_len = 0;
+
+  XModemLoopback tx_end(tx_ring, sizeof(tx_ring));
+  XModemLoopback rx_end(rx_ring, sizeof(rx_ring));
+  tx_end.connect(rx_end);
+  XModem sender;
+  XModem receiver;
+  sender.begin(tx_end, type);
+  receiver.begin(rx_end, type);
+  sender.setTimeoutBounds(10, 200);
+  receiver.setTimeoutBounds(10, 200);
+  receiver.setRecieveBlockHandler(store_block);
+  sender.pipelineSends(pipeline);
+  receiver.setReceiveQueue(queue);
+
+  const size_t guard = 16;
+  static void *work[2][8192 / sizeof(void *)];
+  XModem *ends[2] = { &sender, &receiver };
+  byte *start[2];
+  size_t size[2];
+  for(size_t i = 0; i < 2; ++i) {
+    size[i] = ends[i]->workBufferSize();
+    if(offset + size[i] + guard > sizeof(work[i])) {
+      printf("  workBufferSize() of %zu is too big for the check\n", size[i]);
+      return false;
+    }
+    start[i] = (byte *) work[i] + offset;
+    memset(work[i], 0xA5, sizeof(work[i]));
+    ends[i]->setWorkBuffer(start[i], size[i]);
+  }
+
+  bool ok;
+  if(strcmp(mode, "rx") == 0) {
+    idle_sender = &sender;
+    rx_end.setIdleHandler(poll_idle_sender);
+    sender.beginSend(data, len);
+    ok = receiver.receive() && sender.poll() == XModem::COMPLETE;
+  } else if(strcmp(mode, "tx") == 0) {
+    idle_receiver = &receiver;
+    tx_end.setIdleHandler(poll_idle_receiver);
+    receiver.beginReceive();
+    ok = sender.send(data, len) && receiver.poll() == XModem::COMPLETE;
+  } else {
+    XModem::TransferStatus rx_status, tx_status;
+    receiver.beginReceive();
+    sender.beginSend(data, len);
+    poll_both(sender, receiver, tx_status, rx_status);
+    ok = tx_status == XModem::COMPLETE && rx_status == XModem::COMPLETE;
+  }
+  ok &= received_len == len && memcmp(received, data, len) == 0;
+  for(size_t i = 0; i < 2; ++i) {
+    for(size_t j = 0; j < guard; ++j) ok &= start[i][size[i] + j] == 0xA5;
+  }
+  if(!ok) printf("  type %d %s pipeline %d queue %d offset %zu failed\n", (int) type, mode, pipeline, queue, offset);
+  return ok;
+}
+
+static bool check_work_buffer() {
+  const XModem::ProtocolType types[] = { XModem::ProtocolType::XMODEM, XModem::ProtocolType::CRC_XMODEM, XModem::ProtocolType::XMODEM_1K };
+  const char *modes[] = { "poll", "rx", "tx" };
+  bool ok = true;
+  size_t offset = 1;
+  for(size_t t = 0; t < 3; ++t) {
+    for(size_t m = 0; m < 3; ++m) {
+      for(int pipeline = 0; pipeline < 2; ++pipeline) {
+        for(byte queue = 0; queue <= 4; queue += 4) {
+          ok &= run_work_buffer(types[t], modes[m], pipeline, queue, offset);
+          offset = offset % (sizeof(void *) - 1) + 1;
+        }
+      }
+    }
+  }
+  return ok;
+}
+
+struct check {
+  const char *name;
+  bool (*run) ();
+};
+
+static const struct check checks[] = {
+  { "stream", check_plain_stream },
+  { "dead_stream", check_dead_stream },
+  { "null_chksum", check_null_chksum },
+  { "batch", check_batch },
+  { "resume", check_resume },
+  { "resume_bad", check_resume_bad },
+  { "work_buffer", check_work_buffer },
+};
+
+int main(int argc, char **argv) {
+  const char *name = argc > 1 ? argv[1] : "all";
+  bool found = false;
+  bool ok = true;
+  for(size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); ++i) {
+    if(strcmp(name, "all") != 0 && strcmp(name, checks[i].name) != 0) continue;
+    found = true;
+    unsigned long start = millis();
+    bool passed = checks[i].run();
+    printf("%-12s %s (%lu ms)\n", checks[i].name, passed ? "ok" : "FAILED", millis() - start);
+    ok &= passed;
+  }
+  if(!found) {
+    printf("Unknown check %s\n", name);
+    return 1;
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,77 @@
+#include "xmodem.c"
+#include <string.h>
+#include <stdio.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+//Compares the CRC-16 engines against each other, checks that they all produce
+//the same checksum bytes and reports the cost of each in cycles per byte
+//usage: bench_crc [block_bytes] [iterations]
+
+struct engine {
+  const char *name;
+  void (*fn) (unsigned char *data, size_t data_bytes, unsigned char *chksm);
+};
+
+static unsigned long long now_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+int main(int argc, char** argv) {
+  size_t block_bytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 128;
+  size_t iterations = argc > 2 ? strtoul(argv[2], NULL, 10) : 200000;
+
+  struct engine engines[] = {
+    {"bitwise", fill_checksum_crc_16_bitwise},
+    {"nibble", fill_checksum_crc_16_nibble},
+    {"table", fill_checksum_crc_16_table},
+    {"slice_by_8", fill_checksum_crc_16_slice_by_8},
+  };
+  size_t engine_count = sizeof(engines)/sizeof(engines[0]);
+
+  unsigned char *data = malloc(block_bytes);
+  srand(1);
+  for(size_t i = 0; i < block_bytes; ++i) data[i] = (unsigned char) rand();
+
+  //every engine has to produce exactly the same bytes as the bitwise version
+  //for every length up to the block size
+  for(size_t len = 0; len <= block_bytes; ++len) {
+    unsigned char expected[2], actual[2];
+    engines[0].fn(data, len, expected);
+    for(size_t e = 1; e < engine_count; ++e) {
+      engines[e].fn(data, len, actual);
+      if(memcmp(expected, actual, 2) != 0) {
+        printf("%s differs from %s at length %zu\n", engines[e].name, engines[0].name, len);
+        return 1;
+      }
+    }
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+  const char *unit = "cycles";
+#else
+  const char *unit = "ns";
+#endif
+  printf("block_bytes=%zu iterations=%zu\n", block_bytes, iterations);
+  for(size_t e = 0; e < engine_count; ++e) {
+    unsigned char chksm[2];
+    unsigned long long start = now_cycles();
+    for(size_t i = 0; i < iterations; ++i) {
+      engines[e].fn(data, block_bytes, chksm);
+      //stop the compiler from hoisting the checksum out of the loop
+      __asm__ volatile("" : : "r"(chksm) : "memory");
+    }
+    unsigned long long elapsed = now_cycles() - start;
+    printf("%-10s %6.2f %s/byte\n", engines[e].name, (double) elapsed / ((double) iterations * block_bytes), unit);
+  }
+
+  free(data);
+  return 0;
+}
@@ -0,0 +1,531 @@
+#define _GNU_SOURCE
+#include "xmodem.c"
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+
+//Runs a transfer through a simulated link that sits between the sender and
+//the receiver on two pty pairs. The link corrupts, drops and duplicates bytes
+//in both directions, garbles bursts of bytes, adds latency and limits the
+//bandwidth, all driven from a seed so a profile sees the same faults for the
+//same bytes every run. One JSON object is printed per profile with the
+//goodput, the packets that had to be sent again and how long it took to get
+//the next block through after each fault.
+//usage: bench_noise [profile|all] [mode] [data_bytes] [seed] [min_timeout_ms] [max_timeout_ms] [lookup_us]
+//                   [compress] [random|telemetry] [handler_us] [window_size] [pipeline]
+//The retry limit and packet stall timeout are compile time settings, build
+//with -DXMODEM_RETRY_LIMIT=n or -DXMODEM_READ_TIMEOUT_MS=n to compare them.
+//With lookup_us the sender gets its blocks from a lookup handler that takes
+//that long for each one, like reading them from an SD card. compress 1 turns
+//on compressed transfers on both sides, telemetry data is repeating text
+//records like a logger would send instead of random bytes. handler_us makes
+//the receive handler take that long for each block, like a flash write, build
+//with -DXMODEM_RECEIVE_THREAD to run it on a separate thread. window_size
+//above 1 sets config.window_size on both sides for a windowed transfer and
+//pipeline 1 sets config.pipeline_sends on the sender
+
+#define LINK_QUEUE_BYTES 65536
+
+//xmodem.c keeps its protocol constants to itself
+#define SOH 0x01
+#define STX 0x02
+#define EOT 0x04
+#define NAK 0x15
+#define CAN 0x18
+#define SUB 0x1A
+
+struct link_profile {
+  const char *name;
+  double bit_error_rate; //chance of each bit being flipped
+  double drop_rate; //chance of each byte being lost
+  double dup_rate; //chance of each byte arriving twice
+  double burst_rate; //chance of a burst starting at each byte
+  size_t burst_bytes; //bytes garbled by each burst
+  long latency_ms; //one way
+  long bytes_per_sec; //0 for no limit
+  size_t cancel_after_blocks; //CAN CAN is put in front of the next packet after this many blocks, 0 never
+};
+
+static const struct link_profile profiles[] = {
+  //name       ber     drop    dup     burst  len latency bps    cancel
+  {"clean",    0,      0,      0,      0,     0,  0,      0,     0},
+  {"ber_1e-5", 1e-5,   0,      0,      0,     0,  0,      0,     0},
+  {"ber_1e-4", 1e-4,   0,      0,      0,     0,  0,      0,     0},
+  {"drop",     0,      1e-3,   0,      0,     0,  0,      0,     0},
+  {"dup",      0,      0,      1e-3,   0,     0,  0,      0,     0},
+  {"burst",    0,      0,      0,      2e-4,  16, 0,      0,     0},
+  {"rs485",    1e-6,   0,      0,      1e-4,  8,  0,      11520, 0},
+  {"radio",    1e-5,   1e-4,   0,      1e-4,  32, 20,     4800,  0},
+  {"cancel",   0,      0,      0,      0,     0,  0,      0,     16},
+};
+
+struct link_byte {
+  unsigned char b;
+  long long due_us;
+};
+
+//one direction of the link
+struct link_dir {
+  int in;
+  int out;
+  uint64_t rng;
+  size_t burst_left;
+  struct link_byte queue[LINK_QUEUE_BYTES];
+  size_t head;
+  size_t count;
+  long long last_due_us;
+};
+
+static const struct link_profile *profile;
+static struct link_dir to_rx;
+static struct link_dir to_tx;
+static volatile bool stop;
+
+//link counters, the relay reads the bytes before they are damaged so it can
+//follow the frames exactly
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t faults;
+static size_t packets;
+static size_t resends;
+static size_t eots;
+static size_t naks;
+static long long fault_us = -1; //first fault since the last block got through
+static double *recover_ms;
+static size_t recoveries;
+static size_t recover_len;
+
+static struct xmodem_config tx_config;
+static struct xmodem_config rx_config;
+#ifdef XMODEM_STATS
+static struct xmodem_stats tx_stats;
+static struct xmodem_stats rx_stats;
+#endif
+#ifdef XMODEM_TRACE
+static struct xmodem_trace tx_trace;
+static struct xmodem_trace rx_trace;
+#endif
+static int rx_fd;
+static bool rx_result;
+static unsigned char *tx_data;
+static size_t tx_bytes;
+static long lookup_us;
+static long handler_us;
+static unsigned char window_size;
+static bool pipeline_sends;
+static size_t lookup_index; //block of the last lookup, ids wrap around
+static unsigned char *rx_data;
+static size_t rx_bytes;
+static size_t rx_blocks;
+static bool telemetry;
+
+static long long now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+//xorshift64*
+static double next_random(struct link_dir *dir) {
+  dir->rng ^= dir->rng >> 12;
+  dir->rng ^= dir->rng << 25;
+  dir->rng ^= dir->rng >> 27;
+  return ((dir->rng * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void record_fault(long long now) {
+  pthread_mutex_lock(&lock);
+  ++faults;
+  if(fault_us < 0) fault_us = now;
+  pthread_mutex_unlock(&lock);
+}
+
+static void record_recovery(long long now) {
+  if(fault_us >= 0 && recoveries < recover_len) recover_ms[recoveries++] = (now - fault_us) / 1000.0;
+  fault_us = -1;
+}
+
+static void enqueue(struct link_dir *dir, unsigned char b, long long now) {
+  long long due = now + profile->latency_ms * 1000LL;
+  if(profile->bytes_per_sec > 0) {
+    long long next = dir->last_due_us + 1000000LL / profile->bytes_per_sec;
+    if(next > due) due = next;
+  }
+  dir->last_due_us = due;
+  struct link_byte *slot = &dir->queue[(dir->head + dir->count++) % LINK_QUEUE_BYTES];
+  slot->b = b;
+  slot->due_us = due;
+}
+
+static void damage(struct link_dir *dir, unsigned char b, long long now) {
+  if(next_random(dir) < profile->drop_rate) {
+    record_fault(now);
+    return;
+  }
+
+  bool damaged = false;
+  if(dir->burst_left == 0 && next_random(dir) < profile->burst_rate) {
+    dir->burst_left = profile->burst_bytes;
+    record_fault(now);
+  }
+  if(dir->burst_left != 0) {
+    --dir->burst_left;
+    b ^= (unsigned char) (1 + next_random(dir) * 255);
+  }
+  for(int i = 0; i < 8; ++i) {
+    if(next_random(dir) < profile->bit_error_rate) {
+      b ^= 1 << i;
+      damaged = true;
+    }
+  }
+  if(damaged) record_fault(now);
+
+  enqueue(dir, b, now);
+  if(next_random(dir) < profile->dup_rate) {
+    record_fault(now);
+    enqueue(dir, b, now);
+  }
+}
+
+//follows the packets the sender writes, remaining is what is left of the
+//current one and a packet that isn't newer than every one before it is a
+//resend, a windowed sender goes back to the missing block
+static void follow_sender(unsigned char b, size_t *remaining, long long now) {
+  static unsigned char id[8];
+  static unsigned long long newest_id;
+  static size_t frame_bytes, data_bytes, coded_bytes;
+  if(*remaining != 0) {
+    size_t pos = frame_bytes - *remaining;
+    if(pos < tx_config.id_bytes && pos < sizeof(id)) id[pos] = b;
+    //compressed packets give the length of their payload after the ids
+    if(tx_config.compress && pos == 2*tx_config.id_bytes) coded_bytes = (size_t) b << 8;
+    if(tx_config.compress && pos == 2*tx_config.id_bytes + 2) {
+      coded_bytes |= b;
+      if(coded_bytes > data_bytes) coded_bytes = data_bytes;
+      frame_bytes += coded_bytes + tx_config.chksm_bytes;
+      *remaining += coded_bytes + tx_config.chksm_bytes;
+    }
+    if(--*remaining == frame_bytes - tx_config.id_bytes) {
+      //ids wrap around so newer is less than half the id range ahead
+      unsigned long long mask = tx_config.id_bytes >= sizeof(id) ? ~0ULL : (1ULL << 8*tx_config.id_bytes) - 1;
+      unsigned long long value = 0;
+      for(size_t i = 0; i < tx_config.id_bytes && i < sizeof(id); ++i) value = value << 8 | id[i];
+      unsigned long long ahead = (value - newest_id) & mask;
+      if(packets > 1 && (ahead == 0 || ahead > mask/2)) ++resends;
+      else newest_id = value;
+    }
+    return;
+  }
+  if(b == SOH || b == STX) {
+    data_bytes = b == STX ? tx_config.long_data_bytes : tx_config.data_bytes;
+    frame_bytes = 2*tx_config.id_bytes + (tx_config.compress ? 4 : data_bytes + tx_config.chksm_bytes);
+    *remaining = frame_bytes;
+    memset(id, 0, sizeof(id));
+
+    pthread_mutex_lock(&lock);
+    ++packets;
+    bool cancel = profile->cancel_after_blocks != 0 && rx_blocks == profile->cancel_after_blocks;
+    pthread_mutex_unlock(&lock);
+    if(cancel) {
+      //a CAN that turns up where the receiver expects a header
+      enqueue(&to_rx, CAN, now);
+      enqueue(&to_rx, CAN, now);
+    }
+  } else if(b == EOT) {
+    ++eots;
+  }
+}
+
+static void relay_in(struct link_dir *dir, bool from_sender, size_t *remaining) {
+  unsigned char buf[256];
+  size_t room = LINK_QUEUE_BYTES - dir->count;
+  //leave room for duplicates and injected cancels
+  if(room < 2*sizeof(buf) + 2) return;
+  ssize_t r = read(dir->in, buf, sizeof(buf));
+  long long now = now_us();
+  for(ssize_t i = 0; i < r; ++i) {
+    if(from_sender) {
+      follow_sender(buf[i], remaining, now);
+    } else if(buf[i] == NAK) {
+      ++naks;
+    }
+    damage(dir, buf[i], now);
+  }
+}
+
+static void relay_out(struct link_dir *dir, long long now) {
+  while(dir->count != 0 && dir->queue[dir->head].due_us <= now) {
+    unsigned char buf[256];
+    size_t n = 0;
+    while(n < dir->count && n < sizeof(buf) && dir->queue[(dir->head + n) % LINK_QUEUE_BYTES].due_us <= now) {
+      buf[n] = dir->queue[(dir->head + n) % LINK_QUEUE_BYTES].b;
+      ++n;
+    }
+    ssize_t w = write(dir->out, buf, n);
+    if(w <= 0) return;
+    dir->head = (dir->head + w) % LINK_QUEUE_BYTES;
+    dir->count -= w;
+  }
+}
+
+static void *relay(void *arg) {
+  size_t remaining = 0;
+  while(!stop) {
+    long long now = now_us();
+    relay_out(&to_rx, now);
+    relay_out(&to_tx, now);
+
+    //sleep until a byte arrives or the next queued byte is due
+    long long wake = now + 50000;
+    if(to_rx.count != 0 && to_rx.queue[to_rx.head].due_us < wake) wake = to_rx.queue[to_rx.head].due_us;
+    if(to_tx.count != 0 && to_tx.queue[to_tx.head].due_us < wake) wake = to_tx.queue[to_tx.head].due_us;
+    int timeout = wake > now ? (int) ((wake - now + 999) / 1000) : 0;
+    struct pollfd fds[2] = {{to_rx.in, POLLIN, 0}, {to_tx.in, POLLIN, 0}};
+    if(poll(fds, 2, timeout) <= 0) continue;
+    if(fds[0].revents & POLLIN) relay_in(&to_rx, true, &remaining);
+    if(fds[1].revents & POLLIN) relay_in(&to_tx, false, NULL);
+  }
+  return NULL;
+}
+
+static bool store_block(void *blk_id, size_t id_len, unsigned char *data, size_t data_len) {
+  if(handler_us > 0) {
+    struct timespec wait = { handler_us / 1000000, (handler_us % 1000000) * 1000 };
+    nanosleep(&wait, NULL);
+  }
+  memcpy(rx_data + rx_bytes, data, data_len);
+  rx_bytes += data_len;
+  pthread_mutex_lock(&lock);
+  ++rx_blocks;
+  record_recovery(now_us());
+  pthread_mutex_unlock(&lock);
+  return true;
+}
+
+static void slow_lookup(void *blk_id, size_t id_len, unsigned char *send_data, size_t data_len) {
+  //work out the block from the id bits closest to the last one looked up
+  unsigned long long mask = id_len < sizeof(mask) ? (1ULL << (8*id_len)) - 1 : ~0ULL;
+  unsigned long long id = 0;
+  for(size_t i = 0; i < id_len; ++i) id = (id << 8) | ((unsigned char *) blk_id)[i];
+  unsigned long long delta = (id - 1 - lookup_index) & mask;
+  lookup_index += delta <= mask / 2 ? (long long) delta : (long long) delta - (long long) mask - 1;
+
+  struct timespec wait = { lookup_us / 1000000, (lookup_us % 1000000) * 1000 };
+  nanosleep(&wait, NULL);
+  size_t offset = lookup_index * data_len;
+  size_t len = offset >= tx_bytes ? 0 : tx_bytes - offset < data_len ? tx_bytes - offset : data_len;
+  memcpy(send_data, tx_data + offset, len);
+  memset(send_data + len, SUB, data_len - len);
+}
+
+static void *receiver(void *arg) {
+  rx_result = xmodem_receive(rx_fd, &rx_config);
+  return NULL;
+}
+
+static int open_pair(int *slave) {
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if(master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) return -1;
+  *slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+  struct termios tty;
+  int fds[2] = {master, *slave};
+  for(int i = 0; i < 2; ++i) {
+    tcgetattr(fds[i], &tty);
+    cfmakeraw(&tty);
+    tty.c_cc[VTIME] = 0;
+    tty.c_cc[VMIN] = 0;
+    tcsetattr(fds[i], TCSANOW, &tty);
+  }
+  return master;
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+#ifdef XMODEM_STATS
+//each side's own counts and phase times, printed as part of the JSON object
+static void print_stats(const char *name, struct xmodem_stats *s) {
+  printf("\"%s\":{\"blocks_sent\":%lu,\"blocks_received\":%lu,\"resends\":%lu,\"duplicates\":%lu,", name,
+      s->blocks_sent, s->blocks_received, s->resends, s->duplicates);
+  printf("\"naks\":%lu,\"cans\":%lu,\"timeouts\":%lu,\"resyncs\":%lu,\"wire_bytes\":%lu,\"payload_bytes\":%lu,",
+      s->naks, s->cans, s->timeouts, s->resyncs, s->wire_bytes, s->payload_bytes);
+  printf("\"us\":{\"handshake\":%lu,\"chksum\":%lu,\"wire\":%lu,\"ack_wait\":%lu,\"handler\":%lu,\"other\":%lu}},",
+      s->handshake_us, s->chksum_us, s->wire_us, s->ack_wait_us, s->handler_us, s->other_us);
+}
+#endif
+
+#ifdef XMODEM_TRACE
+//each side's trace goes to <profile>.<tx|rx>.trace for trace_decode
+static void dump_trace(const char *profile, const char *side, struct xmodem_trace *trace) {
+  char name[64];
+  snprintf(name, sizeof(name), "%s.%s.trace", profile, side);
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0 || !xmodem_trace_dump(trace, fd)) printf("Error %i writing %s: %s\n", errno, name, strerror(errno));
+  if(fd >= 0) close(fd);
+}
+#endif
+
+static bool run_profile(const struct link_profile *p, enum x_mode mode, size_t data_bytes, unsigned long seed,
+    long min_timeout_ms, long max_timeout_ms, bool compress) {
+  //sender <-> tx_master/tx_slave <-> relay <-> rx_slave/rx_master <-> receiver
+  int tx_slave, rx_slave;
+  int tx_master = open_pair(&tx_slave);
+  int rx_master = open_pair(&rx_slave);
+  if(tx_master < 0 || rx_master < 0) {
+    printf("Error %i opening pty: %s\n", errno, strerror(errno));
+    return false;
+  }
+
+  unsigned char *data = malloc(data_bytes);
+  srand(seed);
+  //leave out the SUB padding byte so every byte is counted by the receiver
+  for(size_t i = 0; i < data_bytes; ++i) {
+    data[i] = (unsigned char) rand();
+    if(data[i] == SUB) data[i] = 0;
+  }
+  if(telemetry) {
+    //64 byte records of a few readings that drift a little, zero padded
+    int temp = 235, humidity = 41, pressure = 1013;
+    for(size_t i = 0; i < data_bytes; i += 64) {
+      char record[64] = {0};
+      snprintf(record, sizeof(record), "t=%08zu T=%03d.%d H=%02d P=%04d OK\r\n", i / 64, temp / 10, temp % 10,
+          humidity, pressure);
+      memcpy(data + i, record, data_bytes - i < sizeof(record) ? data_bytes - i : sizeof(record));
+      temp += rand() % 3 - 1;
+      humidity += rand() % 3 - 1;
+      pressure += rand() % 3 - 1;
+    }
+  }
+
+  xmodem_init_config(&tx_config, mode);
+  xmodem_init_config(&rx_config, mode);
+  tx_config.min_timeout_ms = rx_config.min_timeout_ms = min_timeout_ms;
+  tx_config.max_timeout_ms = rx_config.max_timeout_ms = max_timeout_ms;
+  tx_config.compress = rx_config.compress = compress;
+  tx_config.window_size = rx_config.window_size = window_size;
+  tx_config.pipeline_sends = pipeline_sends;
+#ifdef XMODEM_STATS
+  tx_config.stats = &tx_stats;
+  rx_config.stats = &rx_stats;
+#endif
+#ifdef XMODEM_TRACE
+  xmodem_trace_clear(&tx_trace);
+  xmodem_trace_clear(&rx_trace);
+  tx_config.trace = &tx_trace;
+  rx_config.trace = &rx_trace;
+#endif
+  rx_config.rx_block_handler = store_block;
+  rx_fd = rx_master;
+  rx_data = malloc(data_bytes + tx_config.long_data_bytes + tx_config.data_bytes);
+  rx_bytes = 0;
+  rx_blocks = 0;
+
+  profile = p;
+  memset(&to_rx, 0, sizeof(to_rx));
+  memset(&to_tx, 0, sizeof(to_tx));
+  to_rx.in = tx_slave;
+  to_rx.out = rx_slave;
+  to_rx.rng = seed * 2 + 1;
+  to_tx.in = rx_slave;
+  to_tx.out = tx_slave;
+  to_tx.rng = seed * 2 + 2;
+  faults = packets = resends = eots = naks = recoveries = 0;
+  fault_us = -1;
+  recover_len = 4096;
+  recover_ms = malloc(recover_len * sizeof(double));
+  stop = false;
+
+  pthread_t relay_thread, rx_thread;
+  pthread_create(&relay_thread, NULL, relay, NULL);
+  pthread_create(&rx_thread, NULL, receiver, NULL);
+  long long start = now_us();
+  bool tx_result;
+  if(lookup_us > 0) {
+    tx_config.block_lookup = slow_lookup;
+    tx_data = data;
+    tx_bytes = data_bytes;
+    lookup_index = 0;
+    tx_result = xmodem_lookup_send(tx_master, &tx_config, 1, (data_bytes + tx_config.data_bytes - 1) / tx_config.data_bytes);
+  } else {
+    tx_result = xmodem_send(tx_master, &tx_config, data, data_bytes);
+  }
+  pthread_join(rx_thread, NULL);
+  long long end = now_us();
+  stop = true;
+  pthread_join(relay_thread, NULL);
+
+  //a fault that was never followed by another block counts up to the end
+  pthread_mutex_lock(&lock);
+  record_recovery(end);
+  pthread_mutex_unlock(&lock);
+
+  bool ok = tx_result && rx_result && rx_bytes == data_bytes && memcmp(rx_data, data, data_bytes) == 0;
+  double wall_ms = (end - start) / 1000.0;
+  double mean = 0;
+  for(size_t i = 0; i < recoveries; ++i) mean += recover_ms[i];
+  if(recoveries != 0) mean /= recoveries;
+  qsort(recover_ms, recoveries, sizeof(double), compare_double);
+#ifdef XMODEM_TRACE
+  dump_trace(p->name, "tx", &tx_trace);
+  dump_trace(p->name, "rx", &rx_trace);
+#endif
+
+  printf("{\"bench\":\"noise\",\"profile\":\"%s\",\"mode\":%d,\"seed\":%lu,\"data_bytes\":%zu,", p->name, mode, seed, data_bytes);
+  printf("\"min_timeout_ms\":%ld,\"max_timeout_ms\":%ld,\"retry_limit\":%d,\"read_timeout_ms\":%d,\"lookup_us\":%ld,",
+      min_timeout_ms, max_timeout_ms, RETRY_LIMIT, XMODEM_READ_TIMEOUT_MS, lookup_us);
+  printf("\"compress\":%s,\"data\":\"%s\",\"handler_us\":%ld,\"window_size\":%u,\"pipeline_sends\":%s,", compress ? "true" : "false",
+      telemetry ? "telemetry" : "random", handler_us, window_size, pipeline_sends ? "true" : "false");
+#ifdef XMODEM_RECEIVE_THREAD
+  printf("\"rx_queue_blocks\":%zu,", rx_config.rx_queue_blocks);
+#endif
+  printf("\"result\":\"%s\",\"wall_ms\":%.1f,\"goodput_bytes_per_sec\":%.0f,", ok ? "ok" : "failed", wall_ms,
+      wall_ms > 0 ? (ok ? data_bytes : 0) / (wall_ms / 1000.0) : 0.0);
+  printf("\"packets\":%zu,\"retransmissions\":%zu,\"eots\":%zu,\"naks\":%zu,\"faults\":%zu,", packets,
+      resends, eots, naks, faults);
+#ifdef XMODEM_STATS
+  print_stats("tx_stats", &tx_stats);
+  print_stats("rx_stats", &rx_stats);
+#endif
+  printf("\"recoveries\":%zu,\"recover_ms\":{\"mean\":%.1f,\"p50\":%.1f,\"max\":%.1f}}\n", recoveries, mean,
+      recoveries != 0 ? recover_ms[recoveries / 2] : 0.0, recoveries != 0 ? recover_ms[recoveries - 1] : 0.0);
+  fflush(stdout);
+
+  close(tx_slave);
+  close(tx_master);
+  close(rx_slave);
+  close(rx_master);
+  free(recover_ms);
+  free(rx_data);
+  free(data);
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  const char *name = argc > 1 ? argv[1] : "all";
+  enum x_mode mode = argc > 2 ? (enum x_mode) atoi(argv[2]) : CRC_XMODEM;
+  size_t data_bytes = argc > 3 ? strtoul(argv[3], NULL, 10) : 16384;
+  unsigned long seed = argc > 4 ? strtoul(argv[4], NULL, 10) : 1;
+  struct xmodem_config defaults;
+  xmodem_init_config(&defaults, mode);
+  long min_timeout_ms = argc > 5 ? strtol(argv[5], NULL, 10) : defaults.min_timeout_ms;
+  long max_timeout_ms = argc > 6 ? strtol(argv[6], NULL, 10) : defaults.max_timeout_ms;
+  lookup_us = argc > 7 ? strtol(argv[7], NULL, 10) : 0;
+  bool compress = argc > 8 && atoi(argv[8]) != 0;
+  telemetry = argc > 9 && strcmp(argv[9], "telemetry") == 0;
+  handler_us = argc > 10 ? strtol(argv[10], NULL, 10) : 0;
+  window_size = argc > 11 ? (unsigned char) atoi(argv[11]) : defaults.window_size;
+  pipeline_sends = argc > 12 ? atoi(argv[12]) != 0 : defaults.pipeline_sends;
+
+  bool found = false;
+  for(size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); ++i) {
+    if(strcmp(name, "all") != 0 && strcmp(name, profiles[i].name) != 0) continue;
+    found = true;
+    run_profile(&profiles[i], mode, data_bytes, seed, min_timeout_ms, max_timeout_ms, compress);
+  }
+  if(!found) {
+    printf("Unknown profile %s\n", name);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,303 @@
+#define _GNU_SOURCE
+//the system headers have to come before the syscall counting macros below
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+//count the syscalls made by each thread
+struct bench_syscalls {
+  unsigned long read;
+  unsigned long write;
+  unsigned long poll;
+  unsigned long other; //tcflush and ioctl
+};
+static __thread struct bench_syscalls syscalls;
+
+static ssize_t bench_read(int fd, void *buf, size_t len) { ++syscalls.read; return read(fd, buf, len); }
+static ssize_t bench_write(int fd, const void *buf, size_t len) { ++syscalls.write; return write(fd, buf, len); }
+static ssize_t bench_writev(int fd, const struct iovec *iov, int count) { ++syscalls.write; return writev(fd, iov, count); }
+static int bench_poll(struct pollfd *fds, nfds_t count, int timeout) { ++syscalls.poll; return poll(fds, count, timeout); }
+static int bench_tcflush(int fd, int queue) { ++syscalls.other; return tcflush(fd, queue); }
+#define read(fd, buf, len) bench_read(fd, buf, len)
+#define write(fd, buf, len) bench_write(fd, buf, len)
+#define writev(fd, iov, count) bench_writev(fd, iov, count)
+#define poll(fds, count, timeout) bench_poll(fds, count, timeout)
+#define tcflush(fd, queue) bench_tcflush(fd, queue)
+#define ioctl(fd, request, ...) (++syscalls.other, ioctl(fd, request, __VA_ARGS__))
+
+#include "xmodem.c"
+
+#undef read
+#undef write
+#undef writev
+#undef poll
+#undef tcflush
+#undef ioctl
+
+//Sends data between the two ends of a pty pair and reports the time between
+//blocks arriving at the receiver and the CPU time per block, along with the
+//CPU time burnt by a receiver waiting for a sender that hasn't started yet.
+//vtime is the VTIME tty setting in tenths of a second, 0 makes reads return
+//straight away when there is no data. window_size above 1 sets
+//config.window_size on both sides for a windowed transfer
+//usage: bench_pty [mode] [data_bytes] [idle_ms] [vtime] [window_size]
+//
+//bench_pty sweep [max_data_bytes] [window_size] runs every combination of data
+//size, id size and checksum type instead and prints one JSON object per
+//transfer so results can be compared across versions. Buffered reads are a
+//compile time setting, build with -DXMODEM_BUFFER_PACKET_READS for the
+//buffered numbers
+
+struct bench_run {
+  enum x_mode mode;
+  size_t data_bytes;
+  size_t id_bytes;
+  unsigned long idle_ms;
+  unsigned char vtime;
+  unsigned char window_size;
+
+  //results
+  bool ok;
+  size_t blocks;
+  double wall_ms; //including the handshakes
+  double blocks_ms; //from the first block arriving to the last
+  size_t blocks_bytes; //data in the blocks after the first
+  double idle_cpu_ms;
+  double tx_cpu_ms;
+  double rx_cpu_ms;
+  struct bench_syscalls tx_syscalls;
+  struct bench_syscalls rx_syscalls;
+  double *intervals_us; //between blocks arriving at the receiver
+  size_t intervals_len;
+};
+
+static int rx_fd;
+static struct xmodem_config rx_config;
+static struct bench_run *rx_run;
+static size_t rx_bytes;
+static double first_block_ms;
+static double last_block_ms;
+static bool rx_result;
+static double rx_cpu;
+static struct bench_syscalls rx_syscalls;
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static double thread_cpu_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static double cpu_ms(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec * 1000.0 + usage.ru_utime.tv_usec / 1000.0
+    + usage.ru_stime.tv_sec * 1000.0 + usage.ru_stime.tv_usec / 1000.0;
+}
+
+static bool count_block(void *blk_id, size_t id_len, unsigned char *data, size_t data_len) {
+  double now = now_ms();
+  if(rx_run->blocks != 0 && rx_run->blocks - 1 < rx_run->intervals_len) {
+    rx_run->intervals_us[rx_run->blocks - 1] = (now - last_block_ms) * 1000.0;
+  }
+  if(rx_run->blocks++ == 0) first_block_ms = now;
+  else rx_run->blocks_bytes += data_len;
+  last_block_ms = now;
+  rx_bytes += data_len;
+  return true;
+}
+
+static void *receiver(void *arg) {
+  memset(&syscalls, 0, sizeof(syscalls));
+  double start = thread_cpu_ms();
+  rx_result = xmodem_receive(rx_fd, &rx_config);
+  rx_cpu = thread_cpu_ms() - start;
+  rx_syscalls = syscalls;
+  return NULL;
+}
+
+static void setup_pty(int fd, unsigned char vtime) {
+  struct termios tty;
+  tcgetattr(fd, &tty);
+  cfmakeraw(&tty);
+  tty.c_cc[VTIME] = vtime;
+  tty.c_cc[VMIN] = 0;
+  tcsetattr(fd, TCSANOW, &tty);
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+static size_t interval_count(struct bench_run *run) {
+  if(run->blocks < 2) return 0;
+  return run->blocks - 1 < run->intervals_len ? run->blocks - 1 : run->intervals_len;
+}
+
+//nearest rank percentile of the sorted block intervals
+static double percentile(struct bench_run *run, double p) {
+  size_t count = interval_count(run);
+  if(count == 0) return 0;
+  size_t rank = (size_t) (p / 100.0 * count + 0.5);
+  if(rank < 1) rank = 1;
+  if(rank > count) rank = count;
+  return run->intervals_us[rank - 1];
+}
+
+static bool run_transfer(struct bench_run *run) {
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if(master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+    printf("Error %i opening pty: %s\n", errno, strerror(errno));
+    return false;
+  }
+  int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+  setup_pty(master, run->vtime);
+  setup_pty(slave, run->vtime);
+
+  unsigned char *data = malloc(run->data_bytes);
+  srand(1);
+  //leave out the SUB padding byte so every byte is counted by the receiver
+  for(size_t i = 0; i < run->data_bytes; ++i) {
+    data[i] = (unsigned char) rand();
+    if(data[i] == 0x1A) data[i] = 0;
+  }
+
+  struct xmodem_config tx_config;
+  xmodem_init_config(&tx_config, run->mode);
+  xmodem_init_config(&rx_config, run->mode);
+  tx_config.id_bytes = run->id_bytes;
+  rx_config.id_bytes = run->id_bytes;
+  tx_config.window_size = run->window_size;
+  rx_config.window_size = run->window_size;
+  rx_config.rx_block_handler = count_block;
+  rx_fd = slave;
+  rx_run = run;
+  rx_bytes = 0;
+  run->blocks = 0;
+  run->blocks_bytes = 0;
+  run->intervals_len = run->data_bytes / tx_config.data_bytes + 1;
+  run->intervals_us = malloc(run->intervals_len * sizeof(double));
+
+  //the receiver starts first and waits for the sender
+  double idle_cpu = cpu_ms();
+  pthread_t thread;
+  pthread_create(&thread, NULL, receiver, NULL);
+  usleep(run->idle_ms * 1000);
+  run->idle_cpu_ms = cpu_ms() - idle_cpu;
+
+  memset(&syscalls, 0, sizeof(syscalls));
+  double start = now_ms();
+  double start_cpu = thread_cpu_ms();
+  bool tx_result = xmodem_send(master, &tx_config, data, run->data_bytes);
+  run->tx_cpu_ms = thread_cpu_ms() - start_cpu;
+  run->tx_syscalls = syscalls;
+  pthread_join(thread, NULL);
+  run->wall_ms = now_ms() - start;
+  run->blocks_ms = run->blocks > 1 ? last_block_ms - first_block_ms : 0;
+  run->rx_cpu_ms = rx_cpu;
+  run->rx_syscalls = rx_syscalls;
+  run->ok = tx_result && rx_result && rx_bytes == run->data_bytes;
+  qsort(run->intervals_us, interval_count(run), sizeof(double), compare_double);
+
+  close(slave);
+  close(master);
+  free(data);
+  return run->ok;
+}
+
+static void print_report(struct bench_run *run) {
+  size_t blocks = run->blocks != 0 ? run->blocks : 1;
+  double interval = run->blocks > 1 ? run->blocks_ms / (run->blocks - 1) : 0;
+  printf("mode=%d data_bytes=%zu blocks=%zu vtime=%u window_size=%u result=%s\n", run->mode, run->data_bytes,
+      run->blocks, run->vtime, run->window_size, run->ok ? "ok" : "failed");
+  printf("  transfer   %10.1f ms  including the handshakes\n", run->wall_ms);
+  printf("  per block  %10.3f ms  between blocks arriving\n", interval);
+  printf("  cpu        %10.3f ms  per block\n", (run->tx_cpu_ms + run->rx_cpu_ms) / blocks);
+  printf("  idle cpu   %10.1f ms  over %lu ms waiting for the sender\n", run->idle_cpu_ms, run->idle_ms);
+}
+
+static void print_syscalls_json(const char *name, struct bench_syscalls *s) {
+  printf("\"%s\":{\"read\":%lu,\"write\":%lu,\"poll\":%lu,\"other\":%lu}", name, s->read, s->write, s->poll, s->other);
+}
+
+static void print_json(struct bench_run *run) {
+  static const char *checksums[] = {"sum8", "crc16", "crc16_be"};
+#if defined(XMODEM_BUFFER_PACKET_READS)
+  const char *buffered = "true";
+#else
+  const char *buffered = "false";
+#endif
+  double seconds = run->wall_ms / 1000.0;
+  printf("{\"bench\":\"pty\",\"mode\":%d,\"checksum\":\"%s\",\"data_bytes\":%zu,\"id_bytes\":%zu,\"buffered\":%s,",
+      run->mode, checksums[run->mode], run->data_bytes, run->id_bytes, buffered);
+  printf("\"window_size\":%u,", run->window_size);
+  printf("\"result\":\"%s\",\"blocks\":%zu,\"wall_ms\":%.3f,\"throughput_bytes_per_sec\":%.0f,",
+      run->ok ? "ok" : "failed", run->blocks, run->wall_ms, seconds > 0 ? run->data_bytes / seconds : 0.0);
+  //without the handshakes, which take a fixed ~100ms and swamp small transfers
+  printf("\"block_throughput_bytes_per_sec\":%.0f,",
+      run->blocks_ms > 0 ? run->blocks_bytes / (run->blocks_ms / 1000.0) : 0.0);
+  printf("\"block_interval_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f},",
+      percentile(run, 50), percentile(run, 90), percentile(run, 99), percentile(run, 100));
+  printf("\"cpu_ms\":{\"tx\":%.3f,\"rx\":%.3f},\"syscalls\":{", run->tx_cpu_ms, run->rx_cpu_ms);
+  print_syscalls_json("tx", &run->tx_syscalls);
+  printf(",");
+  print_syscalls_json("rx", &run->rx_syscalls);
+  printf("}}\n");
+  fflush(stdout);
+}
+
+static int sweep(size_t max_data_bytes, unsigned char window_size) {
+  static const size_t data_sizes[] = {1024, 16384, 131072, 1048576};
+  static const size_t id_sizes[] = {1, 2, 4};
+  static const enum x_mode modes[] = {XMODEM, CRC_XMODEM, XMODEM_1K};
+  int failed = 0;
+  for(size_t d = 0; d < sizeof(data_sizes) / sizeof(data_sizes[0]); ++d) {
+    if(data_sizes[d] > max_data_bytes) break;
+    for(size_t i = 0; i < sizeof(id_sizes) / sizeof(id_sizes[0]); ++i) {
+      for(size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m) {
+        struct bench_run run = {.mode = modes[m], .data_bytes = data_sizes[d], .id_bytes = id_sizes[i],
+                                .window_size = window_size};
+        if(!run_transfer(&run)) ++failed;
+        print_json(&run);
+        free(run.intervals_us);
+      }
+    }
+  }
+  return failed != 0;
+}
+
+int main(int argc, char** argv) {
+  if(argc > 1 && strcmp(argv[1], "sweep") == 0) {
+    return sweep(argc > 2 ? strtoul(argv[2], NULL, 10) : 1048576, argc > 3 ? (unsigned char) atoi(argv[3]) : 1);
+  }
+
+  struct bench_run run;
+  memset(&run, 0, sizeof(run));
+  run.mode = argc > 1 ? (enum x_mode) atoi(argv[1]) : XMODEM;
+  run.data_bytes = argc > 2 ? strtoul(argv[2], NULL, 10) : 128*1024;
+  run.idle_ms = argc > 3 ? strtoul(argv[3], NULL, 10) : 1000;
+  run.vtime = argc > 4 ? (unsigned char) atoi(argv[4]) : 10;
+  run.window_size = argc > 5 ? (unsigned char) atoi(argv[5]) : 1;
+  run.id_bytes = 1;
+
+  bool ok = run_transfer(&run);
+  print_report(&run);
+  free(run.intervals_us);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,131 @@
+#define _GNU_SOURCE
+#include "xmodem.c"
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+
+//Sends a batch of files across a pty pair with xmodem_send_batch and checks
+//what xmodem_receive_batch hands to the file and block handlers. The files are
+//a short one, one that fills its last block exactly and ends in bytes that
+//look like padding, and an empty one. The receiver only returns true once the
+//empty block 0 that ends the batch has arrived. Exits with 0 when every file
+//arrived intact
+//usage: test_batch [mode]
+
+#define MAX_FILES 4
+
+struct rx_file {
+  char name[32];
+  unsigned long size;
+  unsigned long mtime;
+  unsigned char data[8192];
+  size_t len;
+  int closed; //number of times file_close was called
+  bool complete;
+};
+
+static struct rx_file rx_files[MAX_FILES];
+static size_t rx_count;
+
+static bool file_open(const char *name, unsigned long size, unsigned long mtime) {
+  if(rx_count == MAX_FILES) return false;
+  struct rx_file *f = &rx_files[rx_count++];
+  snprintf(f->name, sizeof(f->name), "%s", name);
+  f->size = size;
+  f->mtime = mtime;
+  return true;
+}
+
+static void file_close(bool complete) {
+  struct rx_file *f = &rx_files[rx_count - 1];
+  ++f->closed;
+  f->complete = complete;
+}
+
+static bool rx_block_handler(void *blk_id, size_t id_len, unsigned char *data, size_t data_len) {
+  struct rx_file *f = &rx_files[rx_count - 1];
+  if(f->len + data_len > sizeof(f->data)) return false;
+  memcpy(f->data + f->len, data, data_len);
+  f->len += data_len;
+  return true;
+}
+
+struct sender {
+  int fd;
+  struct xmodem_config *config;
+  struct xmodem_batch_file *files;
+  size_t count;
+  bool result;
+};
+
+static void *send_files(void *arg) {
+  struct sender *s = arg;
+  s->result = xmodem_send_batch(s->fd, s->config, s->files, s->count);
+  return NULL;
+}
+
+static bool open_pty(int *master, int *slave) {
+  *master = posix_openpt(O_RDWR | O_NOCTTY);
+  if(*master < 0 || grantpt(*master) != 0 || unlockpt(*master) != 0) return false;
+  *slave = open(ptsname(*master), O_RDWR | O_NOCTTY);
+  if(*slave < 0) return false;
+
+  int fds[2] = { *master, *slave };
+  for(size_t i = 0; i < 2; ++i) {
+    struct termios tty;
+    tcgetattr(fds[i], &tty);
+    cfmakeraw(&tty);
+    tty.c_cc[VTIME] = 0;
+    tty.c_cc[VMIN] = 0;
+    tcsetattr(fds[i], TCSANOW, &tty);
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  enum x_mode mode = argc > 1 ? (enum x_mode) atoi(argv[1]) : XMODEM_1K;
+  int master, slave;
+  if(!open_pty(&master, &slave)) {
+    printf("Error %i opening pty: %s\n", errno, strerror(errno));
+    return 1;
+  }
+
+  static unsigned char a[5000];
+  static unsigned char b[4096];
+  for(size_t i = 0; i < sizeof(a); ++i) a[i] = (unsigned char) (i*7 + 3);
+  for(size_t i = 0; i < sizeof(b); ++i) b[i] = (unsigned char) (i*13 + 5);
+  memset(b + sizeof(b) - 4, 0x1A, 4);
+  struct xmodem_batch_file files[] = {
+    { "a.txt", a, sizeof(a), 01234567 },
+    { "b.bin", b, sizeof(b), 0 },
+    { "empty", NULL, 0, 42 },
+  };
+  const size_t count = sizeof(files) / sizeof(files[0]);
+
+  struct xmodem_config tx_config, rx_config;
+  xmodem_init_config(&tx_config, mode);
+  xmodem_init_config(&rx_config, mode);
+  rx_config.rx_block_handler = rx_block_handler;
+  rx_config.file_open = file_open;
+  rx_config.file_close = file_close;
+
+  struct sender s = { master, &tx_config, files, count, false };
+  pthread_t thread;
+  pthread_create(&thread, NULL, send_files, &s);
+  bool received = xmodem_receive_batch(slave, &rx_config);
+  pthread_join(thread, NULL);
+
+  bool ok = s.result && received && rx_count == count;
+  for(size_t i = 0; i < rx_count && i < count; ++i) {
+    struct rx_file *f = &rx_files[i];
+    bool file_ok = strcmp(f->name, files[i].name) == 0 && f->size == files[i].len && f->mtime == files[i].mtime &&
+        f->closed == 1 && f->complete && f->len == files[i].len && (f->len == 0 || memcmp(f->data, files[i].data, f->len) == 0);
+    printf("%-8s %zu bytes, mtime %lo%s\n", f->name, f->len, f->mtime, file_ok ? "" : " WRONG");
+    ok &= file_ok;
+  }
+  printf("send %s, receive %s, %zu files: %s\n", s.result ? "complete" : "failed",
+      received ? "complete" : "failed", rx_count, ok ? "ok" : "FAILED");
+  close(master);
+  close(slave);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,141 @@
+#define _GNU_SOURCE
+#include "xmodem.c"
+#include <string.h>
+#include <stdio.h>
+
+//Runs a transfer on each of ports pty pairs at once from a single
+//xmodem_reactor, the sender and the receiver of every pair are both sessions.
+//Each port sends different data and the receiver of the last port refuses the
+//first block, so that transfer has to fail on both sides while all the others
+//still complete. Exits with 0 when every port ended the way it should
+//usage: test_reactor [mode] [ports] [data_bytes]
+
+#define MAX_PORTS 64
+
+struct port {
+  int master;
+  int slave;
+  unsigned char *data;
+  unsigned char *received;
+  size_t received_len;
+  bool refuse; //the receive handler fails the first block
+  struct xmodem_session tx;
+  struct xmodem_session rx;
+  enum xmodem_status tx_status;
+  enum xmodem_status rx_status;
+};
+
+static size_t data_bytes;
+
+static bool port_rx_block_handler(struct xmodem_session *session, void *blk_id, size_t id_len, unsigned char *data, size_t data_len) {
+  struct port *port = session->user;
+  if(port->refuse) return false;
+  //the final block is padded, only keep what fits
+  size_t len = data_bytes - port->received_len < data_len ? data_bytes - port->received_len : data_len;
+  memcpy(port->received + port->received_len, data, len);
+  port->received_len += len;
+  return true;
+}
+
+static void port_tx_done(struct xmodem_session *session, enum xmodem_status status) {
+  ((struct port *) session->user)->tx_status = status;
+}
+
+static void port_rx_done(struct xmodem_session *session, enum xmodem_status status) {
+  ((struct port *) session->user)->rx_status = status;
+}
+
+static bool open_port(struct port *port) {
+  port->master = posix_openpt(O_RDWR | O_NOCTTY);
+  if(port->master < 0 || grantpt(port->master) != 0 || unlockpt(port->master) != 0) return false;
+  port->slave = open(ptsname(port->master), O_RDWR | O_NOCTTY);
+  if(port->slave < 0) return false;
+
+  int fds[2] = { port->master, port->slave };
+  for(size_t i = 0; i < 2; ++i) {
+    struct termios tty;
+    tcgetattr(fds[i], &tty);
+    cfmakeraw(&tty);
+    tty.c_cc[VTIME] = 0;
+    tty.c_cc[VMIN] = 0;
+    tcsetattr(fds[i], TCSANOW, &tty);
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  enum x_mode mode = argc > 1 ? (enum x_mode) atoi(argv[1]) : CRC_XMODEM;
+  size_t ports = argc > 2 ? strtoul(argv[2], NULL, 10) : 8;
+  data_bytes = argc > 3 ? strtoul(argv[3], NULL, 10) : 16384;
+  if(ports < 2 || ports > MAX_PORTS) {
+    printf("ports has to be between 2 and %d\n", MAX_PORTS);
+    return 1;
+  }
+
+  struct xmodem_config config;
+  xmodem_init_config(&config, mode);
+  struct xmodem_reactor reactor;
+  if(!xmodem_reactor_init(&reactor)) {
+    printf("Error %i from xmodem_reactor_init: %s\n", errno, strerror(errno));
+    return 1;
+  }
+
+  static struct port port_arr[MAX_PORTS];
+  for(size_t i = 0; i < ports; ++i) {
+    struct port *port = &port_arr[i];
+    memset(port, 0, sizeof(*port));
+    if(!open_port(port)) {
+      printf("Error %i opening pty: %s\n", errno, strerror(errno));
+      return 1;
+    }
+    //leave out the SUB padding byte so every byte is counted by the receiver
+    port->data = malloc(data_bytes);
+    port->received = malloc(data_bytes);
+    for(size_t j = 0; j < data_bytes; ++j) {
+      port->data[j] = (unsigned char) (j*7 + i*31 + 3);
+      if(port->data[j] == 0x1A) port->data[j] = 0;
+    }
+    port->refuse = i == ports - 1;
+
+    port->tx.user = port->rx.user = port;
+    port->tx.on_done = port_tx_done;
+    port->rx.on_done = port_rx_done;
+    port->rx.rx_block_handler = port_rx_block_handler;
+    if(!xmodem_session_send(&port->tx, port->master, &config, port->data, data_bytes, 1) ||
+        !xmodem_session_receive(&port->rx, port->slave, &config) ||
+        !xmodem_reactor_add(&reactor, &port->tx) || !xmodem_reactor_add(&reactor, &port->rx)) {
+      printf("Error starting the sessions of port %zu\n", i);
+      return 1;
+    }
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  xmodem_reactor_run(&reactor);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  xmodem_reactor_close(&reactor);
+
+  bool ok = true;
+  for(size_t i = 0; i < ports; ++i) {
+    struct port *port = &port_arr[i];
+    bool port_ok;
+    if(port->refuse) {
+      port_ok = port->tx_status == XMODEM_FAILED && port->rx_status == XMODEM_FAILED;
+    } else {
+      port_ok = port->tx_status == XMODEM_COMPLETE && port->rx_status == XMODEM_COMPLETE &&
+          port->received_len == data_bytes && memcmp(port->received, port->data, data_bytes) == 0;
+    }
+    printf("port %zu: send %s, receive %s, %zu bytes%s%s\n", i,
+        port->tx_status == XMODEM_COMPLETE ? "complete" : "failed",
+        port->rx_status == XMODEM_COMPLETE ? "complete" : "failed",
+        port->received_len, port->refuse ? " (refused)" : "", port_ok ? "" : " WRONG");
+    ok &= port_ok;
+    close(port->master);
+    close(port->slave);
+    free(port->data);
+    free(port->received);
+  }
+  printf("%zu ports in %.0f ms: %s\n", ports,
+      (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0, ok ? "ok" : "FAILED");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,135 @@
+#define _GNU_SOURCE
+#include "xmodem.c"
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+
+//Sends data across a pty pair into xmodem_receive_file and checks what ended
+//up in the file. Every case starts from a file that is longer than the data so
+//the transfer has to cut it down, and the data has SUB bytes in the middle of
+//it, at the end of a block and at the very end where only a known size keeps
+//them. The last case receives into a read only fd and both sides have to fail.
+//Exits with 0 when every case ended the way it should
+//usage: test_receive_file [mode]
+
+struct sender {
+  int fd;
+  struct xmodem_config *config;
+  unsigned char *data;
+  size_t data_len;
+  bool result;
+};
+
+static void *send_data(void *arg) {
+  struct sender *s = arg;
+  s->result = xmodem_send(s->fd, s->config, s->data, s->data_len);
+  return NULL;
+}
+
+static bool open_pty(int *master, int *slave) {
+  *master = posix_openpt(O_RDWR | O_NOCTTY);
+  if(*master < 0 || grantpt(*master) != 0 || unlockpt(*master) != 0) return false;
+  *slave = open(ptsname(*master), O_RDWR | O_NOCTTY);
+  if(*slave < 0) return false;
+
+  int fds[2] = { *master, *slave };
+  for(size_t i = 0; i < 2; ++i) {
+    struct termios tty;
+    tcgetattr(fds[i], &tty);
+    cfmakeraw(&tty);
+    tty.c_cc[VTIME] = 0;
+    tty.c_cc[VMIN] = 0;
+    tcsetattr(fds[i], TCSANOW, &tty);
+  }
+  return true;
+}
+
+struct file_case {
+  const char *name;
+  size_t data_len;
+  bool size_known;
+  bool sub_end; //the data ends in SUB bytes that look like padding
+  bool read_only; //the file can't be written so the transfer has to fail
+};
+
+static bool run_case(enum x_mode mode, const struct file_case *c) {
+  int master, slave;
+  if(!open_pty(&master, &slave)) {
+    printf("Error %i opening pty: %s\n", errno, strerror(errno));
+    return false;
+  }
+  char path[] = "/tmp/xmodem_file_XXXXXX";
+  int file_fd = mkstemp(path);
+  if(file_fd < 0) {
+    printf("Error %i creating %s: %s\n", errno, path, strerror(errno));
+    return false;
+  }
+
+  struct xmodem_config config;
+  xmodem_init_config(&config, mode);
+  unsigned char *data = malloc(c->data_len + 1);
+  for(size_t i = 0; i < c->data_len; ++i) {
+    data[i] = (unsigned char) (i*7 + 3);
+    //a block that ends in SUB in the middle of the file has to be kept whole
+    if(i % config.data_bytes == config.data_bytes - 1) data[i] = 0x1A;
+  }
+  //only the last byte decides where a transfer of unknown size ends
+  if(c->data_len > 0 && data[c->data_len - 1] == 0x1A) data[c->data_len - 1] = 0;
+  if(c->sub_end) {
+    for(size_t i = c->data_len > 3 ? c->data_len - 3 : 0; i < c->data_len; ++i) data[i] = 0x1A;
+  }
+
+  //old contents past the end of the data have to be cut off
+  size_t old_len = c->data_len + 3*config.data_bytes;
+  unsigned char *old = malloc(old_len);
+  memset(old, 0x55, old_len);
+  bool ok = write(file_fd, old, old_len) == (ssize_t) old_len;
+  int rx_fd = file_fd;
+  if(c->read_only) rx_fd = open(path, O_RDONLY);
+
+  struct sender s = { master, &config, data, c->data_len, false };
+  pthread_t thread;
+  pthread_create(&thread, NULL, send_data, &s);
+  bool received = xmodem_receive_file(slave, &config, rx_fd, c->size_known ? (long long) c->data_len : -1);
+  pthread_join(thread, NULL);
+
+  struct stat st;
+  fstat(file_fd, &st);
+  unsigned char *contents = malloc(st.st_size + 1);
+  ok &= pread(file_fd, contents, st.st_size, 0) == st.st_size;
+  if(c->read_only) {
+    ok &= !received && !s.result && (size_t) st.st_size == old_len;
+    close(rx_fd);
+  } else {
+    ok &= received && s.result && (size_t) st.st_size == c->data_len && memcmp(contents, data, c->data_len) == 0;
+  }
+  printf("%-16s send %s, receive %s, %lld bytes%s\n", c->name, s.result ? "complete" : "failed",
+      received ? "complete" : "failed", (long long) st.st_size, ok ? "" : " WRONG");
+
+  close(file_fd);
+  unlink(path);
+  close(master);
+  close(slave);
+  free(data);
+  free(old);
+  free(contents);
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  enum x_mode mode = argc > 1 ? (enum x_mode) atoi(argv[1]) : CRC_XMODEM;
+  static const struct file_case cases[] = {
+    { "known_size", 5000, true, false, false },
+    { "known_sub_end", 5000, true, true, false },
+    { "known_multiple", 4096, true, true, false },
+    { "unknown_size", 5000, false, false, false },
+    { "unknown_multiple", 4096, false, false, false },
+    { "unknown_one_byte", 1, false, false, false },
+    { "read_only", 5000, true, false, true },
+  };
+
+  bool ok = true;
+  for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) ok &= run_case(mode, &cases[i]);
+  printf("%s\n", ok ? "ok" : "FAILED");
+  return ok ? 0 : 1;
+}
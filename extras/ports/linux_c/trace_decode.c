@@ -0,0 +1,116 @@
+#include "xmodem.h"
+#include <string.h>
+#include <stdio.h>
+
+//Prints the events of a trace written by xmodem_trace_dump or
+//XModem::dumpTrace as one line each, with the time since the first event and
+//since the event before it in milliseconds
+//usage: trace_decode [dump_file]   (reads stdin without a file)
+
+static const char *type_names[] = {
+  "?", "start", "end", "tx frame", "rx frame", "rx dup", "rx bad",
+  "tx signal", "rx signal", "timeout", "resend", "resync"
+};
+
+static uint32_t get32(const unsigned char *buf) {
+  return buf[0] | (uint32_t) buf[1] << 8 | (uint32_t) buf[2] << 16 | (uint32_t) buf[3] << 24;
+}
+
+//control bytes by name, the rest of the init bytes as characters
+static void print_byte_name(unsigned char b) {
+  switch(b) {
+    case 0x01: printf("SOH"); return;
+    case 0x02: printf("STX"); return;
+    case 0x04: printf("EOT"); return;
+    case 0x06: printf("ACK"); return;
+    case 0x15: printf("NAK"); return;
+    case 0x18: printf("CAN"); return;
+  }
+  if(b >= '!' && b <= '~') printf("'%c'", b);
+  else printf("0x%02X", b);
+}
+
+static void print_event(const unsigned char *buf) {
+  uint32_t id = get32(buf + 4);
+  unsigned int aux = buf[8] | buf[9] << 8;
+  unsigned char type = buf[10];
+  unsigned char value = buf[11];
+  printf("%-10s ", type < sizeof(type_names)/sizeof(type_names[0]) ? type_names[type] : "?");
+
+  switch(type) {
+    case XMODEM_TRACE_START:
+      printf("%s%s", value == 'S' || value == 's' ? "send" : "receive", value == 's' || value == 'r' ? " batch" : "");
+      break;
+    case XMODEM_TRACE_END:
+      printf("%s", value ? "ok" : "failed");
+      break;
+    case XMODEM_TRACE_TX_FRAME:
+    case XMODEM_TRACE_RX_FRAME:
+    case XMODEM_TRACE_RX_DUP:
+      print_byte_name(value);
+      printf(" block %lu, %u bytes", (unsigned long) id, aux);
+      break;
+    case XMODEM_TRACE_RX_BAD:
+      print_byte_name(value);
+      printf(" %u bytes", aux);
+      break;
+    case XMODEM_TRACE_TX_SIGNAL:
+      print_byte_name(value);
+      if(id != 0) printf(" block %lu", (unsigned long) id);
+      if(aux != 0) printf(", attempt %u", aux + 1);
+      break;
+    case XMODEM_TRACE_RX_SIGNAL:
+      print_byte_name(value);
+      break;
+    case XMODEM_TRACE_TIMEOUT:
+      switch(value) {
+        case 'I': printf("init"); break;
+        case 'H': printf("header"); break;
+        case 'P': printf("packet"); break;
+        case 'S': printf("signal"); break;
+        default: printf("answer to "); print_byte_name(value);
+      }
+      printf(" after %u ms", aux);
+      break;
+    case XMODEM_TRACE_RESEND:
+      print_byte_name(value);
+      printf(" block %lu, attempt %u", (unsigned long) id, aux + 1);
+      break;
+  }
+  printf("\n");
+}
+
+int main(int argc, char** argv) {
+  FILE *in = argc > 1 ? fopen(argv[1], "rb") : stdin;
+  if(in == NULL) {
+    printf("Error opening %s\n", argv[1]);
+    return 1;
+  }
+
+  unsigned char header[16];
+  if(fread(header, 1, sizeof(header), in) != sizeof(header) || memcmp(header, "XMTR", 4) != 0 || header[4] != 1 || header[5] < 12) {
+    printf("Not a version 1 xmodem trace\n");
+    return 1;
+  }
+  size_t event_bytes = header[5];
+  uint32_t count = get32(header + 8);
+  uint32_t kept = get32(header + 12);
+  printf("%lu events, the last %lu kept\n", (unsigned long) count, (unsigned long) kept);
+
+  unsigned char buf[256];
+  uint32_t first = 0;
+  uint32_t prev = 0;
+  for(uint32_t i = 0; i < kept; ++i) {
+    if(fread(buf, 1, event_bytes, in) != event_bytes) {
+      printf("Trace ends after %lu events\n", (unsigned long) i);
+      return 1;
+    }
+    //the times wrap around so only differences between them mean anything
+    uint32_t time_us = get32(buf);
+    if(i == 0) first = prev = time_us;
+    printf("%10.3f %+9.3f  ", (uint32_t) (time_us - first) / 1000.0, (uint32_t) (time_us - prev) / 1000.0);
+    prev = time_us;
+    print_event(buf);
+  }
+  return 0;
+}
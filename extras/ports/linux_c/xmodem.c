@@ -3,6 +3,19 @@
 
 #include "xmodem.h"
 #include <string.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <limits.h>
+#include <sys/stat.h>
+#if defined(XMODEM_SEND_THREAD) || defined(XMODEM_RECEIVE_THREAD)
+#include <pthread.h>
+#endif
+#ifdef XMODEM_RECEIVE_THREAD
+#include <semaphore.h>
+#include <stdatomic.h>
+#endif
 
 #ifdef XMODEM_DEBUG
 #define debug_print(format, ...) fprintf(stdout, format __VA_OPT__(,) __VA_ARGS__)
@@ -12,42 +25,216 @@
 #define debug_print_byte(...) do { } while(0)
 #endif
 
-#define RETRY_LIMIT 10
-#define SIGNAL_RETRY_DELAY_MICRO_SEC 99999
+//transfer statistics, see struct xmodem_stats. The time goes to one phase at
+//a time, STATS_ENTER switches to another and STATS_LEAVE goes back to the one
+//before it. Without XMODEM_STATS these compile to nothing
+#ifdef XMODEM_STATS
+#define STATS_ADD(config, field, n) do { if((config)->stats) (config)->stats->field += (n); } while(0)
+#define STATS_ENTER(config, field, prev) unsigned long *prev = (config)->stats ? _xmodem_stats_phase((config)->stats, &(config)->stats->field) : NULL
+#define STATS_LEAVE(config, prev) do { if((config)->stats) _xmodem_stats_phase((config)->stats, prev); } while(0)
+#define STATS_BEGIN(config) _xmodem_stats_begin((config)->stats)
+#define STATS_END(config) _xmodem_stats_end((config)->stats)
+#else
+#define STATS_ADD(...) do { } while(0)
+#define STATS_ENTER(...) do { } while(0)
+#define STATS_LEAVE(...) do { } while(0)
+#define STATS_BEGIN(...) do { } while(0)
+#define STATS_END(...) do { } while(0)
+#endif
+
+//protocol trace, see struct xmodem_trace. The id bytes are stride apart so
+//they can be read straight out of a packet header or windowed signal
+#ifdef XMODEM_TRACE
+#define TRACE(config, type, value, aux, id, stride) do { if((config)->trace) _xmodem_trace_add(config, XMODEM_TRACE_##type, value, aux, id, stride); } while(0)
+#else
+#define TRACE(...) do { } while(0)
+#endif
+
+//number of times an error can be retried before the transfer is cancelled
+#ifndef XMODEM_RETRY_LIMIT
+#define XMODEM_RETRY_LIMIT 10
+#endif
+#define RETRY_LIMIT XMODEM_RETRY_LIMIT
+
+//CRC-16 engines used by fill_checksum_crc_16, all of them are also available
+//directly as config.calc_chksum handlers
+#define XMODEM_CRC_BITWISE    0 //no table, 8 shift/XOR steps per byte
+#define XMODEM_CRC_NIBBLE     1 //2 lookups per byte using 16 entries of the byte table
+#define XMODEM_CRC_TABLE      2 //512 byte table, 1 lookup per byte
+#define XMODEM_CRC_SLICE_BY_8 3 //4KB of tables, 8 bytes per iteration
+
+#ifndef XMODEM_CRC_ENGINE
+#define XMODEM_CRC_ENGINE XMODEM_CRC_SLICE_BY_8
+#endif
+//every wait is a poll() on the fd with a deadline so we wake up as soon as a
+//byte arrives whatever the tty VMIN/VTIME settings are. Waits for ACK/NAK
+//signals come from the round trip time estimate, see struct xmodem_rtt
+#define INITIAL_TIMEOUT_MILLI_SEC 1000 //retransmit timeout before the first round trip is measured
+#define LINE_CLEAR_MILLI_SEC 100 //quiet time before sending a NAK
+#define LINE_CLEAR_MAX_MILLI_SEC 1000 //longest we wait for a noisy line to go quiet
+
+//how long a packet can stall before it is treated as lost
+#ifndef XMODEM_READ_TIMEOUT_MS
+#define XMODEM_READ_TIMEOUT_MS 1000
+#endif
+
+//number of resends a 1K packet can need before the rest of the transfer drops
+//back to regular sized packets
+#ifndef XMODEM_1K_FALLBACK_RESENDS
+#define XMODEM_1K_FALLBACK_RESENDS 3
+#endif
 
 void increment_id(unsigned char *id, size_t length);
-bool find_byte_timed(int fd, unsigned char byte, int timeout_secs);
+bool find_byte_timed(int fd, unsigned char byte, long timeout_ms);
+long long _xmodem_deadline(long timeout_ms);
+ssize_t _xmodem_read_until(int fd, unsigned char *buf, size_t len, long long deadline);
+void _xmodem_clear_line(int fd);
+void _xmodem_rtt_init(struct xmodem_rtt *rtt, struct xmodem_config *config);
+void _xmodem_rtt_sample(struct xmodem_rtt *rtt, long ms);
+void _xmodem_rtt_backoff(struct xmodem_rtt *rtt);
+#ifdef XMODEM_STATS
+void _xmodem_stats_begin(struct xmodem_stats *stats);
+void _xmodem_stats_end(struct xmodem_stats *stats);
+unsigned long *_xmodem_stats_phase(struct xmodem_stats *stats, unsigned long *phase);
+#endif
+#ifdef XMODEM_TRACE
+void _xmodem_trace_add(struct xmodem_config *config, unsigned char type, unsigned char value, size_t aux, const unsigned char *id, size_t stride);
+#endif
 
 //XMODEM constants
 #define SOH (unsigned char) 0x01 //Start of Header
+#define STX (unsigned char) 0x02 //Start of 1K Header
 #define EOT (unsigned char) 0x04 //End of Transmission
 #define ACK (unsigned char) 0x06 //Acknowledge
 #define NAK (unsigned char) 0x15 //Negative Acknowledge
 #define CAN (unsigned char) 0x18 //Cancel
 #define SUB (unsigned char) 0x1A //Padding
+#define WIN (unsigned char) 0x57 //Windowed transfer request/agreement ('W')
+#define ZIP (unsigned char) 0x5A //Compressed transfer request/agreement ('Z')
 
 struct xmodem_packet {
-  unsigned char *id;
+  unsigned char *id; //only used when receiving
+  unsigned char *header; //only used when sending
   unsigned char *chksm;
   unsigned char *data;
+  size_t data_bytes; //config->data_bytes or config->long_data_bytes depending on the header
+#ifdef XMODEM_STATS
+  size_t data_len; //data bytes before the padding, only used when sending
+#endif
+};
+
+//data of a regular transfer that hasn't been built into packets yet
+struct xmodem_tx_source {
+  unsigned char *data; //NULL when the blocks are looked up
+  size_t remaining; //bytes left to send, blocks left to look up for NULL data
+  bool long_packets;
+  bool compressed; //packets are coded by _xmodem_code_packet
+  unsigned char *blk_id; //id of the next packet
+};
+
+//file a transfer is received into, see xmodem_receive_file
+struct xmodem_file_sink {
+  int fd;
+  long long size; //-1 until the end of the file is known
+  off_t next; //offset of the next block of a sequential transfer
+  off_t last; //offset of the furthest block written
+  off_t end; //end of the data in that block without its padding
+  off_t old_size; //blocks of a nonsequential transfer only replace parts of the file
+};
+
+#ifdef XMODEM_RECEIVE_THREAD
+//verified blocks waiting for rx_block_handler, see _xmodem_rx_consumer
+struct xmodem_rx_queue {
+  struct xmodem_config *config;
+  size_t *lens; //data bytes of each queued block
+  unsigned char *blocks; //id followed by the data, block_bytes each
+  size_t block_bytes;
+  size_t size;
+  size_t head; //next slot to fill, only used by the reader
+  size_t tail; //next slot to hand to the handler, only used by the consumer
+  sem_t filled;
+  sem_t free;
+  atomic_bool failed; //the handler refused a block
+  pthread_t consumer;
 };
+#endif
 
-bool _xmodem_init_rx(int fd, struct xmodem_config *config);
-bool find_header(int fd);
-bool _xmodem_rx(int fd, struct xmodem_config *config);
-bool _xmodem_init_tx(int fd, struct xmodem_config *config);
-bool _xmodem_tx(int fd, struct xmodem_config *config, struct xmodem_packet *p, unsigned char *data, size_t data_len, unsigned char *blk_id);
+bool _xmodem_init_rx(int fd, struct xmodem_config *config, bool allow_window, bool *windowed, bool *compressed, unsigned char *header);
+unsigned char find_header(int fd, struct xmodem_config *config, struct xmodem_rtt *rtt, unsigned char *nak, size_t nak_len);
+unsigned char find_header_byte(int fd, struct xmodem_config *config, long timeout_ms);
+bool is_header(struct xmodem_config *config, unsigned char b);
+bool _xmodem_receive(int fd, struct xmodem_config *config, struct xmodem_file_sink *sink);
+bool _xmodem_rx(int fd, struct xmodem_config *config, struct xmodem_rtt *rtt, bool windowed, bool compressed, unsigned char header, unsigned long *remaining, struct xmodem_file_sink *sink);
+bool _xmodem_file_write(struct xmodem_config *config, struct xmodem_file_sink *sink, unsigned char *id, unsigned char *data, size_t data_bytes);
+bool _xmodem_file_finish(struct xmodem_file_sink *sink);
+#ifdef XMODEM_RECEIVE_THREAD
+bool _xmodem_rx_queue_start(struct xmodem_rx_queue *q, struct xmodem_config *config, size_t max_data_bytes);
+bool _xmodem_rx_queue_push(struct xmodem_rx_queue *q, unsigned char *id, unsigned char *data, size_t data_len);
+bool _xmodem_rx_queue_finish(struct xmodem_rx_queue *q);
+#endif
+bool _xmodem_init_tx(int fd, struct xmodem_config *config, bool *windowed, bool *compressed);
+bool _xmodem_tx(int fd, struct xmodem_config *config, struct xmodem_rtt *rtt, struct xmodem_packet *slots, unsigned char *staging, bool compressed, unsigned char *data, size_t data_len, unsigned char *blk_id);
+bool _xmodem_tx_next(struct xmodem_config *config, struct xmodem_tx_source *src, struct xmodem_packet *p, unsigned char *staging);
+void _xmodem_tx_unbuild(struct xmodem_config *config, struct xmodem_tx_source *src, struct xmodem_packet *p);
+bool _xmodem_tx_windowed(int fd, struct xmodem_config *config, struct xmodem_rtt *rtt, struct xmodem_packet *slots, unsigned char *staging, unsigned char *data, size_t data_len, unsigned char *blk_id, unsigned char *ack_id);
 bool _xmodem_read_block(int fd, struct xmodem_config *config, struct xmodem_packet *p, unsigned char *buffer);
-bool _xmodem_fill_buffer(int fd, struct xmodem_config *config, unsigned char *buffer, size_t packet_bytes);
-unsigned char _xmodem_tx_signal(int fd, unsigned char signal);
-unsigned char _xmodem_rx_signal(int fd);
-bool _xmodem_send_packet(int fd, struct xmodem_config *config, struct xmodem_packet *p);
-void _xmodem_build_packet(struct xmodem_config *config, struct xmodem_packet *p, unsigned char *id, unsigned char *data, size_t data_len);
+bool _xmodem_read_block_coded(int fd, struct xmodem_config *config, struct xmodem_packet *p, unsigned char *buffer);
+bool _xmodem_fill_buffer(int fd, struct xmodem_config *config, unsigned char *buffer, size_t bytes, unsigned char *chksm);
+bool _xmodem_check_block(struct xmodem_config *config, struct xmodem_packet *p, unsigned char *buffer);
+void _xmodem_finish_chksm(struct xmodem_config *config, struct xmodem_packet *p);
+void _xmodem_chksm_block(struct xmodem_config *config, unsigned char *data, size_t data_bytes, unsigned char *chksm);
+unsigned char _xmodem_tx_signal(int fd, struct xmodem_config *config, struct xmodem_rtt *rtt, unsigned char signal);
+unsigned char _xmodem_tx_signal_frame(int fd, struct xmodem_config *config, struct xmodem_rtt *rtt, unsigned char *signal, size_t signal_len);
+unsigned char _xmodem_rx_signal(int fd, struct xmodem_config *config, long timeout_ms);
+unsigned char _xmodem_rx_window_signal(int fd, struct xmodem_config *config, struct xmodem_rtt *rtt, unsigned char *id);
+void _xmodem_encode_window_signal(struct xmodem_config *config, unsigned char *signal, unsigned char type, unsigned char *id);
+unsigned long _xmodem_low_id(struct xmodem_config *config, unsigned char *id);
+bool _xmodem_send_packet(int fd, struct xmodem_config *config, struct xmodem_rtt *rtt, struct xmodem_packet *p, unsigned char *resends);
+bool _xmodem_await_ack(int fd, struct xmodem_config *config, struct xmodem_rtt *rtt, struct xmodem_packet *p, unsigned char *resends);
+bool _xmodem_write_packet(int fd, struct xmodem_config *config, struct xmodem_packet *p);
+bool _xmodem_writev_all(int fd, struct iovec *iov, int iovcnt);
+size_t _xmodem_build_packet(struct xmodem_config *config, struct xmodem_packet *p, unsigned char *id, unsigned char *data, size_t data_len);
+void _xmodem_code_packet(struct xmodem_config *config, struct xmodem_packet *p);
 void fill_checksum_basic(unsigned char *data, size_t data_bytes, unsigned char *chksm);
+bool _xmodem_chksm_incremental(struct xmodem_config *config);
 void fill_checksum_crc_16(unsigned char *data, size_t data_bytes, unsigned char *chksm);
+void fill_checksum_crc_16_bitwise(unsigned char *data, size_t data_bytes, unsigned char *chksm);
+void fill_checksum_crc_16_nibble(unsigned char *data, size_t data_bytes, unsigned char *chksm);
+void fill_checksum_crc_16_table(unsigned char *data, size_t data_bytes, unsigned char *chksm);
+void fill_checksum_crc_16_slice_by_8(unsigned char *data, size_t data_bytes, unsigned char *chksm);
+void init_checksum_basic(unsigned char *chksm);
+void update_checksum_basic(unsigned char *data, size_t data_bytes, unsigned char *chksm);
+void init_checksum_crc_16(unsigned char *chksm);
+void update_checksum_crc_16(unsigned char *data, size_t data_bytes, unsigned char *chksm);
+void fill_checksum_crc_16_be(unsigned char *data, size_t data_bytes, unsigned char *chksm);
+void update_checksum_crc_16_be(unsigned char *data, size_t data_bytes, unsigned char *chksm);
 bool dummy_rx_block_handler(void *blk_id, size_t id_len, unsigned char *data, size_t data_len);
 void dummy_block_lookup(void *blk_id, size_t id_len, unsigned char *send_data, size_t data_len);
-bool _xmodem_close_tx(int fd);
+bool _xmodem_close_tx(int fd, struct xmodem_config *config, struct xmodem_rtt *rtt, bool windowed, unsigned char *ack_id);
+
+//session states, see xmodem_session_poll
+#define SESSION_IDLE        0
+#define SESSION_RX_INIT     1 //waiting for the first packet after sending the init byte
+#define SESSION_RX_HEADER   2 //waiting for the next packet after an ACK/NAK
+#define SESSION_RX_PACKET   3 //reading the rest of a packet
+#define SESSION_RX_PURGE    4 //waiting for the line to go quiet before sending a NAK
+#define SESSION_RX_EOT      5 //waiting for the second EOT
+#define SESSION_TX_INIT     6 //waiting for the receiver's init byte
+#define SESSION_TX_PACKET   7 //writing a packet out
+#define SESSION_TX_RESPONSE 8 //waiting for the ACK/NAK of a packet
+#define SESSION_TX_EOT      9 //waiting for the ACK of an EOT
+
+bool _xmodem_session_start(struct xmodem_session *session, int fd, struct xmodem_config *config, int state);
+enum xmodem_status _xmodem_session_finish(struct xmodem_session *session, bool result);
+ssize_t _xmodem_session_read(struct xmodem_session *session, unsigned char *buf, size_t len);
+void _xmodem_session_signal(struct xmodem_session *session, unsigned char signal);
+int _xmodem_session_flush(struct xmodem_session *session);
+enum xmodem_status _xmodem_session_poll_rx(struct xmodem_session *session);
+bool _xmodem_session_rx_block(struct xmodem_session *session);
+bool _xmodem_session_rx_error(struct xmodem_session *session);
+enum xmodem_status _xmodem_session_poll_tx(struct xmodem_session *session);
+void _xmodem_session_tx_block(struct xmodem_session *session);
+bool _xmodem_session_tx_resend(struct xmodem_session *session);
 
 //NOTE: the mode argument has a default value - see header file
 void xmodem_init_config(struct xmodem_config* config, enum x_mode mode) {
@@ -55,47 +242,312 @@ void xmodem_init_config(struct xmodem_config* config, enum x_mode mode) {
     case XMODEM:
       config->id_bytes = 1;
       config->data_bytes = 128;
+      config->long_data_bytes = 0;
       config->chksm_bytes = 1;
       config->rx_init_byte = NAK;
       config->calc_chksum = fill_checksum_basic;
+      config->chksm_init = init_checksum_basic;
+      config->chksm_update = update_checksum_basic;
       break;
     case CRC_XMODEM:
       config->id_bytes = 1;
       config->data_bytes = 128;
+      config->long_data_bytes = 0;
       config->chksm_bytes = 2;
       config->rx_init_byte = 'C';
       config->calc_chksum = fill_checksum_crc_16;
+      config->chksm_init = init_checksum_crc_16;
+      config->chksm_update = update_checksum_crc_16;
+      break;
+    case XMODEM_1K:
+      config->id_bytes = 1;
+      config->data_bytes = 128;
+      config->long_data_bytes = 1024;
+      config->chksm_bytes = 2;
+      config->rx_init_byte = 'C';
+      //standard XMODEM-1K sends the CRC high byte first so tools like lrzsz
+      //can talk to us
+      config->calc_chksum = fill_checksum_crc_16_be;
+      config->chksm_init = init_checksum_crc_16;
+      config->chksm_update = update_checksum_crc_16_be;
       break;
   }
+  config->chksm_final = NULL;
+  config->window_size = 1;
+  config->compress = false;
+  config->pipeline_sends = false;
+  config->min_timeout_ms = 100;
+  config->max_timeout_ms = 10000;
+  config->rx_queue_blocks = 4;
+  config->stats = NULL;
+  config->trace = NULL;
   config->rx_block_handler = dummy_rx_block_handler;
   config->block_lookup = dummy_block_lookup;
+  config->block_lookup_ptr = NULL;
+  config->block_lookup_len = NULL;
+  config->file_open = NULL;
+  config->file_close = NULL;
 }
 
 void fill_checksum_basic(unsigned char *data, size_t data_bytes, unsigned char *chksm) {
-  unsigned char sum = 0;
+  init_checksum_basic(chksm);
+  update_checksum_basic(data, data_bytes, chksm);
+}
+
+void init_checksum_basic(unsigned char *chksm) { *chksm = 0; }
+
+void update_checksum_basic(unsigned char *data, size_t data_bytes, unsigned char *chksm) {
+  unsigned char sum = *chksm;
   for(size_t i = 0; i < data_bytes; ++i) sum += data[i];
   *chksm = sum;
 }
 
-void fill_checksum_crc_16(unsigned char *data, size_t data_bytes, unsigned char *chksm) {
+//crc_16_table[n] is the CRC of the single byte n, generated with the bitwise
+//algorithm in fill_checksum_crc_16_bitwise
+static const unsigned short crc_16_table[256] = {
+  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+  0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+  0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+  0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+  0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+  0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+  0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+  0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+  0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+  0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+  0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+  0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+  0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+  0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+  0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+  0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+  0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+  0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+  0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+  0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+  0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+  0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+  0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+  0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+  0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+  0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+  0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+  0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+  0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+  0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+  0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+  0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0
+};
+
+//crc_16_slice_tables[k][n] is the CRC of the byte n followed by k zero bytes,
+//the k = 0 table is crc_16_table
+static unsigned short crc_16_slice_tables[8][256];
+
+__attribute__((constructor)) static void build_crc_16_slice_tables(void) {
+  for(unsigned int n = 0; n < 256; ++n) {
+    crc_16_slice_tables[0][n] = crc_16_table[n];
+    for(unsigned int k = 1; k < 8; ++k) {
+      unsigned short prev = crc_16_slice_tables[k-1][n];
+      crc_16_slice_tables[k][n] = (prev << 8) ^ crc_16_table[prev >> 8];
+    }
+  }
+}
+
+//all the crc engines store the checksum in native byte order to match the
+//original implementation, chksm may not be aligned so it is copied in and out
+static unsigned short crc_16_update_bitwise(unsigned short crc, unsigned char *data, size_t data_bytes) {
   //XModem CRC prime number is 69665 -> 2^16 + 2^12 + 2^5 + 2^0 -> 10001000000100001 -> 0x11021
   //normal notation of this bit pattern omits the leading bit and represents it as 0x1021
   //in code we can omit the 2^16 term due to shifting before XORing when the MSB is a 1
   const unsigned short crc_prime = 0x1021;
-  unsigned short *crc = (unsigned short *) chksm;
-  *crc = 0;
 
   //We can ignore crc calulations that cross byte boundaries by just assuming
   //that the following byte is 0 and then fixup our simplification at the end
   //by XORing in the true value of the next byte into the most sygnificant byte
   //of the CRC
   for(size_t i = 0; i < data_bytes; ++i) {
-    *crc ^= (((unsigned short) data[i]) << 8);
+    crc ^= (((unsigned short) data[i]) << 8);
     for(unsigned char j = 0; j < 8; ++j) {
-      if(*crc & 0x8000) *crc = (*crc << 1) ^ crc_prime;
-      else *crc <<= 1;
+      if(crc & 0x8000) crc = (crc << 1) ^ crc_prime;
+      else crc <<= 1;
+    }
+  }
+  return crc;
+}
+
+void fill_checksum_crc_16_bitwise(unsigned char *data, size_t data_bytes, unsigned char *chksm) {
+  unsigned short crc = crc_16_update_bitwise(0, data, data_bytes);
+  memcpy(chksm, &crc, sizeof(crc));
+}
+
+static unsigned short crc_16_update_nibble(unsigned short crc, unsigned char *data, size_t data_bytes) {
+  //the first 16 entries of the byte table are the CRCs of each 4 bit value
+  for(size_t i = 0; i < data_bytes; ++i) {
+    crc = (crc << 4) ^ crc_16_table[(crc >> 12) ^ (data[i] >> 4)];
+    crc = (crc << 4) ^ crc_16_table[(crc >> 12) ^ (data[i] & 0x0F)];
+  }
+  return crc;
+}
+
+void fill_checksum_crc_16_nibble(unsigned char *data, size_t data_bytes, unsigned char *chksm) {
+  unsigned short crc = crc_16_update_nibble(0, data, data_bytes);
+  memcpy(chksm, &crc, sizeof(crc));
+}
+
+static unsigned short crc_16_update_table(unsigned short crc, unsigned char *data, size_t data_bytes) {
+  //the top byte of the CRC XORed with the next data byte selects the
+  //remainder that the 8 bitwise steps would have produced
+  for(size_t i = 0; i < data_bytes; ++i) {
+    crc = (crc << 8) ^ crc_16_table[(unsigned char) (crc >> 8) ^ data[i]];
+  }
+  return crc;
+}
+
+void fill_checksum_crc_16_table(unsigned char *data, size_t data_bytes, unsigned char *chksm) {
+  unsigned short crc = crc_16_update_table(0, data, data_bytes);
+  memcpy(chksm, &crc, sizeof(crc));
+}
+
+static unsigned short crc_16_update_slice_by_8(unsigned short crc, unsigned char *data, size_t data_bytes) {
+  //the CRC only overlaps the first 2 bytes of each 8 byte slice, the other 6
+  //bytes are independent lookups that are combined with XOR
+  size_t i = 0;
+  const unsigned short (*t)[256] = (const unsigned short (*)[256]) crc_16_slice_tables;
+  for(; i + 8 <= data_bytes; i += 8) {
+    crc = t[7][data[i] ^ (crc >> 8)] ^ t[6][data[i+1] ^ (crc & 0xFF)]
+      ^ t[5][data[i+2]] ^ t[4][data[i+3]] ^ t[3][data[i+4]]
+      ^ t[2][data[i+5]] ^ t[1][data[i+6]] ^ t[0][data[i+7]];
+  }
+  for(; i < data_bytes; ++i) {
+    crc = (crc << 8) ^ crc_16_table[(unsigned char) (crc >> 8) ^ data[i]];
+  }
+  return crc;
+}
+
+void fill_checksum_crc_16_slice_by_8(unsigned char *data, size_t data_bytes, unsigned char *chksm) {
+  unsigned short crc = crc_16_update_slice_by_8(0, data, data_bytes);
+  memcpy(chksm, &crc, sizeof(crc));
+}
+
+static unsigned short crc_16_update(unsigned short crc, unsigned char *data, size_t data_bytes) {
+#if XMODEM_CRC_ENGINE == XMODEM_CRC_BITWISE
+  return crc_16_update_bitwise(crc, data, data_bytes);
+#elif XMODEM_CRC_ENGINE == XMODEM_CRC_NIBBLE
+  return crc_16_update_nibble(crc, data, data_bytes);
+#elif XMODEM_CRC_ENGINE == XMODEM_CRC_TABLE
+  return crc_16_update_table(crc, data, data_bytes);
+#else
+  return crc_16_update_slice_by_8(crc, data, data_bytes);
+#endif
+}
+
+void fill_checksum_crc_16(unsigned char *data, size_t data_bytes, unsigned char *chksm) {
+  unsigned short crc = crc_16_update(0, data, data_bytes);
+  memcpy(chksm, &crc, sizeof(crc));
+}
+
+void init_checksum_crc_16(unsigned char *chksm) {
+  unsigned short crc = 0;
+  memcpy(chksm, &crc, sizeof(crc));
+}
+
+void update_checksum_crc_16(unsigned char *data, size_t data_bytes, unsigned char *chksm) {
+  unsigned short crc;
+  memcpy(&crc, chksm, sizeof(crc));
+  crc = crc_16_update(crc, data, data_bytes);
+  memcpy(chksm, &crc, sizeof(crc));
+}
+
+//standard byte order for the CRC, the high byte goes first
+void fill_checksum_crc_16_be(unsigned char *data, size_t data_bytes, unsigned char *chksm) {
+  init_checksum_crc_16(chksm);
+  update_checksum_crc_16_be(data, data_bytes, chksm);
+}
+
+void update_checksum_crc_16_be(unsigned char *data, size_t data_bytes, unsigned char *chksm) {
+  unsigned short crc = ((unsigned short) chksm[0] << 8) | chksm[1];
+  crc = crc_16_update(crc, data, data_bytes);
+  chksm[0] = crc >> 8;
+  chksm[1] = crc & 0xFF;
+}
+
+//LZSS with the block itself as the window, the same format as the arduino
+//library. Every group of 8 items starts with a flag byte, a clear bit is a
+//literal byte and a set bit a 2 byte match of 12 bits distance - 1 and 4 bits
+//length - 3 (3 to 18 bytes). Matches may overlap the bytes they produce
+#define LZSS_MIN_MATCH 3
+#define LZSS_MAX_MATCH 18
+#define LZSS_WINDOW 4096
+
+size_t xmodem_lzss_encode(const unsigned char *in, size_t in_len, unsigned char *out, size_t out_max) {
+  size_t i = 0;
+  size_t o = 0;
+  size_t flags = 0;
+  unsigned char bit = 0;
+  while(i < in_len) {
+    if(bit == 0) {
+      if(o >= out_max) return 0;
+      flags = o;
+      out[o++] = 0;
+      bit = 1;
+    }
+
+    //the closest of the longest matches, runs are found at the first distance
+    size_t max_len = in_len - i < LZSS_MAX_MATCH ? in_len - i : LZSS_MAX_MATCH;
+    size_t window = i < LZSS_WINDOW ? i : LZSS_WINDOW;
+    size_t best_len = 0;
+    size_t best_dist = 0;
+    for(size_t dist = 1; dist <= window && best_len < max_len; ++dist) {
+      size_t len = 0;
+      while(len < max_len && in[i - dist + len] == in[i + len]) ++len;
+      if(len > best_len) {
+        best_len = len;
+        best_dist = dist;
+      }
+    }
+
+    if(best_len >= LZSS_MIN_MATCH) {
+      if(o + 2 > out_max) return 0;
+      out[flags] |= bit;
+      out[o++] = (best_dist - 1) >> 4;
+      out[o++] = ((best_dist - 1) << 4) | (best_len - LZSS_MIN_MATCH);
+      i += best_len;
+    } else {
+      if(o >= out_max) return 0;
+      out[o++] = in[i++];
+    }
+    bit <<= 1;
+  }
+  return o;
+}
+
+//the coded block comes off the line so nothing in it is trusted
+bool xmodem_lzss_decode(const unsigned char *in, size_t in_len, unsigned char *out, size_t out_len) {
+  size_t i = 0;
+  size_t o = 0;
+  unsigned char flags = 0;
+  unsigned char bit = 0;
+  while(o < out_len) {
+    if(bit == 0) {
+      if(i >= in_len) return false;
+      flags = in[i++];
+      bit = 1;
+    }
+
+    if(flags & bit) {
+      if(i + 2 > in_len) return false;
+      size_t dist = (((size_t) in[i] << 4) | (in[i + 1] >> 4)) + 1;
+      size_t len = (in[i + 1] & 0x0F) + LZSS_MIN_MATCH;
+      i += 2;
+      if(dist > o || len > out_len - o) return false;
+      for(; len > 0; --len, ++o) out[o] = out[o - dist];
+    } else {
+      if(i >= in_len) return false;
+      out[o++] = in[i++];
     }
+    bit <<= 1;
   }
+  return i == in_len;
 }
 
 bool dummy_rx_block_handler(void *blk_id, size_t id_len, unsigned char *data, size_t data_len) { return true; }
@@ -127,18 +579,143 @@ void print_byte(int fd, unsigned char byte) {
 }
 
 bool xmodem_receive(int fd, struct xmodem_config *config) {
-  if(!_xmodem_init_rx(fd, config) || !_xmodem_rx(fd, config)) {
+  return _xmodem_receive(fd, config, NULL);
+}
+
+bool xmodem_receive_file(int fd, struct xmodem_config *config, int file_fd, long long size) {
+  struct xmodem_file_sink sink;
+  sink.fd = file_fd;
+  sink.size = size;
+  sink.next = 0;
+  sink.last = -1;
+  sink.end = 0;
+  sink.old_size = 0;
+#if defined(XMODEM_ALLOW_NONSEQUENTIAL)
+  struct stat st;
+  if(fstat(file_fd, &st) == 0) sink.old_size = st.st_size;
+#endif
+  return _xmodem_receive(fd, config, &sink);
+}
+
+bool _xmodem_receive(int fd, struct xmodem_config *config, struct xmodem_file_sink *sink) {
+  bool windowed;
+  bool compressed;
+  unsigned char header;
+  struct xmodem_rtt rtt;
+  STATS_BEGIN(config);
+  TRACE(config, START, 'R', 0, NULL, 0);
+  _xmodem_rtt_init(&rtt, config);
+  if(!_xmodem_init_rx(fd, config, true, &windowed, &compressed, &header) || !_xmodem_rx(fd, config, &rtt, windowed, compressed, header, NULL, sink)) {
     //an unrecoverable error occured send cancels to terminate the transcation
     debug_print("\nError Cancelling transfer");
     unsigned char b = CAN;
     write(fd, &b, 1);
     write(fd, &b, 1);
     write(fd, &b, 1);
+    TRACE(config, END, 0, 0, NULL, 0);
+    STATS_END(config);
     return false;
   }
+  TRACE(config, END, 1, 0, NULL, 0);
+  STATS_END(config);
   return true;
 }
 
+bool xmodem_receive_batch(int fd, struct xmodem_config *config) {
+  bool result = false;
+  unsigned char *buffer;
+  struct xmodem_packet p;
+  size_t max_data_bytes = config->long_data_bytes > config->data_bytes ? config->long_data_bytes : config->data_bytes;
+
+  //bundle all our memory allocations together
+  //need to store:
+  //3 id blocks - buffer id and compl_id and xmodem_packet struct
+  //2 chksum blocks - buffer chksum and xmodem_packet struct
+  //1 data block - the file header, the xmodem_packet struct points into the buffer
+  STATS_BEGIN(config);
+  TRACE(config, START, 'r', 0, NULL, 0);
+  buffer = malloc(3*config->id_bytes + 2*config->chksm_bytes + max_data_bytes);
+  p.data = buffer + 2*config->id_bytes;
+  p.id = p.data + max_data_bytes + config->chksm_bytes;
+  p.chksm = p.id + config->id_bytes;
+
+  unsigned char nak = NAK;
+  bool windowed;
+  bool compressed;
+  unsigned char header;
+  struct xmodem_rtt rtt;
+  _xmodem_rtt_init(&rtt, config);
+  while(_xmodem_init_rx(fd, config, false, &windowed, &compressed, &header)) {
+    //block 0 holds the file name followed by its size and modification time
+    bool valid = false;
+    unsigned char errors = 0;
+    while(true) {
+      p.data_bytes = header == STX ? config->long_data_bytes : config->data_bytes;
+      if(header != EOT) STATS_ADD(config, wire_bytes, 1);
+      STATS_ENTER(config, wire_us, prev_phase);
+      valid = header != EOT && _xmodem_read_block(fd, config, &p, buffer);
+      STATS_LEAVE(config, prev_phase);
+      for(size_t i = 0; i < config->id_bytes; ++i) {
+        if(p.id[i] != 0) valid = false;
+      }
+      //the fields are NUL terminated strings so the block has to end in one
+      if(valid && p.data[p.data_bytes - 1] != 0) valid = false;
+
+      if(valid) break;
+      if(header != EOT) TRACE(config, RX_BAD, header, 0, NULL, 0);
+      if(++errors > RETRY_LIMIT) break;
+      header = _xmodem_tx_signal(fd, config, &rtt, NAK);
+      if(!is_header(config, header) && (header = find_header(fd, config, &rtt, &nak, 1)) == 0) break;
+    }
+    if(!valid) break;
+    STATS_ADD(config, blocks_received, 1);
+    TRACE(config, RX_FRAME, header, p.data_bytes, p.id, 1);
+    unsigned char b = ACK;
+    write(fd, &b, 1);
+    TRACE(config, TX_SIGNAL, ACK, 0, NULL, 0);
+
+    //an empty file name ends the batch
+    char *name = (char *) p.data;
+    if(name[0] == 0) {
+      result = true;
+      break;
+    }
+
+    //the size is decimal and the modification time octal, both are optional
+    char *field = name + strlen(name) + 1;
+    char *field_end;
+    unsigned long size = strtoul(field, &field_end, 10);
+    bool size_known = field_end != field;
+    unsigned long mtime = strtoul(field_end, NULL, 8);
+    debug_print("\nReceiving file %s (%lu bytes)\n", name, size);
+    //the header up to the NUL after its fields, the rest is padding
+    STATS_ADD(config, payload_bytes, field + strlen(field) + 1 - name);
+
+    STATS_ENTER(config, handler_us, prev_phase);
+    bool opened = config->file_open == NULL || config->file_open(name, size, mtime);
+    STATS_LEAVE(config, prev_phase);
+    if(!opened) break;
+    bool complete = _xmodem_init_rx(fd, config, true, &windowed, &compressed, &header) && _xmodem_rx(fd, config, &rtt, windowed, compressed, header, size_known ? &size : NULL, NULL);
+    STATS_ENTER(config, handler_us, prev_close_phase);
+    if(config->file_close != NULL) config->file_close(complete);
+    STATS_LEAVE(config, prev_close_phase);
+    if(!complete) break;
+  }
+
+  free(buffer);
+  if(!result) {
+    //an unrecoverable error occured send cancels to terminate the transcation
+    debug_print("\nError Cancelling transfer");
+    unsigned char b = CAN;
+    write(fd, &b, 1);
+    write(fd, &b, 1);
+    write(fd, &b, 1);
+  }
+  TRACE(config, END, result, 0, NULL, 0);
+  STATS_END(config);
+  return result;
+}
+
 bool xmodem_send(int fd, struct xmodem_config *config, unsigned char *data, size_t data_len, unsigned long long start_id) {
   unsigned char *id = malloc(config->id_bytes);
 
@@ -160,35 +737,65 @@ bool xmodem_send(int fd, struct xmodem_config *config, unsigned char *data, size
   return result;
 }
 
-bool xmodem_lookup_send(int fd, struct xmodem_config *config, unsigned long long id) {
-  return xmodem_send(fd, config, (unsigned char *) NULL, 0, id);
+//NOTE: the count argument has a default value - see header file
+bool xmodem_lookup_send(int fd, struct xmodem_config *config, unsigned long long start_id, size_t count) {
+  //a NULL data length of 0 means a single block, see xmodem_bulk_data
+  if(count == 0) return false;
+  return xmodem_send(fd, config, (unsigned char *) NULL, count, start_id);
 }
 
 bool xmodem_send_bulk_data(int fd, struct xmodem_config *config, struct xmodem_bulk_data container) {
   if(container.count == 0) return false;
-
-  struct xmodem_packet p;
+  STATS_BEGIN(config);
+  TRACE(config, START, 'S', 0, NULL, 0);
+
+  //the window size is negotiated during the handshake so it has to happen
+  //before we know how much memory is needed
+  bool windowed;
+  bool compressed;
+  bool result = _xmodem_init_tx(fd, config, &windowed, &compressed);
+  struct xmodem_rtt rtt;
+  _xmodem_rtt_init(&rtt, config);
+  //pipelined transfers build the next packet while waiting for the ACK of the
+  //one before it, a window shares one staging block between its slots
+  size_t slot_count = windowed ? config->window_size : config->pipeline_sends ? 2 : 1;
+  size_t staging_count = windowed ? 1 : slot_count;
+  size_t max_data_bytes = config->long_data_bytes > config->data_bytes ? config->long_data_bytes : config->data_bytes;
+  size_t coded_bytes = compressed ? 4 + max_data_bytes : 0;
 
   //bundle all our memory allocations together
   //need to store:
-  //2 id blocks - blk_id and xmodem_packet struct
-  //1 checksum block - xmodem_packet struct
-  //1 data block - xmodem_packet struct
-  unsigned char *buffer = malloc(2*config->id_bytes + config->chksm_bytes + config->data_bytes);
-  unsigned char *blk_id = buffer + config->data_bytes;
-  p.id = blk_id + config->id_bytes;
-  p.chksm = p.id + config->id_bytes;
-  p.data = buffer;
+  //1 xmodem_packet struct per slot
+  //2 id blocks - blk_id and the id of a windowed ACK/NAK
+  //1 header block per slot - SOH followed by the id and compl_id bytes
+  //1 checksum block per slot
+  //1 coded data block per slot (if compressed) - see _xmodem_code_packet
+  //1 data block per staging block - looked up and padded blocks
+  unsigned char *buffer = malloc(slot_count*(sizeof(struct xmodem_packet) + 1 + 2*config->id_bytes + config->chksm_bytes + coded_bytes) + 2*config->id_bytes + staging_count*config->data_bytes);
+  struct xmodem_packet *slots = (struct xmodem_packet *) buffer;
+  unsigned char *staging = buffer + slot_count*sizeof(struct xmodem_packet);
+  unsigned char *blk_id = staging + staging_count*config->data_bytes;
+  unsigned char *ack_id = blk_id + config->id_bytes;
+  unsigned char *slot_bytes = ack_id + config->id_bytes;
+  for(size_t i = 0; i < slot_count; ++i) {
+    slots[i].header = slot_bytes;
+    slots[i].chksm = slots[i].header + 1 + 2*config->id_bytes;
+    slot_bytes = slots[i].chksm + config->chksm_bytes + coded_bytes;
+  }
 
-  bool result = _xmodem_init_tx(fd, config);
   for(size_t j = 0; result && j < container.count; ++j) {
     for(size_t i = 0; i < config->id_bytes; ++i) blk_id[i] = container.id_arr[j*config->id_bytes + i];
-    result &= _xmodem_tx(fd, config, &p, container.data_arr[j], container.len_arr[j], blk_id);
+    if(windowed) {
+      result &= _xmodem_tx_windowed(fd, config, &rtt, slots, staging, container.data_arr[j], container.len_arr[j], blk_id, ack_id);
+    } else {
+      result &= _xmodem_tx(fd, config, &rtt, slots, staging, compressed, container.data_arr[j], container.len_arr[j], blk_id);
+    }
   }
 
   if(result) {
     debug_print("\nClosing xmodem transfer:");
-    _xmodem_close_tx(fd);
+    //a receiver that queues blocks can still refuse one at the end
+    result = _xmodem_close_tx(fd, config, &rtt, windowed, ack_id);
   } else {
     //an unrecoverable error occured send cancels to terminate the transcation
     debug_print("\nError Cancelling transfer");
@@ -200,166 +807,930 @@ bool xmodem_send_bulk_data(int fd, struct xmodem_config *config, struct xmodem_b
 
   debug_print("\nDone");
   free(buffer);
+  TRACE(config, END, result, 0, NULL, 0);
+  STATS_END(config);
   return result;
 }
 
-inline void increment_id(unsigned char *id, size_t length) {
-  size_t index = length-1;
-  do {
-    id[index]++;
-    if(id[index]) return; //if the current byte is non-zero then there is no overflow and we are done
-  } while(index--);//when we hit an index of zero then we have incremented all the bytes
-}
+bool xmodem_send_batch(int fd, struct xmodem_config *config, struct xmodem_batch_file *files, size_t count) {
+  struct xmodem_packet p;
+  unsigned char resends;
+  bool windowed;
+  bool compressed;
+  struct xmodem_rtt rtt;
+  _xmodem_rtt_init(&rtt, config);
+  size_t max_data_bytes = config->long_data_bytes > config->data_bytes ? config->long_data_bytes : config->data_bytes;
+  //the files are sent with xmodem_send so they add to the counts of the batch
+  STATS_BEGIN(config);
+  TRACE(config, START, 's', 0, NULL, 0);
 
-bool find_byte_timed(int fd, unsigned char byte, int timeout_secs) {
-  unsigned char b = 0;
-  time_t end = time(NULL) + timeout_secs;
-  do {
-    //if no data is available sleep and check again before checking the value of b
-    if(!read(fd, &b, 1)) {
-      usleep(500);
-      read(fd, &b, 1);
+  //bundle all our memory allocations together
+  //need to store:
+  //1 id block - block 0 is all zeros
+  //1 header block - SOH followed by the id and compl_id bytes
+  //1 checksum block - xmodem_packet struct
+  //1 data block - the file header
+  unsigned char *buffer = malloc(1 + 3*config->id_bytes + config->chksm_bytes + max_data_bytes);
+  unsigned char *blk_id = buffer;
+  p.header = blk_id + config->id_bytes;
+  p.chksm = p.header + 1 + 2*config->id_bytes;
+  p.data = p.chksm + config->chksm_bytes;
+  memset(blk_id, 0, config->id_bytes);
+
+  bool result = true;
+  //one extra pass sends the empty file header that ends the batch
+  for(size_t i = 0; result && i <= count; ++i) {
+    memset(p.data, 0, max_data_bytes);
+    size_t used = 0;
+    if(i < count) {
+      //name, NUL, decimal size, space, octal modification time
+      int len = snprintf((char *) p.data, max_data_bytes, "%s", files[i].name) + 1;
+      if(len > 0 && (size_t) len < max_data_bytes) {
+        len += snprintf((char *) p.data + len, max_data_bytes - len, "%zu %lo", files[i].len, files[i].mtime);
+      }
+      //the fields have to be followed by at least one NUL
+      if(len <= 0 || (size_t) len >= max_data_bytes) {
+        result = false;
+        break;
+      }
+      used = len + 1;
+      debug_print("\nSending file %s\n", files[i].name);
     }
 
-#ifdef XMODEM_RESPONSE_DEBUG
-    debug_print_byte(b);
+    //regular sized packets are preferred for the file header like lrzsz does
+    p.data_bytes = used <= config->data_bytes ? config->data_bytes : config->long_data_bytes;
+    _xmodem_build_packet(config, &p, blk_id, p.data, p.data_bytes);
+#ifdef XMODEM_STATS
+    p.data_len = used;
 #endif
-    if(b == byte) return true;
-  } while(time(NULL) < end);
-  return false;
-}
+    result = _xmodem_init_tx(fd, config, &windowed, &compressed) && _xmodem_send_packet(fd, config, &rtt, &p, &resends);
 
-bool _xmodem_init_rx(int fd, struct xmodem_config *config) {
-  debug_print("Initializing Receive Transaction... ");
-  unsigned char i = 0;
-  do {
-    write(fd, &config->rx_init_byte, 1);
-    if(find_byte_timed(fd, SOH, 10)) {
-      debug_print("Done\n");
-      return true;
-    }
-  } while(i++ < RETRY_LIMIT);
-  return false;
-}
+    //the file data is a regular transfer starting from block 1
+    //NOTE: NULL data means a block lookup so empty files still need a pointer
+    if(result && i < count) result = xmodem_send(fd, config, files[i].len != 0 ? files[i].data : p.data, files[i].len, 1);
+  }
 
-bool find_header(int fd) {
-  unsigned char i = 0;
-  static unsigned char retry_byte = NAK;
-  do {
-    if(i != 0) write(fd, &retry_byte, 1);
-    if(find_byte_timed(fd, SOH, 10)) return true;
-  } while(i++ < RETRY_LIMIT);
-  return false;
+  free(buffer);
+  if(!result) {
+    //an unrecoverable error occured send cancels to terminate the transcation
+    debug_print("\nError Cancelling transfer");
+    unsigned char b = CAN;
+    write(fd, &b, 1);
+    write(fd, &b, 1);
+    write(fd, &b, 1);
+  }
+  TRACE(config, END, result, 0, NULL, 0);
+  STATS_END(config);
+  return result;
 }
 
-bool _xmodem_rx(int fd, struct xmodem_config *config) {
-  bool result = false;
-
-  unsigned char *buffer;
-  unsigned char *prev_blk_id;
-  unsigned char *expected_id;
-  struct xmodem_packet p;
+bool xmodem_session_receive(struct xmodem_session *session, int fd, struct xmodem_config *config) {
+  size_t max_data_bytes = config->long_data_bytes > config->data_bytes ? config->long_data_bytes : config->data_bytes;
 
   //bundle all our memory allocations together
-#if defined(XMODEM_BUFFER_PACKET_READS)
   //need to store:
+  //1 xmodem_packet struct
   //5 id blocks - prev_blk_id, expected_id, xmodem_packet struct, buffer id and buffer compl_id
   //2 chksum block - xmodem_packet struct and buffer chksum
-  //2 data block - xmodem_packet struct and buffer data
-  buffer = malloc(5*config->id_bytes + 2*config->chksm_bytes + 2*config->data_bytes);
-  prev_blk_id = buffer + 2*config->id_bytes + config->chksm_bytes + config->data_bytes;
-#else
+  //1 data block - buffer data, the xmodem_packet struct points into the buffer
+  session->buffer = malloc(sizeof(struct xmodem_packet) + 5*config->id_bytes + 2*config->chksm_bytes + max_data_bytes);
+  if(session->buffer == NULL) return false;
+
+  //the packet is always read into the buffer so that it can be collected a
+  //few bytes at a time, prev_blk_id and expected_id sit just before p->id
+  struct xmodem_packet *p = (struct xmodem_packet *) session->buffer;
+  unsigned char *frame = session->buffer + sizeof(struct xmodem_packet);
+  unsigned char *prev_blk_id = frame + 2*config->id_bytes + max_data_bytes + config->chksm_bytes;
+  unsigned char *expected_id = prev_blk_id + config->id_bytes;
+  p->data = frame + 2*config->id_bytes;
+  p->id = expected_id + config->id_bytes;
+  p->chksm = p->id + config->id_bytes;
+  for(size_t i = 0; i < config->id_bytes; ++i) prev_blk_id[i] = expected_id[i] = 0;
+
+  if(!_xmodem_session_start(session, fd, config, SESSION_RX_INIT)) return false;
+  _xmodem_session_signal(session, config->rx_init_byte);
+  session->deadline = _xmodem_deadline(config->max_timeout_ms);
+  return true;
+}
+
+bool xmodem_session_send(struct xmodem_session *session, int fd, struct xmodem_config *config, unsigned char *data, size_t data_len, unsigned long long start_id) {
+  //bundle all our memory allocations together
   //need to store:
-  //3 id blocks - prev_blk_id, expected_id and xmodem_packet struct
+  //1 xmodem_packet struct
+  //1 data block - staging for looked up and padded blocks
+  //1 id block - blk_id
+  //1 header block - SOH followed by the id and compl_id bytes
   //1 checksum block - xmodem_packet struct
-  //1 data block - xmodem_packet struct
-  buffer = malloc(3*config->id_bytes + config->chksm_bytes + config->data_bytes);
-  prev_blk_id = buffer;
-#endif
+  session->buffer = malloc(sizeof(struct xmodem_packet) + config->data_bytes + 1 + 3*config->id_bytes + config->chksm_bytes);
+  if(session->buffer == NULL) return false;
 
-  expected_id = prev_blk_id + config->id_bytes;
-  p.id = expected_id + config->id_bytes;
-  p.chksm = p.id + config->id_bytes;
-  p.data = p.chksm + config->chksm_bytes;
+  struct xmodem_packet *p = (struct xmodem_packet *) session->buffer;
+  unsigned char *blk_id = session->buffer + sizeof(struct xmodem_packet) + config->data_bytes;
+  p->header = blk_id + config->id_bytes;
+  p->chksm = p->header + 1 + 2*config->id_bytes;
 
-  for(size_t i = 0; i < config->id_bytes; ++i) prev_blk_id[i] = expected_id[i] = 0;
+  //convert the start id to big endian format
+  unsigned long long temp = start_id;
+  for(size_t i = 0; i < config->id_bytes; ++i) {
+    blk_id[config->id_bytes-i-1] = (unsigned char) (temp & 0xFF);
+    temp >>= 8;
+  }
 
-  unsigned char errors = 0;
-  while(true) {
-    if(_xmodem_read_block(fd, config, &p, buffer)) {
-      //reset errors
-      errors = 0;
+  //a NULL data pointer sends a single looked up block like xmodem_lookup_send
+  session->data = data;
+  session->data_len = data == NULL ? config->data_bytes : data_len;
+  session->long_packets = config->long_data_bytes != 0;
+  if(!_xmodem_session_start(session, fd, config, SESSION_TX_INIT)) return false;
+  session->deadline = _xmodem_deadline(6*config->max_timeout_ms);
+  return true;
+}
 
-      //ignore resends of the last received block
-      size_t matches = 0;
-      for(size_t i = 0; i < config->id_bytes; ++i) {
-        if(prev_blk_id[i] == p.id[i]) ++matches;
-      }
+enum xmodem_status xmodem_session_poll(struct xmodem_session *session) {
+  if(session->state == SESSION_IDLE) return session->status;
+  if(_xmodem_session_flush(session) < 0) return _xmodem_session_finish(session, false);
+  if(session->state >= SESSION_TX_INIT) return _xmodem_session_poll_tx(session);
+  return _xmodem_session_poll_rx(session);
+}
 
-      //if its a duplicate block we still need to send an ACK
-      if(matches != config->id_bytes) {
+//while there is output waiting the session only needs to know when the fd is
+//writable, reading in the meantime would take the response before the packet
+//has been sent
+bool xmodem_session_wants_write(struct xmodem_session *session) {
+  return session->signal_len != 0 || session->state == SESSION_TX_PACKET;
+}
 
-#if defined(XMODEM_ALLOW_NONSEQUENTIAL)
-        for(size_t i = 0; i < config->id_bytes; ++i) expected_id[i] = p.id[i];
-#else
-        increment_id(expected_id, config->id_bytes);
+//the time (CLOCK_MONOTONIC milliseconds) the session has to be polled by even
+//if nothing arrives on its fd
+long long xmodem_session_deadline(struct xmodem_session *session) {
+  return session->deadline;
+}
 
-        matches = 0;
-        for(size_t i = 0; i < config->id_bytes; ++i) {
-          if(expected_id[i] == p.id[i]) ++matches;
-        }
+void xmodem_session_cancel(struct xmodem_session *session) {
+  if(session->state != SESSION_IDLE) _xmodem_session_finish(session, false);
+}
 
-        if(matches != config->id_bytes) break;
-#endif
+bool xmodem_reactor_init(struct xmodem_reactor *reactor) {
+  reactor->sessions = NULL;
+  reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  return reactor->epoll_fd >= 0;
+}
 
-        size_t padding_bytes = 0;
-        //count number of padding SUB bytes
-        while(p.data[config->data_bytes - 1 - padding_bytes] == SUB) ++padding_bytes;
+//NOTE: the session has to have been started with xmodem_session_receive or
+//xmodem_session_send and stay valid until its on_done handler is called
+bool xmodem_reactor_add(struct xmodem_reactor *reactor, struct xmodem_session *session) {
+  struct epoll_event event;
+  session->events = xmodem_session_wants_write(session) ? EPOLLOUT : EPOLLIN;
+  event.events = session->events;
+  event.data.ptr = session;
+  if(epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, session->fd, &event) != 0) return false;
+
+  session->next = reactor->sessions;
+  reactor->sessions = session;
+  return true;
+}
 
-        //process packet
-        if(!config->rx_block_handler(p.id, config->id_bytes, p.data, config->data_bytes - padding_bytes)) break;
+//waits for one of the fds to be ready or for the first session deadline, polls
+//the sessions that need it and returns the number that are still running
+size_t xmodem_reactor_run_once(struct xmodem_reactor *reactor, int max_wait_ms) {
+  long long now = _xmodem_deadline(0);
+  long long wake = max_wait_ms < 0 ? LLONG_MAX : now + max_wait_ms;
+  for(struct xmodem_session *s = reactor->sessions; s != NULL; s = s->next) {
+    if(s->deadline < wake) wake = s->deadline;
+  }
+  if(reactor->sessions == NULL && max_wait_ms < 0) return 0;
+
+  struct epoll_event events[64];
+  int timeout = wake == LLONG_MAX ? -1 : (wake > now ? (int) (wake - now) : 0);
+  int ready = epoll_wait(reactor->epoll_fd, events, sizeof(events)/sizeof(events[0]), timeout);
+  for(int i = 0; i < ready; ++i) {
+    struct xmodem_session *s = events[i].data.ptr;
+    //the other end has gone away, nothing more can be read from it
+    if((events[i].events & (EPOLLERR | EPOLLHUP)) && !(events[i].events & EPOLLIN)) xmodem_session_cancel(s);
+    else xmodem_session_poll(s);
+  }
 
-        for(size_t i = 0; i < config->id_bytes; ++i) prev_blk_id[i] = expected_id[i];
-      }
+  //run the timers and take the sessions that have ended out of the loop
+  now = _xmodem_deadline(0);
+  size_t running = 0;
+  struct xmodem_session **link = &reactor->sessions;
+  while(*link != NULL) {
+    struct xmodem_session *s = *link;
+    if(s->state != SESSION_IDLE && s->deadline <= now) xmodem_session_poll(s);
+
+    if(s->state == SESSION_IDLE) {
+      *link = s->next;
+      epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
+      if(s->on_done != NULL) s->on_done(s, s->status);
+      continue;
+    }
 
-      //signal acknowledgement
-      unsigned char response = _xmodem_tx_signal(fd, ACK);
-      if(response == CAN) break;
-      if(response == EOT) {
-        response = _xmodem_tx_signal(fd, NAK);
-        if(response == CAN) break;
-        if(response == EOT) {
-          buffer[0] = ACK;
-          write(fd, buffer, 1);
-          result = true;
-          break;
-        }
-      }
-      //Unexpected response and resync attempt failed so fail out
-      if(response != SOH && !find_header(fd)) break;
-    } else {
-      if(++errors > RETRY_LIMIT) break;
-      unsigned char response = _xmodem_tx_signal(fd, NAK);
-      if(response == CAN) break;
-      if(response != SOH && !find_header(fd)) break;
+    unsigned int wanted = xmodem_session_wants_write(s) ? EPOLLOUT : EPOLLIN;
+    if(wanted != s->events) {
+      struct epoll_event event;
+      event.events = wanted;
+      event.data.ptr = s;
+      epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, s->fd, &event);
+      s->events = wanted;
     }
+    ++running;
+    link = &s->next;
   }
+  return running;
+}
 
-  free(buffer);
-  return result;
+void xmodem_reactor_run(struct xmodem_reactor *reactor) {
+  while(xmodem_reactor_run_once(reactor, -1) != 0) {}
 }
 
+//NOTE: sessions that are still running are cancelled
+void xmodem_reactor_close(struct xmodem_reactor *reactor) {
+  while(reactor->sessions != NULL) {
+    struct xmodem_session *s = reactor->sessions;
+    reactor->sessions = s->next;
+    xmodem_session_cancel(s);
+  }
+  close(reactor->epoll_fd);
+}
+
+inline void increment_id(unsigned char *id, size_t length) {
+  size_t index = length-1;
+  do {
+    id[index]++;
+    if(id[index]) return; //if the current byte is non-zero then there is no overflow and we are done
+  } while(index--);//when we hit an index of zero then we have incremented all the bytes
+}
+
+bool find_byte_timed(int fd, unsigned char byte, long timeout_ms) {
+  unsigned char b;
+  long long end = _xmodem_deadline(timeout_ms);
+  while(_xmodem_read_until(fd, &b, 1, end) == 1) {
+#ifdef XMODEM_RESPONSE_DEBUG
+    debug_print_byte(b);
+#endif
+    if(b == byte) return true;
+  }
+  return false;
+}
+
+//deadlines are in milliseconds on the monotonic clock so they aren't affected
+//by changes to the system time
+long long _xmodem_deadline(long timeout_ms) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000 + timeout_ms;
+}
+
+//reads up to len bytes, sleeping in poll() until at least one arrives or the
+//deadline passes. Returns the number of bytes read, 0 on a timeout and -1 if
+//the fd has an error or has been closed
+ssize_t _xmodem_read_until(int fd, unsigned char *buf, size_t len, long long deadline) {
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  while(true) {
+    long long remaining = deadline - _xmodem_deadline(0);
+    if(remaining < 0) remaining = 0;
+
+    int ready = poll(&pfd, 1, (int) remaining);
+    if(ready < 0 && errno != EINTR) return -1;
+    if(ready == 0) return 0;
+    if(ready < 0) continue;
+
+    ssize_t r = read(fd, buf, len);
+    if(r > 0) return r;
+    //a readable fd that has nothing to read has been closed
+    if(r == 0 || (errno != EAGAIN && errno != EINTR)) return -1;
+  }
+}
+
+//waits for the line to go quiet so that the rest of a bad packet isn't
+//mistaken for the start of the next one
+void _xmodem_clear_line(int fd) {
+  unsigned char b[64];
+  long long end = _xmodem_deadline(LINE_CLEAR_MAX_MILLI_SEC);
+  while(_xmodem_read_until(fd, b, sizeof(b), _xmodem_deadline(LINE_CLEAR_MILLI_SEC)) > 0 && _xmodem_deadline(0) < end) {}
+  tcflush(fd, TCIFLUSH);
+}
+
+void _xmodem_rtt_init(struct xmodem_rtt *rtt, struct xmodem_config *config) {
+  rtt->srtt = -1;
+  rtt->rttvar = 0;
+  rtt->min_ms = config->min_timeout_ms;
+  rtt->max_ms = config->max_timeout_ms;
+  rtt->rto = INITIAL_TIMEOUT_MILLI_SEC;
+  if(rtt->rto < rtt->min_ms) rtt->rto = rtt->min_ms;
+  if(rtt->rto > rtt->max_ms) rtt->rto = rtt->max_ms;
+}
+
+//ms is the time between a packet or signal going out and its answer arriving.
+//NOTE: only answers to something that was sent once are sampled (Karn's
+//algorithm) as there is no telling which copy a resend was answered for
+void _xmodem_rtt_sample(struct xmodem_rtt *rtt, long ms) {
+  if(rtt->srtt < 0) {
+    rtt->srtt = ms << 3;
+    rtt->rttvar = ms << 1;
+  } else {
+    //srtt += (ms - srtt)/8 and rttvar += (|ms - srtt| - rttvar)/4 in the
+    //scaled units so that small round trips don't round down to nothing
+    long err = ms - (rtt->srtt >> 3);
+    rtt->srtt += err;
+    if(err < 0) err = -err;
+    rtt->rttvar += err - (rtt->rttvar >> 2);
+  }
+
+  rtt->rto = (rtt->srtt >> 3) + rtt->rttvar;
+  if(rtt->rto < rtt->min_ms) rtt->rto = rtt->min_ms;
+  if(rtt->rto > rtt->max_ms) rtt->rto = rtt->max_ms;
+}
+
+//nothing came back in time, the link may have slowed down so give the next
+//attempt twice as long
+void _xmodem_rtt_backoff(struct xmodem_rtt *rtt) {
+  rtt->rto = rtt->rto*2 > rtt->max_ms ? rtt->max_ms : rtt->rto*2;
+}
+
+#ifdef XMODEM_STATS
+static long long _xmodem_stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+//starts counting from 0 unless this transfer is part of a bigger one
+void _xmodem_stats_begin(struct xmodem_stats *stats) {
+  if(stats == NULL || stats->depth++ != 0) return;
+  unsigned char depth = stats->depth;
+  memset(stats, 0, sizeof(*stats));
+  stats->depth = depth;
+  stats->phase = &stats->other_us;
+  stats->mark = _xmodem_stats_now();
+}
+
+void _xmodem_stats_end(struct xmodem_stats *stats) {
+  if(stats != NULL && --stats->depth == 0) _xmodem_stats_phase(stats, NULL);
+}
+
+//adds the time since the last switch to the phase being timed and starts
+//timing phase, returns the phase it replaced. Nothing is timed between
+//transfers
+unsigned long *_xmodem_stats_phase(struct xmodem_stats *stats, unsigned long *phase) {
+  unsigned long *prev = stats->phase;
+  if(prev == NULL) return NULL;
+  long long now = _xmodem_stats_now();
+  *prev += now - stats->mark;
+  stats->mark = now;
+  stats->phase = phase;
+  return prev;
+}
+#endif
+
+void xmodem_trace_clear(struct xmodem_trace *trace) {
+  trace->count = 0;
+}
+
+#ifdef XMODEM_TRACE
+//NOTE: only the last 4 bytes of longer ids are kept
+void _xmodem_trace_add(struct xmodem_config *config, unsigned char type, unsigned char value, size_t aux, const unsigned char *id, size_t stride) {
+  struct xmodem_trace_event *e = &config->trace->events[config->trace->count++ % XMODEM_TRACE_EVENTS];
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  e->time_us = (uint32_t) (ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000);
+  e->type = type;
+  e->value = value;
+  e->aux = aux > 0xFFFF ? 0xFFFF : aux;
+  uint32_t low_id = 0;
+  if(id) {
+    for(size_t i = config->id_bytes > 4 ? config->id_bytes - 4 : 0; i < config->id_bytes; ++i) low_id = (low_id << 8) | id[i*stride];
+  }
+  e->id = low_id;
+}
+#endif
+
+static void _xmodem_trace_put32(unsigned char *buf, uint32_t val) {
+  for(size_t i = 0; i < 4; ++i) buf[i] = (unsigned char) (val >> 8*i);
+}
+
+//the dump is an 8 byte header ("XMTR", version 1, 12 byte events and 2 unused
+//bytes), the number of events ever added and the number that follow as 4 byte
+//values and then the events. Every value is little endian
+bool xmodem_trace_dump(struct xmodem_trace *trace, int fd) {
+  unsigned long kept = trace->count < XMODEM_TRACE_EVENTS ? trace->count : XMODEM_TRACE_EVENTS;
+  unsigned char buf[16] = { 'X', 'M', 'T', 'R', 1, 12, 0, 0 };
+  _xmodem_trace_put32(buf + 8, (uint32_t) trace->count);
+  _xmodem_trace_put32(buf + 12, (uint32_t) kept);
+  struct iovec iov = { buf, 16 };
+  if(!_xmodem_writev_all(fd, &iov, 1)) return false;
+
+  for(unsigned long i = trace->count - kept; i != trace->count; ++i) {
+    struct xmodem_trace_event *e = &trace->events[i % XMODEM_TRACE_EVENTS];
+    _xmodem_trace_put32(buf, e->time_us);
+    _xmodem_trace_put32(buf + 4, e->id);
+    buf[8] = e->aux & 0xFF;
+    buf[9] = e->aux >> 8;
+    buf[10] = e->type;
+    buf[11] = e->value;
+    iov.iov_base = buf;
+    iov.iov_len = 12;
+    if(!_xmodem_writev_all(fd, &iov, 1)) return false;
+  }
+  return true;
+}
+
+bool _xmodem_init_rx(int fd, struct xmodem_config *config, bool allow_window, bool *windowed, bool *compressed, unsigned char *header) {
+  debug_print("Initializing Receive Transaction... ");
+#if defined(XMODEM_ALLOW_NONSEQUENTIAL)
+  //windows rely on the block ids being sequential to spot missing blocks
+  bool ask_window = false;
+#else
+  bool ask_window = allow_window && config->window_size > 1;
+#endif
+  //a compressed transfer is asked for in place of a window
+  bool ask_compress = allow_window && config->compress;
+  if(ask_compress) ask_window = false;
+  *windowed = false;
+  *compressed = false;
+  STATS_ENTER(config, handshake_us, prev_phase);
+
+  unsigned char i = 0;
+  do {
+    //alternate between asking for a windowed or compressed transfer and the
+    //regular init byte so that senders without support for them can still
+    //start a transfer
+    bool win_attempt = (ask_window || ask_compress) && i % 2 == 0;
+    unsigned char init_byte = win_attempt ? (ask_compress ? ZIP : WIN) : config->rx_init_byte;
+    write(fd, &init_byte, 1);
+    TRACE(config, TX_SIGNAL, init_byte, i, NULL, 0);
+
+    //a sender that agrees echoes WIN or ZIP before its first packet, one that
+    //doesn't know them stays silent so don't wait long for it
+    long win_wait = config->max_timeout_ms < 3000 ? config->max_timeout_ms : 3000;
+    long long end = _xmodem_deadline(win_attempt ? win_wait : config->max_timeout_ms);
+    unsigned char b;
+    while(_xmodem_read_until(fd, &b, 1, end) == 1) {
+      //an empty transfer ends straight away
+      if(is_header(config, b) || b == EOT) {
+        debug_print("Done\n");
+        *header = b;
+        STATS_LEAVE(config, prev_phase);
+        return true;
+      }
+      if(b == WIN && ask_window) *windowed = true;
+      if(b == ZIP && ask_compress) *compressed = true;
+      if(b == WIN || b == ZIP) TRACE(config, RX_SIGNAL, b, 0, NULL, 0);
+    }
+    STATS_ADD(config, timeouts, 1);
+    TRACE(config, TIMEOUT, 'I', win_attempt ? win_wait : config->max_timeout_ms, NULL, 0);
+  } while(i++ < RETRY_LIMIT);
+  STATS_LEAVE(config, prev_phase);
+  return false;
+}
+
+unsigned char find_header(int fd, struct xmodem_config *config, struct xmodem_rtt *rtt, unsigned char *nak, size_t nak_len) {
+  STATS_ADD(config, resyncs, 1);
+  TRACE(config, RESYNC, 0, 0, NULL, 0);
+  unsigned char i = 0;
+  do {
+    if(i != 0) {
+      write(fd, nak, nak_len);
+      STATS_ADD(config, naks, 1);
+      TRACE(config, TX_SIGNAL, nak[0], i, nak_len > 1 ? nak + 1 : NULL, 2);
+    }
+    unsigned char header = find_header_byte(fd, config, rtt->rto);
+    if(header != 0) return header;
+    _xmodem_rtt_backoff(rtt);
+  } while(i++ < RETRY_LIMIT);
+  return 0;
+}
+
+//returns the header byte that was found or 0 if there wasn't one
+unsigned char find_header_byte(int fd, struct xmodem_config *config, long timeout_ms) {
+  unsigned char header = 0;
+  STATS_ENTER(config, ack_wait_us, prev_phase);
+  if(config->long_data_bytes == 0) {
+    if(find_byte_timed(fd, SOH, timeout_ms)) header = SOH;
+  } else {
+    long long end = _xmodem_deadline(timeout_ms);
+    unsigned char b;
+    while(header == 0 && _xmodem_read_until(fd, &b, 1, end) == 1) {
+#ifdef XMODEM_RESPONSE_DEBUG
+      debug_print_byte(b);
+#endif
+      if(is_header(config, b)) header = b;
+    }
+  }
+  STATS_LEAVE(config, prev_phase);
+  if(header == 0) {
+    STATS_ADD(config, timeouts, 1);
+    TRACE(config, TIMEOUT, 'H', timeout_ms, NULL, 0);
+  }
+  return header;
+}
+
+//STX packets are only recognised when they are enabled so that receivers
+//without the memory for them don't mistake them for the start of a packet
+bool is_header(struct xmodem_config *config, unsigned char b) {
+  return b == SOH || (b == STX && config->long_data_bytes != 0);
+}
+
+//NOTE: remaining is the number of bytes left in the file when the sender told
+//us the file size, otherwise it is NULL and the SUB padding is stripped
+//NOTE: blocks go to sink instead of rx_block_handler when it isn't NULL
+bool _xmodem_rx(int fd, struct xmodem_config *config, struct xmodem_rtt *rtt, bool windowed, bool compressed, unsigned char header, unsigned long *remaining, struct xmodem_file_sink *sink) {
+  bool result = false;
+
+  unsigned char *buffer;
+  unsigned char *prev_blk_id;
+  unsigned char *expected_id;
+  unsigned char *window_signal;
+  unsigned char *coded;
+  struct xmodem_packet p;
+  size_t window_signal_bytes = windowed ? 1 + 2*config->id_bytes : 0;
+  //the data block has to fit the biggest packet we accept
+  size_t max_data_bytes = config->long_data_bytes > config->data_bytes ? config->long_data_bytes : config->data_bytes;
+  //a compressed transfer reads each packet into the coded block at the end and
+  //decodes its data into the data block
+  size_t coded_bytes = compressed ? 2*config->id_bytes + 4 + max_data_bytes : 0;
+
+  //bundle all our memory allocations together
+#if defined(XMODEM_BUFFER_PACKET_READS)
+  //need to store:
+  //5 id blocks - prev_blk_id, expected_id, xmodem_packet struct, buffer id and buffer compl_id
+  //2 chksum block - xmodem_packet struct and buffer chksum
+  //1 data block - buffer data, the xmodem_packet struct points into the buffer
+  //1 window signal block (if windowed) - ACK/NAK followed by the id and compl_id bytes
+  //1 coded packet block (if compressed) - the packet as it was sent
+  buffer = malloc(5*config->id_bytes + 2*config->chksm_bytes + max_data_bytes + window_signal_bytes + coded_bytes);
+  prev_blk_id = buffer + 2*config->id_bytes + config->chksm_bytes + max_data_bytes;
+#else
+  //need to store:
+  //3 id blocks - prev_blk_id, expected_id and xmodem_packet struct
+  //1 checksum block - xmodem_packet struct
+  //1 data block - xmodem_packet struct
+  //1 window signal block (if windowed) - ACK/NAK followed by the id and compl_id bytes
+  //1 coded packet block (if compressed) - the packet as it was sent
+  buffer = malloc(3*config->id_bytes + config->chksm_bytes + max_data_bytes + window_signal_bytes + coded_bytes);
+  prev_blk_id = buffer;
+#endif
+
+  expected_id = prev_blk_id + config->id_bytes;
+  p.id = expected_id + config->id_bytes;
+  p.chksm = p.id + config->id_bytes;
+#if defined(XMODEM_BUFFER_PACKET_READS)
+  p.data = buffer + 2*config->id_bytes;
+  window_signal = p.chksm + config->chksm_bytes;
+#else
+  p.data = p.chksm + config->chksm_bytes;
+  window_signal = p.data + max_data_bytes;
+#endif
+  coded = window_signal + window_signal_bytes;
+
+  //in a windowed transfer ACK and NAK are followed by the id of the last block
+  //we have committed, a NAK asks the sender to resend everything after it
+  size_t signal_len = 1;
+  unsigned char nak = NAK;
+  unsigned char *nak_signal = &nak;
+  if(windowed) {
+    signal_len = window_signal_bytes;
+    nak_signal = window_signal;
+  }
+  for(size_t i = 0; i < config->id_bytes; ++i) prev_blk_id[i] = expected_id[i] = 0;
+
+#ifdef XMODEM_RECEIVE_THREAD
+  struct xmodem_rx_queue queue;
+  bool queued = config->rx_queue_blocks != 0 && sink == NULL;
+  if(queued && !_xmodem_rx_queue_start(&queue, config, max_data_bytes)) {
+    free(buffer);
+    return false;
+  }
+#endif
+
+  size_t errors = 0;
+  while(true) {
+    p.data_bytes = header == STX ? config->long_data_bytes : config->data_bytes;
+    if(header != EOT) STATS_ADD(config, wire_bytes, 1);
+    STATS_ENTER(config, wire_us, prev_phase);
+    bool valid = header != EOT && (compressed ? _xmodem_read_block_coded(fd, config, &p, coded) : _xmodem_read_block(fd, config, &p, buffer));
+    STATS_LEAVE(config, prev_phase);
+    if(valid) {
+      //reset errors
+      errors = 0;
+
+      //ignore resends of the last received block
+      size_t matches = 0;
+      for(size_t i = 0; i < config->id_bytes; ++i) {
+        if(prev_blk_id[i] == p.id[i]) ++matches;
+      }
+
+      //if its a duplicate block we still need to send an ACK
+      bool duplicate = matches == config->id_bytes;
+      if(duplicate) {
+        STATS_ADD(config, duplicates, 1);
+        TRACE(config, RX_DUP, header, p.data_bytes, p.id, 1);
+      }
+      if(!duplicate) {
+
+#if defined(XMODEM_ALLOW_NONSEQUENTIAL)
+        for(size_t i = 0; i < config->id_bytes; ++i) expected_id[i] = p.id[i];
+#else
+        increment_id(expected_id, config->id_bytes);
+
+        matches = 0;
+        for(size_t i = 0; i < config->id_bytes; ++i) {
+          if(expected_id[i] == p.id[i]) ++matches;
+        }
+
+        if(matches != config->id_bytes) {
+          if(!windowed) break;
+          //an earlier block in the window went missing, treat this block
+          //like a bad one and keep waiting for the missing block
+          for(size_t i = 0; i < config->id_bytes; ++i) expected_id[i] = prev_blk_id[i];
+          valid = false;
+        }
+#endif
+      }
+
+      if(valid && !duplicate) {
+        size_t data_len = p.data_bytes;
+        if(remaining != NULL) {
+          //anything past the end of the file is padding
+          if(data_len > *remaining) data_len = *remaining;
+          *remaining -= data_len;
+        } else {
+          //count number of padding SUB bytes
+          while(data_len > 0 && p.data[data_len - 1] == SUB) --data_len;
+        }
+
+        //process packet
+        STATS_ENTER(config, handler_us, prev_handler_phase);
+        bool processed;
+        if(sink != NULL) {
+          //the padding is trimmed once the end of the file is known
+          processed = _xmodem_file_write(config, sink, p.id, p.data, p.data_bytes);
+        } else {
+#ifdef XMODEM_RECEIVE_THREAD
+          //only waits for the handler when the queue is full
+          processed = queued ? _xmodem_rx_queue_push(&queue, p.id, p.data, data_len) : config->rx_block_handler(p.id, config->id_bytes, p.data, data_len);
+#else
+          processed = config->rx_block_handler(p.id, config->id_bytes, p.data, data_len);
+#endif
+        }
+        STATS_LEAVE(config, prev_handler_phase);
+        if(!processed) break;
+        STATS_ADD(config, blocks_received, 1);
+        STATS_ADD(config, payload_bytes, data_len);
+        TRACE(config, RX_FRAME, header, p.data_bytes, p.id, 1);
+
+        for(size_t i = 0; i < config->id_bytes; ++i) prev_blk_id[i] = expected_id[i];
+      }
+    }
+
+    unsigned char response;
+    if(header == EOT) {
+      TRACE(config, RX_SIGNAL, EOT, 0, NULL, 0);
+      response = EOT;
+    } else if(valid) {
+      //signal acknowledgement
+      if(windowed) {
+        _xmodem_encode_window_signal(config, window_signal, ACK, prev_blk_id);
+        response = _xmodem_tx_signal_frame(fd, config, rtt, window_signal, signal_len);
+      } else {
+        response = _xmodem_tx_signal(fd, config, rtt, ACK);
+      }
+    } else {
+      TRACE(config, RX_BAD, header, p.data_bytes, NULL, 0);
+      if(++errors > RETRY_LIMIT) break;
+      //the line is cleared before a NAK so the rest of the window is skipped
+      //and the sender has finished writing it by the time the NAK arrives, the
+      //first packet after it is the missing block again
+      if(windowed) _xmodem_encode_window_signal(config, window_signal, NAK, prev_blk_id);
+      response = _xmodem_tx_signal_frame(fd, config, rtt, nak_signal, signal_len);
+    }
+
+    //a lone CAN is likely just a corrupted byte or part of a packet whose
+    //header got lost, wait for a second one before stopping
+    if(response == CAN && _xmodem_rx_signal(fd, config, rtt->rto) == CAN) break;
+    //a windowed sender may still have resent blocks in flight when the last
+    //ACK arrives, so the end of the transfer can follow a discarded block
+    if(response == EOT) {
+      if(windowed) _xmodem_encode_window_signal(config, window_signal, NAK, prev_blk_id);
+      response = _xmodem_tx_signal_frame(fd, config, rtt, nak_signal, signal_len);
+      if(response == CAN) break;
+      if(response == EOT) {
+#ifdef XMODEM_RECEIVE_THREAD
+        //the transfer is only complete once the handler has taken every block
+        if(queued) {
+          queued = false;
+          if(!_xmodem_rx_queue_finish(&queue)) break;
+        }
+#endif
+        STATS_ENTER(config, handler_us, prev_handler_phase);
+        bool finished = sink == NULL || _xmodem_file_finish(sink);
+        STATS_LEAVE(config, prev_handler_phase);
+        if(!finished) break;
+        if(windowed) {
+          _xmodem_encode_window_signal(config, window_signal, ACK, prev_blk_id);
+          write(fd, window_signal, signal_len);
+        } else {
+          buffer[0] = ACK;
+          write(fd, buffer, 1);
+        }
+        TRACE(config, TX_SIGNAL, ACK, 0, NULL, 0);
+        result = true;
+        break;
+      }
+    }
+    //Unexpected response and resync attempt failed so fail out
+    if(windowed) _xmodem_encode_window_signal(config, window_signal, NAK, prev_blk_id);
+    if(is_header(config, response)) header = response;
+    else if((header = find_header(fd, config, rtt, nak_signal, signal_len)) == 0) break;
+  }
+
+#ifdef XMODEM_RECEIVE_THREAD
+  if(queued) _xmodem_rx_queue_finish(&queue);
+#endif
+  free(buffer);
+  return result;
+}
+
+//writes a whole block at its offset, the SUB padding of the last block is
+//only cut off by _xmodem_file_finish
+bool _xmodem_file_write(struct xmodem_config *config, struct xmodem_file_sink *sink, unsigned char *id, unsigned char *data, size_t data_bytes) {
+  off_t offset;
+#if defined(XMODEM_ALLOW_NONSEQUENTIAL)
+  //the offset comes from the id so every block has to be a regular one
+  unsigned long long n = 0;
+  for(size_t i = 0; i < config->id_bytes; ++i) n = (n << 8) | id[i];
+  if(n == 0 || data_bytes != config->data_bytes) return false;
+  offset = (off_t) (n - 1) * config->data_bytes;
+#else
+  offset = sink->next;
+  sink->next += data_bytes;
+#endif
+
+  size_t len = data_bytes;
+  if(sink->size >= 0) {
+    if(offset >= sink->size) return true;
+    if((unsigned long long) (sink->size - offset) < len) len = sink->size - offset;
+  } else if(offset >= sink->last) {
+    size_t data_len = data_bytes;
+    while(data_len > 0 && data[data_len - 1] == SUB) --data_len;
+    sink->last = offset;
+    sink->end = offset + data_len;
+  }
+
+  while(len > 0) {
+    ssize_t written = pwrite(sink->fd, data, len, offset);
+    if(written < 0 && errno == EINTR) continue;
+    if(written <= 0) return false;
+    data += written;
+    offset += written;
+    len -= written;
+  }
+  return true;
+}
+
+//cuts off the padding and makes sure the file is on disk before the final ACK
+bool _xmodem_file_finish(struct xmodem_file_sink *sink) {
+  off_t end = sink->size;
+  if(end < 0) end = sink->end > sink->old_size ? sink->end : sink->old_size;
+  return ftruncate(sink->fd, end) == 0 && fsync(sink->fd) == 0;
+}
+
+#ifdef XMODEM_RECEIVE_THREAD
+//verified blocks are handed to rx_block_handler by a consumer thread so the ACK
+//doesn't wait for it. The thread that reads the packets is the only one that
+//fills slots and the consumer the only one that empties them, so the ring
+//needs no lock, the semaphores count the free and filled slots and order the
+//accesses to them
+static void _xmodem_sem_wait(sem_t *sem) {
+  while(sem_wait(sem) != 0 && errno == EINTR);
+}
+
+static void *_xmodem_rx_consumer(void *arg) {
+  struct xmodem_rx_queue *q = arg;
+  while(true) {
+    _xmodem_sem_wait(&q->filled);
+    size_t slot = q->tail;
+    q->tail = (q->tail + 1) % q->size;
+    size_t len = q->lens[slot];
+    if(len == SIZE_MAX) break;
+    unsigned char *id = q->blocks + slot*q->block_bytes;
+    //blocks after a refused one are dropped, the reader cancels the transfer
+    if(!atomic_load(&q->failed) && !q->config->rx_block_handler(id, q->config->id_bytes, id + q->config->id_bytes, len)) {
+      atomic_store(&q->failed, true);
+    }
+    sem_post(&q->free);
+  }
+  return NULL;
+}
+
+bool _xmodem_rx_queue_start(struct xmodem_rx_queue *q, struct xmodem_config *config, size_t max_data_bytes) {
+  q->config = config;
+  q->block_bytes = config->id_bytes + max_data_bytes;
+  //need to store:
+  //1 length per slot - SIZE_MAX stops the consumer
+  //1 id and data block per slot
+  q->size = config->rx_queue_blocks;
+  q->lens = malloc(q->size*(sizeof(size_t) + q->block_bytes));
+  if(q->lens == NULL) return false;
+  q->blocks = (unsigned char *) (q->lens + q->size);
+  q->head = 0;
+  q->tail = 0;
+  atomic_init(&q->failed, false);
+  sem_init(&q->filled, 0, 0);
+  sem_init(&q->free, 0, q->size);
+  if(pthread_create(&q->consumer, NULL, _xmodem_rx_consumer, q) != 0) {
+    sem_destroy(&q->free);
+    sem_destroy(&q->filled);
+    free(q->lens);
+    return false;
+  }
+  return true;
+}
+
+//waits for a free slot, returns false once the handler has refused a block
+bool _xmodem_rx_queue_push(struct xmodem_rx_queue *q, unsigned char *id, unsigned char *data, size_t data_len) {
+  if(atomic_load(&q->failed)) return false;
+  _xmodem_sem_wait(&q->free);
+  if(atomic_load(&q->failed)) {
+    sem_post(&q->free);
+    return false;
+  }
+  size_t slot = q->head;
+  q->head = (q->head + 1) % q->size;
+  unsigned char *block = q->blocks + slot*q->block_bytes;
+  memcpy(block, id, q->config->id_bytes);
+  memcpy(block + q->config->id_bytes, data, data_len);
+  q->lens[slot] = data_len;
+  sem_post(&q->filled);
+  return true;
+}
+
+//waits for the handler to take the queued blocks and stops the consumer,
+//returns false if it refused any of them
+bool _xmodem_rx_queue_finish(struct xmodem_rx_queue *q) {
+  _xmodem_sem_wait(&q->free);
+  q->lens[q->head] = SIZE_MAX;
+  sem_post(&q->filled);
+  pthread_join(q->consumer, NULL);
+  sem_destroy(&q->free);
+  sem_destroy(&q->filled);
+  free(q->lens);
+  return !atomic_load(&q->failed);
+}
+#endif
+
 bool _xmodem_read_block(int fd, struct xmodem_config *config, struct xmodem_packet *p, unsigned char *buffer) {
   debug_print("\nReading packet ");
 #if defined(XMODEM_BUFFER_PACKET_READS)
-  size_t b_pos = 2*config->id_bytes + config->chksm_bytes + config->data_bytes;
-  if(!_xmodem_fill_buffer(fd, config, buffer, b_pos)) return false;
+  size_t data_start = 2*config->id_bytes;
+  size_t data_end = data_start + p->data_bytes;
+  size_t frame_bytes = data_end + config->chksm_bytes;
+
+  bool incremental = _xmodem_chksm_incremental(config);
+  if(incremental) config->chksm_init(p->chksm);
+
+  //checksum the data of each chunk as soon as it arrives so that the checksum
+  //is ready when the last byte of the packet is read. p->data points into the
+  //buffer so the data is never copied
+  size_t count = 0;
+  while(count < frame_bytes) {
+    ssize_t r = _xmodem_read_until(fd, buffer + count, frame_bytes - count, _xmodem_deadline(XMODEM_READ_TIMEOUT_MS));
+
+    //the baud rate / sending device may be much slower than ourselves so
+    //we only signal an error condition if no data has been received at all
+    //within the read timeout
+    if(r <= 0) {
+      if(r == 0) {
+        STATS_ADD(config, timeouts, 1);
+        TRACE(config, TIMEOUT, 'P', XMODEM_READ_TIMEOUT_MS, NULL, 0);
+      }
+      return false;
+    }
+    STATS_ADD(config, wire_bytes, r);
+
+    size_t start = count > data_start ? count : data_start;
+    count += r;
+    size_t end = count < data_end ? count : data_end;
+    if(incremental && start < end) {
+      STATS_ENTER(config, chksum_us, prev_phase);
+      config->chksm_update(buffer + start, end - start, p->chksm);
+      STATS_LEAVE(config, prev_phase);
+    }
+  }
 
-  b_pos = 0;
+  if(!_xmodem_check_block(config, p, buffer)) return false;
+#else
+  //read 1 byte at a time so nothing past the end of each field is consumed
+  unsigned char tmp;
   for(size_t i = 0; i < config->id_bytes; ++i) {
-    p->id[i] = buffer[b_pos++];
+    if(_xmodem_read_until(fd, p->id + i, 1, _xmodem_deadline(XMODEM_READ_TIMEOUT_MS)) <= 0 || _xmodem_read_until(fd, &tmp, 1, _xmodem_deadline(XMODEM_READ_TIMEOUT_MS)) <= 0) {
+      STATS_ADD(config, timeouts, 1);
+      TRACE(config, TIMEOUT, 'P', XMODEM_READ_TIMEOUT_MS, NULL, 0);
+      return false;
+    }
+    STATS_ADD(config, wire_bytes, 2);
+
     debug_print_byte(p->id[i]);
-    debug_print_byte(buffer[b_pos]);
+    debug_print_byte(tmp);
 
     /*
        possibly because of C integer promotion rules the ~ operator changes
@@ -371,32 +1742,38 @@ bool _xmodem_read_block(int fd, struct xmodem_config *config, struct xmodem_pack
        back to an unsigned char
        */
 
-    if(p->id[i] != (unsigned char) ~buffer[b_pos++]) return false;
+    if(p->id[i] != (unsigned char) ~tmp) return false;
   }
   debug_print(": ");
 
-  for(size_t i = 0; i < config->data_bytes; ++i) {
-    p->data[i] = buffer[b_pos++];
-    debug_print_byte(p->data[i]);
-  }
+  if(_xmodem_chksm_incremental(config)) config->chksm_init(p->chksm);
+  if(!_xmodem_fill_buffer(fd, config, p->data, p->data_bytes, p->chksm)) return false;
+  for(size_t i = 0; i < p->data_bytes; ++i) debug_print_byte(p->data[i]);
 
+  _xmodem_finish_chksm(config, p);
   for(size_t i = 0; i < config->chksm_bytes; ++i) {
-    debug_print_byte(buffer[b_pos + i]);
+    if(_xmodem_read_until(fd, &tmp, 1, _xmodem_deadline(XMODEM_READ_TIMEOUT_MS)) <= 0) {
+      STATS_ADD(config, timeouts, 1);
+      TRACE(config, TIMEOUT, 'P', XMODEM_READ_TIMEOUT_MS, NULL, 0);
+      return false;
+    }
+    STATS_ADD(config, wire_bytes, 1);
+    debug_print_byte(tmp);
+    if(p->chksm[i] != tmp) return false;
   }
+#endif
 
-  config->calc_chksum(p->data, config->data_bytes, p->chksm);
-  for(size_t i = 0; i < config->chksm_bytes; ++i) {
-    if(p->chksm[i] != buffer[b_pos++]) return false;
-  }
-#else
-  //can only read 1 byte at a time because of our serial device settings VMIN/VTIME
-  unsigned char tmp;
-  for(size_t i = 0; i < config->id_bytes; ++i) {
-    if(read(fd, p->id + i, 1) <= 0) return false;
-    if(read(fd, &tmp, 1) <= 0) return false;
+  return true;
+}
+
+//NOTE: buffer holds a whole packet after its header and p->data points into it
+bool _xmodem_check_block(struct xmodem_config *config, struct xmodem_packet *p, unsigned char *buffer) {
+  size_t b_pos = 0;
 
+  for(size_t i = 0; i < config->id_bytes; ++i) {
+    p->id[i] = buffer[b_pos++];
     debug_print_byte(p->id[i]);
-    debug_print_byte(tmp);
+    debug_print_byte(buffer[b_pos]);
 
     /*
        possibly because of C integer promotion rules the ~ operator changes
@@ -408,196 +1785,1188 @@ bool _xmodem_read_block(int fd, struct xmodem_config *config, struct xmodem_pack
        back to an unsigned char
        */
 
-    if(p->id[i] != (unsigned char) ~tmp) return false;
+    if(p->id[i] != (unsigned char) ~buffer[b_pos++]) return false;
+  }
+  debug_print(": ");
+
+  for(size_t i = 0; i < p->data_bytes; ++i) debug_print_byte(p->data[i]);
+  b_pos = 2*config->id_bytes + p->data_bytes;
+  for(size_t i = 0; i < config->chksm_bytes; ++i) {
+    debug_print_byte(buffer[b_pos + i]);
+  }
+
+  _xmodem_finish_chksm(config, p);
+  for(size_t i = 0; i < config->chksm_bytes; ++i) {
+    if(p->chksm[i] != buffer[b_pos++]) return false;
+  }
+  return true;
+}
+
+//NOTE: chksm is only updated when config has an incremental checksum handler
+//and it isn't NULL, see _xmodem_chksm_incremental
+bool _xmodem_fill_buffer(int fd, struct xmodem_config *config, unsigned char *buffer, size_t bytes, unsigned char *chksm) {
+  if(!_xmodem_chksm_incremental(config)) chksm = NULL;
+  size_t count = 0;
+  while(count < bytes) {
+    ssize_t r = _xmodem_read_until(fd, buffer + count, bytes - count, _xmodem_deadline(XMODEM_READ_TIMEOUT_MS));
+    for(ssize_t i = 0; i < r; ++i) debug_print_byte(buffer[count + i]);
+
+    //the baud rate / sending device may be much slower than ourselves so
+    //we only signal an error condition if no data has been received at all
+    //within the read timeout
+    if(r <= 0) {
+      if(r == 0) {
+        STATS_ADD(config, timeouts, 1);
+        TRACE(config, TIMEOUT, 'P', XMODEM_READ_TIMEOUT_MS, NULL, 0);
+      }
+      return false;
+    }
+    STATS_ADD(config, wire_bytes, r);
+
+    if(chksm) {
+      STATS_ENTER(config, chksum_us, prev_phase);
+      config->chksm_update(buffer + count, r, chksm);
+      STATS_LEAVE(config, prev_phase);
+    }
+    count += r;
+  }
+  return true;
+}
+
+//NOTE: buffer has room for the id, length and data of the biggest packet,
+//p->data_bytes is the size the data decodes to
+bool _xmodem_read_block_coded(int fd, struct xmodem_config *config, struct xmodem_packet *p, unsigned char *buffer) {
+  debug_print("\nReading coded packet ");
+  //the length is checked before reading the data so a corrupted one can't
+  //make us wait for more bytes than the sender wrote
+  size_t len_start = 2*config->id_bytes;
+  if(!_xmodem_fill_buffer(fd, config, buffer, len_start + 4, NULL)) return false;
+  for(size_t i = 0; i < config->id_bytes; ++i) {
+    p->id[i] = buffer[2*i];
+    debug_print_byte(p->id[i]);
+    if(p->id[i] != (unsigned char) ~buffer[2*i + 1]) return false;
   }
+  if(buffer[len_start] != (unsigned char) ~buffer[len_start + 1] || buffer[len_start + 2] != (unsigned char) ~buffer[len_start + 3]) return false;
+  size_t len = ((size_t) buffer[len_start] << 8) | buffer[len_start + 2];
+  if(len == 0 || len > p->data_bytes) return false;
   debug_print(": ");
 
-  if(!_xmodem_fill_buffer(fd, config, p->data, config->data_bytes)) return false;
-  for(size_t i = 0; i < config->data_bytes; ++i) debug_print_byte(p->data[i]);
+  unsigned char *coded = buffer + len_start + 4;
+  if(!_xmodem_fill_buffer(fd, config, coded, len, NULL)) return false;
 
-  config->calc_chksum(p->data, config->data_bytes, p->chksm);
+  //the checksum is compared a byte at a time like the unbuffered
+  //_xmodem_read_block so a packet that lost a byte fails on the first wrong
+  //one instead of waiting out the timeout for a byte that is never coming
+  unsigned char tmp;
+  _xmodem_chksm_block(config, coded, len, p->chksm);
   for(size_t i = 0; i < config->chksm_bytes; ++i) {
-    if(read(fd, &tmp, 1) <= 0) return false;
+    if(_xmodem_read_until(fd, &tmp, 1, _xmodem_deadline(XMODEM_READ_TIMEOUT_MS)) <= 0) {
+      STATS_ADD(config, timeouts, 1);
+      TRACE(config, TIMEOUT, 'P', XMODEM_READ_TIMEOUT_MS, NULL, 0);
+      return false;
+    }
+    STATS_ADD(config, wire_bytes, 1);
     debug_print_byte(tmp);
     if(p->chksm[i] != tmp) return false;
   }
-#endif
 
-  return true;
+  //a block that didn't get any shorter is sent as it is
+  if(len == p->data_bytes) {
+    memcpy(p->data, coded, len);
+    return true;
+  }
+  return xmodem_lzss_decode(coded, len, p->data, p->data_bytes);
 }
 
-bool _xmodem_fill_buffer(int fd, struct xmodem_config *config, unsigned char *buffer, size_t bytes) {
-  size_t count = 0;
-  while(count < bytes) {
-    ssize_t r = read(fd, buffer + count, bytes - count);
-    for(ssize_t i = 0; i < r; ++i) debug_print_byte(buffer[count + i]);
-
-    //the baud rate / sending device may be much slower than ourselves so
-    //we only signal an error condition if no data has been received at all
-    //within the tty timeout period (VTIME)
-    if(r <= 0) return false;
+//the incremental handlers that xmodem_init_config sets up only stand in for the
+//calc_chksum it set up with them, a calc_chksum replaced after that is used as
+//it is. Incremental handlers that were set by the caller are always used
+bool _xmodem_chksm_incremental(struct xmodem_config *config) {
+  if(!config->chksm_update) return false;
+  if(config->chksm_update == update_checksum_basic) return config->calc_chksum == fill_checksum_basic;
+  if(config->chksm_update == update_checksum_crc_16) return config->calc_chksum == fill_checksum_crc_16;
+  if(config->chksm_update == update_checksum_crc_16_be) return config->calc_chksum == fill_checksum_crc_16_be;
+  return true;
+}
 
-    count += r;
+void _xmodem_chksm_block(struct xmodem_config *config, unsigned char *data, size_t data_bytes, unsigned char *chksm) {
+  STATS_ENTER(config, chksum_us, prev_phase);
+  if(!_xmodem_chksm_incremental(config)) {
+    config->calc_chksum(data, data_bytes, chksm);
+  } else {
+    config->chksm_init(chksm);
+    config->chksm_update(data, data_bytes, chksm);
+    if(config->chksm_final) config->chksm_final(chksm);
   }
-  return true;
+  STATS_LEAVE(config, prev_phase);
 }
 
-bool _xmodem_init_tx(int fd, struct xmodem_config *config) {
+void _xmodem_finish_chksm(struct xmodem_config *config, struct xmodem_packet *p) {
+  STATS_ENTER(config, chksum_us, prev_phase);
+  if(!_xmodem_chksm_incremental(config)) config->calc_chksum(p->data, p->data_bytes, p->chksm);
+  else if(config->chksm_final) config->chksm_final(p->chksm);
+  STATS_LEAVE(config, prev_phase);
+}
+
+bool _xmodem_init_tx(int fd, struct xmodem_config *config, bool *windowed, bool *compressed) {
   debug_print("Initializing Send Transaction... ");
+  *windowed = false;
+  *compressed = false;
+  STATS_ENTER(config, handshake_us, prev_phase);
+  bool started = false;
   unsigned char i = 0;
   do {
-    if(find_byte_timed(fd, config->rx_init_byte, 60)) {
-      debug_print("Done\n");
-      return true;
+    if(config->window_size <= 1 && !config->compress) {
+      started = find_byte_timed(fd, config->rx_init_byte, 6*config->max_timeout_ms);
+      if(started) {
+        debug_print("Done\n");
+        TRACE(config, RX_SIGNAL, config->rx_init_byte, 0, NULL, 0);
+      }
+    } else {
+      //the receiver may also ask for a windowed transfer, agree to it by echoing WIN
+      long long end = _xmodem_deadline(6*config->max_timeout_ms);
+      unsigned char b;
+      while(!started && _xmodem_read_until(fd, &b, 1, end) == 1) {
+        if(b == config->rx_init_byte) {
+          debug_print("Done\n");
+          started = true;
+        } else if(b == WIN && config->window_size > 1) {
+          *windowed = true;
+          write(fd, &b, 1);
+          debug_print("Done (windowed)\n");
+          started = true;
+        } else if(b == ZIP && config->compress) {
+          //or a compressed one, agreed to the same way
+          *compressed = true;
+          write(fd, &b, 1);
+          debug_print("Done (compressed)\n");
+          started = true;
+        }
+        if(started) TRACE(config, RX_SIGNAL, b, 0, NULL, 0);
+      }
     }
-  } while(i++ < RETRY_LIMIT);
-  return false;
+    if(!started) {
+      STATS_ADD(config, timeouts, 1);
+      TRACE(config, TIMEOUT, 'I', 6*config->max_timeout_ms, NULL, 0);
+    }
+  } while(!started && i++ < RETRY_LIMIT);
+  STATS_LEAVE(config, prev_phase);
+  return started;
+}
+
+#ifdef XMODEM_SEND_THREAD
+//packets are built by a producer thread and sent by the thread that called
+//_xmodem_tx, slot built % depth is the next one to build and slot sent % depth
+//the next one to send
+struct xmodem_tx_pipe {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct xmodem_config *config;
+  //copy of the sender's config without stats or trace, the phases are only
+  //timed and traced on the sending thread
+  struct xmodem_config producer_config;
+  struct xmodem_tx_source src;
+  struct xmodem_packet *slots;
+  unsigned char *staging;
+  size_t built;
+  size_t sent;
+  size_t depth; //2 builds a packet ahead, 1 waits for the ACK first
+  bool long_packets; //cleared by the sender to fall back from 1K packets
+  bool done; //nothing left to build
+  bool stop; //the sender has given up
+};
+
+static void *_xmodem_tx_producer(void *arg) {
+  struct xmodem_tx_pipe *pipe = arg;
+  pthread_mutex_lock(&pipe->lock);
+  while(true) {
+    while(!pipe->stop && pipe->built - pipe->sent == pipe->depth) pthread_cond_wait(&pipe->cond, &pipe->lock);
+    if(pipe->stop) break;
+    size_t slot = pipe->built % pipe->depth;
+    pipe->src.long_packets = pipe->long_packets;
+    pthread_mutex_unlock(&pipe->lock);
+
+    bool ready = _xmodem_tx_next(&pipe->producer_config, &pipe->src, &pipe->slots[slot], pipe->staging + slot*pipe->config->data_bytes);
+
+    pthread_mutex_lock(&pipe->lock);
+    if(ready) ++pipe->built;
+    else pipe->done = true;
+    pthread_cond_signal(&pipe->cond);
+    if(!ready) break;
+  }
+  pthread_mutex_unlock(&pipe->lock);
+  return NULL;
 }
+#endif
 
-bool _xmodem_tx(int fd, struct xmodem_config *config, struct xmodem_packet *p, unsigned char *data, size_t data_len, unsigned char *blk_id) {
-  unsigned char *data_ptr = data;
-  unsigned char *data_end = data_ptr + data_len;
+//NOTE: there is a slot (2 with pipeline_sends) each with its own data_bytes
+//staging block, full blocks are sent straight from the callers memory so only
+//lookups and the padded final block are copied into them. With pipeline_sends
+//the next packet is built while the one before it is being answered so slow
+//lookups overlap with the line. With XMODEM_SEND_THREAD defined they are built
+//on a separate thread
+bool _xmodem_tx(int fd, struct xmodem_config *config, struct xmodem_rtt *rtt, struct xmodem_packet *slots, unsigned char *staging, bool compressed, unsigned char *data, size_t data_len, unsigned char *blk_id) {
+  struct xmodem_tx_source src;
+  src.data = data;
+  src.compressed = compressed;
+  //NULL data looks up data_len blocks, 0 for a single block
+  src.remaining = data == NULL && data_len == 0 ? 1 : data_len;
+  //1K packets are only used for full blocks, the rest of the data goes out in
+  //regular packets so that the final packet never needs more than a regular
+  //packet worth of padding
+  src.long_packets = config->long_data_bytes != 0;
+  src.blk_id = blk_id;
+  unsigned char resends;
 
   //flush the incoming stream before starting
   tcflush(fd, TCIFLUSH);
 
-  if(data == NULL) {
-    //need to use block_lookup to fill in the packet data
-    _xmodem_build_packet(config, p, blk_id, NULL, config->data_bytes);
-    return _xmodem_send_packet(fd, config, p);
+#ifdef XMODEM_SEND_THREAD
+  struct xmodem_tx_pipe pipe;
+  pthread_mutex_init(&pipe.lock, NULL);
+  pthread_cond_init(&pipe.cond, NULL);
+  pipe.config = config;
+  pipe.producer_config = *config;
+  pipe.producer_config.stats = NULL;
+  pipe.producer_config.trace = NULL;
+  pipe.src = src;
+  pipe.slots = slots;
+  pipe.staging = staging;
+  pipe.built = 0;
+  pipe.sent = 0;
+  pipe.depth = config->pipeline_sends ? 2 : 1;
+  pipe.long_packets = src.long_packets;
+  pipe.done = false;
+  pipe.stop = false;
+  pthread_t producer;
+  bool result = pthread_create(&producer, NULL, _xmodem_tx_producer, &pipe) == 0;
+  if(!result) {
+    pthread_cond_destroy(&pipe.cond);
+    pthread_mutex_destroy(&pipe.lock);
+    return false;
+  }
+
+  pthread_mutex_lock(&pipe.lock);
+  while(true) {
+    while(pipe.sent == pipe.built && !pipe.done) pthread_cond_wait(&pipe.cond, &pipe.lock);
+    if(pipe.sent == pipe.built) break;
+    struct xmodem_packet *p = &slots[pipe.sent % pipe.depth];
+    pthread_mutex_unlock(&pipe.lock);
+
+    result = _xmodem_send_packet(fd, config, rtt, p, &resends);
+
+    pthread_mutex_lock(&pipe.lock);
+    if(!result) break;
+    //a line that keeps corrupting 1K packets is better off with smaller ones
+    if(p->header[0] == STX && resends >= XMODEM_1K_FALLBACK_RESENDS && pipe.long_packets) {
+      debug_print("\nFalling back to %zu byte packets", config->data_bytes);
+      pipe.long_packets = false;
+      //the producer stops once it has built the next packet, a 1K one is put
+      //back so that it gets built again as regular packets
+      while(pipe.depth == 2 && pipe.built - pipe.sent != 2 && !pipe.done) pthread_cond_wait(&pipe.cond, &pipe.lock);
+      struct xmodem_packet *next = &slots[(pipe.sent + 1) % pipe.depth];
+      if(pipe.depth == 2 && pipe.built - pipe.sent == 2 && next->header[0] == STX) {
+        _xmodem_tx_unbuild(config, &pipe.src, next);
+        --pipe.built;
+      }
+    }
+    ++pipe.sent;
+    pthread_cond_signal(&pipe.cond);
+  }
+  pipe.stop = true;
+  pthread_cond_signal(&pipe.cond);
+  pthread_mutex_unlock(&pipe.lock);
+  pthread_join(producer, NULL);
+  pthread_cond_destroy(&pipe.cond);
+  pthread_mutex_destroy(&pipe.lock);
+  return result;
+#else
+  size_t slot = 0;
+  bool ready = _xmodem_tx_next(config, &src, &slots[0], staging);
+  while(ready) {
+    struct xmodem_packet *p = &slots[slot];
+    debug_print("\nSending packet: ");
+    if(!_xmodem_write_packet(fd, config, p)) return false;
+    debug_print("Done ");
+    if(config->pipeline_sends) {
+      slot ^= 1;
+      ready = _xmodem_tx_next(config, &src, &slots[slot], staging + slot*config->data_bytes);
+    }
+    if(!_xmodem_await_ack(fd, config, rtt, p, &resends)) return false;
+
+    //a line that keeps corrupting 1K packets is better off with smaller ones
+    //NOTE: the header tells them apart, data_bytes is the coded size when the
+    //transfer is compressed
+    if(p->header[0] == STX && resends >= XMODEM_1K_FALLBACK_RESENDS && src.long_packets) {
+      debug_print("\nFalling back to %zu byte packets", config->data_bytes);
+      src.long_packets = false;
+      //a 1K packet that was built ahead gets built again as regular packets
+      if(config->pipeline_sends && ready && slots[slot].header[0] == STX) {
+        _xmodem_tx_unbuild(config, &src, &slots[slot]);
+        ready = _xmodem_tx_next(config, &src, &slots[slot], staging + slot*config->data_bytes);
+      }
+    }
+    if(!config->pipeline_sends) ready = _xmodem_tx_next(config, &src, &slots[0], staging);
   }
+  return true;
+#endif
+}
+
+//builds the next packet of a regular transfer, returns false once there is
+//nothing left to send
+bool _xmodem_tx_next(struct xmodem_config *config, struct xmodem_tx_source *src, struct xmodem_packet *p, unsigned char *staging) {
+  if(src->remaining == 0) return false;
+  p->data = staging;
 
-  while(data_ptr + config->data_bytes < data_end) {
-    _xmodem_build_packet(config, p, blk_id, data_ptr, config->data_bytes);
-    increment_id(blk_id, config->id_bytes);
-    if(!_xmodem_send_packet(fd, config, p)) return false;
-    data_ptr += config->data_bytes;
+  if(src->data == NULL) {
+    //need to use block_lookup to fill in the packet data
+    p->data_bytes = config->data_bytes;
+    size_t filled = _xmodem_build_packet(config, p, src->blk_id, NULL, config->data_bytes);
+    //the lookup handler has run out of data
+    if(filled == 0) {
+      src->remaining = 0;
+      return false;
+    }
+    //a short block is the last one so the padding only ever ends the data
+    src->remaining = filled < config->data_bytes ? 0 : src->remaining - 1;
+  } else {
+    bool long_packet = src->long_packets && src->remaining >= config->long_data_bytes;
+    p->data_bytes = long_packet ? config->long_data_bytes : config->data_bytes;
+
+    size_t block_len = src->remaining < p->data_bytes ? src->remaining : p->data_bytes;
+    if(block_len != p->data_bytes) memset(p->data, SUB, p->data_bytes); //set all bytes to the padding byte
+    _xmodem_build_packet(config, p, src->blk_id, src->data, block_len);
+    src->data += block_len;
+    src->remaining -= block_len;
   }
 
-  if(data_ptr != data_end) {
-    memset(p->data, SUB, config->data_bytes); //set all bytes to the padding byte
+  if(src->compressed) _xmodem_code_packet(config, p);
+  increment_id(src->blk_id, config->id_bytes);
+  return true;
+}
+
+//puts a full 1K packet built by _xmodem_tx_next back into src
+void _xmodem_tx_unbuild(struct xmodem_config *config, struct xmodem_tx_source *src, struct xmodem_packet *p) {
+  src->data -= config->long_data_bytes;
+  src->remaining += config->long_data_bytes;
+  for(size_t i = 0; i < config->id_bytes; ++i) src->blk_id[i] = p->header[1 + 2*i];
+}
+
+//NOTE: slots must have config->window_size entries with their header and chksm set
+bool _xmodem_tx_windowed(int fd, struct xmodem_config *config, struct xmodem_rtt *rtt, struct xmodem_packet *slots, unsigned char *staging, unsigned char *data, size_t data_len, unsigned char *blk_id, unsigned char *ack_id) {
+  //blocks are counted from 0 within this call: base is the oldest block that
+  //hasn't been acknowledged, sent is the next block to write out and built is
+  //the next block to encode. Blocks between base and built are kept in the
+  //slots so going back to resend them doesn't need to rebuild them
+  //NOTE: the first long_count blocks are full 1K packets, falling back to
+  //regular packets cuts long_count back to base and builds the rest again
+  size_t long_count = data == NULL || config->long_data_bytes == 0 ? 0 : data_len / config->long_data_bytes;
+  size_t long_len = long_count * config->long_data_bytes;
+  //NOTE: NULL data looks up data_len blocks like _xmodem_tx does, the lookup
+  //handler can end them early
+  size_t count = data == NULL ? (data_len == 0 ? 1 : data_len) : long_count + (data_len - long_len + config->data_bytes - 1) / config->data_bytes;
+  size_t base = 0;
+  size_t sent = 0;
+  size_t built = 0;
+  unsigned long base_id = _xmodem_low_id(config, blk_id);
+  unsigned long id_mask = config->id_bytes < sizeof(unsigned long) ? (1UL << (8*config->id_bytes)) - 1 : ~0UL;
+  unsigned char errors = 0;
+  //one block at a time is timed from being sent to being acknowledged, timed
+  //is count while no block is being timed. Blocks sent again after a NAK are
+  //timed too as the NAK's id says the first copy never made it
+  size_t timed = count;
+  long long timed_at = 0;
+  bool after_nak = false;
+  //looked up blocks all share the staging block, staged is the block that is
+  //in it so any other has to be looked up again before it is resent
+  size_t staged = 0;
+
+  //flush the incoming stream before starting
+  tcflush(fd, TCIFLUSH);
+
+  while(base < count) {
+    if(sent < count && sent - base < config->window_size) {
+      struct xmodem_packet *p = &slots[sent % config->window_size];
+      bool first_send = sent == built;
+      if(first_send) {
+        p->data_bytes = built < long_count ? config->long_data_bytes : config->data_bytes;
+        size_t offset = built < long_count ? built*config->long_data_bytes : long_len + (built - long_count)*config->data_bytes;
+        unsigned char *block = data == NULL ? NULL : data + offset;
+        size_t block_len = data == NULL ? config->data_bytes : data_len - offset;
+        if(block_len > p->data_bytes) block_len = p->data_bytes;
+
+        if(block == NULL || block_len != p->data_bytes) {
+          p->data = staging;
+          memset(p->data, SUB, p->data_bytes); //set all bytes to the padding byte
+        }
+        size_t filled = _xmodem_build_packet(config, p, blk_id, block, block_len);
+        if(filled != 0) {
+          if(p->data == staging) staged = built;
+          increment_id(blk_id, config->id_bytes);
+          ++built;
+        }
+        if(filled < block_len) {
+          //a looked up block that is short or missing ends the data
+          if(timed == count) timed = built;
+          count = built;
+          if(filled == 0) continue;
+        }
+      } else if(data == NULL && p->data == staging && staged != sent) {
+        //ack_id is only read straight after _xmodem_rx_window_signal so it can
+        //hold the id while the block is looked up again
+        for(size_t i = 0; i < config->id_bytes; ++i) ack_id[i] = p->header[1 + 2*i];
+        _xmodem_build_packet(config, p, ack_id, NULL, config->data_bytes);
+        staged = sent;
+      }
+
+      if(!first_send) {
+        STATS_ADD(config, resends, 1);
+        TRACE(config, RESEND, p->header[0], errors, p->header + 1, 2);
+      }
+      if(!_xmodem_write_packet(fd, config, p)) return false;
+      if(timed == count && (first_send || after_nak)) {
+        timed = sent;
+        timed_at = _xmodem_deadline(0);
+      }
+      ++sent;
+
+      //keep filling the window until the receiver has something to say
+      int available = 0;
+      if(ioctl(fd, FIONREAD, &available) == 0 && available == 0) continue;
+    }
 
-    _xmodem_build_packet(config, p, blk_id, data_ptr, data_end - data_ptr);
-    if(!_xmodem_send_packet(fd, config, p)) return false;
+    unsigned char response = _xmodem_rx_window_signal(fd, config, rtt, ack_id);
+    if(response == ACK || response == NAK) {
+      //everything up to and including ack_id has been committed
+      unsigned long acked = (_xmodem_low_id(config, ack_id) - base_id + 1) & id_mask;
+      if(acked <= sent - base) {
+#ifdef XMODEM_STATS
+        if(config->stats) {
+          config->stats->blocks_sent += acked;
+          //a block stays in its slot until it has been committed
+          for(size_t i = base; i < base + acked; ++i) config->stats->payload_bytes += slots[i % config->window_size].data_len;
+        }
+#endif
+        base += acked;
+        base_id += acked;
+        if(acked != 0) errors = 0;
+      }
+      if(timed < base) {
+        _xmodem_rtt_sample(rtt, _xmodem_deadline(0) - timed_at);
+        timed = count;
+      }
+      if(response == ACK) continue;
+    } else if(response == CAN) {
+      if(_xmodem_rx_signal(fd, config, rtt->rto) == CAN) return false;
+    } else {
+      _xmodem_rtt_backoff(rtt);
+    }
+
+    //go back and resend everything after the last committed block
+    debug_print("\nResending from block %zu", base);
+    sent = base;
+    after_nak = response == NAK;
+    //the timed block is going to be sent again
+    if(timed != count && timed >= base) timed = count;
+    if(++errors > RETRY_LIMIT) return false;
+
+    //a line that keeps corrupting 1K packets is better off with smaller ones,
+    //errors only counts the times base has been sent again
+    if(errors >= XMODEM_1K_FALLBACK_RESENDS && base < long_count) {
+      debug_print("\nFalling back to %zu byte packets", config->data_bytes);
+      //the next block id to build is the one base went out with
+      struct xmodem_packet *p = &slots[base % config->window_size];
+      for(size_t i = 0; i < config->id_bytes; ++i) blk_id[i] = p->header[1 + 2*i];
+      long_count = base;
+      long_len = long_count * config->long_data_bytes;
+      count = long_count + (data_len - long_len + config->data_bytes - 1) / config->data_bytes;
+      timed = count;
+      built = base;
+    }
   }
 
   return true;
 }
 
-bool _xmodem_close_tx(int fd) {
+bool _xmodem_close_tx(int fd, struct xmodem_config *config, struct xmodem_rtt *rtt, bool windowed, unsigned char *ack_id) {
   unsigned char error_responses = 0;
+  //the receiver NAKs the first EOT, a windowed ACK that comes back before
+  //anything else is a repeated ACK of the last block that was still on its way
+  bool answered = !windowed;
   while(error_responses < RETRY_LIMIT) {
-    unsigned char response = _xmodem_tx_signal(fd, EOT);
-    if(response == ACK) return true;
+    unsigned char response;
+    unsigned char b = EOT;
+    struct iovec iov = { &b, 1 };
+    if(!_xmodem_writev_all(fd, &iov, 1)) return false;
+    TRACE(config, TX_SIGNAL, EOT, error_responses, NULL, 0);
+    if(windowed) {
+      //a windowed receiver follows every ACK/NAK with a block id, read it off
+      //the line so its bytes are not mistaken for a response
+      response = _xmodem_rx_window_signal(fd, config, rtt, ack_id);
+    } else {
+      //the receiver NAKs the first EOT and repeats its NAK if ours got lost
+      response = _xmodem_rx_signal(fd, config, config->max_timeout_ms);
+    }
+    if(response == ACK) {
+      if(answered) return true;
+      continue;
+    }
+    answered = true;
     if(response == NAK) continue;
     if(response == CAN) {
-      if(_xmodem_rx_signal(fd) == CAN) break;
+      if(_xmodem_rx_signal(fd, config, rtt->rto) == CAN) break;
     } else ++error_responses;
   }
   return false;
 }
 
-void _xmodem_build_packet(struct xmodem_config *config, struct xmodem_packet *p, unsigned char *id, unsigned char *data, size_t data_len) {
+//returns the number of data bytes in the packet, a short looked up block is
+//padded and 0 means block_lookup_len had nothing left
+size_t _xmodem_build_packet(struct xmodem_config *config, struct xmodem_packet *p, unsigned char *id, unsigned char *data, size_t data_len) {
   debug_print("\nBuilding packet for block ");
   for(size_t i = 0; i < config->id_bytes; ++i) debug_print_byte(id[i]);
   debug_print("\n");
 
-  memcpy(p->id, id, config->id_bytes);
-  if(data == NULL) config->block_lookup(id, config->id_bytes, p->data, data_len);
-  else memcpy(p->data, data, data_len);
-  config->calc_chksum(p->data, config->data_bytes, p->chksm);
+  //encode the header once so that resends only have to write it out again
+  size_t h_pos = 0;
+  p->header[h_pos++] = p->data_bytes == config->data_bytes ? SOH : STX;
+  for(size_t i = 0; i < config->id_bytes; ++i) {
+    p->header[h_pos++] = id[i];
+    p->header[h_pos++] = ~id[i];
+  }
+
+  if(data == NULL) {
+    STATS_ENTER(config, handler_us, prev_phase);
+    //the send path never writes to the packet data so it is safe to cast away
+    //the const of data that the lookup handler already has in memory
+    const unsigned char *found = config->block_lookup_ptr ? config->block_lookup_ptr(id, config->id_bytes, data_len) : NULL;
+    if(found) {
+      p->data = (unsigned char *) found;
+    } else if(config->block_lookup_len) {
+      size_t filled = config->block_lookup_len(id, config->id_bytes, p->data, data_len);
+      if(filled < data_len) {
+        //pad a short block the same way as the end of regular data
+        memset(p->data + filled, SUB, p->data_bytes - filled);
+        data_len = filled;
+      }
+    } else {
+      config->block_lookup(id, config->id_bytes, p->data, data_len);
+    }
+    STATS_LEAVE(config, prev_phase);
+  } else if(data_len == p->data_bytes) {
+    p->data = data;
+  } else {
+    memcpy(p->data, data, data_len);
+  }
+
+  _xmodem_chksm_block(config, p->data, p->data_bytes, p->chksm);
+#ifdef XMODEM_STATS
+  p->data_len = data_len;
+#endif
+  return data_len;
 }
 
-bool _xmodem_send_packet(int fd, struct xmodem_config *config, struct xmodem_packet *p) {
-  static unsigned char start_byte = SOH;
+//turns a packet from _xmodem_build_packet into the compressed form, the data
+//is the coded length with each byte followed by its complement and then the
+//coded block. A block that doesn't get any shorter is sent as it is (stored)
+//and keeps its checksum, the checksum never covers the length
+//NOTE: the coded data block follows the checksum block of the slot
+void _xmodem_code_packet(struct xmodem_config *config, struct xmodem_packet *p) {
+  unsigned char *coded = p->chksm + config->chksm_bytes;
+  size_t len = xmodem_lzss_encode(p->data, p->data_bytes, coded + 4, p->data_bytes - 1);
+  if(len != 0) {
+    _xmodem_chksm_block(config, coded + 4, len, p->chksm);
+  } else {
+    len = p->data_bytes;
+    memcpy(coded + 4, p->data, len);
+  }
+  debug_print("\nCoded %zu bytes into %zu", p->data_bytes, len);
+
+  coded[0] = len >> 8;
+  coded[1] = ~coded[0];
+  coded[2] = len & 0xFF;
+  coded[3] = ~coded[2];
+  p->data = coded;
+  p->data_bytes = 4 + len;
+}
 
-  debug_print("Packet:\n");
-  debug_print_byte(start_byte);
-  for(size_t i = 0; i < config->id_bytes; ++i) {
-    debug_print_byte(p->id[i]);
-    debug_print_byte(~p->id[i]);
+//write out every byte described by iov, retrying on partial writes
+bool _xmodem_writev_all(int fd, struct iovec *iov, int iovcnt) {
+  while(iovcnt > 0) {
+    ssize_t w = writev(fd, iov, iovcnt);
+    if(w < 0) {
+      if(errno == EINTR) continue;
+      return false;
+    }
+    while(iovcnt > 0 && (size_t) w >= iov->iov_len) {
+      w -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if(iovcnt > 0) {
+      iov->iov_base = (unsigned char *) iov->iov_base + w;
+      iov->iov_len -= w;
+    }
   }
-  for(size_t i = 0; i < config->data_bytes; ++i) debug_print_byte(p->data[i]);
+  return true;
+}
+
+//NOTE: a failed write (EIO, a closed port) won't get any better with retries so
+//the callers give up on the transfer straight away
+bool _xmodem_write_packet(int fd, struct xmodem_config *config, struct xmodem_packet *p) {
+  //the whole frame goes out in a single system call so it isn't split up into
+  //lots of tiny transfers by USB serial adapters
+  struct iovec iov[3] = {
+    { p->header, 1 + 2*config->id_bytes },
+    { p->data, p->data_bytes },
+    { p->chksm, config->chksm_bytes }
+  };
+  STATS_ENTER(config, wire_us, prev_phase);
+  bool result = _xmodem_writev_all(fd, iov, 3);
+  STATS_LEAVE(config, prev_phase);
+  STATS_ADD(config, wire_bytes, 1 + 2*config->id_bytes + p->data_bytes + config->chksm_bytes);
+  TRACE(config, TX_FRAME, p->header[0], p->data_bytes, p->header + 1, 2);
+  return result;
+}
+
+//NOTE: resends is set to the number of times the packet had to be resent
+bool _xmodem_send_packet(int fd, struct xmodem_config *config, struct xmodem_rtt *rtt, struct xmodem_packet *p, unsigned char *resends) {
+  size_t header_bytes = 1 + 2*config->id_bytes;
+
+  debug_print("Packet:\n");
+  for(size_t i = 0; i < header_bytes; ++i) debug_print_byte(p->header[i]);
+  for(size_t i = 0; i < p->data_bytes; ++i) debug_print_byte(p->data[i]);
   for(size_t i = 0; i < config->chksm_bytes; ++i) debug_print_byte(p->chksm[i]);
 
-  char tries = 0;
-  do {
-    debug_print("\nSending packet: ");
-    --tries;
-    //Sending packet
-    write(fd, &start_byte, 1);
-    for(size_t i = 0; i < config->id_bytes; ++i) {
-      unsigned char compl = ~p->id[i];
-      write(fd, p->id+i, 1);
-      write(fd, &compl, 1);
-    }
-    write(fd, p->data, config->data_bytes);
-    write(fd, p->chksm, config->chksm_bytes);
-    debug_print("Done ");
+  debug_print("\nSending packet: ");
+  if(!_xmodem_write_packet(fd, config, p)) return false;
+  debug_print("Done ");
+  return _xmodem_await_ack(fd, config, rtt, p, resends);
+}
 
+//waits for the ACK of a packet that has been written once, resending it when
+//the receiver asks for it
+bool _xmodem_await_ack(int fd, struct xmodem_config *config, struct xmodem_rtt *rtt, struct xmodem_packet *p, unsigned char *resends) {
+  unsigned char tries = 0;
+  while(true) {
     //Waiting for response
-    unsigned char response = _xmodem_rx_signal(fd);
-    if(response == ACK) return true;
-    if(response == NAK) continue;
-    if(response == CAN) {
-      if(_xmodem_rx_signal(fd) == CAN) break;
+    //without block ids in the signals a resend that crosses with the
+    //receiver's NAK gets answered twice and the spare ACK would be taken as
+    //the answer to the next packet, so the receiver's timeouts are the ones
+    //that recover from lost packets and signals and we only give up waiting
+    //after the longest timeout
+    unsigned char response = _xmodem_rx_signal(fd, config, config->max_timeout_ms);
+    if(response == ACK) {
+      *resends = tries;
+      STATS_ADD(config, blocks_sent, 1);
+      STATS_ADD(config, payload_bytes, p->data_len);
+      return true;
     }
-  } while(tries < RETRY_LIMIT);
+    if(response == CAN && _xmodem_rx_signal(fd, config, rtt->rto) == CAN) return false;
+    if(tries++ >= RETRY_LIMIT) return false;
+    STATS_ADD(config, resends, 1);
+    TRACE(config, RESEND, p->header[0], tries, p->header + 1, 2);
 
-  return false;
+    debug_print("\nSending packet: ");
+    if(!_xmodem_write_packet(fd, config, p)) return false;
+    debug_print("Done ");
+  }
 }
 
-unsigned char _xmodem_tx_signal(int fd, unsigned char signal) {
-  if(signal == NAK) {
-    //make sure the line is clear
-    //TODO: better approach?
-    sleep(1);
-    tcflush(fd, TCIFLUSH);
-  }
+unsigned char _xmodem_tx_signal(int fd, struct xmodem_config *config, struct xmodem_rtt *rtt, unsigned char signal) {
+  return _xmodem_tx_signal_frame(fd, config, rtt, &signal, 1);
+}
 
-  debug_print_byte(signal);
+//NOTE: signal is the signal byte optionally followed by extra bytes (eg. the
+//id of a windowed ACK/NAK) that are written out together with it
+unsigned char _xmodem_tx_signal_frame(int fd, struct xmodem_config *config, struct xmodem_rtt *rtt, unsigned char *signal, size_t signal_len) {
+  STATS_ENTER(config, ack_wait_us, prev_phase);
+  //make sure the line is clear
+  if(signal[0] == NAK) _xmodem_clear_line(fd);
+
+  debug_print_byte(signal[0]);
   debug_print("->");
   unsigned char i = 0;
   unsigned char b;
+  unsigned char nak = NAK;
   do {
-    unsigned char x = 0;
-    write(fd, &signal, 1);
-    while(read(fd, &b, 1) != 1 && ++x < RETRY_LIMIT) usleep(SIGNAL_RETRY_DELAY_MICRO_SEC);
-
-    debug_print_byte(b);
-    switch(b) {
-      case SOH:
-      case EOT:
-      case CAN:
-      case ACK:
-      case NAK:
-        return b;
+    write(fd, signal, signal_len);
+    if(signal[0] == NAK) STATS_ADD(config, naks, 1);
+    TRACE(config, TX_SIGNAL, signal[0], i, signal_len > 1 ? signal + 1 : NULL, 2);
+    long long sent_at = _xmodem_deadline(0);
+    long long deadline = _xmodem_deadline(rtt->rto);
+    bool quiet = true;
+    while(_xmodem_read_until(fd, &b, 1, deadline) == 1) {
+      debug_print_byte(b);
+      switch(b) {
+        case SOH:
+        case STX:
+        case EOT:
+        case CAN:
+        case ACK:
+        case NAK:
+          //the packets of a windowed transfer are already on their way when
+          //an ACK goes out, the line is cleared before a NAK so the first
+          //packet after it is the sender going back
+          if(i == 0 && (signal_len == 1 || signal[0] == NAK)) _xmodem_rtt_sample(rtt, _xmodem_deadline(0) - sent_at);
+          if(b == CAN) STATS_ADD(config, cans, 1);
+          if(b == NAK) STATS_ADD(config, naks, 1);
+          if(b != SOH && b != STX) TRACE(config, RX_SIGNAL, b, 0, NULL, 0);
+          STATS_LEAVE(config, prev_phase);
+          return b;
+      }
+      //windowed signals carry the block id so they can be repeated straight
+      //away, other bytes after a regular signal are the rest of a packet whose
+      //header got lost so they are left to run out until the timeout
+      if(signal_len != 1) {
+        quiet = false;
+        break;
+      }
     }
+    if(!quiet) continue;
+
+    STATS_ADD(config, timeouts, 1);
+    TRACE(config, TIMEOUT, signal[0], rtt->rto, NULL, 0);
+    _xmodem_rtt_backoff(rtt);
+    //a repeated ACK would be taken as the answer to the next packet when only
+    //its header got lost, a NAK gets either that packet or the one we ACKed
+    //sent again
+    if(signal_len == 1 && signal[0] == ACK) signal = &nak;
   } while(++i < RETRY_LIMIT);
+  STATS_LEAVE(config, prev_phase);
   return 255;
 }
 
-unsigned char _xmodem_rx_signal(int fd) {
-  unsigned char i = 0;
+unsigned char _xmodem_rx_signal(int fd, struct xmodem_config *config, long timeout_ms) {
   unsigned char b;
-  while(read(fd, &b, 1) != 1 && ++i < RETRY_LIMIT) usleep(SIGNAL_RETRY_DELAY_MICRO_SEC);
+  STATS_ENTER(config, ack_wait_us, prev_phase);
+  bool read = _xmodem_read_until(fd, &b, 1, _xmodem_deadline(timeout_ms)) == 1;
+  STATS_LEAVE(config, prev_phase);
+  if(!read) {
+    STATS_ADD(config, timeouts, 1);
+    TRACE(config, TIMEOUT, 'S', timeout_ms, NULL, 0);
+    return 255;
+  }
 
   debug_print_byte(b);
   switch(b) {
-    case ACK:
     case NAK:
+      STATS_ADD(config, naks, 1);
+      TRACE(config, RX_SIGNAL, b, 0, NULL, 0);
+      return b;
     case CAN:
+      STATS_ADD(config, cans, 1);
+      TRACE(config, RX_SIGNAL, b, 0, NULL, 0);
+      return b;
+    case ACK:
+      TRACE(config, RX_SIGNAL, b, 0, NULL, 0);
       return b;
   }
   return 255;
 }
 
+unsigned char _xmodem_rx_window_signal(int fd, struct xmodem_config *config, struct xmodem_rtt *rtt, unsigned char *id) {
+  //like _xmodem_await_ack the receiver's timeouts are the ones that recover
+  //from lost packets and signals, it NAKs a missing block and repeats its
+  //ACKs. Going back on a timeout of our own would send every lost window twice
+  //so we only give up waiting after the longest timeout
+  unsigned char val = _xmodem_rx_signal(fd, config, config->max_timeout_ms);
+  if(val != ACK && val != NAK) return val;
+
+  //the id bytes follow straight after the signal so the read timeout is
+  //enough to wait for them
+  unsigned char tmp;
+  for(size_t i = 0; i < config->id_bytes; ++i) {
+    if(_xmodem_read_until(fd, id + i, 1, _xmodem_deadline(XMODEM_READ_TIMEOUT_MS)) != 1) return 255;
+    if(_xmodem_read_until(fd, &tmp, 1, _xmodem_deadline(XMODEM_READ_TIMEOUT_MS)) != 1) return 255;
+    if(id[i] != (unsigned char) ~tmp) return 255;
+  }
+  return val;
+}
+
+void _xmodem_encode_window_signal(struct xmodem_config *config, unsigned char *signal, unsigned char type, unsigned char *id) {
+  size_t pos = 0;
+  signal[pos++] = type;
+  for(size_t i = 0; i < config->id_bytes; ++i) {
+    signal[pos++] = id[i];
+    signal[pos++] = ~id[i];
+  }
+}
+
+//the least significant bytes of a big endian id, enough to tell blocks in a
+//window apart
+unsigned long _xmodem_low_id(struct xmodem_config *config, unsigned char *id) {
+  unsigned long val = 0;
+  size_t i = config->id_bytes > sizeof(unsigned long) ? config->id_bytes - sizeof(unsigned long) : 0;
+  for(; i < config->id_bytes; ++i) val = (val << 8) | id[i];
+  return val;
+}
+
+bool _xmodem_session_start(struct xmodem_session *session, int fd, struct xmodem_config *config, int state) {
+  //reads and writes must never block so that one stalled port doesn't hold
+  //up the others
+  session->fd_flags = fcntl(fd, F_GETFL);
+  if(session->fd_flags < 0 || fcntl(fd, F_SETFL, session->fd_flags | O_NONBLOCK) != 0) {
+    free(session->buffer);
+    session->buffer = NULL;
+    return false;
+  }
+  session->fd = fd;
+  session->config = config;
+  session->state = state;
+  session->status = XMODEM_IN_PROGRESS;
+  session->signal_len = 0;
+  session->count = 0;
+  session->tries = 0;
+  session->can = false;
+  session->next = NULL;
+  _xmodem_rtt_init(&session->rtt, config);
+  return true;
+}
+
+enum xmodem_status _xmodem_session_finish(struct xmodem_session *session, bool result) {
+  //the cancels are sent with the fd back in its original mode so they aren't
+  //dropped when the output is busy
+  fcntl(session->fd, F_SETFL, session->fd_flags);
+  if(!result) {
+    //an unrecoverable error occured send cancels to terminate the transcation
+    debug_print("\nError Cancelling transfer");
+    unsigned char b[3] = { CAN, CAN, CAN };
+    write(session->fd, b, 3);
+  }
+  free(session->buffer);
+  session->buffer = NULL;
+  session->state = SESSION_IDLE;
+  session->status = result ? XMODEM_COMPLETE : XMODEM_FAILED;
+  return session->status;
+}
+
+//returns the number of bytes read, 0 when there is nothing to read and -1 on an error
+ssize_t _xmodem_session_read(struct xmodem_session *session, unsigned char *buf, size_t len) {
+  ssize_t r = read(session->fd, buf, len);
+  if(r < 0 && (errno == EAGAIN || errno == EINTR)) return 0;
+  return r;
+}
+
+void _xmodem_session_signal(struct xmodem_session *session, unsigned char signal) {
+  debug_print_byte(signal);
+  if(session->signal_len < sizeof(session->signal)) session->signal[session->signal_len++] = signal;
+  _xmodem_session_flush(session);
+}
+
+//writes out as much of the waiting output as the fd takes without blocking,
+//returns 1 when it has all been written, 0 if some is left and -1 on an error
+int _xmodem_session_flush(struct xmodem_session *session) {
+  while(session->signal_len != 0) {
+    ssize_t w = write(session->fd, session->signal, session->signal_len);
+    if(w < 0) return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    session->signal_len -= w;
+    memmove(session->signal, session->signal + w, session->signal_len);
+  }
+  if(session->state != SESSION_TX_PACKET) return 1;
+
+  struct xmodem_config *config = session->config;
+  struct xmodem_packet *p = (struct xmodem_packet *) session->buffer;
+  struct iovec iov[3] = {
+    { p->header, 1 + 2*config->id_bytes },
+    { p->data, p->data_bytes },
+    { p->chksm, config->chksm_bytes }
+  };
+  size_t frame_bytes = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+  while(session->count < frame_bytes) {
+    //skip the part of the packet that has already been written
+    size_t skip = session->count;
+    int first = 0;
+    while(skip >= iov[first].iov_len) skip -= iov[first++].iov_len;
+    struct iovec rest[3];
+    for(int i = first; i < 3; ++i) rest[i - first] = iov[i];
+    rest[0].iov_base = (unsigned char *) rest[0].iov_base + skip;
+    rest[0].iov_len -= skip;
+
+    ssize_t w = writev(session->fd, rest, 3 - first);
+    if(w < 0) return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    session->count += w;
+  }
+
+  session->can = false;
+  session->state = SESSION_TX_RESPONSE;
+  //the receiver recovers lost packets and signals, see _xmodem_send_packet
+  session->deadline = _xmodem_deadline(config->max_timeout_ms);
+  return 1;
+}
+
+enum xmodem_status _xmodem_session_poll_rx(struct xmodem_session *session) {
+  struct xmodem_config *config = session->config;
+  struct xmodem_packet *p = (struct xmodem_packet *) session->buffer;
+  unsigned char *frame = session->buffer + sizeof(struct xmodem_packet);
+  ssize_t r;
+
+  while(true) {
+    if(session->state == SESSION_RX_PACKET) {
+      size_t data_start = 2*config->id_bytes;
+      size_t data_end = data_start + p->data_bytes;
+      size_t frame_bytes = data_end + config->chksm_bytes;
+
+      r = _xmodem_session_read(session, frame + session->count, frame_bytes - session->count);
+      if(r <= 0) break;
+
+      //checksum the data as it arrives the same way _xmodem_read_block does
+      size_t start = session->count > data_start ? session->count : data_start;
+      session->count += r;
+      size_t end = session->count < data_end ? session->count : data_end;
+      if(_xmodem_chksm_incremental(config) && start < end) config->chksm_update(frame + start, end - start, p->chksm);
+
+      //a slow sender is fine as long as the packet keeps arriving
+      session->deadline = _xmodem_deadline(XMODEM_READ_TIMEOUT_MS);
+      if(session->count == frame_bytes && !_xmodem_session_rx_block(session)) return _xmodem_session_finish(session, false);
+      continue;
+    }
+
+    unsigned char b;
+    if((r = _xmodem_session_read(session, &b, 1)) <= 0) break;
+#ifdef XMODEM_RESPONSE_DEBUG
+    debug_print_byte(b);
+#endif
+    bool can = session->can;
+    session->can = false;
+    if(session->state == SESSION_RX_PURGE) {
+      //wait for the line to be clear before sending the NAK
+      session->deadline = _xmodem_deadline(LINE_CLEAR_MILLI_SEC);
+    } else if(is_header(config, b)) {
+      if(session->state == SESSION_RX_HEADER && session->tries == 0) _xmodem_rtt_sample(&session->rtt, _xmodem_deadline(0) - session->sent);
+      p->data_bytes = b == STX ? config->long_data_bytes : config->data_bytes;
+      if(_xmodem_chksm_incremental(config)) config->chksm_init(p->chksm);
+      session->count = 0;
+      session->state = SESSION_RX_PACKET;
+      session->deadline = _xmodem_deadline(XMODEM_READ_TIMEOUT_MS);
+    } else if(b == EOT) {
+      if(session->state == SESSION_RX_EOT) {
+        _xmodem_session_signal(session, ACK);
+        return _xmodem_session_finish(session, _xmodem_session_flush(session) == 1);
+      }
+      //make sure the EOT wasn't a corrupted byte by asking for it again
+      _xmodem_session_signal(session, NAK);
+      session->state = SESSION_RX_EOT;
+      session->deadline = _xmodem_deadline(session->rtt.rto);
+    } else if(b == CAN && session->state != SESSION_RX_INIT) {
+      //a lone CAN can be a data byte of a packet whose header got lost
+      if(can) return _xmodem_session_finish(session, false);
+      session->can = true;
+    }
+  }
+  if(r < 0) return _xmodem_session_finish(session, false);
+
+  if(_xmodem_deadline(0) < session->deadline) return XMODEM_IN_PROGRESS;
+  switch(session->state) {
+    case SESSION_RX_INIT:
+      if(++session->tries > RETRY_LIMIT) return _xmodem_session_finish(session, false);
+      _xmodem_session_signal(session, config->rx_init_byte);
+      session->deadline = _xmodem_deadline(config->max_timeout_ms);
+      break;
+    case SESSION_RX_PACKET:
+      //the rest of the packet never arrived
+      if(!_xmodem_session_rx_error(session)) return _xmodem_session_finish(session, false);
+      break;
+    case SESSION_RX_PURGE:
+      _xmodem_session_signal(session, NAK);
+      session->state = SESSION_RX_HEADER;
+      session->sent = _xmodem_deadline(0);
+      session->deadline = session->sent + session->rtt.rto;
+      break;
+    case SESSION_RX_HEADER:
+      if(++session->tries > RETRY_LIMIT) return _xmodem_session_finish(session, false);
+      _xmodem_rtt_backoff(&session->rtt);
+      //a NAK is safe whether the ACK or the next packet got lost, see _xmodem_tx_signal_frame
+      _xmodem_session_signal(session, NAK);
+      session->deadline = _xmodem_deadline(session->rtt.rto);
+      break;
+    case SESSION_RX_EOT:
+      if(++session->tries > RETRY_LIMIT) return _xmodem_session_finish(session, false);
+      _xmodem_rtt_backoff(&session->rtt);
+      _xmodem_session_signal(session, NAK);
+      session->deadline = _xmodem_deadline(session->rtt.rto);
+      break;
+  }
+  return XMODEM_IN_PROGRESS;
+}
+
+//returns false when the transfer has to be cancelled
+bool _xmodem_session_rx_block(struct xmodem_session *session) {
+  struct xmodem_config *config = session->config;
+  struct xmodem_packet *p = (struct xmodem_packet *) session->buffer;
+  unsigned char *prev_blk_id = p->id - 2*config->id_bytes;
+  unsigned char *expected_id = p->id - config->id_bytes;
+
+  if(!_xmodem_check_block(config, p, session->buffer + sizeof(struct xmodem_packet))) return _xmodem_session_rx_error(session);
+
+  //ignore resends of the last received block
+  size_t matches = 0;
+  for(size_t i = 0; i < config->id_bytes; ++i) {
+    if(prev_blk_id[i] == p->id[i]) ++matches;
+  }
+
+  //if its a duplicate block we still need to send an ACK
+  if(matches != config->id_bytes) {
+#if defined(XMODEM_ALLOW_NONSEQUENTIAL)
+    for(size_t i = 0; i < config->id_bytes; ++i) expected_id[i] = p->id[i];
+#else
+    increment_id(expected_id, config->id_bytes);
+
+    matches = 0;
+    for(size_t i = 0; i < config->id_bytes; ++i) {
+      if(expected_id[i] == p->id[i]) ++matches;
+    }
+    if(matches != config->id_bytes) return false;
+#endif
+
+    //count number of padding SUB bytes
+    size_t data_len = p->data_bytes;
+    while(data_len > 0 && p->data[data_len - 1] == SUB) --data_len;
+
+    //process packet
+    bool accepted = session->rx_block_handler != NULL
+      ? session->rx_block_handler(session, p->id, config->id_bytes, p->data, data_len)
+      : config->rx_block_handler(p->id, config->id_bytes, p->data, data_len);
+    if(!accepted) return false;
+
+    for(size_t i = 0; i < config->id_bytes; ++i) prev_blk_id[i] = expected_id[i];
+  }
+
+  //signal acknowledgement
+  session->tries = 0;
+  _xmodem_session_signal(session, ACK);
+  session->state = SESSION_RX_HEADER;
+  session->sent = _xmodem_deadline(0);
+  session->deadline = session->sent + session->rtt.rto;
+  return true;
+}
+
+bool _xmodem_session_rx_error(struct xmodem_session *session) {
+  if(++session->tries > RETRY_LIMIT) return false;
+  session->state = SESSION_RX_PURGE;
+  session->deadline = _xmodem_deadline(LINE_CLEAR_MILLI_SEC);
+  return true;
+}
+
+enum xmodem_status _xmodem_session_poll_tx(struct xmodem_session *session) {
+  struct xmodem_config *config = session->config;
+  struct xmodem_packet *p = (struct xmodem_packet *) session->buffer;
+  ssize_t r;
+
+  //the response can't arrive before the whole packet has gone out
+  if(session->state == SESSION_TX_PACKET) return XMODEM_IN_PROGRESS;
+
+  unsigned char b;
+  while((r = _xmodem_session_read(session, &b, 1)) > 0) {
+#ifdef XMODEM_RESPONSE_DEBUG
+    debug_print_byte(b);
+#endif
+    if(session->state == SESSION_TX_INIT) {
+      if(b != config->rx_init_byte) continue;
+
+      //flush the incoming stream before starting
+      tcflush(session->fd, TCIFLUSH);
+      _xmodem_session_tx_block(session);
+      return _xmodem_session_flush(session) < 0 ? _xmodem_session_finish(session, false) : XMODEM_IN_PROGRESS;
+    }
+
+    if(b == CAN) {
+      if(session->can) return _xmodem_session_finish(session, false);
+      session->can = true;
+      continue;
+    }
+    session->can = false;
+
+    if(b == ACK) {
+      if(session->state == SESSION_TX_EOT) return _xmodem_session_finish(session, true);
+
+      //a line that keeps corrupting 1K packets is better off with smaller ones
+      if(p->data_bytes != config->data_bytes && session->tries >= XMODEM_1K_FALLBACK_RESENDS) session->long_packets = false;
+
+      size_t block_len = p->data_bytes < session->data_len ? p->data_bytes : session->data_len;
+      if(session->data != NULL) session->data += block_len;
+      session->data_len -= block_len;
+      increment_id(session->buffer + sizeof(struct xmodem_packet) + config->data_bytes, config->id_bytes);
+      _xmodem_session_tx_block(session);
+      return _xmodem_session_flush(session) < 0 ? _xmodem_session_finish(session, false) : XMODEM_IN_PROGRESS;
+    }
+    if(b == NAK) {
+      if(!_xmodem_session_tx_resend(session)) return _xmodem_session_finish(session, false);
+      return _xmodem_session_flush(session) < 0 ? _xmodem_session_finish(session, false) : XMODEM_IN_PROGRESS;
+    }
+  }
+  if(r < 0) return _xmodem_session_finish(session, false);
+
+  if(_xmodem_deadline(0) < session->deadline) return XMODEM_IN_PROGRESS;
+  if(session->state == SESSION_TX_INIT) {
+    if(++session->tries > RETRY_LIMIT) return _xmodem_session_finish(session, false);
+    session->deadline = _xmodem_deadline(6*config->max_timeout_ms);
+    return XMODEM_IN_PROGRESS;
+  }
+  if(!_xmodem_session_tx_resend(session) || _xmodem_session_flush(session) < 0) return _xmodem_session_finish(session, false);
+  return XMODEM_IN_PROGRESS;
+}
+
+//builds the next packet or starts closing the transfer when there is no data left
+void _xmodem_session_tx_block(struct xmodem_session *session) {
+  struct xmodem_config *config = session->config;
+  struct xmodem_packet *p = (struct xmodem_packet *) session->buffer;
+  unsigned char *staging = session->buffer + sizeof(struct xmodem_packet);
+  unsigned char *blk_id = staging + config->data_bytes;
+  session->tries = 0;
+
+  if(session->data_len == 0) {
+    debug_print("\nClosing xmodem transfer:");
+    _xmodem_session_signal(session, EOT);
+    session->state = SESSION_TX_EOT;
+    session->deadline = _xmodem_deadline(config->max_timeout_ms);
+    return;
+  }
+
+  p->data = staging;
+  if(session->data == NULL) {
+    //need to use block_lookup to fill in the packet data
+    p->data_bytes = config->data_bytes;
+    _xmodem_build_packet(config, p, blk_id, NULL, config->data_bytes);
+  } else {
+    //1K packets are only used for full blocks like _xmodem_tx does
+    bool long_packet = session->long_packets && session->data_len >= config->long_data_bytes;
+    p->data_bytes = long_packet ? config->long_data_bytes : config->data_bytes;
+
+    size_t block_len = session->data_len < p->data_bytes ? session->data_len : p->data_bytes;
+    if(block_len != p->data_bytes) memset(p->data, SUB, p->data_bytes);
+    _xmodem_build_packet(config, p, blk_id, session->data, block_len);
+  }
+
+  session->count = 0;
+  session->state = SESSION_TX_PACKET;
+}
+
+bool _xmodem_session_tx_resend(struct xmodem_session *session) {
+  if(++session->tries > RETRY_LIMIT) return false;
+  if(session->state == SESSION_TX_EOT) {
+    _xmodem_session_signal(session, EOT);
+    session->deadline = _xmodem_deadline(session->config->max_timeout_ms);
+  } else {
+    debug_print("\nResending packet");
+    session->count = 0;
+    session->state = SESSION_TX_PACKET;
+  }
+  return true;
+}
+
 #undef SOH
+#undef STX
 #undef EOT
 #undef ACK
 #undef NAK
 #undef CAN
 #undef SUB
+#undef WIN
+#undef ZIP
+#undef LZSS_MIN_MATCH
+#undef LZSS_MAX_MATCH
+#undef LZSS_WINDOW
 #undef debug_print
 #undef debug_print_byte
 #endif
@@ -9,21 +9,146 @@
 #include <stdlib.h>
 #include <time.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 enum x_mode {
   XMODEM,
-  CRC_XMODEM
+  CRC_XMODEM,
+  XMODEM_1K
 };
 
+//counters and the time spent in each phase of a blocking transfer, filled in
+//through xmodem_config.stats when built with XMODEM_STATS. Sessions are not
+//counted
+struct xmodem_stats {
+  unsigned long blocks_sent; //acknowledged by the receiver
+  unsigned long blocks_received; //new blocks that passed their checks
+  unsigned long resends; //packets written again
+  unsigned long duplicates; //packets for a block that was already received
+  unsigned long naks; //NAK signals sent or received
+  unsigned long cans; //CAN bytes received
+  unsigned long timeouts; //waits for the other side that ran out
+  unsigned long resyncs; //searches for the next packet header
+  unsigned long wire_bytes; //packet bytes written or read, resends included
+  unsigned long payload_bytes; //data bytes of the blocks counted above without padding
+  unsigned long handshake_us; //waiting for the transfer to start
+  unsigned long chksum_us; //calculating checksums
+  unsigned long wire_us; //writing and reading packets
+  unsigned long ack_wait_us; //waiting for ACK/NAK signals or the next packet
+  unsigned long handler_us; //receive, lookup and file handlers
+  unsigned long other_us; //everything else, eg. copying and coding blocks
+
+  //internal state
+  unsigned long *phase; //field of the phase being timed, NULL between transfers
+  long long mark; //CLOCK_MONOTONIC microseconds when the phase started
+  unsigned char depth; //transfers started inside another, eg. the files of xmodem_send_batch
+};
+
+//binary trace of the protocol events of blocking transfers, kept in memory
+//through xmodem_config.trace when built with XMODEM_TRACE. Unlike XMODEM_DEBUG
+//adding an event only costs a clock read and a few stores so it doesn't change
+//the timing being looked at. The ring holds the last XMODEM_TRACE_EVENTS
+//events (a power of 2), xmodem_trace_dump writes them out for trace_decode.
+//NOTE: the values are part of the dump format, XModem.h uses the same ones
+enum xmodem_trace_type {
+  XMODEM_TRACE_START = 1, //value is 'S' send, 'R' receive, 's'/'r' for a batch
+  XMODEM_TRACE_END, //value is 1 if the transfer worked
+  XMODEM_TRACE_TX_FRAME, //value is the header, aux the data bytes written
+  XMODEM_TRACE_RX_FRAME, //a new block passed its checks, aux is its data bytes
+  XMODEM_TRACE_RX_DUP, //a block that was already received
+  XMODEM_TRACE_RX_BAD, //a packet that failed its checks, value is the header
+  XMODEM_TRACE_TX_SIGNAL, //value is the signal, aux the attempt
+  XMODEM_TRACE_RX_SIGNAL, //value is the signal
+  XMODEM_TRACE_TIMEOUT, //value is 'I' init, 'H' header, 'P' packet, 'S' signal or the signal that wasn't answered, aux the wait in ms
+  XMODEM_TRACE_RESEND, //a packet is written again, aux is the attempt
+  XMODEM_TRACE_RESYNC //searching for the next packet header
+};
+
+#ifndef XMODEM_TRACE_EVENTS
+#define XMODEM_TRACE_EVENTS 1024
+#endif
+
+struct xmodem_trace_event {
+  uint32_t time_us; //CLOCK_MONOTONIC microseconds, wraps after about 71 minutes
+  uint32_t id; //the last 4 bytes of the block id, 0 when there isn't one
+  uint16_t aux;
+  uint8_t type;
+  uint8_t value;
+};
+
+struct xmodem_trace {
+  unsigned long count; //events added since xmodem_trace_clear
+  struct xmodem_trace_event events[XMODEM_TRACE_EVENTS];
+};
+
+void xmodem_trace_clear(struct xmodem_trace *trace);
+//writes the events still in the ring oldest first, see trace_decode.c
+bool xmodem_trace_dump(struct xmodem_trace *trace, int fd);
+
 struct xmodem_config {
   size_t id_bytes;
   size_t data_bytes;
+  //data bytes in a STX (1K) packet, 0 disables them. Receiving allocates room
+  //for the bigger of data_bytes and long_data_bytes
+  size_t long_data_bytes;
   size_t chksm_bytes;
   unsigned char rx_init_byte;
+  //number of packets that can be sent before waiting for an ACK, 1 (the
+  //default) is a regular XMODEM transfer. Larger windows are negotiated with
+  //the other side during the handshake and fall back to 1 if it doesn't agree
+  unsigned char window_size;
+  //ask for (or agree to) a transfer with each block compressed on its own,
+  //false by default. Compressed transfers are never windowed
+  bool compress;
+  //build the next packet of a regular send, block_lookup included, while
+  //waiting for the ACK of the one before it, false by default. See
+  //block_lookup for what that means for the lookup handlers
+  bool pipeline_sends;
+  //bounds for the ACK/NAK and retransmit timeouts. They are worked out from the
+  //round trip times measured during the transfer and start at 1 second, the
+  //handshake waits use max_timeout_ms as nothing is known about the link yet
+  long min_timeout_ms;
+  long max_timeout_ms;
+  //verified blocks that can be ACKed before rx_block_handler has been given
+  //them, 4 by default. The handler runs on a separate thread and a full queue
+  //holds back the next ACK, 0 calls it before each ACK. Only used when built
+  //with XMODEM_RECEIVE_THREAD
+  size_t rx_queue_blocks;
+  //optional statistics of the last transfer, NULL (the default) doesn't keep
+  //any. Only used when built with XMODEM_STATS
+  struct xmodem_stats *stats;
+  //optional trace of the protocol events, NULL (the default) doesn't keep any.
+  //Only used when built with XMODEM_TRACE
+  struct xmodem_trace *trace;
   //function pointer handlers
   bool (*rx_block_handler) (void *blk_id, size_t id_len, unsigned char *data, size_t data_len);
+  //blocks are looked up before they are first sent, only ahead of the block
+  //before them being ACKed with pipeline_sends (1 block) or in a windowed
+  //transfer (up to window_size blocks), which also looks a block up again when
+  //it has to be resent
   void (*block_lookup) (void *blk_id, size_t id_len, unsigned char *send_data, size_t data_len);
+  //optional zero copy form of block_lookup that returns a pointer to data that
+  //is already in memory, block_lookup is used instead when it returns NULL.
+  //Resends reuse the pointer so the data has to stay put until it is ACKed
+  const unsigned char *(*block_lookup_ptr) (void *blk_id, size_t id_len, size_t data_len);
+  //optional sized form of block_lookup that returns the number of bytes it put
+  //in send_data, used instead of block_lookup when set. Fewer than data_len
+  //makes the block the last one (padded with SUB) and 0 ends the transfer
+  //without sending it, so xmodem_lookup_send can stream data of unknown length
+  size_t (*block_lookup_len) (void *blk_id, size_t id_len, unsigned char *send_data, size_t data_len);
   void (*calc_chksum) (unsigned char *data, size_t data_bytes, unsigned char *chksm);
+  //optional incremental form of calc_chksum used to checksum received data as
+  //it arrives, the running state is kept in the chksm bytes. The ones set by
+  //xmodem_init_config are only used while calc_chksum is the built in handler
+  //they match, so replacing calc_chksum on its own is enough
+  void (*chksm_init) (unsigned char *chksm);
+  void (*chksm_update) (unsigned char *data, size_t data_bytes, unsigned char *chksm);
+  void (*chksm_final) (unsigned char *chksm); //may be NULL
+  //optional batch (YMODEM) handlers called around each file received by
+  //xmodem_receive_batch, file_open returning false stops the batch. size is 0
+  //when the sender didn't provide it and mtime is in seconds since 1970-01-01 UTC
+  bool (*file_open) (const char *name, unsigned long size, unsigned long mtime);
+  void (*file_close) (bool complete);
 };
 
 void xmodem_init_config(struct xmodem_config* config, enum x_mode mode);
@@ -32,14 +157,31 @@ void xmodem_init_config(struct xmodem_config* config, enum x_mode mode);
 
 void print_byte(int fd, unsigned char byte);
 
+//LZSS codec used by compressed transfers, encode returns 0 when the coded
+//block wouldn't fit in out_max bytes and decode returns false for a coded
+//block that doesn't decode to exactly out_len bytes
+size_t xmodem_lzss_encode(const unsigned char *in, size_t in_len, unsigned char *out, size_t out_max);
+bool xmodem_lzss_decode(const unsigned char *in, size_t in_len, unsigned char *out, size_t out_len);
+
 bool xmodem_receive(int fd, struct xmodem_config *config);
+//receives straight into file_fd with pwrite instead of calling rx_block_handler.
+//Each block is written at its offset in the file, with
+//XMODEM_ALLOW_NONSEQUENTIAL block n goes to (n - 1)*data_bytes. size is the
+//length of the file when it is known and -1 when the end is worked out from
+//the SUB padding of the last block. The file is synced before the final ACK
+bool xmodem_receive_file(int fd, struct xmodem_config *config, int file_fd, long long size);
 bool xmodem_send(int fd, struct xmodem_config *config, unsigned char *data, size_t data_len, unsigned long long start_id);
 #define xmodem_send(fd, config, data, data_len, ...) xmodem_send_default(fd, config, data, data_len __VA_OPT__(,) __VA_ARGS__, 1)
 #define xmodem_send_default(fd, config, data, data_len, id, ...) xmodem_send(fd, config, data, data_len, id)
-bool xmodem_lookup_send(int fd, struct xmodem_config *config, unsigned long long id);
+//sends count consecutive blocks from block_lookup starting at start_id, a
+//count of 0 returns false without starting a transfer
+bool xmodem_lookup_send(int fd, struct xmodem_config *config, unsigned long long start_id, size_t count);
+#define xmodem_lookup_send(fd, config, start_id, ...) xmodem_lookup_send_default(fd, config, start_id __VA_OPT__(,) __VA_ARGS__, 1)
+#define xmodem_lookup_send_default(fd, config, start_id, count, ...) xmodem_lookup_send(fd, config, start_id, count)
 
 struct xmodem_bulk_data {
   unsigned char **data_arr;
+  //for NULL data the number of blocks to look up, 0 for a single block
   size_t *len_arr;
   //each id is xmodem_config.id_bytes long in big endian format
   unsigned char *id_arr;
@@ -48,4 +190,86 @@ struct xmodem_bulk_data {
 
 bool xmodem_send_bulk_data(int fd, struct xmodem_config *config, struct xmodem_bulk_data container);
 
+struct xmodem_batch_file {
+  const char *name;
+  unsigned char *data;
+  size_t len;
+  unsigned long mtime; //seconds since 1970-01-01 UTC, 0 if unknown
+};
+
+bool xmodem_receive_batch(int fd, struct xmodem_config *config);
+bool xmodem_send_batch(int fd, struct xmodem_config *config, struct xmodem_batch_file *files, size_t count);
+
+//round trip time estimate kept for each transfer, the retransmit timeout is
+//the smoothed round trip time plus 4 times its mean deviation like TCP
+struct xmodem_rtt {
+  long srtt; //milliseconds scaled by 8, negative until the first sample
+  long rttvar; //milliseconds scaled by 4
+  long rto; //milliseconds
+  long min_ms;
+  long max_ms;
+};
+
+//Sessions run a transfer without taking over the calling thread. The protocol
+//state is kept in the session struct and xmodem_session_poll moves it along
+//using only the bytes that are already waiting on the fd, so one thread can
+//run any number of sessions (see xmodem_reactor). Sessions use the regular
+//ACK/NAK protocol, they never ask for windows
+enum xmodem_status {
+  XMODEM_IDLE,
+  XMODEM_IN_PROGRESS,
+  XMODEM_COMPLETE,
+  XMODEM_FAILED
+};
+
+struct xmodem_session {
+  //set by the caller, rx_block_handler is used instead of
+  //config->rx_block_handler when it isn't NULL
+  void *user;
+  bool (*rx_block_handler) (struct xmodem_session *session, void *blk_id, size_t id_len, unsigned char *data, size_t data_len);
+  //called by xmodem_reactor once the session has ended, it is no longer used
+  //by the reactor so it may be restarted or freed
+  void (*on_done) (struct xmodem_session *session, enum xmodem_status status);
+
+  //internal state
+  int fd;
+  int fd_flags; //restored when the session ends
+  struct xmodem_config *config;
+  int state;
+  enum xmodem_status status;
+  unsigned char *buffer;
+  unsigned char *data; //next block to send, NULL when it is looked up
+  size_t data_len; //bytes left to send
+  size_t count; //bytes of the current packet read or written so far
+  unsigned char signal[4]; //signals waiting to be written
+  size_t signal_len;
+  unsigned char tries;
+  bool long_packets;
+  bool can; //the last signal was a CAN
+  long long deadline; //CLOCK_MONOTONIC milliseconds
+  long long sent; //when the last ACK/NAK went out
+  struct xmodem_rtt rtt;
+  struct xmodem_session *next; //reactor list
+  unsigned int events; //reactor epoll events
+};
+
+bool xmodem_session_receive(struct xmodem_session *session, int fd, struct xmodem_config *config);
+bool xmodem_session_send(struct xmodem_session *session, int fd, struct xmodem_config *config, unsigned char *data, size_t data_len, unsigned long long start_id);
+enum xmodem_status xmodem_session_poll(struct xmodem_session *session);
+bool xmodem_session_wants_write(struct xmodem_session *session);
+long long xmodem_session_deadline(struct xmodem_session *session);
+void xmodem_session_cancel(struct xmodem_session *session);
+
+//single threaded epoll loop that drives many sessions at once
+struct xmodem_reactor {
+  int epoll_fd;
+  struct xmodem_session *sessions;
+};
+
+bool xmodem_reactor_init(struct xmodem_reactor *reactor);
+bool xmodem_reactor_add(struct xmodem_reactor *reactor, struct xmodem_session *session);
+size_t xmodem_reactor_run_once(struct xmodem_reactor *reactor, int max_wait_ms);
+void xmodem_reactor_run(struct xmodem_reactor *reactor);
+void xmodem_reactor_close(struct xmodem_reactor *reactor);
+
 #endif
@@ -1,33 +1,113 @@
 #include "Arduino.h"
 #include "XModem.h"
 
+//not every core provides the AVR program memory helpers
+#ifndef PROGMEM
+#define PROGMEM
+#endif
+#ifndef pgm_read_word
+#define pgm_read_word(addr) (*(const unsigned short *)(addr))
+#endif
+
+//transfer statistics, see stats(). The time goes to one phase at a time,
+//STATS_ENTER switches to another and STATS_LEAVE goes back to the one before
+//it. Without XMODEM_STATS these compile to nothing
+#ifdef XMODEM_STATS
+#define STATS_ADD(field, n) (_stats.field += (n))
+#define STATS_ENTER(field, prev) unsigned long *prev = stats_phase(&_stats.field)
+#define STATS_LEAVE(prev) stats_phase(prev)
+#define STATS_BEGIN() stats_begin()
+#define STATS_END() stats_end()
+#else
+#define STATS_ADD(field, n) do { } while(0)
+#define STATS_ENTER(field, prev) do { } while(0)
+#define STATS_LEAVE(prev) do { } while(0)
+#define STATS_BEGIN() do { } while(0)
+#define STATS_END() do { } while(0)
+#endif
+
+//protocol trace, see dumpTrace(). The id bytes are stride apart so they can be
+//read straight out of a packet header or windowed signal
+#ifdef XMODEM_TRACE
+#define TRACE(type, value, aux, id, stride) trace(TRACE_##type, value, aux, id, stride)
+#else
+#define TRACE(...) do { } while(0)
+#endif
+
 XModem::XModem() {}
 
 //NOTE: the type argument has a default value - see header file
-void XModem::begin(HardwareSerial &serial, XModem::ProtocolType type) {
+void XModem::begin(Stream &serial, XModem::ProtocolType type) {
   _serial = &serial;
   switch(type) {
     case ProtocolType::XMODEM:
       _id_bytes = 1;
       _chksum_bytes = 1;
       _data_bytes = 128;
+      _long_data_bytes = 0;
       _rx_init_byte = NAK;
       calc_chksum = XModem::basic_chksum;
+      chksum_init = XModem::basic_chksum_init;
+      chksum_update = XModem::basic_chksum_update;
       break;
     case ProtocolType::CRC_XMODEM:
       _id_bytes = 1;
       _chksum_bytes = 2;
       _data_bytes = 128;
+      _long_data_bytes = 0;
       _rx_init_byte = 'C';
       calc_chksum = XModem::crc_16_chksum;
+      chksum_init = XModem::crc_16_chksum_init;
+      chksum_update = XModem::crc_16_chksum_update;
+      break;
+    case ProtocolType::XMODEM_1K:
+      _id_bytes = 1;
+      _chksum_bytes = 2;
+      _data_bytes = 128;
+      _long_data_bytes = 1024;
+      _rx_init_byte = 'C';
+      //standard XMODEM-1K sends the CRC high byte first so tools like lrzsz
+      //can talk to us
+      calc_chksum = XModem::crc_16_be_chksum;
+      chksum_init = XModem::crc_16_chksum_init;
+      chksum_update = XModem::crc_16_be_chksum_update;
       break;
   }
+  chksum_final = NULL;
   retry_limit = 10;
   _signal_retry_delay_ms = 100;
+  _min_timeout_ms = 100;
+  _max_timeout_ms = 10000;
+  rtt_reset();
   _allow_nonsequential = false;
+  _window_size = 1;
+  _window_active = false;
   _buffer_packet_reads = true;
+  _pipeline_sends = false;
+  _compress = false;
+  _compress_active = false;
+  _rx_queue_size = 0;
   process_rx_block = XModem::dummy_rx_block_handler;
   block_lookup = XModem::dummy_block_lookup;
+  block_lookup_ptr = NULL;
+  block_lookup_len = NULL;
+  file_open = NULL;
+  file_close = NULL;
+  checkpoint = NULL;
+  _resume = false;
+  _work_buffer = NULL;
+  _poll_state = POLL_IDLE;
+  _poll_status = IDLE;
+  _poll_buffer = NULL;
+  _poll_queue = NULL;
+#ifdef XMODEM_STATS
+  memset(&_stats, 0, sizeof(_stats));
+  _stats_phase = NULL;
+  _stats_depth = 0;
+#endif
+#ifdef XMODEM_TRACE
+  _trace_count = 0;
+#endif
 }
 
 // SETTERS
@@ -43,6 +123,10 @@ void XModem::setDataSize(size_t size) {
   _data_bytes = size;
 }
 
+void XModem::setLongDataSize(size_t size) {
+  _long_data_bytes = size;
+}
+
 void XModem::setSendInitByte(byte b) {
   _rx_init_byte = b;
 }
@@ -55,6 +139,16 @@ void XModem::setSignalRetryDelay(unsigned long ms) {
   _signal_retry_delay_ms = ms;
 }
 
+void XModem::setTimeoutBounds(unsigned long min_ms, unsigned long max_ms) {
+  _min_timeout_ms = min_ms;
+  _max_timeout_ms = max_ms;
+  rtt_reset();
+}
+
+void XModem::setWindowSize(byte size) {
+  _window_size = size;
+}
+
 void XModem::allowNonSequentailBlocks(bool b) {
   _allow_nonsequential = b;
 }
@@ -63,43 +157,285 @@ void XModem::bufferPacketReads(bool b) {
   _buffer_packet_reads = b;
 }
 
+void XModem::pipelineSends(bool b) {
+  _pipeline_sends = b;
+}
+
+void XModem::compressTransfers(bool b) {
+  _compress = b;
+}
+
+void XModem::setReceiveQueue(byte blocks) {
+  _rx_queue_size = blocks;
+}
+
 void XModem::setRecieveBlockHandler(bool (*handler) (void *blk_id, size_t idSize, byte *data, size_t dataSize)) {
   process_rx_block = handler;
 }
 
 void XModem::setBlockLookupHandler(void (*handler) (void *blk_id, size_t idSize, byte *send_data, size_t dataSize)) {
   block_lookup = handler;
+  block_lookup_ptr = NULL;
+  block_lookup_len = NULL;
+}
+
+void XModem::setBlockLookupHandler(const byte *(*handler) (void *blk_id, size_t idSize, size_t dataSize)) {
+  block_lookup_ptr = handler;
+}
+
+void XModem::setBlockLookupHandler(size_t (*handler) (void *blk_id, size_t idSize, byte *send_data, size_t dataSize)) {
+  block_lookup_len = handler;
+  block_lookup_ptr = NULL;
 }
 
 void XModem::setChksumHandler(void (*handler) (byte *data, size_t dataSize, byte *chksum)) {
   calc_chksum = handler;
+  //the built in incremental handlers no longer match so always checksum whole blocks
+  chksum_init = NULL;
+  chksum_update = NULL;
+  chksum_final = NULL;
+}
+
+void XModem::setChksumHandler(void (*init) (byte *chksum), void (*update) (byte *data, size_t dataSize, byte *chksum), void (*final) (byte *chksum)) {
+  //calc_chksum is only used without an update handler, so keep it for one
+  //that is missing
+  if(init == NULL || update == NULL) return;
+  calc_chksum = NULL;
+  chksum_init = init;
+  chksum_update = update;
+  chksum_final = final;
+}
+
+void XModem::setFileHandlers(bool (*open) (const char *name, unsigned long size, unsigned long mtime), void (*close) (bool complete)) {
+  file_open = open;
+  file_close = close;
+}
+
+void XModem::setCheckpointHandler(void (*handler) (void *blk_id, size_t idSize, unsigned long offset)) {
+  checkpoint = handler;
+}
+
+void XModem::setWorkBuffer(byte *buffer, size_t size) {
+  _work_buffer = buffer;
+  _work_size = size;
+  _work_used = 0;
+}
+
+//the most memory a transfer can need at once with the current settings, see
+//the work_alloc() calls
+//NOTE: the batch argument has a default value - see header file
+size_t XModem::workBufferSize(bool batch) {
+  //a windowed send only knows if it got a window after the handshake
+  size_t slot_count = _pipeline_sends ? 2 : 1;
+  size_t send_bytes = send_buffer_bytes(slot_count, slot_count, _compress);
+  if(_window_size > 1 && send_buffer_bytes(_window_size, 1, false) > send_bytes) send_bytes = send_buffer_bytes(_window_size, 1, false);
+  send_bytes = work_bytes(_id_bytes) + work_bytes(send_bytes);
+  //a compressed transfer is never windowed
+  size_t rx_bytes = work_bytes(rx_buffer_bytes(_window_size > 1));
+  if(_compress && work_bytes(rx_buffer_bytes(false) + rx_coded_buffer_bytes()) > rx_bytes) rx_bytes = work_bytes(rx_buffer_bytes(false) + rx_coded_buffer_bytes());
+  if(batch) {
+    //block 0 is held while the file data is transferred
+    send_bytes += work_bytes(tx_batch_buffer_bytes());
+    rx_bytes += work_bytes(rx_batch_buffer_bytes());
+  }
+
+  size_t bytes = send_bytes > rx_bytes ? send_bytes : rx_bytes;
+  size_t poll_rx_bytes = work_bytes(rx_poll_buffer_bytes()) + work_bytes(_rx_queue_size*rx_queue_slot_bytes());
+  if(poll_rx_bytes > bytes) bytes = poll_rx_bytes;
+  if(work_bytes(tx_poll_buffer_bytes()) > bytes) bytes = work_bytes(tx_poll_buffer_bytes());
+  //room to line up the start of a buffer that isn't aligned
+  return bytes + sizeof(void *) - 1;
+}
+
+#ifdef XMODEM_STATS
+const struct XModem::transfer_stats &XModem::stats() {
+  return _stats;
+}
+#endif
+
+#ifdef XMODEM_TRACE
+void XModem::clearTrace() {
+  _trace_count = 0;
+}
+
+//the dump is an 8 byte header ("XMTR", version 1, 12 byte events and 2 unused
+//bytes), the number of events ever added and the number that follow as 4 byte
+//values and then the events. Every value is little endian
+void XModem::dumpTrace(Stream &out) {
+  unsigned long kept = _trace_count < XMODEM_TRACE_EVENTS ? _trace_count : XMODEM_TRACE_EVENTS;
+  byte buf[16] = { 'X', 'M', 'T', 'R', 1, 12, 0, 0 };
+  for(byte i = 0; i < 4; ++i) {
+    buf[8 + i] = _trace_count >> 8*i;
+    buf[12 + i] = kept >> 8*i;
+  }
+  out.write(buf, 16);
+
+  for(unsigned long n = _trace_count - kept; n != _trace_count; ++n) {
+    struct trace_event *e = &_trace[n % XMODEM_TRACE_EVENTS];
+    for(byte i = 0; i < 4; ++i) {
+      buf[i] = e->time_us >> 8*i;
+      buf[4 + i] = e->id >> 8*i;
+    }
+    buf[8] = e->aux & 0xFF;
+    buf[9] = e->aux >> 8;
+    buf[10] = e->type;
+    buf[11] = e->value;
+    out.write(buf, 12);
+  }
 }
+#endif
 
 // PUBLIC METHODS
 bool XModem::receive() {
-  if(!init_rx() || !rx()) {
+  byte header;
+  STATS_BEGIN();
+  TRACE(START, 'R', 0, NULL, 0);
+  rtt_reset();
+  _resume = false;
+  _rx_offset = 0;
+  if(!init_rx(&header, true) || !rx(header, NULL)) {
     //An unrecoverable error occured send cancels to terminate the transaction
     _serial->write(CAN);
     _serial->write(CAN);
     _serial->write(CAN);
+    TRACE(END, 0, 0, NULL, 0);
+    STATS_END();
     return false;
   }
+  TRACE(END, 1, 0, NULL, 0);
+  STATS_END();
   return true;
 }
 
+bool XModem::resume_receive(unsigned long long last_id, unsigned long offset) {
+  byte header;
+  STATS_BEGIN();
+  TRACE(START, 'R', 0, NULL, 0);
+  rtt_reset();
+  //windows are never requested, see init_rx()
+  _resume = true;
+  _resume_id = last_id & id_mask();
+  _resume_offset = offset;
+  _rx_offset = offset;
+  bool result = init_rx(&header, false) && rx(header, NULL);
+  _resume = false;
+  if(!result) {
+    //An unrecoverable error occured send cancels to terminate the transaction
+    _serial->write(CAN);
+    _serial->write(CAN);
+    _serial->write(CAN);
+  }
+  TRACE(END, result, 0, NULL, 0);
+  STATS_END();
+  return result;
+}
+
+bool XModem::receive_batch() {
+  bool result = false;
+  byte *buffer;
+  struct packet p;
+  size_t max_data_bytes = _long_data_bytes > _data_bytes ? _long_data_bytes : _data_bytes;
+
+  //bundle all our memory allocations together
+  //need to store:
+  //3 id blocks - buffer id and compl_id and packet struct
+  //2 chksum blocks - buffer chksum and packet struct
+  //1 data block - the file header, the packet struct points into the buffer
+  STATS_BEGIN();
+  TRACE(START, 'r', 0, NULL, 0);
+  buffer = work_alloc(rx_batch_buffer_bytes());
+  p.data = buffer + 2*_id_bytes;
+  p.id = p.data + max_data_bytes + _chksum_bytes;
+  p.chksum = p.id + _id_bytes;
+
+  byte nak = NAK;
+  byte header;
+  rtt_reset();
+  _resume = false;
+  while(buffer != NULL && init_rx(&header, false)) {
+    //block 0 holds the file name followed by its size and modification time
+    bool valid = false;
+    byte errors = 0;
+    while(true) {
+      p.data_bytes = header == STX ? _long_data_bytes : _data_bytes;
+      if(header != EOT) STATS_ADD(wire_bytes, 1);
+      STATS_ENTER(wire_us, prev_phase);
+      valid = header != EOT && read_block(&p, buffer);
+      STATS_LEAVE(prev_phase);
+      for(size_t i = 0; i < _id_bytes; ++i) {
+        if(p.id[i] != 0) valid = false;
+      }
+      //the fields are NUL terminated strings so the block has to end in one
+      if(valid && p.data[p.data_bytes - 1] != 0) valid = false;
+
+      if(valid) break;
+      if(header != EOT) TRACE(RX_BAD, header, 0, NULL, 0);
+      if(++errors > retry_limit) break;
+      header = tx_signal(NAK);
+      if(!is_header(header) && (header = find_header(&nak, 1)) == 0) break;
+    }
+    if(!valid) break;
+    STATS_ADD(blocks_received, 1);
+    TRACE(RX_FRAME, header, p.data_bytes, p.id, 1);
+    _serial->write(ACK);
+    TRACE(TX_SIGNAL, ACK, 0, NULL, 0);
+
+    //an empty file name ends the batch
+    char *name = (char *) p.data;
+    if(name[0] == 0) {
+      result = true;
+      break;
+    }
+
+    //the size is decimal and the modification time octal, both are optional
+    char *field = name + strlen(name) + 1;
+    char *field_end;
+    unsigned long size = strtoul(field, &field_end, 10);
+    bool size_known = field_end != field;
+    unsigned long mtime = strtoul(field_end, NULL, 8);
+    //the header up to the NUL after its fields, the rest is padding
+    STATS_ADD(payload_bytes, field + strlen(field) + 1 - name);
+
+    STATS_ENTER(handler_us, prev_phase);
+    bool opened = file_open == NULL || file_open(name, size, mtime);
+    STATS_LEAVE(prev_phase);
+    if(!opened) break;
+    _rx_offset = 0;
+    bool complete = init_rx(&header, true) && rx(header, size_known ? &size : NULL);
+    STATS_ENTER(handler_us, prev_close_phase);
+    if(file_close != NULL) file_close(complete);
+    STATS_LEAVE(prev_close_phase);
+    if(!complete) break;
+  }
+
+  work_free(buffer);
+  if(!result) {
+    //An unrecoverable error occured send cancels to terminate the transaction
+    _serial->write(CAN);
+    _serial->write(CAN);
+    _serial->write(CAN);
+  }
+  TRACE(END, result, 0, NULL, 0);
+  STATS_END();
+  return result;
+}
+
 bool XModem::lookup_send(unsigned long long id) {
-  return send((byte*) NULL, 0, id);
+  return lookup_send(id, 1);
+}
+
+//NOTE: NULL data in a bulk_data entry looks up len blocks, see tx()
+bool XModem::lookup_send(unsigned long long start_id, size_t count) {
+  //a len of 0 would look up a single block
+  if(count == 0) return false;
+  return send((byte*) NULL, count, start_id);
 }
 
 bool XModem::send(byte *data, size_t data_len, unsigned long long start_id) {
-  byte *id = (byte *) malloc(_id_bytes);
+  byte *id = work_alloc(_id_bytes);
+  if(id == NULL) return false;
 
-  //convert the start_id to big endian format
-  unsigned long long temp = start_id;
-  for(size_t i = 0; i < _id_bytes; ++i) {
-    id[_id_bytes-i-1] = (byte) (temp & 0xFF);
-    temp >>=8;
-  }
+  encode_id(id, start_id);
 
   struct bulk_data container;
   container.data_arr = &data;
@@ -108,34 +444,68 @@ bool XModem::send(byte *data, size_t data_len, unsigned long long start_id) {
   container.count = 1;
 
   bool result = send_bulk_data(container);
-  free(id);
+  work_free(id);
   return result;
 }
 
 bool XModem::send_bulk_data(struct bulk_data container) {
   if(container.count == 0) return false;
-
-  struct packet p;
+  STATS_BEGIN();
+  TRACE(START, 'S', 0, NULL, 0);
+
+  //the window size is negotiated during the handshake so it has to happen
+  //before we know how much memory is needed
+  //only a single block of data in memory can be carried on from an offset
+  bool result = init_tx(container.count == 1 && container.data_arr[0] != NULL ? &container : NULL);
+  //a window shares one staging block between its slots, see tx_windowed()
+  size_t slot_count = _window_active ? _window_size : _pipeline_sends ? 2 : 1;
+  size_t staging_count = _window_active ? 1 : slot_count;
+  rtt_reset();
 
   //bundle all our memory allocations together
   //need to store:
-  //2 id blocks - blk_id and packet struct
-  //1 checksum block - packet struct
-  //1 data block - packet struct
-  byte *buffer = (byte *) malloc(2*_id_bytes + 1*_chksum_bytes + 1*_data_bytes);
-  byte *blk_id = buffer + _data_bytes;
-  p.id = blk_id + _id_bytes;
-  p.chksum = p.id + _id_bytes;
-  p.data = buffer;
+  //1 packet struct per slot
+  //2 id blocks - blk_id and the id of a windowed ACK/NAK
+  //1 header block per slot - SOH followed by the id and compl_id bytes (and
+  //the coded length when compressed)
+  //1 checksum block per slot
+  //1 coded data block per slot (if compressed) - see code_packet()
+  //1 data block per staging block - looked up and padded blocks
+  byte *buffer = work_alloc(send_buffer_bytes(slot_count, staging_count, _compress_active));
+  if(buffer == NULL) result = false;
+  struct packet *slots = (struct packet *) buffer;
+  byte *staging = buffer + slot_count*sizeof(struct packet);
+  byte *blk_id = staging + staging_count*_data_bytes;
+  byte *ack_id = blk_id + _id_bytes;
+  byte *slot_bytes = ack_id + _id_bytes;
+  size_t max_data_bytes = _long_data_bytes > _data_bytes ? _long_data_bytes : _data_bytes;
+  for(size_t i = 0; result && i < slot_count; ++i) {
+    slots[i].header = slot_bytes;
+    slots[i].chksum = slots[i].header + 1 + 2*_id_bytes + (_compress_active ? 4 : 0);
+    slot_bytes = slots[i].chksum + _chksum_bytes + (_compress_active ? max_data_bytes - 1 : 0);
+  }
 
-  bool result = init_tx();
   for(size_t j = 0; result && j < container.count; ++j) {
+    byte *data = container.data_arr[j];
+    size_t data_len = container.len_arr[j];
     for(size_t i = 0; i < _id_bytes; ++i) blk_id[i] = container.id_arr[j*_id_bytes + i];
-    result &= tx(&p, container.data_arr[j], container.len_arr[j], blk_id);
+    if(_resume) {
+      //carry on after the receiver's checkpoint, init_tx() made sure the
+      //offset is within the data
+      data += _resume_offset;
+      data_len -= _resume_offset;
+      encode_id(blk_id, _resume_id);
+      increment_id(blk_id, _id_bytes);
+    }
+    if(_window_active) {
+      result &= tx_windowed(slots, staging, data, data_len, blk_id, ack_id);
+    } else {
+      result &= tx(slots, staging, slot_count, data, data_len, blk_id);
+    }
   }
 
   if(result) {
-    result = close_tx();
+    result = close_tx(ack_id);
   } else {
     //An unrecoverable error occured send cancels to terminate the transaction
     _serial->write(CAN);
@@ -143,7 +513,9 @@ bool XModem::send_bulk_data(struct bulk_data container) {
     _serial->write(CAN);
   }
 
-  free(buffer);
+  work_free(buffer);
+  TRACE(END, result, 0, NULL, 0);
+  STATS_END();
   return result;
 }
 
@@ -151,63 +523,322 @@ bool XModem::send(byte *data, size_t data_len) {
   return send(data, data_len, 1);
 }
 
+bool XModem::send_batch(struct batch_file *files, size_t count) {
+  struct packet p;
+  byte resends;
+  size_t max_data_bytes = _long_data_bytes > _data_bytes ? _long_data_bytes : _data_bytes;
+
+  //bundle all our memory allocations together
+  //need to store:
+  //1 id block - block 0 is all zeros
+  //1 header block - SOH followed by the id and compl_id bytes
+  //1 checksum block - packet struct
+  //1 data block - the file header
+  byte *buffer = work_alloc(tx_batch_buffer_bytes());
+  if(buffer == NULL) {
+    _serial->write(CAN);
+    _serial->write(CAN);
+    _serial->write(CAN);
+    return false;
+  }
+  //the files are sent with send() so they add to the counts of the batch
+  STATS_BEGIN();
+  TRACE(START, 's', 0, NULL, 0);
+  byte *blk_id = buffer;
+  p.header = blk_id + _id_bytes;
+  p.chksum = p.header + 1 + 2*_id_bytes;
+  p.data = p.chksum + _chksum_bytes;
+  memset(blk_id, 0, _id_bytes);
+
+  bool result = true;
+  rtt_reset();
+  //one extra pass sends the empty file header that ends the batch
+  for(size_t i = 0; result && i <= count; ++i) {
+    memset(p.data, 0, max_data_bytes);
+    size_t used = 0;
+    if(i < count) {
+      //name, NUL, decimal size, space, octal modification time
+      int len = snprintf((char *) p.data, max_data_bytes, "%s", files[i].name) + 1;
+      if(len > 0 && (size_t) len < max_data_bytes) {
+        len += snprintf((char *) p.data + len, max_data_bytes - len, "%lu %lo", (unsigned long) files[i].len, files[i].mtime);
+      }
+      //the fields have to be followed by at least one NUL
+      if(len <= 0 || (size_t) len >= max_data_bytes) {
+        result = false;
+        break;
+      }
+      used = len + 1;
+    }
+
+    //regular sized packets are preferred for the file header like lrzsz does
+    p.data_bytes = used <= _data_bytes ? _data_bytes : _long_data_bytes;
+    build_packet(&p, blk_id, p.data, p.data_bytes);
+#ifdef XMODEM_STATS
+    p.data_len = used;
+#endif
+    result = init_tx(NULL) && send_packet(&p, &resends);
+
+    //the file data is a regular transfer starting from block 1
+    //NOTE: NULL data means a block lookup so empty files still need a pointer
+    if(result && i < count) result = send(files[i].len != 0 ? files[i].data : p.data, files[i].len, 1);
+  }
+
+  work_free(buffer);
+  if(!result) {
+    //An unrecoverable error occured send cancels to terminate the transaction
+    _serial->write(CAN);
+    _serial->write(CAN);
+    _serial->write(CAN);
+  }
+  TRACE(END, result, 0, NULL, 0);
+  STATS_END();
+  return result;
+}
+
+bool XModem::beginReceive() {
+  if(_poll_state != POLL_IDLE) return false;
+  size_t max_data_bytes = _long_data_bytes > _data_bytes ? _long_data_bytes : _data_bytes;
+
+  //bundle all our memory allocations together
+  //need to store:
+  //5 id blocks - prev_blk_id, expected_id, packet struct, buffer id and buffer compl_id
+  //2 chksum block - packet struct and buffer chksum
+  //1 data block - buffer data, the packet struct points into the buffer
+  _poll_buffer = work_alloc(rx_poll_buffer_bytes());
+  if(_poll_buffer == NULL) return false;
+  //need to store:
+  //1 queued_block, id block and data block per queue slot
+  if(_rx_queue_size != 0) {
+    _poll_queue = work_alloc(_rx_queue_size*rx_queue_slot_bytes());
+    if(_poll_queue == NULL) {
+      work_free(_poll_buffer);
+      _poll_buffer = NULL;
+      return false;
+    }
+  }
+  _poll_queue_first = 0;
+  _poll_queued = 0;
+
+  //the packet is always read into the buffer so that it can be collected a
+  //few bytes at a time, prev_blk_id and expected_id sit just before p.id
+  byte *prev_blk_id = _poll_buffer + 2*_id_bytes + max_data_bytes + _chksum_bytes;
+  byte *expected_id = prev_blk_id + _id_bytes;
+  _poll_packet.data = _poll_buffer + 2*_id_bytes;
+  _poll_packet.id = expected_id + _id_bytes;
+  _poll_packet.chksum = _poll_packet.id + _id_bytes;
+  for(size_t i = 0; i < _id_bytes; ++i) prev_blk_id[i] = expected_id[i] = 0;
+
+  //windows are never requested, the transfer uses regular ACK/NAK signals
+  _window_active = false;
+  _rx_offset = 0;
+  _poll_tries = 0;
+  _poll_can = false;
+  _poll_state = POLL_RX_INIT;
+  _poll_status = IN_PROGRESS;
+  rtt_reset();
+  _serial->write(_rx_init_byte);
+  poll_wait(_max_timeout_ms);
+  return true;
+}
+
+bool XModem::beginSend(byte *data, size_t data_len) {
+  return beginSend(data, data_len, 1);
+}
+
+bool XModem::beginSend(byte *data, size_t data_len, unsigned long long start_id) {
+  if(_poll_state != POLL_IDLE) return false;
+
+  //bundle all our memory allocations together
+  //need to store:
+  //1 data block - staging for looked up and padded blocks
+  //1 id block - blk_id
+  //1 header block - SOH followed by the id and compl_id bytes
+  //1 checksum block - packet struct
+  _poll_buffer = work_alloc(tx_poll_buffer_bytes());
+  if(_poll_buffer == NULL) return false;
+  byte *blk_id = _poll_buffer + _data_bytes;
+  _poll_packet.header = blk_id + _id_bytes;
+  _poll_packet.chksum = _poll_packet.header + 1 + 2*_id_bytes;
+
+  //convert the start_id to big endian format
+  unsigned long long temp = start_id;
+  for(size_t i = 0; i < _id_bytes; ++i) {
+    blk_id[_id_bytes-i-1] = (byte) (temp & 0xFF);
+    temp >>=8;
+  }
+
+  //a NULL data pointer sends a single looked up block like lookup_send()
+  _poll_data = data;
+  _poll_data_len = data == NULL ? _data_bytes : data_len;
+  _poll_long_packets = _long_data_bytes != 0;
+  _poll_write_room = false;
+  _window_active = false;
+  _poll_tries = 0;
+  _poll_state = POLL_TX_INIT;
+  _poll_status = IN_PROGRESS;
+  rtt_reset();
+  poll_wait(6*_max_timeout_ms);
+  return true;
+}
+
+XModem::TransferStatus XModem::poll() {
+  if(_poll_state == POLL_IDLE) return _poll_status;
+  if(_poll_state >= POLL_TX_INIT) return poll_tx();
+  return poll_rx();
+}
+
+void XModem::cancel() {
+  if(_poll_state != POLL_IDLE) poll_finish(false);
+}
+
 // INTERNAL RECEIVE METHODS
-bool XModem::init_rx() {
+bool XModem::init_rx(byte *header, bool allow_window) {
+  //windows rely on the block ids being sequential to spot missing blocks
+  bool ask_window = allow_window && _window_size > 1 && !_allow_nonsequential;
+  //a compressed transfer is asked for in place of a window
+  bool ask_compress = allow_window && _compress;
+  if(ask_compress) ask_window = false;
+  _window_active = false;
+  _compress_active = false;
+  _resume_confirmed = false;
+  STATS_ENTER(handshake_us, prev_phase);
+
   byte i = 0;
   do {
-    _serial->write(_rx_init_byte);
-    if(find_byte_timed(SOH, 10)) return true;
+    //alternate between asking for a windowed, compressed or resumed transfer
+    //and the regular init byte so that senders without support for them can
+    //still start a transfer
+    bool special_attempt = (ask_window || ask_compress || _resume) && i % 2 == 0;
+    byte init_byte = special_attempt ? (_resume ? RES : (ask_compress ? ZIP : WIN)) : _rx_init_byte;
+    if(init_byte == RES) write_resume_signal(_resume_id, _resume_offset);
+    else _serial->write(init_byte);
+    TRACE(TX_SIGNAL, init_byte, i, NULL, 0);
+
+    //a sender that agrees to a special transfer echoes the request
+    //before its first packet, one that doesn't know it stays silent so don't
+    //wait long for it
+    unsigned long wait = special_attempt && _max_timeout_ms > 3000UL ? 3000UL : _max_timeout_ms;
+    unsigned long start = millis();
+    do {
+      if(_serial->available() <= 0) continue;
+      byte b = _serial->read();
+      //an empty transfer ends straight away
+      if(is_header(b) || b == EOT) {
+        *header = b;
+        STATS_LEAVE(prev_phase);
+        return true;
+      }
+      if(b == WIN || b == ZIP || b == RES) TRACE(RX_SIGNAL, b, 0, NULL, 0);
+      if(b == WIN && ask_window) _window_active = true;
+      if(b == ZIP && ask_compress) _compress_active = true;
+      if(b == RES && _resume) {
+        unsigned long long id;
+        unsigned long offset;
+        if(read_resume_signal(&id, &offset) && id == _resume_id && offset == _resume_offset) _resume_confirmed = true;
+      }
+    } while(millis() - start < wait);
+    STATS_ADD(timeouts, 1);
+    TRACE(TIMEOUT, 'I', wait, NULL, 0);
   } while(i++ < retry_limit);
+  STATS_LEAVE(prev_phase);
   return false;
 }
 
-bool XModem::find_header() {
+byte XModem::find_header(byte *nak, size_t nak_len) {
+  STATS_ADD(resyncs, 1);
+  TRACE(RESYNC, 0, 0, NULL, 0);
   byte i = 0;
   do {
-    if(i != 0) _serial->write(NAK);
-    if(find_byte_timed(SOH, 10)) return true;
+    if(i != 0) {
+      _nak_timed = false;
+      _serial->write(nak, nak_len);
+      STATS_ADD(naks, 1);
+      TRACE(TX_SIGNAL, nak[0], i, nak_len > 1 ? nak + 1 : NULL, 2);
+    }
+    byte header = find_header_byte(_rto_ms);
+    if(header != 0) return header;
+    rtt_backoff();
   } while(i++ < retry_limit);
-  return false;
+  return 0;
 }
 
-bool XModem::rx() {
+//NOTE: remaining is the number of bytes left in the file when the sender told
+//us the file size, otherwise it is NULL and the SUB padding is stripped
+bool XModem::rx(byte header, unsigned long *remaining) {
   bool result = false;
 
   byte *buffer;
   byte *prev_blk_id;
   byte * expected_id;
+  byte *window_signal;
   struct packet p;
+  //the data block has to fit the biggest packet we accept
+  size_t max_data_bytes = _long_data_bytes > _data_bytes ? _long_data_bytes : _data_bytes;
 
   //bundle all our memory allocations together
+  //a compressed transfer reads each packet into the coded block at the end and
+  //decodes its data into the data block
+  buffer = work_alloc(rx_buffer_bytes(_window_active) + (_compress_active ? rx_coded_buffer_bytes() : 0));
+  if(buffer == NULL) return false;
+  byte *coded = buffer + rx_buffer_bytes(_window_active);
   if(_buffer_packet_reads) {
     //need to store:
     //5 id blocks - prev_blk_id, expected_id, packet struct, buffer id and buffer compl_id
     //2 chksum block - packet struct and buffer chksum
-    //2 data block - packet struct and buffer data
-    buffer = (byte *) malloc(5*_id_bytes + 2*_chksum_bytes + 2*_data_bytes);
-
-    prev_blk_id = buffer + 2*_id_bytes + _chksum_bytes + _data_bytes;
+    //1 data block - buffer data, the packet struct points into the buffer
+    //1 window signal block (if windowed) - ACK/NAK followed by the id and compl_id bytes
+    prev_blk_id = buffer + 2*_id_bytes + _chksum_bytes + max_data_bytes;
   } else {
     //need to store:
     //3 id blocks - prev_blk_id, expected_id and packet struct
     //1 checksum block - packet struct
     //1 data block - packet struct
-    buffer = (byte *) malloc(3*_id_bytes + _chksum_bytes + _data_bytes);
+    //1 window signal block (if windowed) - ACK/NAK followed by the id and compl_id bytes
     prev_blk_id = buffer;
   }
 
   expected_id = prev_blk_id + _id_bytes;
   p.id = expected_id + _id_bytes;
   p.chksum = p.id + _id_bytes;
-  p.data = p.chksum + _chksum_bytes;
+  if(_buffer_packet_reads) {
+    p.data = buffer + 2*_id_bytes;
+    window_signal = p.chksum + _chksum_bytes;
+  } else {
+    p.data = p.chksum + _chksum_bytes;
+    window_signal = p.data + max_data_bytes;
+  }
+
+  //in a windowed transfer ACK and NAK are followed by the id of the last block
+  //we have committed, a NAK asks the sender to resend everything after it
+  size_t signal_len = 1;
+  byte nak = NAK;
+  byte *nak_signal = &nak;
+  if(_window_active) {
+    signal_len += 2*_id_bytes;
+    nak_signal = window_signal;
+  }
+  //after a windowed NAK the blocks that were already in flight are discarded
+  //until the sender goes back to the missing one
+  bool nak_sent = false;
 
   for(size_t i = 0; i < _id_bytes; ++i) prev_blk_id[i] = expected_id[i] = 0;
+  if(_resume) {
+    //the checkpoint block counts as received so the next one follows it
+    encode_id(prev_blk_id, _resume_id);
+    encode_id(expected_id, _resume_id);
+  }
 
-  byte errors = 0;
+  size_t errors = 0;
   while(true) {
-    if(read_block(&p, buffer)) {
+    p.data_bytes = header == STX ? _long_data_bytes : _data_bytes;
+    if(header != EOT) STATS_ADD(wire_bytes, 1);
+    STATS_ENTER(wire_us, prev_phase);
+    bool valid = header != EOT && (_compress_active ? read_block_coded(&p, coded) : read_block(&p, buffer));
+    STATS_LEAVE(prev_phase);
+    if(valid) {
       //reset errors
       errors = 0;
+      if(_resume) resume_block(&p, prev_blk_id, expected_id);
 
       //ignore resends of the last received block
       size_t matches = 0;
@@ -216,7 +847,12 @@ bool XModem::rx() {
       }
 
       //if its a duplicate block we still need to send an ACK
-      if(matches != _id_bytes) {
+      bool duplicate = matches == _id_bytes;
+      if(duplicate) {
+        STATS_ADD(duplicates, 1);
+        TRACE(RX_DUP, header, p.data_bytes, p.id, 1);
+      }
+      if(!duplicate) {
         if(_allow_nonsequential) {
           for(size_t i = 0; i < _id_bytes; ++i) expected_id[i] = p.id[i];
         } else {
@@ -227,42 +863,108 @@ bool XModem::rx() {
             if(expected_id[i] == p.id[i]) ++matches;
           }
 
-          if(matches != _id_bytes) break;
+          if(matches != _id_bytes) {
+            if(!_window_active) break;
+            //an earlier block in the window went missing, treat this block
+            //like a bad one and keep waiting for the missing block
+            for(size_t i = 0; i < _id_bytes; ++i) expected_id[i] = prev_blk_id[i];
+            valid = false;
+          }
         }
+      }
 
-        size_t padding_bytes = 0;
-        //count number of padding SUB bytes
-        while(p.data[_data_bytes - 1 - padding_bytes] == SUB) ++padding_bytes;
+      if(valid && !duplicate) {
+        size_t data_len = p.data_bytes;
+        if(remaining != NULL) {
+          //anything past the end of the file is padding
+          if(data_len > *remaining) data_len = *remaining;
+          *remaining -= data_len;
+        } else {
+          //count number of padding SUB bytes
+          while(data_len > 0 && p.data[data_len - 1] == SUB) --data_len;
+        }
 
         //process packet
-        if(!process_rx_block(p.id, _id_bytes, p.data, _data_bytes - padding_bytes)) break;
+        STATS_ENTER(handler_us, prev_handler_phase);
+        bool processed = process_rx_block(p.id, _id_bytes, p.data, data_len);
+        if(processed) commit_block(&p);
+        STATS_LEAVE(prev_handler_phase);
+        if(!processed) break;
+        if(_window_active && _nak_timed) {
+          //a block that took longer than the timeout may have been sent again
+          //by the sender timing out rather than for the NAK
+          unsigned long ms = millis() - _nak_at;
+          if(ms <= _rto_ms) rtt_sample(ms);
+          _nak_timed = false;
+        }
+        STATS_ADD(blocks_received, 1);
+        STATS_ADD(payload_bytes, data_len);
+        TRACE(RX_FRAME, header, p.data_bytes, p.id, 1);
 
         for(size_t i = 0; i < _id_bytes; ++i) prev_blk_id[i] = expected_id[i];
       }
+    }
 
+    byte response;
+    if(header == EOT) {
+      TRACE(RX_SIGNAL, EOT, 0, NULL, 0);
+      response = EOT;
+    } else if(valid) {
       //signal acknowledgment
-      byte response = tx_signal(ACK);
-      if(response == CAN) break;
-      if(response == EOT) {
+      if(_window_active) {
+        encode_window_signal(window_signal, ACK, prev_blk_id);
+        nak_sent = false;
+        response = tx_signal(window_signal, signal_len);
+      } else {
+        response = tx_signal(ACK);
+      }
+    } else {
+      TRACE(RX_BAD, header, p.data_bytes, NULL, 0);
+      //the sender already knows where to go back to after a windowed NAK, the
+      //packets that follow it only count as an error once it is sent again
+      response = nak_sent ? find_header_byte(_rto_ms) : 0;
+      if(response == 0) {
+        if(++errors > retry_limit) break;
+        if(_window_active) encode_window_signal(window_signal, NAK, prev_blk_id);
+        response = tx_signal(nak_signal, signal_len);
+        //the block could be answering the NAK before this one
+        if(nak_sent) _nak_timed = false;
+        nak_sent = _window_active;
+      }
+    }
+
+    //a lone CAN is likely just a corrupted byte or part of a packet whose
+    //header got lost, wait for a second one before stopping
+    if(response == CAN && rx_signal(_rto_ms) == CAN) break;
+    //a windowed sender may still have resent blocks in flight when the last
+    //ACK arrives, so the end of the transfer can follow a discarded block
+    if(response == EOT) {
+      if(_window_active) {
+        encode_window_signal(window_signal, NAK, prev_blk_id);
+        response = tx_signal(window_signal, signal_len);
+      } else {
         response = tx_signal(NAK);
-        if(response == CAN) break; // This is not strictly neccessary
-        if(response == EOT) {
+      }
+      if(response == CAN) break; // This is not strictly neccessary
+      if(response == EOT) {
+        if(_window_active) {
+          encode_window_signal(window_signal, ACK, prev_blk_id);
+          _serial->write(window_signal, signal_len);
+        } else {
           _serial->write(ACK);
-          result = true;
-          break;
         }
+        TRACE(TX_SIGNAL, ACK, 0, NULL, 0);
+        result = true;
+        break;
       }
-      // Unexpected response and resync attempt failed so fail out
-      if(response != SOH && !find_header()) break;
-    } else {
-      if(++errors > retry_limit) break;
-      byte response = tx_signal(NAK);
-      if(response == CAN) break;
-      if(response != SOH && !find_header()) break;
     }
+    // Unexpected response and resync attempt failed so fail out
+    if(_window_active) encode_window_signal(window_signal, NAK, prev_blk_id);
+    if(is_header(response)) header = response;
+    else if((header = find_header(nak_signal, signal_len)) == 0) break;
   }
 
-  free(buffer);
+  work_free(buffer);
   return result;
 }
 
@@ -275,10 +977,45 @@ bool XModem::read_block(struct packet *p, byte *buffer) {
 }
 
 bool XModem::read_block_buffered(struct packet *p, byte *buffer) {
-  size_t b_pos = 2*_id_bytes + _data_bytes + _chksum_bytes;
-  if(!fill_buffer(buffer, b_pos)) return false;
+  size_t data_start = 2*_id_bytes;
+  size_t data_end = data_start + p->data_bytes;
+  size_t frame_bytes = data_end + _chksum_bytes;
+
+  if(chksum_update != NULL) chksum_init(p->chksum);
+
+  //checksum the data of each chunk as soon as it arrives so that the checksum
+  //is ready when the last byte of the packet is read. p->data points into the
+  //buffer so the data is never copied
+  size_t count = 0;
+  while(count < frame_bytes) {
+    size_t r = _serial->readBytes(buffer + count, frame_bytes - count);
+
+    //the baud rate / sending device may be much slower than ourselves so we
+    //only signal an error condition if no data has been received at all within
+    //the serial timeout period
+    if(r == 0) {
+      STATS_ADD(timeouts, 1);
+      TRACE(TIMEOUT, 'P', _serial->getTimeout(), NULL, 0);
+      return false;
+    }
+    STATS_ADD(wire_bytes, r);
+
+    size_t start = count > data_start ? count : data_start;
+    count += r;
+    size_t end = count < data_end ? count : data_end;
+    if(chksum_update != NULL && start < end) {
+      STATS_ENTER(chksum_us, prev_phase);
+      chksum_update(buffer + start, end - start, p->chksum);
+      STATS_LEAVE(prev_phase);
+    }
+  }
+
+  return check_block(p, buffer);
+}
 
-  b_pos = 0;
+//NOTE: buffer holds a whole packet after its header and p->data points into it
+bool XModem::check_block(struct packet *p, byte *buffer) {
+  size_t b_pos = 0;
   for(size_t i = 0; i < _id_bytes; ++i) {
     p->id[i] = buffer[b_pos++];
     //Because of C integer promotion rules the ~ operator changes
@@ -287,11 +1024,8 @@ bool XModem::read_block_buffered(struct packet *p, byte *buffer) {
     if(p->id[i] != (byte) ~buffer[b_pos++]) return false;
   }
 
-  for(size_t i = 0; i < _data_bytes; ++i) {
-    p->data[i] = buffer[b_pos++];
-  }
-
-  calc_chksum(p->data, _data_bytes, p->chksum);
+  finish_chksum(p);
+  b_pos = 2*_id_bytes + p->data_bytes;
   for(size_t i = 0; i < _chksum_bytes; ++i) {
     if(p->chksum[i] != buffer[b_pos++]) return false;
   }
@@ -302,8 +1036,12 @@ bool XModem::read_block_buffered(struct packet *p, byte *buffer) {
 bool XModem::read_block_unbuffered(struct packet *p) {
   byte tmp;
   for(size_t i = 0; i < _id_bytes; ++i) {
-    if(!_serial->readBytes(p->id + i, 1)) return false;
-    if(!_serial->readBytes(&tmp, 1)) return false;
+    if(!_serial->readBytes(p->id + i, 1) || !_serial->readBytes(&tmp, 1)) {
+      STATS_ADD(timeouts, 1);
+      TRACE(TIMEOUT, 'P', _serial->getTimeout(), NULL, 0);
+      return false;
+    }
+    STATS_ADD(wire_bytes, 2);
 
     //Because of C integer promotion rules the ~ operator changes
     //the variable type of an unsigned char (byte) to a char so we need to
@@ -311,18 +1049,26 @@ bool XModem::read_block_unbuffered(struct packet *p) {
     if(p->id[i] != (byte) ~tmp) return false;
   }
 
-  if(!fill_buffer(p->data, _data_bytes)) return false;
+  if(chksum_update != NULL) chksum_init(p->chksum);
+  if(!fill_buffer(p->data, p->data_bytes, p->chksum)) return false;
 
-  calc_chksum(p->data, _data_bytes, p->chksum);
+  finish_chksum(p);
   for(size_t i = 0; i < _chksum_bytes; ++i) {
-    if(!_serial->readBytes(&tmp, 1)) return false;
+    if(!_serial->readBytes(&tmp, 1)) {
+      STATS_ADD(timeouts, 1);
+      TRACE(TIMEOUT, 'P', _serial->getTimeout(), NULL, 0);
+      return false;
+    }
+    STATS_ADD(wire_bytes, 1);
     if(p->chksum[i] != tmp) return false;
   }
 
   return true;
 }
 
-bool XModem::fill_buffer(byte *buffer, size_t bytes) {
+//NOTE: chksum is only updated when an incremental checksum handler is set and
+//it isn't NULL
+bool XModem::fill_buffer(byte *buffer, size_t bytes, byte *chksum) {
   size_t count = 0;
   while(count < bytes) {
     size_t r = _serial->readBytes(buffer + count, bytes - count);
@@ -330,98 +1076,1038 @@ bool XModem::fill_buffer(byte *buffer, size_t bytes) {
     //the baud rate / sending device may be much slower than ourselves so we
     //only signal an error condition if no data has been received at all within
     //the serial timeout period
-    if(r == 0) return false;
+    if(r == 0) {
+      STATS_ADD(timeouts, 1);
+      TRACE(TIMEOUT, 'P', _serial->getTimeout(), NULL, 0);
+      return false;
+    }
+    STATS_ADD(wire_bytes, r);
 
+    if(chksum != NULL && chksum_update != NULL) {
+      STATS_ENTER(chksum_us, prev_phase);
+      chksum_update(buffer + count, r, chksum);
+      STATS_LEAVE(prev_phase);
+    }
     count += r;
   }
   return true;
 }
 
-// INTERNAL SEND METHODS
-bool XModem::init_tx() {
-  byte i = 0;
-  do {
-    if(find_byte_timed(_rx_init_byte, 60)) return true;
-  } while(i++ < retry_limit);
-  return false;
-}
-
-bool XModem::tx(struct packet *p, byte *data, size_t data_len, byte *blk_id) {
-  byte *data_ptr = data;
-  byte *data_end = data_ptr + data_len;
+//NOTE: buffer has room for the id, length and data of the biggest packet,
+//p->data_bytes is the size the data decodes to
+bool XModem::read_block_coded(struct packet *p, byte *buffer) {
+  //the length is checked before reading the data so a corrupted one can't
+  //make us wait for more bytes than the sender wrote
+  size_t len_start = 2*_id_bytes;
+  if(!fill_buffer(buffer, len_start + 4, NULL)) return false;
+  for(size_t i = 0; i < _id_bytes; ++i) {
+    p->id[i] = buffer[2*i];
+    if(p->id[i] != (byte) ~buffer[2*i + 1]) return false;
+  }
+  if(buffer[len_start] != (byte) ~buffer[len_start + 1] || buffer[len_start + 2] != (byte) ~buffer[len_start + 3]) return false;
+  size_t len = ((size_t) buffer[len_start] << 8) | buffer[len_start + 2];
+  if(len == 0 || len > p->data_bytes) return false;
 
-  //flush incoming data before starting
-  while(_serial->available()) _serial->read();
+  byte *coded = buffer + len_start + 4;
+  if(!fill_buffer(coded, len, NULL)) return false;
 
-  if(data == NULL) {
-    //need to use block_lookup to fill in the packet data
-    build_packet(p, blk_id, NULL, _data_bytes);
-    return send_packet(p);
+  //compare the checksum a byte at a time like read_block_unbuffered so a
+  //packet that lost a byte fails on the first wrong one instead of waiting
+  //out the timeout for a byte that is never coming
+  byte tmp;
+  chksum_block(coded, len, p->chksum);
+  for(size_t i = 0; i < _chksum_bytes; ++i) {
+    if(!_serial->readBytes(&tmp, 1)) {
+      STATS_ADD(timeouts, 1);
+      TRACE(TIMEOUT, 'P', _serial->getTimeout(), NULL, 0);
+      return false;
+    }
+    STATS_ADD(wire_bytes, 1);
+    if(p->chksum[i] != tmp) return false;
   }
 
-  while(data_ptr + _data_bytes < data_end) {
-    build_packet(p, blk_id, data_ptr, _data_bytes);
-    increment_id(blk_id, _id_bytes);
-    if(!send_packet(p)) return false;
-    data_ptr += _data_bytes;
+  //a block that didn't get any shorter is sent as it is
+  if(len == p->data_bytes) {
+    memcpy(p->data, coded, len);
+    return true;
   }
+  return xmodem_lzss_decode(coded, len, p->data, p->data_bytes);
+}
 
-  if(data_ptr != data_end) {
-    memset(p->data, SUB, _data_bytes);
+void XModem::finish_chksum(struct packet *p) {
+  STATS_ENTER(chksum_us, prev_phase);
+  if(chksum_update == NULL) calc_chksum(p->data, p->data_bytes, p->chksum);
+  else if(chksum_final != NULL) chksum_final(p->chksum);
+  STATS_LEAVE(prev_phase);
+}
 
-    build_packet(p, blk_id, data_ptr, data_end - data_ptr);
-    if(!send_packet(p)) return false;
+void XModem::chksum_block(byte *data, size_t dataSize, byte *chksum) {
+  STATS_ENTER(chksum_us, prev_phase);
+  if(chksum_update == NULL) {
+    calc_chksum(data, dataSize, chksum);
+  } else {
+    chksum_init(chksum);
+    chksum_update(data, dataSize, chksum);
+    if(chksum_final != NULL) chksum_final(chksum);
   }
+  STATS_LEAVE(prev_phase);
+}
 
-  return true;
+//the offset counts whole packets, the padding of the last one doesn't matter
+//as there is nothing after it to resume
+void XModem::commit_block(struct packet *p) {
+  _rx_offset += p->data_bytes;
+  if(checkpoint != NULL) checkpoint(p->id, _id_bytes, _rx_offset);
 }
 
-void XModem::build_packet(struct packet *p, byte *id, byte *data, size_t data_len) {
-  memcpy(p->id, id, _id_bytes);
-  if(data == NULL) block_lookup(id, _id_bytes, p->data, data_len);
-  else memcpy(p->data, data, data_len);
-  calc_chksum(p->data, _data_bytes, p->chksum);
+//decides from the first good packet of a resumed transfer whether the sender
+//carried on from the checkpoint, its echo may have been lost so a packet that
+//follows the checkpoint is as good as the echo. Anything else means the
+//sender started over, the checkpoint handler is told with an offset of 0
+void XModem::resume_block(struct packet *p, byte *prev_blk_id, byte *expected_id) {
+  _resume = false;
+  increment_id(expected_id, _id_bytes);
+  size_t matches = 0;
+  for(size_t i = 0; i < _id_bytes; ++i) {
+    if(expected_id[i] == p->id[i]) ++matches;
+  }
+  for(size_t i = 0; i < _id_bytes; ++i) expected_id[i] = prev_blk_id[i];
+  if(_resume_confirmed || matches == _id_bytes) return;
+
+  for(size_t i = 0; i < _id_bytes; ++i) prev_blk_id[i] = expected_id[i] = 0;
+  _rx_offset = 0;
+  if(checkpoint != NULL) checkpoint(prev_blk_id, _id_bytes, 0);
 }
 
-bool XModem::send_packet(struct packet *p) {
-  byte tries = 0;
+// INTERNAL SEND METHODS
+//NOTE: resumable is the data that can be carried on from the receiver's
+//checkpoint, NULL when the transfer has to start from the beginning
+bool XModem::init_tx(struct bulk_data *resumable) {
+  _window_active = false;
+  _compress_active = false;
+  _resume = false;
+  STATS_ENTER(handshake_us, prev_phase);
+  bool started = false;
+  byte i = 0;
   do {
-    _serial->write(SOH);
-
-    for(size_t i = 0; i < _id_bytes; ++i) {
-      _serial->write(p->id[i]);
-      _serial->write(~p->id[i]);
+    unsigned long wait = 6*_max_timeout_ms;
+    unsigned long start = millis();
+    do {
+      if(_serial->available() <= 0) continue;
+      byte b = _serial->read();
+      if(b == _rx_init_byte) {
+        started = true;
+      } else if(b == WIN && _window_size > 1) {
+        //the receiver may also ask for a windowed transfer, agree to it by echoing WIN
+        _window_active = true;
+        _serial->write(WIN);
+        started = true;
+      } else if(b == ZIP && _compress) {
+        //or a compressed one, agreed to the same way
+        _compress_active = true;
+        _serial->write(ZIP);
+        started = true;
+      } else if(b == RES && resumable != NULL && read_resume_signal(&_resume_id, &_resume_offset) && _resume_offset <= resumable->len_arr[0]) {
+        //or to carry on from its checkpoint, agree to it by echoing the checkpoint
+        _resume = true;
+        write_resume_signal(_resume_id, _resume_offset);
+        started = true;
+      }
+    } while(!started && millis() - start < wait);
+    if(started) {
+      TRACE(RX_SIGNAL, _resume ? RES : (_compress_active ? ZIP : (_window_active ? WIN : _rx_init_byte)), 0, NULL, 0);
+    } else {
+      STATS_ADD(timeouts, 1);
+      TRACE(TIMEOUT, 'I', wait, NULL, 0);
     }
+  } while(!started && i++ < retry_limit);
+  STATS_LEAVE(prev_phase);
+  return started;
+}
 
-    _serial->write(p->data, _data_bytes);
-    _serial->write(p->chksum, _chksum_bytes);
+//NOTE: p->data has to point at the staging data block, full blocks are sent
+//straight from the callers memory so only lookups and the padded final block
+//are copied into it
+//NOTE: every slot has its own _data_bytes staging block for looked up and
+//padded blocks. With 2 slots the next packet is built while the one before it
+//is going out and being answered, so a slow lookup handler overlaps with the
+//line instead of adding to every block
+bool XModem::tx(struct packet *slots, byte *staging, size_t slot_count, byte *data, size_t data_len, byte *blk_id) {
+  //NULL data looks up data_len blocks (0 for a single block)
+  size_t remaining = data == NULL && data_len == 0 ? 1 : data_len;
+  //1K packets are only used for full blocks, the rest of the data goes out in
+  //regular packets so that the final packet never needs more than a regular
+  //packet worth of padding
+  bool long_packets = _long_data_bytes != 0;
+  size_t slot = 0;
+  byte resends;
 
-    byte response = rx_signal();
-    if(response == ACK) return true;
-    if(response == NAK) continue;
-    if(response == CAN) {
-      response = rx_signal();
-      if(response == CAN) break;
+  //flush incoming data before starting
+  while(_serial->available()) _serial->read();
+
+  bool ready = build_next(&slots[0], staging, &data, &remaining, long_packets, blk_id);
+  while(ready) {
+    struct packet *p = &slots[slot];
+    if(!write_packet(p)) return false;
+    size_t next = (slot + 1) % slot_count;
+    if(slot_count > 1) ready = build_next(&slots[next], staging + next*_data_bytes, &data, &remaining, long_packets, blk_id);
+    if(!await_ack(p, &resends)) return false;
+
+    //a line that keeps corrupting 1K packets is better off with smaller ones
+    //NOTE: the header tells them apart, data_bytes is the coded size when
+    //the transfer is compressed
+    if(p->header[0] == STX && resends >= XMODEM_1K_FALLBACK_RESENDS) {
+      long_packets = false;
+      //a 1K packet that was built ahead is always a full one so it can be
+      //put back and built again from its header's id
+      if(slot_count > 1 && ready && slots[next].header[0] == STX) {
+        data -= _long_data_bytes;
+        remaining += _long_data_bytes;
+        for(size_t i = 0; i < _id_bytes; ++i) blk_id[i] = slots[next].header[1 + 2*i];
+        ready = build_next(&slots[next], staging + next*_data_bytes, &data, &remaining, long_packets, blk_id);
+      }
     }
-  } while(tries++ < retry_limit);
+    if(slot_count == 1) ready = build_next(&slots[0], staging, &data, &remaining, long_packets, blk_id);
+    slot = next;
+  }
 
-  return false;
+  return true;
 }
 
-bool XModem::close_tx() {
-  byte error_responses = 0;
-  while(error_responses < retry_limit) {
-    byte response = tx_signal(EOT);
-    if(response == ACK) return true;
-    if(response == NAK) continue;
-    if(response == CAN) {
-      if(rx_signal() == CAN) break;
-    } else ++error_responses;
+//builds the next packet of tx() and moves data and remaining past it, returns
+//FALSE when there is nothing left to send. For lookups remaining counts blocks
+bool XModem::build_next(struct packet *p, byte *staging, byte **data, size_t *remaining, bool long_packets, byte *blk_id) {
+  if(*remaining == 0) return false;
+  p->data = staging;
+
+  if(*data == NULL) {
+    //need to use block_lookup to fill in the packet data
+    p->data_bytes = _data_bytes;
+    size_t filled = build_packet(p, blk_id, NULL, _data_bytes);
+    //the lookup handler has run out of data
+    if(filled == 0) {
+      *remaining = 0;
+      return false;
+    }
+    //a short block is the last one so the padding only ever ends the data
+    *remaining = filled < _data_bytes ? 0 : *remaining - 1;
+  } else {
+    bool long_packet = long_packets && *remaining >= _long_data_bytes;
+    p->data_bytes = long_packet ? _long_data_bytes : _data_bytes;
+
+    size_t block_len = *remaining < p->data_bytes ? *remaining : p->data_bytes;
+    if(block_len != p->data_bytes) memset(p->data, SUB, p->data_bytes);
+    build_packet(p, blk_id, *data, block_len);
+    *data += block_len;
+    *remaining -= block_len;
   }
-  return false;
+
+  if(_compress_active) code_packet(p);
+  increment_id(blk_id, _id_bytes);
+  return true;
+}
+
+//NOTE: slots must have _window_size entries with their header and chksum set
+bool XModem::tx_windowed(struct packet *slots, byte *staging, byte *data, size_t data_len, byte *blk_id, byte *ack_id) {
+  //blocks are counted from 0 within this call: base is the oldest block that
+  //hasn't been acknowledged, sent is the next block to write out and built is
+  //the next block to encode. Blocks between base and built are kept in the
+  //slots so going back to resend them doesn't need to rebuild them
+  //NOTE: the first long_count blocks are full 1K packets, falling back to
+  //regular packets cuts long_count back to base and builds the rest again
+  size_t long_count = data == NULL || _long_data_bytes == 0 ? 0 : data_len / _long_data_bytes;
+  size_t long_len = long_count * _long_data_bytes;
+  //NOTE: NULL data looks up data_len blocks like tx() does, the lookup
+  //handler can end them early
+  size_t count = data == NULL ? (data_len == 0 ? 1 : data_len) : long_count + (data_len - long_len + _data_bytes - 1) / _data_bytes;
+  size_t base = 0;
+  size_t sent = 0;
+  size_t built = 0;
+  unsigned long base_id = low_id(blk_id);
+  unsigned long id_mask = _id_bytes < sizeof(unsigned long) ? (1UL << (8*_id_bytes)) - 1 : ~0UL;
+  byte errors = 0;
+  //one block at a time is timed from being sent to being acknowledged, timed
+  //is count while no block is being timed. Blocks sent again after a NAK are
+  //timed too as the NAK's id says the first copy never made it
+  size_t timed = count;
+  unsigned long timed_at = 0;
+  bool after_nak = false;
+  //looked up blocks all share the staging block, staged is the block that is
+  //in it so any other has to be looked up again before it is resent
+  size_t staged = 0;
+
+  //flush incoming data before starting
+  while(_serial->available()) _serial->read();
+
+  while(base < count) {
+    if(sent < count && sent - base < _window_size) {
+      struct packet *p = &slots[sent % _window_size];
+      bool first_send = sent == built;
+      if(first_send) {
+        p->data_bytes = built < long_count ? _long_data_bytes : _data_bytes;
+        size_t offset = built < long_count ? built*_long_data_bytes : long_len + (built - long_count)*_data_bytes;
+        byte *block = data == NULL ? NULL : data + offset;
+        size_t block_len = data == NULL ? _data_bytes : data_len - offset;
+        if(block_len > p->data_bytes) block_len = p->data_bytes;
+
+        if(block == NULL || block_len != p->data_bytes) {
+          p->data = staging;
+          memset(p->data, SUB, p->data_bytes);
+        }
+        size_t filled = build_packet(p, blk_id, block, block_len);
+        if(filled != 0) {
+          if(p->data == staging) staged = built;
+          increment_id(blk_id, _id_bytes);
+          ++built;
+        }
+        if(filled < block_len) {
+          //a looked up block that is short or missing ends the data
+          if(timed == count) timed = built;
+          count = built;
+          if(filled == 0) continue;
+        }
+      } else if(data == NULL && p->data == staging && staged != sent) {
+        //ack_id is only read straight after rx_window_signal() so it can hold
+        //the id while the block is looked up again
+        for(size_t i = 0; i < _id_bytes; ++i) ack_id[i] = p->header[1 + 2*i];
+        build_packet(p, ack_id, NULL, _data_bytes);
+        staged = sent;
+      }
+
+      if(!first_send) {
+        STATS_ADD(resends, 1);
+        TRACE(RESEND, p->header[0], errors, p->header + 1, 2);
+      }
+      if(!write_packet(p)) return false;
+      if(timed == count && (first_send || after_nak)) {
+        timed = sent;
+        timed_at = millis();
+      }
+      ++sent;
+
+      //keep filling the window until the receiver has something to say
+      if(!_serial->available()) continue;
+    }
+
+    byte response = rx_window_signal(ack_id);
+    if(response == ACK || response == NAK) {
+      //everything up to and including ack_id has been committed
+      unsigned long acked = (low_id(ack_id) - base_id + 1) & id_mask;
+      if(acked <= sent - base) {
+#ifdef XMODEM_STATS
+        _stats.blocks_sent += acked;
+        //a block stays in its slot until it has been committed
+        for(size_t i = base; i < base + acked; ++i) _stats.payload_bytes += slots[i % _window_size].data_len;
+#endif
+        base += acked;
+        base_id += acked;
+        if(acked != 0) errors = 0;
+      }
+      if(timed < base) {
+        rtt_sample(millis() - timed_at);
+        timed = count;
+      }
+      if(response == ACK) continue;
+    } else if(response == CAN) {
+      if(rx_signal(_rto_ms) == CAN) return false;
+    } else {
+      rtt_backoff();
+    }
+
+    //go back and resend everything after the last committed block
+    sent = base;
+    after_nak = response == NAK;
+    //the timed block is going to be sent again
+    if(timed != count && timed >= base) timed = count;
+    if(++errors > retry_limit) return false;
+
+    //a line that keeps corrupting 1K packets is better off with smaller ones,
+    //errors only counts the times base has been sent again
+    if(errors >= XMODEM_1K_FALLBACK_RESENDS && base < long_count) {
+      //the next block id to build is the one base went out with
+      struct packet *p = &slots[base % _window_size];
+      for(size_t i = 0; i < _id_bytes; ++i) blk_id[i] = p->header[1 + 2*i];
+      long_count = base;
+      long_len = long_count * _long_data_bytes;
+      count = long_count + (data_len - long_len + _data_bytes - 1) / _data_bytes;
+      timed = count;
+      built = base;
+    }
+  }
+
+  return true;
+}
+
+//returns the number of data bytes in the packet, a lookup handler that has
+//run out of data can make that less than data_len
+size_t XModem::build_packet(struct packet *p, byte *id, byte *data, size_t data_len) {
+  //encode the header once so that resends only have to write it out again
+  size_t h_pos = 0;
+  p->header[h_pos++] = p->data_bytes == _data_bytes ? SOH : STX;
+  for(size_t i = 0; i < _id_bytes; ++i) {
+    p->header[h_pos++] = id[i];
+    p->header[h_pos++] = ~id[i];
+  }
+
+  if(data == NULL) {
+    STATS_ENTER(handler_us, prev_phase);
+    //the send path never writes to the packet data so it is safe to cast away
+    //the const of data that the lookup handler already has in memory
+    const byte *found = block_lookup_ptr == NULL ? NULL : block_lookup_ptr(id, _id_bytes, data_len);
+    if(found != NULL) {
+      p->data = (byte *) found;
+    } else if(block_lookup_len != NULL) {
+      size_t filled = block_lookup_len(id, _id_bytes, p->data, data_len);
+      if(filled < data_len) {
+        //pad a short block the same way as the end of regular data
+        memset(p->data + filled, SUB, p->data_bytes - filled);
+        data_len = filled;
+      }
+    } else {
+      block_lookup(id, _id_bytes, p->data, data_len);
+    }
+    STATS_LEAVE(prev_phase);
+  } else if(data_len == p->data_bytes) {
+    p->data = data;
+  } else {
+    memcpy(p->data, data, data_len);
+  }
+
+  chksum_block(p->data, p->data_bytes, p->chksum);
+#ifdef XMODEM_STATS
+  p->data_len = data_len;
+#endif
+  return data_len;
+}
+
+//turns a packet from build_packet() into the compressed form, the header
+//gains the length of the data that follows with each byte followed by its
+//complement. A block that doesn't get any shorter is sent as it is (stored)
+//and keeps its checksum, a coded one goes into the slot's coded data block
+//after the checksum and is checksummed as it goes out
+void XModem::code_packet(struct packet *p) {
+  byte *coded = p->chksum + _chksum_bytes;
+  size_t len = xmodem_lzss_encode(p->data, p->data_bytes, coded, p->data_bytes - 1);
+  if(len != 0) {
+    p->data = coded;
+    p->data_bytes = len;
+    chksum_block(p->data, p->data_bytes, p->chksum);
+  }
+
+  byte *h = p->header + 1 + 2*_id_bytes;
+  h[0] = p->data_bytes >> 8;
+  h[1] = ~h[0];
+  h[2] = p->data_bytes & 0xFF;
+  h[3] = ~h[2];
+}
+
+//NOTE: resends is set to the number of times the packet had to be resent
+bool XModem::send_packet(struct packet *p, byte *resends) {
+  if(!write_packet(p)) return false;
+  return await_ack(p, resends);
+}
+
+//a stream that takes none of the packet has gone away (eg. a closed network
+//client) and won't get any better with retries, so the callers give up on the
+//transfer straight away. A packet that is only partly written is left to the
+//receiver to NAK like any other bytes lost on the line
+bool XModem::write_packet(struct packet *p) {
+  size_t header_bytes = 1 + 2*_id_bytes + (_compress_active ? 4 : 0);
+  STATS_ENTER(wire_us, prev_phase);
+  size_t written = _serial->write(p->header, header_bytes);
+  written += _serial->write(p->data, p->data_bytes);
+  written += _serial->write(p->chksum, _chksum_bytes);
+  STATS_LEAVE(prev_phase);
+  STATS_ADD(wire_bytes, header_bytes + p->data_bytes + _chksum_bytes);
+  TRACE(TX_FRAME, p->header[0], p->data_bytes, p->header + 1, 2);
+  return written != 0;
+}
+
+//waits for the ACK of a packet that has been written once, resending it when
+//the receiver asks for it
+bool XModem::await_ack(struct packet *p, byte *resends) {
+  byte tries = 0;
+  while(true) {
+    //without block ids in the signals a resend that crosses with the
+    //receiver's NAK gets answered twice and the spare ACK would be taken as
+    //the answer to the next packet, so the receiver's timeouts are the ones
+    //that recover from lost packets and signals and we only give up waiting
+    //after the longest timeout
+    byte response = rx_signal(_max_timeout_ms);
+    if(response == ACK) {
+      *resends = tries;
+      STATS_ADD(blocks_sent, 1);
+      STATS_ADD(payload_bytes, p->data_len);
+      return true;
+    }
+    if(response == CAN && rx_signal(_rto_ms) == CAN) return false;
+    if(tries++ >= retry_limit) return false;
+    STATS_ADD(resends, 1);
+    TRACE(RESEND, p->header[0], tries, p->header + 1, 2);
+    if(!write_packet(p)) return false;
+  }
+}
+
+bool XModem::close_tx(byte *ack_id) {
+  byte error_responses = 0;
+  //the receiver NAKs the first EOT, a windowed ACK that comes back before
+  //anything else is a repeated ACK of the last block that was still on its way
+  bool answered = !_window_active;
+  while(error_responses < retry_limit) {
+    byte response;
+    if(_window_active) {
+      //a windowed receiver follows every ACK/NAK with a block id, read it off
+      //the line so its bytes are not mistaken for a response
+      _serial->write(EOT);
+      TRACE(TX_SIGNAL, EOT, error_responses, NULL, 0);
+      response = rx_window_signal(ack_id);
+    } else {
+      //the receiver NAKs the first EOT and repeats its NAK if ours got lost
+      _serial->write(EOT);
+      TRACE(TX_SIGNAL, EOT, error_responses, NULL, 0);
+      response = rx_signal(_max_timeout_ms);
+    }
+    if(response == ACK) {
+      if(answered) return true;
+      continue;
+    }
+    answered = true;
+    if(response == NAK) continue;
+    if(response == CAN) {
+      if(rx_signal(_rto_ms) == CAN) break;
+    } else ++error_responses;
+  }
+  return false;
+}
+
+// INTERNAL NON-BLOCKING METHODS
+//NOTE: these never wait for the serial device, each call handles the bytes
+//that are already available and checks whether the current wait has run out
+XModem::TransferStatus XModem::poll_rx() {
+  struct packet *p = &_poll_packet;
+  byte *buffer = _poll_buffer;
+
+  //queued blocks are handed over one per call while the line is quiet between
+  //packets, or straight away when the next one is waiting for room
+  bool line_quiet = (_poll_state == POLL_RX_HEADER || _poll_state == POLL_RX_EOT) && _serial->available() <= 0;
+  if(_poll_state == POLL_RX_FULL || (_poll_queued != 0 && line_quiet)) {
+    if(!poll_rx_dequeue()) return poll_finish(false);
+    if(_poll_state == POLL_RX_FULL) {
+      byte *prev_blk_id = p->id - 2*_id_bytes;
+      byte *expected_id = p->id - _id_bytes;
+      poll_rx_enqueue();
+      for(size_t i = 0; i < _id_bytes; ++i) prev_blk_id[i] = expected_id[i];
+      poll_rx_ack();
+    }
+  }
+
+  int available;
+  while((available = _serial->available()) > 0) {
+    if(_poll_state == POLL_RX_PACKET) {
+      size_t data_start = 2*_id_bytes;
+      size_t data_end = data_start + p->data_bytes;
+      size_t frame_bytes = data_end + _chksum_bytes;
+
+      size_t want = frame_bytes - _poll_count;
+      if(want > (size_t) available) want = available;
+      size_t r = _serial->readBytes(buffer + _poll_count, want);
+
+      //checksum the data as it arrives the same way read_block_buffered does
+      size_t start = _poll_count > data_start ? _poll_count : data_start;
+      _poll_count += r;
+      size_t end = _poll_count < data_end ? _poll_count : data_end;
+      if(chksum_update != NULL && start < end) chksum_update(buffer + start, end - start, p->chksum);
+
+      //a slow sender is fine as long as the packet keeps arriving
+      poll_wait(_signal_retry_delay_ms * retry_limit);
+      if(_poll_count == frame_bytes && !poll_rx_block()) return poll_finish(false);
+      continue;
+    }
+
+    byte b = _serial->read();
+    bool can = _poll_can;
+    _poll_can = false;
+    if(_poll_state == POLL_RX_PURGE) {
+      //wait for the line to be clear before sending the NAK
+      poll_wait(_signal_retry_delay_ms);
+    } else if(is_header(b)) {
+      if(_poll_state == POLL_RX_HEADER && _poll_tries == 0) rtt_sample(millis() - _poll_sent);
+      p->data_bytes = b == STX ? _long_data_bytes : _data_bytes;
+      if(chksum_update != NULL) chksum_init(p->chksum);
+      _poll_count = 0;
+      _poll_state = POLL_RX_PACKET;
+      poll_wait(_signal_retry_delay_ms * retry_limit);
+    } else if(b == EOT) {
+      if(_poll_state == POLL_RX_EOT) {
+        //the transfer is only complete once the handler has every block
+        while(_poll_queued != 0) {
+          if(!poll_rx_dequeue()) return poll_finish(false);
+        }
+        _serial->write(ACK);
+        return poll_finish(true);
+      }
+      //make sure the EOT wasn't a corrupted byte by asking for it again
+      _serial->write(NAK);
+      _poll_state = POLL_RX_EOT;
+      poll_wait(_rto_ms);
+    } else if(b == CAN && _poll_state != POLL_RX_INIT) {
+      //a lone CAN can be a data byte of a packet whose header got lost
+      if(can) return poll_finish(false);
+      _poll_can = true;
+    }
+  }
+
+  if(!poll_timed_out()) return IN_PROGRESS;
+  switch(_poll_state) {
+    case POLL_RX_INIT:
+      if(++_poll_tries > retry_limit) return poll_finish(false);
+      _serial->write(_rx_init_byte);
+      poll_wait(_max_timeout_ms);
+      break;
+    case POLL_RX_PACKET:
+      //the rest of the packet never arrived
+      if(!poll_rx_error()) return poll_finish(false);
+      break;
+    case POLL_RX_PURGE:
+      _serial->write(NAK);
+      _poll_state = POLL_RX_HEADER;
+      poll_wait(_rto_ms);
+      _poll_sent = _poll_timer;
+      break;
+    case POLL_RX_HEADER:
+      if(++_poll_tries > retry_limit) return poll_finish(false);
+      rtt_backoff();
+      //a NAK is safe whether the ACK or the next packet got lost, see tx_signal()
+      _serial->write(NAK);
+      poll_wait(_rto_ms);
+      break;
+    case POLL_RX_EOT:
+      if(++_poll_tries > retry_limit) return poll_finish(false);
+      rtt_backoff();
+      _serial->write(NAK);
+      poll_wait(_rto_ms);
+      break;
+    default:
+      break;
+  }
+  return IN_PROGRESS;
+}
+
+//returns false when the transfer has to be cancelled
+bool XModem::poll_rx_block() {
+  struct packet *p = &_poll_packet;
+  byte *prev_blk_id = p->id - 2*_id_bytes;
+  byte *expected_id = p->id - _id_bytes;
+
+  if(!check_block(p, _poll_buffer)) return poll_rx_error();
+
+  //ignore resends of the last received block
+  size_t matches = 0;
+  for(size_t i = 0; i < _id_bytes; ++i) {
+    if(prev_blk_id[i] == p->id[i]) ++matches;
+  }
+
+  //if its a duplicate block we still need to send an ACK
+  if(matches != _id_bytes) {
+    if(_allow_nonsequential) {
+      for(size_t i = 0; i < _id_bytes; ++i) expected_id[i] = p->id[i];
+    } else {
+      increment_id(expected_id, _id_bytes);
+
+      matches = 0;
+      for(size_t i = 0; i < _id_bytes; ++i) {
+        if(expected_id[i] == p->id[i]) ++matches;
+      }
+      if(matches != _id_bytes) return false;
+    }
+
+    if(_rx_queue_size == 0) {
+      //count number of padding SUB bytes
+      size_t data_len = p->data_bytes;
+      while(data_len > 0 && p->data[data_len - 1] == SUB) --data_len;
+
+      //process packet
+      if(!process_rx_block(p->id, _id_bytes, p->data, data_len)) return false;
+      commit_block(p);
+    } else if(_poll_queued == _rx_queue_size) {
+      //withhold the ACK until the handler has made room, see poll_rx()
+      _poll_state = POLL_RX_FULL;
+      return true;
+    } else {
+      poll_rx_enqueue();
+    }
+
+    for(size_t i = 0; i < _id_bytes; ++i) prev_blk_id[i] = expected_id[i];
+  }
+
+  poll_rx_ack();
+  return true;
+}
+
+void XModem::poll_rx_ack() {
+  _poll_tries = 0;
+  _serial->write(ACK);
+  _poll_state = POLL_RX_HEADER;
+  poll_wait(_rto_ms);
+  _poll_sent = _poll_timer;
+}
+
+//copies the block in the packet buffer to the end of the queue
+void XModem::poll_rx_enqueue() {
+  struct packet *p = &_poll_packet;
+  byte *slot = _poll_queue + (_poll_queue_first + _poll_queued) % _rx_queue_size * rx_queue_slot_bytes();
+  struct queued_block *q = (struct queued_block *) slot;
+
+  //count number of padding SUB bytes
+  size_t data_len = p->data_bytes;
+  while(data_len > 0 && p->data[data_len - 1] == SUB) --data_len;
+
+  q->data_len = data_len;
+  q->data_bytes = p->data_bytes;
+  slot += sizeof(struct queued_block);
+  memcpy(slot, p->id, _id_bytes);
+  memcpy(slot + _id_bytes, p->data, data_len);
+  ++_poll_queued;
+}
+
+//gives the oldest queued block to the receive handler, returns false if it
+//refused it
+bool XModem::poll_rx_dequeue() {
+  byte *slot = _poll_queue + _poll_queue_first * rx_queue_slot_bytes();
+  struct queued_block *q = (struct queued_block *) slot;
+  struct packet block;
+  block.id = slot + sizeof(struct queued_block);
+  block.data = block.id + _id_bytes;
+  block.data_bytes = q->data_bytes;
+  _poll_queue_first = (_poll_queue_first + 1) % _rx_queue_size;
+  --_poll_queued;
+
+  if(!process_rx_block(block.id, _id_bytes, block.data, q->data_len)) return false;
+  commit_block(&block);
+  return true;
+}
+
+bool XModem::poll_rx_error() {
+  if(++_poll_tries > retry_limit) return false;
+  _poll_state = POLL_RX_PURGE;
+  poll_wait(_signal_retry_delay_ms);
+  return true;
+}
+
+XModem::TransferStatus XModem::poll_tx() {
+  struct packet *p = &_poll_packet;
+
+  if(_poll_state == POLL_TX_PACKET) {
+    //only write what fits in the serial transmit buffer so the write never
+    //has to wait for the buffer to drain
+    size_t header_bytes = 1 + 2*_id_bytes;
+    size_t chksum_start = header_bytes + p->data_bytes;
+    size_t frame_bytes = chksum_start + _chksum_bytes;
+    while(_poll_count < frame_bytes) {
+      int room = _serial->availableForWrite();
+      //a Stream that doesn't implement availableForWrite() always reports 0,
+      //it is given XMODEM_POLL_WRITE_BYTES per poll() instead
+      bool bounded = room <= 0 && !_poll_write_room;
+      if(bounded) room = XMODEM_POLL_WRITE_BYTES;
+      else if(room <= 0) break;
+      else _poll_write_room = true;
+
+      byte *src;
+      size_t len;
+      if(_poll_count < header_bytes) {
+        src = p->header + _poll_count;
+        len = header_bytes - _poll_count;
+      } else if(_poll_count < chksum_start) {
+        src = p->data + (_poll_count - header_bytes);
+        len = chksum_start - _poll_count;
+      } else {
+        src = p->chksum + (_poll_count - chksum_start);
+        len = frame_bytes - _poll_count;
+      }
+      if(len > (size_t) room) len = room;
+      size_t written = _serial->write(src, len);
+      if(written == 0) break;
+      _poll_count += written;
+      //the packet is timed out when the writes stop making progress
+      poll_wait(_max_timeout_ms);
+      if(bounded) break;
+    }
+    if(_poll_count < frame_bytes) {
+      if(!poll_timed_out()) return IN_PROGRESS;
+      //a stalled packet is sent again from the start like a lost one
+      if(!poll_tx_resend()) return poll_finish(false);
+      return IN_PROGRESS;
+    }
+    _poll_can = false;
+    _poll_state = POLL_TX_RESPONSE;
+    //the receiver recovers lost packets and signals, see send_packet()
+    poll_wait(_max_timeout_ms);
+  }
+
+  while(_serial->available() > 0) {
+    byte b = _serial->read();
+    if(_poll_state == POLL_TX_INIT) {
+      if(b != _rx_init_byte) continue;
+
+      //flush incoming data before starting
+      while(_serial->available()) _serial->read();
+      poll_tx_block();
+      return IN_PROGRESS;
+    }
+
+    if(b == CAN) {
+      if(_poll_can) return poll_finish(false);
+      _poll_can = true;
+      continue;
+    }
+    _poll_can = false;
+
+    if(b == ACK) {
+      if(_poll_state == POLL_TX_EOT) return poll_finish(true);
+
+      //a line that keeps corrupting 1K packets is better off with smaller ones
+      if(p->data_bytes != _data_bytes && _poll_tries >= XMODEM_1K_FALLBACK_RESENDS) _poll_long_packets = false;
+
+      size_t block_len = p->data_bytes < _poll_data_len ? p->data_bytes : _poll_data_len;
+      if(_poll_data != NULL) _poll_data += block_len;
+      _poll_data_len -= block_len;
+      increment_id(_poll_buffer + _data_bytes, _id_bytes);
+      poll_tx_block();
+      return IN_PROGRESS;
+    }
+    if(b == NAK) {
+      if(!poll_tx_resend()) return poll_finish(false);
+      return IN_PROGRESS;
+    }
+  }
+
+  if(!poll_timed_out()) return IN_PROGRESS;
+  if(_poll_state == POLL_TX_INIT) {
+    if(++_poll_tries > retry_limit) return poll_finish(false);
+    poll_wait(6*_max_timeout_ms);
+    return IN_PROGRESS;
+  }
+  if(!poll_tx_resend()) return poll_finish(false);
+  return IN_PROGRESS;
+}
+
+//builds the next packet or starts closing the transfer when there is no data left
+void XModem::poll_tx_block() {
+  struct packet *p = &_poll_packet;
+  byte *staging = _poll_buffer;
+  byte *blk_id = staging + _data_bytes;
+  _poll_tries = 0;
+
+  if(_poll_data_len == 0) {
+    _serial->write(EOT);
+    _poll_state = POLL_TX_EOT;
+    poll_wait(_max_timeout_ms);
+    return;
+  }
+
+  p->data = staging;
+  if(_poll_data == NULL) {
+    //need to use block_lookup to fill in the packet data
+    p->data_bytes = _data_bytes;
+    build_packet(p, blk_id, NULL, _data_bytes);
+  } else {
+    //1K packets are only used for full blocks like tx() does
+    bool long_packet = _poll_long_packets && _poll_data_len >= _long_data_bytes;
+    p->data_bytes = long_packet ? _long_data_bytes : _data_bytes;
+
+    size_t block_len = _poll_data_len < p->data_bytes ? _poll_data_len : p->data_bytes;
+    if(block_len != p->data_bytes) memset(p->data, SUB, p->data_bytes);
+    build_packet(p, blk_id, _poll_data, block_len);
+  }
+
+  _poll_count = 0;
+  _poll_state = POLL_TX_PACKET;
+  poll_wait(_max_timeout_ms);
+}
+
+bool XModem::poll_tx_resend() {
+  if(++_poll_tries > retry_limit) return false;
+  if(_poll_state == POLL_TX_EOT) {
+    _serial->write(EOT);
+    poll_wait(_max_timeout_ms);
+  } else {
+    _poll_count = 0;
+    _poll_state = POLL_TX_PACKET;
+    poll_wait(_max_timeout_ms);
+  }
+  return true;
+}
+
+void XModem::poll_wait(unsigned long ms) {
+  _poll_timer = millis();
+  _poll_timeout = ms;
+}
+
+bool XModem::poll_timed_out() {
+  return millis() - _poll_timer >= _poll_timeout;
+}
+
+XModem::TransferStatus XModem::poll_finish(bool result) {
+  if(!result) {
+    //An unrecoverable error occured send cancels to terminate the transaction
+    _serial->write(CAN);
+    _serial->write(CAN);
+    _serial->write(CAN);
+  }
+  work_free(_poll_queue);
+  _poll_queue = NULL;
+  work_free(_poll_buffer);
+  _poll_buffer = NULL;
+  _poll_state = POLL_IDLE;
+  _poll_status = result ? COMPLETE : FAILED;
+  return _poll_status;
 }
 
 // INTERNAL SHARED METHODS
+//takes memory from the work buffer when one has been set, blocks are always
+//released in the reverse order they were taken so it is used like a stack
+byte *XModem::work_alloc(size_t bytes) {
+  if(_work_buffer == NULL) return (byte *) malloc(bytes);
+
+  //line the block up for the packet structs at the start of the send buffer
+  size_t start = _work_used + (sizeof(void *) - (uintptr_t) (_work_buffer + _work_used) % sizeof(void *)) % sizeof(void *);
+  if(start + bytes > _work_size) return NULL;
+  _work_used = start + bytes;
+  return _work_buffer + start;
+}
+
+void XModem::work_free(byte *block) {
+  if(_work_buffer == NULL) free(block);
+  else if(block != NULL) _work_used = block - _work_buffer;
+}
+
+//bytes a block takes from the work buffer, including padding for the next one
+size_t XModem::work_bytes(size_t bytes) {
+  return (bytes + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+}
+
+//NOTE: the layout of each buffer is described where it is allocated
+size_t XModem::send_buffer_bytes(size_t slot_count, size_t staging_count, bool coded) {
+  size_t max_data_bytes = _long_data_bytes > _data_bytes ? _long_data_bytes : _data_bytes;
+  size_t coded_bytes = coded ? 4 + max_data_bytes - 1 : 0;
+  return slot_count*(sizeof(struct packet) + 1 + 2*_id_bytes + _chksum_bytes + coded_bytes) + 2*_id_bytes + staging_count*_data_bytes;
+}
+
+size_t XModem::rx_buffer_bytes(bool windowed) {
+  size_t max_data_bytes = _long_data_bytes > _data_bytes ? _long_data_bytes : _data_bytes;
+  size_t window_bytes = windowed ? 1 + 2*_id_bytes : 0;
+  if(_buffer_packet_reads) return 5*_id_bytes + 2*_chksum_bytes + max_data_bytes + window_bytes;
+  return 3*_id_bytes + _chksum_bytes + max_data_bytes + window_bytes;
+}
+
+size_t XModem::rx_coded_buffer_bytes() {
+  size_t max_data_bytes = _long_data_bytes > _data_bytes ? _long_data_bytes : _data_bytes;
+  return 2*_id_bytes + 4 + max_data_bytes;
+}
+
+size_t XModem::rx_batch_buffer_bytes() {
+  size_t max_data_bytes = _long_data_bytes > _data_bytes ? _long_data_bytes : _data_bytes;
+  return 3*_id_bytes + 2*_chksum_bytes + max_data_bytes;
+}
+
+size_t XModem::tx_batch_buffer_bytes() {
+  size_t max_data_bytes = _long_data_bytes > _data_bytes ? _long_data_bytes : _data_bytes;
+  return 1 + 3*_id_bytes + _chksum_bytes + max_data_bytes;
+}
+
+size_t XModem::rx_poll_buffer_bytes() {
+  size_t max_data_bytes = _long_data_bytes > _data_bytes ? _long_data_bytes : _data_bytes;
+  return 5*_id_bytes + 2*_chksum_bytes + max_data_bytes;
+}
+
+size_t XModem::rx_queue_slot_bytes() {
+  size_t max_data_bytes = _long_data_bytes > _data_bytes ? _long_data_bytes : _data_bytes;
+  return work_bytes(sizeof(struct queued_block) + _id_bytes + max_data_bytes);
+}
+
+size_t XModem::tx_poll_buffer_bytes() {
+  return _data_bytes + 1 + 3*_id_bytes + _chksum_bytes;
+}
+
+#ifdef XMODEM_STATS
+//starts counting from 0 unless this transfer is part of a bigger one
+void XModem::stats_begin() {
+  if(_stats_depth++ != 0) return;
+  memset(&_stats, 0, sizeof(_stats));
+  _stats_phase = &_stats.other_us;
+  _stats_mark = micros();
+}
+
+void XModem::stats_end() {
+  if(--_stats_depth == 0) stats_phase(NULL);
+}
+
+//adds the time since the last switch to the phase being timed and starts
+//timing phase, returns the phase it replaced. Nothing is timed between
+//transfers or during non-blocking transfers
+unsigned long *XModem::stats_phase(unsigned long *phase) {
+  unsigned long *prev = _stats_phase;
+  if(prev == NULL) return NULL;
+  unsigned long now = micros();
+  *prev += now - _stats_mark;
+  _stats_mark = now;
+  _stats_phase = phase;
+  return prev;
+}
+#endif
+
+#ifdef XMODEM_TRACE
+//NOTE: only the last 4 bytes of longer ids are kept
+void XModem::trace(byte type, byte value, size_t aux, const byte *id, size_t stride) {
+  struct trace_event *e = &_trace[_trace_count++ % XMODEM_TRACE_EVENTS];
+  e->time_us = micros();
+  e->type = type;
+  e->value = value;
+  e->aux = aux > 0xFFFF ? 0xFFFF : aux;
+  unsigned long low_id = 0;
+  if(id != NULL) {
+    for(size_t i = _id_bytes > 4 ? _id_bytes - 4 : 0; i < _id_bytes; ++i) low_id = (low_id << 8) | id[i*stride];
+  }
+  e->id = low_id;
+}
+#endif
+
+void XModem::rtt_reset() {
+  _srtt = -1;
+  _rttvar = 0;
+  _rto_ms = 1000;
+  if(_rto_ms < _min_timeout_ms) _rto_ms = _min_timeout_ms;
+  if(_rto_ms > _max_timeout_ms) _rto_ms = _max_timeout_ms;
+  _nak_timed = false;
+}
+
+//ms is the time between a packet or signal going out and its answer arriving.
+//NOTE: only answers to something that was sent once are sampled (Karn's
+//algorithm) as there is no telling which copy a resend was answered for
+void XModem::rtt_sample(unsigned long ms) {
+  if(_srtt < 0) {
+    _srtt = (long) ms << 3;
+    _rttvar = (long) ms << 1;
+  } else {
+    //srtt += (ms - srtt)/8 and rttvar += (|ms - srtt| - rttvar)/4 in the
+    //scaled units so that small round trips don't round down to nothing
+    long err = (long) ms - (_srtt >> 3);
+    _srtt += err;
+    if(err < 0) err = -err;
+    _rttvar += err - (_rttvar >> 2);
+  }
+
+  _rto_ms = (_srtt >> 3) + _rttvar;
+  if(_rto_ms < _min_timeout_ms) _rto_ms = _min_timeout_ms;
+  if(_rto_ms > _max_timeout_ms) _rto_ms = _max_timeout_ms;
+}
+
+//nothing came back in time, the link may have slowed down so give the next
+//attempt twice as long
+void XModem::rtt_backoff() {
+  _rto_ms = 2*_rto_ms > _max_timeout_ms ? _max_timeout_ms : 2*_rto_ms;
+}
+
 void XModem::increment_id(byte *id, size_t length) {
   size_t index = length-1;
   do {
@@ -430,52 +2116,234 @@ void XModem::increment_id(byte *id, size_t length) {
   } while(index--); //when our index is zero before decrementing then we have incremented all the bytes
 }
 
+//big endian format, ids longer than 8 bytes are padded with zeros
+void XModem::encode_id(byte *id, unsigned long long val) {
+  for(size_t i = 0; i < _id_bytes; ++i) {
+    id[_id_bytes-i-1] = (byte) (val & 0xFF);
+    val = i < sizeof(val) - 1 ? val >> 8 : 0;
+  }
+}
+
+//the ids that fit in _id_bytes
+unsigned long long XModem::id_mask() {
+  return _id_bytes < sizeof(unsigned long long) ? (1ULL << (8*_id_bytes)) - 1 : ~0ULL;
+}
+
+//RES followed by the id of the checkpoint block and the 4 byte offset, each
+//byte followed by its complement like the id bytes of a packet header
+void XModem::write_resume_signal(unsigned long long id, unsigned long offset) {
+  byte signal[1 + 2*8 + 2*4];
+  size_t pos = 0;
+  signal[pos++] = RES;
+  size_t id_bytes = _id_bytes < 8 ? _id_bytes : 8;
+  for(size_t i = 0; i < id_bytes; ++i) {
+    byte b = (byte) (id >> (8*(id_bytes-i-1)));
+    signal[pos++] = b;
+    signal[pos++] = ~b;
+  }
+  for(size_t i = 0; i < 4; ++i) {
+    byte b = (byte) (offset >> (8*(3-i)));
+    signal[pos++] = b;
+    signal[pos++] = ~b;
+  }
+  _serial->write(signal, pos);
+}
+
+//reads the rest of a resume signal after its RES byte
+bool XModem::read_resume_signal(unsigned long long *id, unsigned long *offset) {
+  byte pair[2];
+  size_t id_bytes = _id_bytes < 8 ? _id_bytes : 8;
+  *id = 0;
+  *offset = 0;
+  for(size_t i = 0; i < id_bytes + 4; ++i) {
+    if(_serial->readBytes(pair, 2) != 2) return false;
+    //Because of C integer promotion rules the ~ operator changes
+    //the variable type of an unsigned char (byte) to a char so we need to
+    //cast it back
+    if(pair[0] != (byte) ~pair[1]) return false;
+    if(i < id_bytes) *id = (*id << 8) | pair[0];
+    else *offset = (*offset << 8) | pair[0];
+  }
+  return true;
+}
+
 byte XModem::tx_signal(byte signal) {
-  if(signal == NAK) {
+  return tx_signal(&signal, 1);
+}
+
+//NOTE: signal is the signal byte optionally followed by extra bytes (eg. the
+//id of a windowed ACK/NAK) that are written out together with it
+byte XModem::tx_signal(byte *signal, size_t signal_len) {
+  if(signal[0] == NAK) {
     //flush to make sure the line is clear
     while(_serial->available()) _serial->read();
   }
   byte i = 0;
   byte val;
+  byte nak = NAK;
+  STATS_ENTER(ack_wait_us, prev_phase);
   do {
-    byte read_attempt = 0;
-    _serial->write(signal);
-    while(_serial->readBytes(&val, 1) == 0 && read_attempt++ < retry_limit) delay(_signal_retry_delay_ms);
-
-    switch(val) {
-      case SOH:
-      case EOT:
-      case CAN:
-      case ACK:
-      case NAK:
-        return val;
+    _serial->write(signal, signal_len);
+    if(signal[0] == NAK) STATS_ADD(naks, 1);
+    TRACE(TX_SIGNAL, signal[0], i, signal_len > 1 ? signal + 1 : NULL, 2);
+    unsigned long sent_at = millis();
+    if(signal_len != 1 && signal[0] == NAK) {
+      _nak_at = sent_at;
+      _nak_timed = i == 0;
+    }
+    bool quiet = true;
+    while(millis() - sent_at < _rto_ms) {
+      if(_serial->available() <= 0) continue;
+      val = _serial->read();
+      switch(val) {
+        case SOH:
+        case STX:
+        case EOT:
+        case CAN:
+        case ACK:
+        case NAK:
+          //the packets of a windowed transfer are already on their way so the
+          //first byte back doesn't answer the signal, see _nak_at
+          if(i == 0 && signal_len == 1) rtt_sample(millis() - sent_at);
+          if(val == CAN) STATS_ADD(cans, 1);
+          if(val == NAK) STATS_ADD(naks, 1);
+          if(val != SOH && val != STX) TRACE(RX_SIGNAL, val, 0, NULL, 0);
+          STATS_LEAVE(prev_phase);
+          return val;
+      }
+      //windowed signals carry the block id so they can be repeated straight
+      //away, other bytes after a regular signal are the rest of a packet whose
+      //header got lost so they are left to run out until the timeout
+      if(signal_len != 1) {
+        quiet = false;
+        break;
+      }
     }
+    if(!quiet) continue;
+
+    STATS_ADD(timeouts, 1);
+    TRACE(TIMEOUT, signal[0], _rto_ms, NULL, 0);
+    rtt_backoff();
+    //a repeated ACK would be taken as the answer to the next packet when only
+    //its header got lost, a NAK gets either that packet or the one we ACKed
+    //sent again
+    if(signal_len == 1 && signal[0] == ACK) signal = &nak;
   } while(++i < retry_limit);
+  STATS_LEAVE(prev_phase);
   return 255;
 }
 
-byte XModem::rx_signal() {
-  byte i = 0;
+byte XModem::rx_signal(unsigned long timeout_ms) {
   byte val;
-  while(_serial->readBytes(&val, 1) == 0 && ++i < retry_limit) delay(_signal_retry_delay_ms);
+  STATS_ENTER(ack_wait_us, prev_phase);
+  bool read = read_byte_timed(&val, timeout_ms);
+  STATS_LEAVE(prev_phase);
+  if(!read) {
+    STATS_ADD(timeouts, 1);
+    TRACE(TIMEOUT, 'S', timeout_ms, NULL, 0);
+    return 255;
+  }
 
   switch(val) {
-    case ACK:
     case NAK:
+      STATS_ADD(naks, 1);
+      TRACE(RX_SIGNAL, val, 0, NULL, 0);
+      return val;
     case CAN:
+      STATS_ADD(cans, 1);
+      TRACE(RX_SIGNAL, val, 0, NULL, 0);
+      return val;
+    case ACK:
+      TRACE(RX_SIGNAL, val, 0, NULL, 0);
       return val;
   }
   return 255;
 }
 
-bool XModem::find_byte_timed(byte b, byte timeout_secs) {
-  unsigned long end = millis() + ((unsigned long) timeout_secs * 1000UL);
+byte XModem::rx_window_signal(byte *id) {
+  //like tx() the receiver's timeouts are the ones that recover from lost
+  //packets and signals, it NAKs a missing block and repeats its ACKs. Going
+  //back on a timeout of our own would send every lost window twice so we only
+  //give up waiting after the longest timeout
+  byte val = rx_signal(_max_timeout_ms);
+  if(val != ACK && val != NAK) return val;
+
+  byte tmp;
+  for(size_t i = 0; i < _id_bytes; ++i) {
+    if(!_serial->readBytes(id + i, 1)) return 255;
+    if(!_serial->readBytes(&tmp, 1)) return 255;
+
+    //Because of C integer promotion rules the ~ operator changes
+    //the variable type of an unsigned char (byte) to a char so we need to
+    //cast it back
+    if(id[i] != (byte) ~tmp) return 255;
+  }
+  return val;
+}
+
+void XModem::encode_window_signal(byte *signal, byte type, byte *id) {
+  size_t pos = 0;
+  signal[pos++] = type;
+  for(size_t i = 0; i < _id_bytes; ++i) {
+    signal[pos++] = id[i];
+    signal[pos++] = ~id[i];
+  }
+}
+
+//the least significant bytes of a big endian id, enough to tell blocks in a
+//window apart
+unsigned long XModem::low_id(byte *id) {
+  unsigned long val = 0;
+  size_t i = _id_bytes > sizeof(unsigned long) ? _id_bytes - sizeof(unsigned long) : 0;
+  for(; i < _id_bytes; ++i) val = (val << 8) | id[i];
+  return val;
+}
+
+//waits for a byte without going through the Stream timeout so that it
+//doesn't add to the timeouts worked out from the round trip time
+bool XModem::read_byte_timed(byte *b, unsigned long timeout_ms) {
+  unsigned long start = millis();
+  do {
+    if(_serial->available() > 0) {
+      *b = _serial->read();
+      return true;
+    }
+  } while(millis() - start < timeout_ms);
+  return false;
+}
+
+bool XModem::find_byte_timed(byte b, unsigned long timeout_ms) {
+  unsigned long start = millis();
   do {
-    if(_serial->find(b)) return true;
-  } while(millis() < end);
+    if(_serial->available() > 0 && _serial->read() == b) return true;
+  } while(millis() - start < timeout_ms);
   return false;
 }
 
+//returns the header byte that was found or 0 if there wasn't one
+byte XModem::find_header_byte(unsigned long timeout_ms) {
+  byte header = 0;
+  STATS_ENTER(ack_wait_us, prev_phase);
+  unsigned long start = millis();
+  do {
+    if(_serial->available() <= 0) continue;
+    byte b = _serial->read();
+    if(is_header(b)) header = b;
+  } while(header == 0 && millis() - start < timeout_ms);
+  STATS_LEAVE(prev_phase);
+  if(header == 0) {
+    STATS_ADD(timeouts, 1);
+    TRACE(TIMEOUT, 'H', timeout_ms, NULL, 0);
+  }
+  return header;
+}
+
+//STX packets are only recognised when they are enabled so that receivers
+//without the memory for them don't mistake them for the start of a packet
+bool XModem::is_header(byte b) {
+  return b == SOH || (b == STX && _long_data_bytes != 0);
+}
+
 // DEFAULT HANDLERS
 bool XModem::dummy_rx_block_handler(void *blk_id, size_t idSize, byte *data, size_t dataSize) {
   return true;
@@ -486,28 +2354,209 @@ void XModem::dummy_block_lookup(void *blk_id, size_t idSize, byte *send_data, si
 }
 
 void XModem::basic_chksum(byte *data, size_t dataSize, byte *chksum) {
-  byte sum = 0;
+  basic_chksum_init(chksum);
+  basic_chksum_update(data, dataSize, chksum);
+}
+
+void XModem::basic_chksum_init(byte *chksum) {
+  *chksum = 0;
+}
+
+void XModem::basic_chksum_update(byte *data, size_t dataSize, byte *chksum) {
+  byte sum = *chksum;
   for(size_t i = 0; i < dataSize; ++i) sum += data[i];
   *chksum = sum;
 }
 
-void XModem::crc_16_chksum(byte *data, size_t dataSize, byte *chksum) {
+#if XMODEM_CRC_ENGINE == XMODEM_CRC_TABLE
+//crc_16_table[n] is the CRC of the single byte n, generated with the bitwise
+//algorithm below
+static const unsigned short crc_16_table[256] PROGMEM = {
+  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+  0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+  0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+  0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+  0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+  0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+  0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+  0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+  0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+  0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+  0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+  0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+  0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+  0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+  0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+  0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+  0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+  0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+  0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+  0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+  0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+  0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+  0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+  0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+  0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+  0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+  0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+  0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+  0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+  0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+  0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+  0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0
+};
+#elif XMODEM_CRC_ENGINE == XMODEM_CRC_NIBBLE
+//crc_16_nibble_table[n] is the CRC of the 4 bit value n
+static const unsigned short crc_16_nibble_table[16] PROGMEM = {
+  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+  0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+};
+#endif
+
+unsigned short xmodem_crc_16_update(unsigned short crc, const byte *data, size_t dataSize) {
+#if XMODEM_CRC_ENGINE == XMODEM_CRC_TABLE
+  //The top byte of the CRC XORed with the next data byte selects the
+  //remainder that the 8 bitwise steps would have produced
+  for(size_t i = 0; i < dataSize; ++i) {
+    crc = (crc << 8) ^ pgm_read_word(&crc_16_table[(byte) (crc >> 8) ^ data[i]]);
+  }
+#elif XMODEM_CRC_ENGINE == XMODEM_CRC_NIBBLE
+  //Same as the full table but processing 4 bits at a time
+  for(size_t i = 0; i < dataSize; ++i) {
+    crc = (crc << 4) ^ pgm_read_word(&crc_16_nibble_table[(crc >> 12) ^ (data[i] >> 4)]);
+    crc = (crc << 4) ^ pgm_read_word(&crc_16_nibble_table[(crc >> 12) ^ (data[i] & 0x0F)]);
+  }
+#else
   //XModem CRC prime number is 69665 -> 2^16 + 2^12 + 2^5 + 2^0 -> 10001000000100001 -> 0x11021
   //normal notation of this bit pattern omits the leading bit and represents it as 0x1021
   //in code we can omit the 2^16 term due to shifting before XORing when the MSB is a 1
   const unsigned short crc_prime = 0x1021;
-  unsigned short *crc = (unsigned short *) chksum;
-  *crc = 0;
 
   //We can ignore crc calulations that cross byte boundaries by just assuming
   //that the following byte is 0 and then fixup our simplification at the end
   //by XORing in the true value of the next byte into the most sygnificant byte
   //of the CRC
   for(size_t i = 0; i < dataSize; ++i) {
-    *crc ^= (((unsigned short) data[i]) << 8);
+    crc ^= (((unsigned short) data[i]) << 8);
     for(byte j = 0; j < 8; ++j) {
-      if(*crc & 0x8000) *crc = (*crc << 1) ^ crc_prime;
-      else *crc <<= 1;
+      if(crc & 0x8000) crc = (crc << 1) ^ crc_prime;
+      else crc <<= 1;
+    }
+  }
+#endif
+
+  return crc;
+}
+
+//the checksum has always been stored in native byte order, chksum may not be
+//aligned for an unsigned short so the running value is copied in and out
+void XModem::crc_16_chksum(byte *data, size_t dataSize, byte *chksum) {
+  crc_16_chksum_init(chksum);
+  crc_16_chksum_update(data, dataSize, chksum);
+}
+
+void XModem::crc_16_chksum_init(byte *chksum) {
+  unsigned short crc = 0;
+  memcpy(chksum, &crc, sizeof(crc));
+}
+
+void XModem::crc_16_chksum_update(byte *data, size_t dataSize, byte *chksum) {
+  unsigned short crc;
+  memcpy(&crc, chksum, sizeof(crc));
+  crc = xmodem_crc_16_update(crc, data, dataSize);
+  memcpy(chksum, &crc, sizeof(crc));
+}
+
+//standard byte order for the CRC, the high byte goes first
+void XModem::crc_16_be_chksum(byte *data, size_t dataSize, byte *chksum) {
+  crc_16_chksum_init(chksum);
+  crc_16_be_chksum_update(data, dataSize, chksum);
+}
+
+void XModem::crc_16_be_chksum_update(byte *data, size_t dataSize, byte *chksum) {
+  unsigned short crc = ((unsigned short) chksum[0] << 8) | chksum[1];
+  crc = xmodem_crc_16_update(crc, data, dataSize);
+  chksum[0] = crc >> 8;
+  chksum[1] = crc & 0xFF;
+}
+
+//LZSS with the block itself as the window. Every group of 8 items starts with
+//a flag byte, a clear bit is a literal byte and a set bit a 2 byte match of
+//12 bits distance - 1 and 4 bits length - 3 (3 to 18 bytes). Matches may
+//overlap the bytes they produce so a run costs a literal and then 2 bytes
+//for every 18 bytes of it
+#define LZSS_MIN_MATCH 3
+#define LZSS_MAX_MATCH 18
+#define LZSS_WINDOW 4096
+
+size_t xmodem_lzss_encode(const byte *in, size_t in_len, byte *out, size_t out_max) {
+  size_t i = 0;
+  size_t o = 0;
+  size_t flags = 0;
+  byte bit = 0;
+  while(i < in_len) {
+    if(bit == 0) {
+      if(o >= out_max) return 0;
+      flags = o;
+      out[o++] = 0;
+      bit = 1;
+    }
+
+    //the closest of the longest matches, a block is at most a few KB so a
+    //plain search is small enough and runs are found at the first distance
+    size_t max_len = in_len - i < LZSS_MAX_MATCH ? in_len - i : LZSS_MAX_MATCH;
+    size_t window = i < LZSS_WINDOW ? i : LZSS_WINDOW;
+    size_t best_len = 0;
+    size_t best_dist = 0;
+    for(size_t dist = 1; dist <= window && best_len < max_len; ++dist) {
+      size_t len = 0;
+      while(len < max_len && in[i - dist + len] == in[i + len]) ++len;
+      if(len > best_len) {
+        best_len = len;
+        best_dist = dist;
+      }
+    }
+
+    if(best_len >= LZSS_MIN_MATCH) {
+      if(o + 2 > out_max) return 0;
+      out[flags] |= bit;
+      out[o++] = (best_dist - 1) >> 4;
+      out[o++] = ((best_dist - 1) << 4) | (best_len - LZSS_MIN_MATCH);
+      i += best_len;
+    } else {
+      if(o >= out_max) return 0;
+      out[o++] = in[i++];
+    }
+    bit <<= 1;
+  }
+  return o;
+}
+
+//the coded block comes off the line so nothing in it is trusted
+bool xmodem_lzss_decode(const byte *in, size_t in_len, byte *out, size_t out_len) {
+  size_t i = 0;
+  size_t o = 0;
+  byte flags = 0;
+  byte bit = 0;
+  while(o < out_len) {
+    if(bit == 0) {
+      if(i >= in_len) return false;
+      flags = in[i++];
+      bit = 1;
+    }
+
+    if(flags & bit) {
+      if(i + 2 > in_len) return false;
+      size_t dist = (((size_t) in[i] << 4) | (in[i + 1] >> 4)) + 1;
+      size_t len = (in[i + 1] & 0x0F) + LZSS_MIN_MATCH;
+      i += 2;
+      if(dist > o || len > out_len - o) return false;
+      for(; len > 0; --len, ++o) out[o] = out[o - dist];
+    } else {
+      if(i >= in_len) return false;
+      out[o++] = in[i++];
     }
+    bit <<= 1;
   }
+  return i == in_len;
 }
@@ -12,36 +12,97 @@
 
 //XModem constants
 #define SOH (byte) 0x01 //Start of Header
+#define STX (byte) 0x02 //Start of 1K Header
 #define EOT (byte) 0x04 //End of Transmission
 #define ACK (byte) 0x06 //Acknowledge
 #define NAK (byte) 0x15 //Negative Acknowledge
 #define CAN (byte) 0x18 //Cancel Transmission
 #define SUB (byte) 0x1A //Padding
+#define WIN (byte) 0x57 //Windowed transfer request/agreement ('W')
+#define RES (byte) 0x52 //Resume request/agreement ('R')
+#define ZIP (byte) 0x5A //Compressed transfer request/agreement ('Z')
+
+//CRC-16 engines, select one by defining XMODEM_CRC_ENGINE in your build flags
+//all of them produce identical checksums they only trade memory for speed
+#define XMODEM_CRC_BITWISE 0 //no table, 8 shift/XOR steps per byte
+#define XMODEM_CRC_NIBBLE  1 //32 byte table, 2 lookups per byte
+#define XMODEM_CRC_TABLE   2 //512 byte table (stored in PROGMEM on AVR), 1 lookup per byte
+
+#ifndef XMODEM_CRC_ENGINE
+#define XMODEM_CRC_ENGINE XMODEM_CRC_TABLE
+#endif
+
+//events kept by the protocol trace when XMODEM_TRACE is defined, each one
+//takes 12 bytes of RAM
+#ifndef XMODEM_TRACE_EVENTS
+#define XMODEM_TRACE_EVENTS 16
+#endif
+
+//runs the CRC-16 over more data with the selected engine, start from 0
+unsigned short xmodem_crc_16_update(unsigned short crc, const byte *data, size_t dataSize);
+
+//LZSS codec used by compressed transfers, each block is coded on its own so the
+//block before it is never needed to decode it. encode returns 0 when the coded
+//block wouldn't fit in out_max bytes and decode returns FALSE for a coded block
+//that doesn't decode to exactly out_len bytes
+size_t xmodem_lzss_encode(const byte *in, size_t in_len, byte *out, size_t out_max);
+bool xmodem_lzss_decode(const byte *in, size_t in_len, byte *out, size_t out_len);
+
+//number of resends a 1K packet can need before the rest of the transfer drops
+//back to regular sized packets
+#ifndef XMODEM_1K_FALLBACK_RESENDS
+#define XMODEM_1K_FALLBACK_RESENDS 3
+#endif
+
+//bytes poll() writes at a time to a Stream whose availableForWrite() never
+//reports any room (the Print default), each write may wait for the device
+#ifndef XMODEM_POLL_WRITE_BYTES
+#define XMODEM_POLL_WRITE_BYTES 16
+#endif
 
 class XModem {
   public:
     enum ProtocolType {
       XMODEM,
-      CRC_XMODEM
+      CRC_XMODEM,
+      XMODEM_1K
     };
 
     XModem();
-    void begin(HardwareSerial &serial, XModem::ProtocolType type = XModem::ProtocolType::XMODEM);
+    void begin(Stream &serial, XModem::ProtocolType type = XModem::ProtocolType::XMODEM);
     void setIdSize(size_t size);
     void setChecksumSize(size_t size);
     void setDataSize(size_t size);
+    void setLongDataSize(size_t size);
     void setSendInitByte(byte b);
     void setRetryLimit(byte limit);
     void setSignalRetryDelay(unsigned long ms);
+    void setTimeoutBounds(unsigned long min_ms, unsigned long max_ms);
+    void setWindowSize(byte size);
     void allowNonSequentailBlocks(bool b);
     void bufferPacketReads(bool b);
+    void pipelineSends(bool b);
+    void compressTransfers(bool b);
+    void setReceiveQueue(byte blocks);
     void setRecieveBlockHandler(bool (*handler) (void *blk_id, size_t idSize, byte *data, size_t dataSize));
     void setBlockLookupHandler(void (*handler) (void *blk_id, size_t idSize, byte *send_data, size_t dataSize));
+    void setBlockLookupHandler(const byte *(*handler) (void *blk_id, size_t idSize, size_t dataSize));
+    void setBlockLookupHandler(size_t (*handler) (void *blk_id, size_t idSize, byte *send_data, size_t dataSize));
     void setChksumHandler(void (*handler) (byte *data, size_t dataSize, byte *chksum));
+    void setChksumHandler(void (*init) (byte *chksum), void (*update) (byte *data, size_t dataSize, byte *chksum), void (*final) (byte *chksum));
+    void setFileHandlers(bool (*open) (const char *name, unsigned long size, unsigned long mtime), void (*close) (bool complete));
+    void setCheckpointHandler(void (*handler) (void *blk_id, size_t idSize, unsigned long offset));
+    void setWorkBuffer(byte *buffer, size_t size);
+    size_t workBufferSize(bool batch = false);
     bool receive();
+    bool resume_receive(unsigned long long last_id, unsigned long offset);
+    bool receive_batch();
     bool send(byte data[], size_t data_len);
     bool send(byte data[], size_t data_len, unsigned long long start_id);
     bool lookup_send(unsigned long long id);
+    //count consecutive blocks in one transfer, a count of 0 returns false
+    //without starting one
+    bool lookup_send(unsigned long long start_id, size_t count);
 
     struct bulk_data {
       byte **data_arr;
@@ -52,19 +113,147 @@ class XModem {
 
     bool send_bulk_data(struct bulk_data container);
 
+    struct batch_file {
+      const char *name;
+      byte *data;
+      size_t len;
+      unsigned long mtime; //seconds since 1970-01-01 UTC, 0 if unknown
+    };
+
+    bool send_batch(struct batch_file *files, size_t count);
+
+#ifdef XMODEM_STATS
+    //counters and the time spent in each phase of the last blocking transfer,
+    //the phase times wrap around after about 71 minutes
+    struct transfer_stats {
+      unsigned long blocks_sent; //acknowledged by the receiver
+      unsigned long blocks_received; //new blocks that passed their checks
+      unsigned long resends; //packets written again
+      unsigned long duplicates; //packets for a block that was already received
+      unsigned long naks; //NAK signals sent or received
+      unsigned long cans; //CAN bytes received
+      unsigned long timeouts; //waits for the other device that ran out
+      unsigned long resyncs; //searches for the next packet header
+      unsigned long wire_bytes; //packet bytes written or read, resends included
+      unsigned long payload_bytes; //data bytes of the blocks counted above without padding
+      unsigned long handshake_us; //waiting for the transfer to start
+      unsigned long chksum_us; //calculating checksums
+      unsigned long wire_us; //writing and reading packets
+      unsigned long ack_wait_us; //waiting for ACK/NAK signals or the next packet
+      unsigned long handler_us; //receive, lookup, file and checkpoint handlers
+      unsigned long other_us; //everything else, eg. copying and coding blocks
+    };
+
+    const struct transfer_stats &stats();
+#endif
+
+#ifdef XMODEM_TRACE
+    //the last XMODEM_TRACE_EVENTS protocol events of the blocking transfers,
+    //dumpTrace writes them out in the binary form read by trace_decode
+    void clearTrace();
+    void dumpTrace(Stream &out);
+#endif
+
+    //non-blocking transfers, start one with beginReceive/beginSend and then
+    //call poll() regularly until it stops returning IN_PROGRESS
+    enum TransferStatus {
+      IDLE,
+      IN_PROGRESS,
+      COMPLETE,
+      FAILED
+    };
+
+    bool beginReceive();
+    bool beginSend(byte data[], size_t data_len);
+    bool beginSend(byte data[], size_t data_len, unsigned long long start_id);
+    XModem::TransferStatus poll();
+    void cancel();
+
   private:
-    HardwareSerial *_serial;
+    Stream *_serial;
     byte _rx_init_byte;
     size_t _id_bytes;
     size_t _chksum_bytes;
     size_t _data_bytes;
+    size_t _long_data_bytes; //data bytes in a STX packet, 0 when they aren't used
     byte retry_limit;
     unsigned long _signal_retry_delay_ms;
+    unsigned long _min_timeout_ms;
+    unsigned long _max_timeout_ms;
+    //round trip time estimate, the retransmit timeout is the smoothed round
+    //trip time plus 4 times its mean deviation like TCP
+    long _srtt; //ms scaled by 8, negative until the first sample
+    long _rttvar; //ms scaled by 4
+    unsigned long _rto_ms;
+    //when the windowed NAK being answered was written, it is timed to the
+    //block it asks for as packets already in flight can follow it straight away
+    unsigned long _nak_at;
+    bool _nak_timed; //false when there isn't one or it had to be repeated
     bool _allow_nonsequential;
     bool _buffer_packet_reads;
+    bool _pipeline_sends; //build the next packet while waiting for an ACK
+    byte _window_size;
+    bool _window_active; //negotiated during init_rx/init_tx
+    bool _compress;
+    bool _compress_active; //negotiated during init_rx/init_tx
+    byte _rx_queue_size; //blocks a non-blocking receive can ACK before handling them
     bool (*process_rx_block) (void *blk_id, size_t id_bytes, byte *data, size_t dataSize);
     void (*block_lookup) (void *blk_id, size_t id_bytes, byte *data, size_t dataSize);
+    const byte *(*block_lookup_ptr) (void *blk_id, size_t id_bytes, size_t dataSize);
+    //block_lookup that reports how much data it had, NULL when not set
+    size_t (*block_lookup_len) (void *blk_id, size_t id_bytes, byte *data, size_t dataSize);
+    bool (*file_open) (const char *name, unsigned long size, unsigned long mtime);
+    void (*file_close) (bool complete);
+    void (*checkpoint) (void *blk_id, size_t id_bytes, unsigned long offset);
     void (*calc_chksum) (byte *data, size_t dataSize, byte *chksum);
+    //optional incremental form of calc_chksum, the running state is kept in
+    //the chksum bytes, chksum_update is NULL when only calc_chksum is available
+    void (*chksum_init) (byte *chksum);
+    void (*chksum_update) (byte *data, size_t dataSize, byte *chksum);
+    void (*chksum_final) (byte *chksum);
+    //resuming an earlier transfer, see resume_receive(). A receiver asks for
+    //it and a sender sets _resume once it has agreed
+    bool _resume;
+    bool _resume_confirmed; //the sender echoed the checkpoint back
+    unsigned long long _resume_id; //last block id the receiver committed
+    unsigned long _resume_offset; //data bytes the receiver committed
+    unsigned long _rx_offset; //data bytes committed so far by the receiver
+    //caller owned memory used in place of the heap, NULL to use malloc
+    byte *_work_buffer;
+    size_t _work_size;
+    size_t _work_used;
+#ifdef XMODEM_STATS
+    struct transfer_stats _stats;
+    unsigned long *_stats_phase; //field of the phase being timed, NULL between transfers
+    unsigned long _stats_mark; //micros() when the phase started
+    byte _stats_depth; //transfers started inside another, eg. the files of send_batch()
+#endif
+#ifdef XMODEM_TRACE
+    //NOTE: the values are part of the dump format, they match xmodem_trace_type
+    //in the linux port
+    enum TraceType {
+      TRACE_START = 1, //value is 'S' send, 'R' receive, 's'/'r' for a batch
+      TRACE_END, //value is 1 if the transfer worked
+      TRACE_TX_FRAME, //value is the header, aux the data bytes written
+      TRACE_RX_FRAME, //a new block passed its checks, aux is its data bytes
+      TRACE_RX_DUP, //a block that was already received
+      TRACE_RX_BAD, //a packet that failed its checks, value is the header
+      TRACE_TX_SIGNAL, //value is the signal, aux the attempt
+      TRACE_RX_SIGNAL, //value is the signal
+      TRACE_TIMEOUT, //value is 'I' init, 'H' header, 'P' packet, 'S' signal or the signal that wasn't answered, aux the wait in ms
+      TRACE_RESEND, //a packet is written again, aux is the attempt
+      TRACE_RESYNC //searching for the next packet header
+    };
+    struct trace_event {
+      unsigned long time_us; //micros()
+      unsigned long id; //the last 4 bytes of the block id, 0 when there isn't one
+      unsigned short aux;
+      byte type;
+      byte value;
+    };
+    struct trace_event _trace[XMODEM_TRACE_EVENTS];
+    unsigned long _trace_count; //events added since clearTrace()
+#endif
 
     //NOTE: The function definitions for these in the cpp file don't include
     //      the static keyword because static is an overloaded keyword, here it means
@@ -74,31 +263,140 @@ class XModem {
     static void dummy_block_lookup(void *blk_id, size_t idSize, byte *data, size_t dataSize);
     static void basic_chksum(byte *data, size_t dataSize, byte *chksum);
     static void crc_16_chksum(byte *data, size_t dataSize, byte *chksum);
+    static void basic_chksum_init(byte *chksum);
+    static void basic_chksum_update(byte *data, size_t dataSize, byte *chksum);
+    static void crc_16_chksum_init(byte *chksum);
+    static void crc_16_chksum_update(byte *data, size_t dataSize, byte *chksum);
+    static void crc_16_be_chksum(byte *data, size_t dataSize, byte *chksum);
+    static void crc_16_be_chksum_update(byte *data, size_t dataSize, byte *chksum);
 
     struct packet {
-      byte *id;
+      byte *id; //only used when receiving
+      byte *header; //only used when sending
       byte *chksum;
       byte *data;
+      size_t data_bytes; //_data_bytes or _long_data_bytes depending on the header
+#ifdef XMODEM_STATS
+      size_t data_len; //data bytes before the padding, only used when sending
+#endif
     };
 
-    bool init_rx();
-    bool find_header();
-    bool rx();
+    //non-blocking transfer state, see poll()
+    enum PollState {
+      POLL_IDLE,
+      POLL_RX_INIT,     //waiting for the first packet after sending the init byte
+      POLL_RX_HEADER,   //waiting for the next packet after an ACK/NAK
+      POLL_RX_PACKET,   //reading the rest of a packet
+      POLL_RX_PURGE,    //waiting for the line to go quiet before sending a NAK
+      POLL_RX_EOT,      //waiting for the second EOT
+      POLL_RX_FULL,     //holding a good block until there is room for it in the queue
+      POLL_TX_INIT,     //waiting for the receiver's init byte
+      POLL_TX_PACKET,   //writing a packet out
+      POLL_TX_RESPONSE, //waiting for the ACK/NAK of a packet
+      POLL_TX_EOT       //waiting for the ACK of an EOT
+    };
+    PollState _poll_state;
+    TransferStatus _poll_status; //returned by poll() while idle
+    byte *_poll_buffer;
+    struct packet _poll_packet;
+    byte *_poll_data; //next block to send, NULL when it is looked up
+    size_t _poll_data_len; //bytes left to send
+    size_t _poll_count; //bytes of the current packet read or written so far
+    byte _poll_tries;
+    bool _poll_long_packets;
+    bool _poll_can; //the last signal was a CAN
+    bool _poll_write_room; //availableForWrite() has reported room this transfer
+    unsigned long _poll_timer;
+    unsigned long _poll_timeout;
+    unsigned long _poll_sent; //when the last signal went out
+    //blocks that have been ACKed but not given to the receive handler yet, see
+    //setReceiveQueue(). Each one is a queued_block followed by the id and data
+    struct queued_block {
+      size_t data_len; //without the padding
+      size_t data_bytes;
+    };
+    byte *_poll_queue;
+    byte _poll_queue_first;
+    byte _poll_queued;
+
+    XModem::TransferStatus poll_rx();
+    bool poll_rx_block();
+    bool poll_rx_error();
+    void poll_rx_ack();
+    void poll_rx_enqueue();
+    bool poll_rx_dequeue();
+    XModem::TransferStatus poll_tx();
+    void poll_tx_block();
+    bool poll_tx_resend();
+    void poll_wait(unsigned long ms);
+    bool poll_timed_out();
+    XModem::TransferStatus poll_finish(bool result);
+
+    bool init_rx(byte *header, bool allow_window);
+    byte find_header(byte *nak, size_t nak_len);
+    bool rx(byte header, unsigned long *remaining);
     bool read_block(struct packet *p, byte *buffer);
     bool read_block_buffered(struct packet *p, byte *buffer);
     bool read_block_unbuffered(struct packet *p);
-    bool fill_buffer(byte *buffer, size_t bytes);
+    bool read_block_coded(struct packet *p, byte *buffer);
+    bool check_block(struct packet *p, byte *buffer);
+    void commit_block(struct packet *p);
+    void resume_block(struct packet *p, byte *prev_blk_id, byte *expected_id);
+    bool fill_buffer(byte *buffer, size_t bytes, byte *chksum);
+    void finish_chksum(struct packet *p);
+    void chksum_block(byte *data, size_t dataSize, byte *chksum);
+
+    bool init_tx(struct bulk_data *resumable);
+    bool tx(struct packet *slots, byte *staging, size_t slot_count, byte *data, size_t data_len, byte *blk_id);
+    bool build_next(struct packet *p, byte *staging, byte **data, size_t *remaining, bool long_packets, byte *blk_id);
+    bool tx_windowed(struct packet *slots, byte *staging, byte *data, size_t data_len, byte *blk_id, byte *ack_id);
+    size_t build_packet(struct packet *p, byte *id, byte *data, size_t data_len);
+    void code_packet(struct packet *p);
+    bool send_packet(struct packet *p, byte *resends);
+    bool write_packet(struct packet *p);
+    bool await_ack(struct packet *p, byte *resends);
+    bool close_tx(byte *ack_id);
+
+    byte *work_alloc(size_t bytes);
+    void work_free(byte *block);
+    size_t work_bytes(size_t bytes);
+    size_t send_buffer_bytes(size_t slot_count, size_t staging_count, bool coded);
+    size_t rx_buffer_bytes(bool windowed);
+    size_t rx_coded_buffer_bytes();
+    size_t rx_batch_buffer_bytes();
+    size_t tx_batch_buffer_bytes();
+    size_t rx_poll_buffer_bytes();
+    size_t rx_queue_slot_bytes();
+    size_t tx_poll_buffer_bytes();
+
+#ifdef XMODEM_STATS
+    void stats_begin();
+    void stats_end();
+    unsigned long *stats_phase(unsigned long *phase);
+#endif
+#ifdef XMODEM_TRACE
+    void trace(byte type, byte value, size_t aux, const byte *id, size_t stride);
+#endif
 
-    bool init_tx();
-    bool tx(struct packet *p, byte *data, size_t data_len, byte *blk_id);
-    void build_packet(struct packet *p, byte *id, byte *data, size_t data_len);
-    bool send_packet(struct packet *p);
-    bool close_tx();
+    void rtt_reset();
+    void rtt_sample(unsigned long ms);
+    void rtt_backoff();
 
     void increment_id(byte *id, size_t length);
+    void encode_id(byte *id, unsigned long long val);
+    unsigned long long id_mask();
+    void write_resume_signal(unsigned long long id, unsigned long offset);
+    bool read_resume_signal(unsigned long long *id, unsigned long *offset);
     byte tx_signal(byte signal);
-    byte rx_signal();
-    bool find_byte_timed(byte b, byte timeout_secs);
+    byte tx_signal(byte *signal, size_t signal_len);
+    byte rx_signal(unsigned long timeout_ms);
+    byte rx_window_signal(byte *id);
+    void encode_window_signal(byte *signal, byte type, byte *id);
+    unsigned long low_id(byte *id);
+    bool read_byte_timed(byte *b, unsigned long timeout_ms);
+    bool find_byte_timed(byte b, unsigned long timeout_ms);
+    byte find_header_byte(unsigned long timeout_ms);
+    bool is_header(byte b);
 };
 
 #endif
@@ -0,0 +1,82 @@
+#include "Arduino.h"
+#include "XModemLoopback.h"
+
+XModemLoopback::XModemLoopback(byte *buffer, size_t size) {
+  _buffer = buffer;
+  _size = size;
+  _head = 0;
+  _tail = 0;
+  _peer = NULL;
+  _idle = NULL;
+}
+
+void XModemLoopback::connect(XModemLoopback &other) {
+  _peer = &other;
+  other._peer = this;
+}
+
+void XModemLoopback::setIdleHandler(void (*handler) (void)) {
+  _idle = handler;
+}
+
+int XModemLoopback::available() {
+  if(used() == 0 && _idle != NULL) _idle();
+  return used();
+}
+
+int XModemLoopback::read() {
+  if(available() == 0) return -1;
+  byte b = _buffer[_head];
+  _head = (_head + 1) % _size;
+  return b;
+}
+
+int XModemLoopback::peek() {
+  if(available() == 0) return -1;
+  return _buffer[_head];
+}
+
+size_t XModemLoopback::write(uint8_t b) {
+  return write(&b, 1);
+}
+
+//writes what fits in the other end's buffer, a write that still doesn't fit
+//after the idle handler has run is cut short like a serial device dropping
+//bytes when nobody reads them
+size_t XModemLoopback::write(const uint8_t *buffer, size_t size) {
+  if(_peer == NULL) return 0;
+
+  size_t written = 0;
+  while(written < size) {
+    size_t free = _peer->room();
+    if(free == 0) {
+      if(_idle != NULL) _idle();
+      free = _peer->room();
+      if(free == 0) break;
+    }
+
+    //copy up to the end of the ring in one go
+    size_t len = size - written;
+    if(len > free) len = free;
+    if(len > _peer->_size - _peer->_tail) len = _peer->_size - _peer->_tail;
+    memcpy(_peer->_buffer + _peer->_tail, buffer + written, len);
+    _peer->_tail = (_peer->_tail + len) % _peer->_size;
+    written += len;
+  }
+  return written;
+}
+
+int XModemLoopback::availableForWrite() {
+  if(_peer == NULL) return 0;
+  return _peer->room();
+}
+
+void XModemLoopback::flush() {}
+
+size_t XModemLoopback::used() {
+  return (_tail + _size - _head) % _size;
+}
+
+size_t XModemLoopback::room() {
+  return _size - 1 - used();
+}
@@ -0,0 +1,44 @@
+/*
+ * XModemLoopback.h - In memory Stream for connecting two XModem objects
+ *
+ * Each end of the loopback receives into its own ring buffer and writes into
+ * the buffer of the end it is connected to, so a sender and a receiver can be
+ * run against each other without any serial hardware. Neither end is thread
+ * safe, both have to be used from the same thread.
+ */
+#ifndef XModemLoopback_h
+#define XModemLoopback_h
+#include "Arduino.h"
+
+class XModemLoopback : public Stream {
+  public:
+    //buffer holds the bytes waiting to be read from this end, one byte of it
+    //is always kept free to tell a full buffer from an empty one
+    XModemLoopback(byte *buffer, size_t size);
+    void connect(XModemLoopback &other);
+    //called when this end has nothing to read or no room to write, it can
+    //move the other end along (eg. by calling its XModem's poll())
+    void setIdleHandler(void (*handler) (void));
+
+    int available();
+    int read();
+    int peek();
+    size_t write(uint8_t b);
+    size_t write(const uint8_t *buffer, size_t size);
+    int availableForWrite();
+    void flush();
+    using Print::write;
+
+  private:
+    byte *_buffer;
+    size_t _size;
+    size_t _head; //next byte to read
+    size_t _tail; //next free byte
+    XModemLoopback *_peer;
+    void (*_idle) (void);
+
+    size_t used();
+    size_t room();
+};
+
+#endif
@@ -0,0 +1,510 @@
+/*
+ * XModemT.h - XModem transfers with the packet layout fixed at compile time
+ *
+ * XModemT<IdBytes, DataBytes, Checksum> speaks the same protocol as an XModem
+ * object set up with the same id size, data size and checksum but everything
+ * that XModem reads from runtime fields is a template parameter instead:
+ *
+ *  - The packet buffer is a member array so send() and receive() never use
+ *    the heap.
+ *  - The checksum is a policy class that is called directly instead of
+ *    through the calc_chksum function pointer so the compiler can inline it.
+ *  - Block ids are kept in a native integer so incrementing and comparing
+ *    them is a single operation instead of a loop over the id bytes.
+ *
+ * Only regular blocking transfers are supported: no windows, <STX> packets,
+ * batch transfers or poll(). Use the XModem class for those.
+ */
+#ifndef XModemT_h
+#define XModemT_h
+#include "Arduino.h"
+#include "XModem.h"
+
+//Checksum policies. value_type is the running checksum, store() writes it out
+//in the byte order it goes on the wire and init_byte is what a receiver sends
+//to start the transfer
+struct XModemSumChecksum { //same as XModem::ProtocolType::XMODEM
+  typedef byte value_type;
+  static const size_t bytes = 1;
+  static const byte init_byte = NAK;
+  static value_type init() { return 0; }
+  static value_type update(value_type sum, const byte *data, size_t dataSize) {
+    for(size_t i = 0; i < dataSize; ++i) sum += data[i];
+    return sum;
+  }
+  static void store(value_type sum, byte *chksum) { chksum[0] = sum; }
+};
+
+struct XModemCRC16 { //same as XModem::ProtocolType::CRC_XMODEM, native byte order
+  typedef unsigned short value_type;
+  static const size_t bytes = 2;
+  static const byte init_byte = 'C';
+  static value_type init() { return 0; }
+  static value_type update(value_type crc, const byte *data, size_t dataSize) {
+    return xmodem_crc_16_update(crc, data, dataSize);
+  }
+  static void store(value_type crc, byte *chksum) { memcpy(chksum, &crc, sizeof(crc)); }
+};
+
+struct XModemCRC16BE { //the CRC high byte first like XMODEM-1K and most other tools
+  typedef unsigned short value_type;
+  static const size_t bytes = 2;
+  static const byte init_byte = 'C';
+  static value_type init() { return 0; }
+  static value_type update(value_type crc, const byte *data, size_t dataSize) {
+    return xmodem_crc_16_update(crc, data, dataSize);
+  }
+  static void store(value_type crc, byte *chksum) {
+    chksum[0] = crc >> 8;
+    chksum[1] = crc & 0xFF;
+  }
+};
+
+//smallest unsigned integer that holds an id of N bytes
+template <size_t N> struct XModemIdType { typedef unsigned long long type; };
+template <> struct XModemIdType<1> { typedef uint8_t type; };
+template <> struct XModemIdType<2> { typedef uint16_t type; };
+template <> struct XModemIdType<3> { typedef uint32_t type; };
+template <> struct XModemIdType<4> { typedef uint32_t type; };
+
+template <size_t IdBytes = 1, size_t DataBytes = 128, class Checksum = XModemSumChecksum>
+class XModemT {
+    static_assert(IdBytes >= 1 && IdBytes <= 8, "XModemT ids have to be 1 to 8 bytes");
+    static_assert(DataBytes >= 1, "XModemT packets need at least one data byte");
+
+  public:
+    typedef typename XModemIdType<IdBytes>::type id_type;
+
+    XModemT() {}
+
+    void begin(Stream &serial) {
+      _serial = &serial;
+      _retry_limit = 10;
+      _min_timeout_ms = 100;
+      _max_timeout_ms = 10000;
+      rtt_reset();
+      _allow_nonsequential = false;
+      _process_rx_block = dummy_rx_block_handler;
+      _block_lookup = dummy_block_lookup;
+      _block_lookup_ptr = NULL;
+      _block_lookup_len = NULL;
+    }
+
+    void setRetryLimit(byte limit) { _retry_limit = limit; }
+    void setTimeoutBounds(unsigned long min_ms, unsigned long max_ms) {
+      _min_timeout_ms = min_ms;
+      _max_timeout_ms = max_ms;
+      rtt_reset();
+    }
+    void allowNonSequentailBlocks(bool b) { _allow_nonsequential = b; }
+    void setRecieveBlockHandler(bool (*handler) (void *blk_id, size_t idSize, byte *data, size_t dataSize)) {
+      _process_rx_block = handler;
+    }
+    void setBlockLookupHandler(void (*handler) (void *blk_id, size_t idSize, byte *send_data, size_t dataSize)) {
+      _block_lookup = handler;
+      _block_lookup_ptr = NULL;
+      _block_lookup_len = NULL;
+    }
+    void setBlockLookupHandler(const byte *(*handler) (void *blk_id, size_t idSize, size_t dataSize)) {
+      _block_lookup_ptr = handler;
+    }
+    void setBlockLookupHandler(size_t (*handler) (void *blk_id, size_t idSize, byte *send_data, size_t dataSize)) {
+      _block_lookup_len = handler;
+      _block_lookup_ptr = NULL;
+    }
+
+    bool receive() {
+      byte header;
+      rtt_reset();
+      if(!init_rx(&header) || !rx(header)) {
+        //An unrecoverable error occured send cancels to terminate the transaction
+        send_cancels();
+        return false;
+      }
+      return true;
+    }
+
+    bool send(byte data[], size_t data_len) {
+      return send(data, data_len, 1);
+    }
+
+    bool send(byte data[], size_t data_len, unsigned long long start_id) {
+      bool result = init_tx();
+      rtt_reset();
+      if(result && !tx(data, data_len, (id_type) start_id & id_mask)) {
+        //An unrecoverable error occured send cancels to terminate the transaction
+        send_cancels();
+        return false;
+      }
+      return result && close_tx();
+    }
+
+    bool lookup_send(unsigned long long id) {
+      return lookup_send(id, 1);
+    }
+
+    bool lookup_send(unsigned long long start_id, size_t count) {
+      return send((byte *) NULL, count, start_id);
+    }
+
+  private:
+    //ids wrap around at IdBytes bytes like XModem's byte arrays do
+    static const id_type id_mask = (id_type) ~(id_type) 0 >> 8*(sizeof(id_type) - IdBytes);
+    static const size_t header_bytes = 1 + 2*IdBytes;
+    static const size_t data_start = 2*IdBytes;
+    static const size_t frame_bytes = 2*IdBytes + DataBytes + Checksum::bytes;
+
+    Stream *_serial;
+    byte _retry_limit;
+    unsigned long _min_timeout_ms;
+    unsigned long _max_timeout_ms;
+    //round trip time estimate, see XModem
+    long _srtt; //ms scaled by 8, negative until the first sample
+    long _rttvar; //ms scaled by 4
+    unsigned long _rto_ms;
+    bool _allow_nonsequential;
+    bool (*_process_rx_block) (void *blk_id, size_t id_bytes, byte *data, size_t dataSize);
+    void (*_block_lookup) (void *blk_id, size_t id_bytes, byte *data, size_t dataSize);
+    const byte *(*_block_lookup_ptr) (void *blk_id, size_t id_bytes, size_t dataSize);
+    size_t (*_block_lookup_len) (void *blk_id, size_t id_bytes, byte *data, size_t dataSize);
+
+    //a received packet after its header, when sending its data bytes are the
+    //staging block for looked up and padded blocks
+    byte _frame[frame_bytes];
+    byte _header[header_bytes];
+    byte _chksum[Checksum::bytes];
+    byte _id[IdBytes]; //big endian copy of the current id for the handlers
+    byte *_data; //data of the packet being sent
+
+    static bool dummy_rx_block_handler(void *blk_id, size_t idSize, byte *data, size_t dataSize) {
+      return true;
+    }
+
+    static void dummy_block_lookup(void *blk_id, size_t idSize, byte *send_data, size_t dataSize) {
+      memset(send_data, 0x3A, dataSize);
+    }
+
+    void send_cancels() {
+      _serial->write(CAN);
+      _serial->write(CAN);
+      _serial->write(CAN);
+    }
+
+    // RECEIVE
+    bool init_rx(byte *header) {
+      byte i = 0;
+      do {
+        _serial->write(Checksum::init_byte);
+        unsigned long start = millis();
+        do {
+          if(_serial->available() <= 0) continue;
+          byte b = _serial->read();
+          //an empty transfer ends straight away
+          if(b == SOH || b == EOT) {
+            *header = b;
+            return true;
+          }
+        } while(millis() - start < _max_timeout_ms);
+      } while(i++ < _retry_limit);
+      return false;
+    }
+
+    bool rx(byte header) {
+      id_type prev_blk_id = 0;
+      id_type expected_id = 0;
+      size_t errors = 0;
+      while(true) {
+        id_type id;
+        bool valid = header != EOT && read_block(&id);
+        if(valid) {
+          //reset errors
+          errors = 0;
+
+          //if its a duplicate block we still need to send an ACK
+          if(id != prev_blk_id) {
+            if(_allow_nonsequential) {
+              expected_id = id;
+            } else {
+              expected_id = (expected_id + 1) & id_mask;
+              if(expected_id != id) break;
+            }
+
+            //count number of padding SUB bytes
+            byte *data = _frame + data_start;
+            size_t data_len = DataBytes;
+            while(data_len > 0 && data[data_len - 1] == SUB) --data_len;
+
+            //process packet
+            if(!_process_rx_block(_id, IdBytes, data, data_len)) break;
+            prev_blk_id = expected_id;
+          }
+        }
+
+        byte response;
+        if(header == EOT) {
+          response = EOT;
+        } else if(valid) {
+          response = tx_signal(ACK);
+        } else {
+          if(++errors > _retry_limit) break;
+          response = tx_signal(NAK);
+        }
+
+        //a lone CAN is likely just a corrupted byte, see XModem::rx()
+        if(response == CAN && rx_signal(_rto_ms) == CAN) break;
+        if(response == EOT) {
+          response = tx_signal(NAK);
+          if(response == CAN) break;
+          if(response == EOT) {
+            _serial->write(ACK);
+            return true;
+          }
+        }
+        // Unexpected response and resync attempt failed so fail out
+        if(response == SOH) header = response;
+        else if((header = find_header()) == 0) break;
+      }
+      return false;
+    }
+
+    //reads the packet after its header and checksums the data of each chunk as
+    //soon as it arrives like XModem::read_block_buffered()
+    bool read_block(id_type *id) {
+      const size_t data_end = data_start + DataBytes;
+      typename Checksum::value_type sum = Checksum::init();
+      size_t count = 0;
+      while(count < frame_bytes) {
+        //bytes that have already arrived are read without going through
+        //readBytes() which checks the time for every byte
+        int available = _serial->available();
+        size_t r = available > 0 ? available : 0;
+        if(r > frame_bytes - count) r = frame_bytes - count;
+        for(size_t i = 0; i < r; ++i) _frame[count + i] = _serial->read();
+
+        //only signal an error condition if no data has been received at all
+        //within the serial timeout period
+        if(r == 0 && (r = _serial->readBytes(_frame + count, 1)) == 0) return false;
+
+        size_t start = count > data_start ? count : data_start;
+        count += r;
+        size_t end = count < data_end ? count : data_end;
+        if(start < end) sum = Checksum::update(sum, _frame + start, end - start);
+      }
+
+      id_type val = 0;
+      for(size_t i = 0; i < IdBytes; ++i) {
+        //Because of C integer promotion rules the ~ operator changes
+        //the variable type of an unsigned char (byte) to a char so we need to
+        //cast it back
+        if(_frame[2*i] != (byte) ~_frame[2*i + 1]) return false;
+        _id[i] = _frame[2*i];
+        val = (id_type) (val << 8) | _frame[2*i];
+      }
+      *id = val;
+
+      byte chksum[Checksum::bytes];
+      Checksum::store(sum, chksum);
+      return memcmp(chksum, _frame + data_end, Checksum::bytes) == 0;
+    }
+
+    byte find_header() {
+      byte i = 0;
+      do {
+        if(i != 0) _serial->write(NAK);
+        unsigned long start = millis();
+        do {
+          if(_serial->available() > 0 && _serial->read() == SOH) return SOH;
+        } while(millis() - start < _rto_ms);
+        rtt_backoff();
+      } while(i++ < _retry_limit);
+      return 0;
+    }
+
+    // SEND
+    bool init_tx() {
+      byte i = 0;
+      do {
+        unsigned long start = millis();
+        do {
+          if(_serial->available() > 0 && _serial->read() == Checksum::init_byte) return true;
+        } while(millis() - start < 6*_max_timeout_ms);
+      } while(i++ < _retry_limit);
+      return false;
+    }
+
+    bool tx(byte *data, size_t data_len, id_type id) {
+      //flush incoming data before starting
+      while(_serial->available()) _serial->read();
+
+      if(data == NULL) {
+        //need to use block_lookup to fill in the packet data, data_len is the
+        //number of blocks to look up, see XModem::tx()
+        size_t blocks = data_len == 0 ? 1 : data_len;
+        for(size_t i = 0; i < blocks; ++i) {
+          size_t filled = build_packet(id, NULL, DataBytes);
+          if(filled == 0) break;
+          id = (id + 1) & id_mask;
+          if(!send_packet()) return false;
+          if(filled < DataBytes) break;
+        }
+        return true;
+      }
+
+      byte *data_end = data + data_len;
+      while(data != data_end) {
+        size_t remaining = data_end - data;
+        size_t block_len = remaining < DataBytes ? remaining : DataBytes;
+        build_packet(id, data, block_len);
+        id = (id + 1) & id_mask;
+        if(!send_packet()) return false;
+        data += block_len;
+      }
+      return true;
+    }
+
+    size_t build_packet(id_type id, byte *data, size_t data_len) {
+      _header[0] = SOH;
+      for(size_t i = 0; i < IdBytes; ++i) {
+        byte b = (byte) (id >> 8*(IdBytes - 1 - i));
+        _id[i] = b;
+        _header[1 + 2*i] = b;
+        _header[2 + 2*i] = ~b;
+      }
+
+      //full blocks are sent straight from the callers memory
+      byte *staging = _frame + data_start;
+      if(data == NULL) {
+        //the send path never writes to the packet data so it is safe to cast
+        //away the const of data that the lookup handler already has in memory
+        const byte *found = _block_lookup_ptr == NULL ? NULL : _block_lookup_ptr(_id, IdBytes, DataBytes);
+        if(found != NULL) {
+          _data = (byte *) found;
+        } else if(_block_lookup_len != NULL) {
+          _data = staging;
+          data_len = _block_lookup_len(_id, IdBytes, _data, DataBytes);
+          if(data_len > DataBytes) data_len = DataBytes;
+          memset(_data + data_len, SUB, DataBytes - data_len);
+        } else {
+          _data = staging;
+          _block_lookup(_id, IdBytes, _data, DataBytes);
+        }
+      } else if(data_len == DataBytes) {
+        _data = data;
+      } else {
+        _data = staging;
+        memcpy(_data, data, data_len);
+        memset(_data + data_len, SUB, DataBytes - data_len);
+      }
+
+      Checksum::store(Checksum::update(Checksum::init(), _data, DataBytes), _chksum);
+      return data_len;
+    }
+
+    //the receiver's timeouts recover lost packets and signals, see XModem::send_packet()
+    bool send_packet() {
+      byte tries = 0;
+      do {
+        _serial->write(_header, header_bytes);
+        _serial->write(_data, DataBytes);
+        _serial->write(_chksum, Checksum::bytes);
+
+        byte response = rx_signal(_max_timeout_ms);
+        if(response == ACK) return true;
+        if(response == NAK) continue;
+        if(response == CAN && rx_signal(_rto_ms) == CAN) break;
+      } while(tries++ < _retry_limit);
+      return false;
+    }
+
+    bool close_tx() {
+      byte error_responses = 0;
+      while(error_responses < _retry_limit) {
+        //the receiver NAKs the first EOT and repeats its NAK if ours got lost
+        _serial->write(EOT);
+        byte response = rx_signal(_max_timeout_ms);
+        if(response == ACK) return true;
+        if(response == NAK) continue;
+        if(response == CAN) {
+          if(rx_signal(_rto_ms) == CAN) break;
+        } else ++error_responses;
+      }
+      return false;
+    }
+
+    // SHARED
+    void rtt_reset() {
+      _srtt = -1;
+      _rttvar = 0;
+      _rto_ms = 1000;
+      if(_rto_ms < _min_timeout_ms) _rto_ms = _min_timeout_ms;
+      if(_rto_ms > _max_timeout_ms) _rto_ms = _max_timeout_ms;
+    }
+
+    //see XModem::rtt_sample()
+    void rtt_sample(unsigned long ms) {
+      if(_srtt < 0) {
+        _srtt = (long) ms << 3;
+        _rttvar = (long) ms << 1;
+      } else {
+        long err = (long) ms - (_srtt >> 3);
+        _srtt += err;
+        if(err < 0) err = -err;
+        _rttvar += err - (_rttvar >> 2);
+      }
+
+      _rto_ms = (_srtt >> 3) + _rttvar;
+      if(_rto_ms < _min_timeout_ms) _rto_ms = _min_timeout_ms;
+      if(_rto_ms > _max_timeout_ms) _rto_ms = _max_timeout_ms;
+    }
+
+    void rtt_backoff() {
+      _rto_ms = 2*_rto_ms > _max_timeout_ms ? _max_timeout_ms : 2*_rto_ms;
+    }
+
+    //see XModem::tx_signal(), only regular single byte signals are sent here
+    byte tx_signal(byte signal) {
+      if(signal == NAK) {
+        //flush to make sure the line is clear
+        while(_serial->available()) _serial->read();
+      }
+      byte i = 0;
+      do {
+        _serial->write(signal);
+        unsigned long sent_at = millis();
+        while(millis() - sent_at < _rto_ms) {
+          if(_serial->available() <= 0) continue;
+          byte val = _serial->read();
+          switch(val) {
+            case SOH:
+            case EOT:
+            case CAN:
+            case ACK:
+            case NAK:
+              if(i == 0) rtt_sample(millis() - sent_at);
+              return val;
+          }
+          //anything else is the rest of a packet whose header got lost
+        }
+
+        rtt_backoff();
+        //never repeat an ACK, a NAK gets either the lost packet or the one we
+        //ACKed sent again
+        signal = NAK;
+      } while(++i < _retry_limit);
+      return 255;
+    }
+
+    byte rx_signal(unsigned long timeout_ms) {
+      unsigned long start = millis();
+      do {
+        if(_serial->available() > 0) {
+          byte val = _serial->read();
+          if(val == ACK || val == NAK || val == CAN) return val;
+          return 255;
+        }
+      } while(millis() - start < timeout_ms);
+      return 255;
+    }
+};
+
+#endif